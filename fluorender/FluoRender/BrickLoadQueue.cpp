@@ -0,0 +1,245 @@
+/*
+For more information, please see: http://software.sci.utah.edu
+
+The MIT License
+
+Copyright (c) 2014 Scientific Computing and Imaging Institute,
+University of Utah.
+
+
+Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the "Software"),
+to deal in the Software without restriction, including without limitation
+the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.
+*/
+
+#include "BrickLoadQueue.h"
+#include "FLIVR/TextureBrick.h"
+#include <algorithm>
+
+BrickLoadQueue::BrickLoadQueue(SizeFunc size)
+{
+	m_size = size ? size : brick_bytes;
+	m_seq = 0;
+	m_last = -1.0;
+	m_bytes = 0;
+}
+
+BrickLoadQueue::~BrickLoadQueue()
+{
+}
+
+void BrickLoadQueue::place(size_t i)
+{
+	m_index[pair<TextureBrick*, int>(m_heap[i].d.brick, m_heap[i].d.mode)] = i;
+}
+
+void BrickLoadQueue::sift_up(size_t i)
+{
+	Node n = m_heap[i];
+	while (i > 0)
+	{
+		size_t p = (i - 1) / 2;
+		if (!before(n, m_heap[p]))
+			break;
+		m_heap[i] = m_heap[p];
+		place(i);
+		i = p;
+	}
+	m_heap[i] = n;
+	place(i);
+}
+
+void BrickLoadQueue::sift_down(size_t i)
+{
+	Node n = m_heap[i];
+	size_t num = m_heap.size();
+	while (1)
+	{
+		size_t c = i * 2 + 1;
+		if (c >= num)
+			break;
+		if (c + 1 < num && before(m_heap[c + 1], m_heap[c]))
+			c++;
+		if (!before(m_heap[c], n))
+			break;
+		m_heap[i] = m_heap[c];
+		place(i);
+		i = c;
+	}
+	m_heap[i] = n;
+	place(i);
+}
+
+long long BrickLoadQueue::brick_bytes(TextureBrick *b)
+{
+	if (b->isLoaded())
+		return 0;
+	return (long long)b->nx()*(long long)b->ny()*(long long)b->nz()*(long long)b->nb(0);
+}
+
+void BrickLoadQueue::erase(size_t i)
+{
+	m_bytes -= m_heap[i].bytes;
+	m_index.erase(pair<TextureBrick*, int>(m_heap[i].d.brick, m_heap[i].d.mode));
+	size_t last = m_heap.size() - 1;
+	if (i != last)
+	{
+		m_heap[i] = m_heap[last];
+		m_heap.pop_back();
+		sift_down(i);
+		sift_up(i);
+	}
+	else
+		m_heap.pop_back();
+}
+
+void BrickLoadQueue::push(const VolumeLoaderData &d, double priority)
+{
+	auto ite = m_index.find(pair<TextureBrick*, int>(d.brick, d.mode));
+	if (ite != m_index.end())
+	{
+		size_t i = ite->second;
+		m_heap[i].d = d;
+		m_heap[i].d.priority = priority;
+		sift_down(i);
+		sift_up(i);
+	}
+	else
+	{
+		Node n;
+		n.d = d;
+		n.d.priority = priority;
+		n.seq = m_seq++;
+		n.bytes = m_size(d.brick);
+		m_bytes += n.bytes;
+		m_heap.push_back(n);
+		sift_up(m_heap.size() - 1);
+	}
+	if (priority > m_last)
+		m_last = priority;
+}
+
+void BrickLoadQueue::Assign(const vector<VolumeLoaderData> &vld)
+{
+	wxCriticalSectionLocker enter(m_cs);
+	m_heap.clear();
+	m_index.clear();
+	m_bytes = 0;
+	m_heap.reserve(vld.size());
+	m_index.reserve(vld.size());
+	//items in ascending order of priority already form a heap
+	for (size_t i = 0; i < vld.size(); i++)
+	{
+		pair<TextureBrick*, int> key(vld[i].brick, vld[i].mode);
+		if (m_index.find(key) != m_index.end())
+			continue;
+		Node n;
+		n.d = vld[i];
+		n.d.priority = (double)i;
+		n.seq = m_seq++;
+		n.bytes = m_size(n.d.brick);
+		m_bytes += n.bytes;
+		m_index[key] = m_heap.size();
+		m_heap.push_back(n);
+	}
+	m_last = (double)vld.size() - 1.0;
+}
+
+void BrickLoadQueue::Push(const VolumeLoaderData &d)
+{
+	wxCriticalSectionLocker enter(m_cs);
+	push(d, m_heap.empty() ? 0.0 : m_last + 1.0);
+}
+
+void BrickLoadQueue::Push(const VolumeLoaderData &d, double priority)
+{
+	wxCriticalSectionLocker enter(m_cs);
+	push(d, priority);
+}
+
+bool BrickLoadQueue::Pop(VolumeLoaderData &d)
+{
+	wxCriticalSectionLocker enter(m_cs);
+	if (m_heap.empty())
+		return false;
+	d = m_heap[0].d;
+	erase(0);
+	return true;
+}
+
+bool BrickLoadQueue::SetPriority(TextureBrick *b, int mode, double priority)
+{
+	wxCriticalSectionLocker enter(m_cs);
+	auto ite = m_index.find(pair<TextureBrick*, int>(b, mode));
+	if (ite == m_index.end())
+		return false;
+	push(m_heap[ite->second].d, priority);
+	return true;
+}
+
+bool BrickLoadQueue::Remove(TextureBrick *b, int mode)
+{
+	wxCriticalSectionLocker enter(m_cs);
+	auto ite = m_index.find(pair<TextureBrick*, int>(b, mode));
+	if (ite == m_index.end())
+		return false;
+	erase(ite->second);
+	return true;
+}
+
+bool BrickLoadQueue::Contains(TextureBrick *b, int mode)
+{
+	wxCriticalSectionLocker enter(m_cs);
+	return m_index.find(pair<TextureBrick*, int>(b, mode)) != m_index.end();
+}
+
+void BrickLoadQueue::Clear()
+{
+	wxCriticalSectionLocker enter(m_cs);
+	m_heap.clear();
+	m_index.clear();
+	m_last = -1.0;
+	m_bytes = 0;
+}
+
+long long BrickLoadQueue::GetBytes()
+{
+	wxCriticalSectionLocker enter(m_cs);
+	return m_bytes;
+}
+
+size_t BrickLoadQueue::Size()
+{
+	wxCriticalSectionLocker enter(m_cs);
+	return m_heap.size();
+}
+
+void BrickLoadQueue::GetFront(size_t num, vector<VolumeLoaderData> &items)
+{
+	wxCriticalSectionLocker enter(m_cs);
+	num = min(num, m_heap.size());
+	for (size_t i = 0; i < num; i++)
+		items.push_back(m_heap[i].d);
+}
+
+void BrickLoadQueue::GetAll(vector<VolumeLoaderData> &items)
+{
+	wxCriticalSectionLocker enter(m_cs);
+	items.reserve(items.size() + m_heap.size());
+	for (size_t i = 0; i < m_heap.size(); i++)
+		items.push_back(m_heap[i].d);
+}
@@ -0,0 +1,125 @@
+/*
+For more information, please see: http://software.sci.utah.edu
+
+The MIT License
+
+Copyright (c) 2014 Scientific Computing and Imaging Institute,
+University of Utah.
+
+
+Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the "Software"),
+to deal in the Software without restriction, including without limitation
+the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef _BRICKLOADQUEUE_H_
+#define _BRICKLOADQUEUE_H_
+
+#include <wx/thread.h>
+#include <vector>
+#include <unordered_map>
+#include <utility>
+
+namespace FLIVR
+{
+	class TextureBrick;
+	class FileLocInfo;
+}
+class VolumeData;
+
+using namespace std;
+using namespace FLIVR;
+
+struct VolumeLoaderData
+{
+	FileLocInfo *finfo;
+	TextureBrick *brick;
+	VolumeData *vd;
+	unsigned long long datasize;
+	int mode;
+	//set by the queue, lower values are loaded first
+	double priority;
+};
+
+//bricks waiting to be loaded, the lowest priority value first
+//a binary heap indexed by brick and mode so that queued bricks can be
+//moved or removed without searching, all methods lock the queue
+class BrickLoadQueue
+{
+	public:
+		//memory a brick needs to be loaded
+		typedef long long (*SizeFunc)(TextureBrick *b);
+
+		//size: how the memory of the queued bricks is counted,
+		//NULL for the size of the brick data if it is not loaded
+		BrickLoadQueue(SizeFunc size=NULL);
+		~BrickLoadQueue();
+		//replace the queue, the priority of a brick is its position in vld
+		void Assign(const vector<VolumeLoaderData> &vld);
+		//add a brick after the queued ones
+		void Push(const VolumeLoaderData &d);
+		//add a brick or move it if it is queued already
+		void Push(const VolumeLoaderData &d, double priority);
+		bool Pop(VolumeLoaderData &d);
+		bool SetPriority(TextureBrick *b, int mode, double priority);
+		bool Remove(TextureBrick *b, int mode);
+		bool Contains(TextureBrick *b, int mode);
+		void Clear();
+		size_t Size();
+		bool Empty() {return Size() == 0;}
+		//memory of the queued bricks that were not loaded when they were queued
+		long long GetBytes();
+		//copy the first num items of the heap
+		//they are among the first to be loaded but are not sorted
+		void GetFront(size_t num, vector<VolumeLoaderData> &items);
+		void GetAll(vector<VolumeLoaderData> &items);
+
+	private:
+		struct Node
+		{
+			VolumeLoaderData d;
+			unsigned long long seq;
+			long long bytes;
+		};
+		struct KeyHash
+		{
+			size_t operator()(const pair<TextureBrick*, int> &k) const
+			{ return std::hash<TextureBrick*>()(k.first) ^ (size_t)k.second; }
+		};
+
+		vector<Node> m_heap;
+		unordered_map<pair<TextureBrick*, int>, size_t, KeyHash> m_index;
+		unsigned long long m_seq;
+		double m_last;
+		long long m_bytes;
+		SizeFunc m_size;
+		wxCriticalSection m_cs;
+
+		bool before(const Node &a, const Node &b) const
+		{
+			return a.d.priority < b.d.priority ||
+				(a.d.priority == b.d.priority && a.seq < b.seq);
+		}
+		void place(size_t i);
+		void sift_up(size_t i);
+		void sift_down(size_t i);
+		void erase(size_t i);
+		void push(const VolumeLoaderData &d, double priority);
+		static long long brick_bytes(TextureBrick *b);
+};
+
+#endif//_BRICKLOADQUEUE_H_
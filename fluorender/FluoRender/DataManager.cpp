@@ -282,7 +282,11 @@ VolumeData* VolumeData::DeepCopy(VolumeData &copy, bool use_default_settings, Da
 	}
 	bool is_brxml = tex->isBrxml();
 	int time = is_brxml ? 0 : copy.GetCurTime();
-	Nrrd *nv = vd->m_reader->Convert(time, copy.GetCurChannel(), true);
+	Nrrd *nv = NULL;
+	{
+		lock_guard<recursive_mutex> lock(vd->m_reader->GetLock());
+		nv = vd->m_reader->Convert(time, copy.GetCurChannel(), true);
+	}
 	if (!nv)
 	{
 		delete(vd);
@@ -601,6 +605,31 @@ int VolumeData::Load(Nrrd* data, const wxString &name, const wxString &path, BRK
 	return 1;
 }
 
+int VolumeData::LoadRegion(BaseReader* reader, int t, int c, const VolumeRegion &region,
+	const wxString &name, const wxString &path)
+{
+	if (!reader)
+		return 0;
+
+	Nrrd* data = NULL;
+	{
+		lock_guard<recursive_mutex> lock(reader->GetLock());
+		data = reader->ConvertRegion(t, c, true, region);
+	}
+	if (!data || !Load(data, name, path))
+		return 0;
+
+	//the spacings of the region include the strides
+	SetBaseSpacings(data->axis[0].spacing, data->axis[1].spacing, data->axis[2].spacing);
+	SetSpcFromFile(reader->IsSpcInfoValid());
+	SetScalarScale(reader->GetScalarScale());
+	SetMaxValue(reader->GetMaxValue());
+	SetCurTime(t);
+	SetCurChannel(c);
+	SetReader(reader);
+	return 1;
+}
+
 int VolumeData::Replace(Nrrd* data, bool del_tex)
 {
 	if (!data || data->dim!=3)
@@ -5153,8 +5182,11 @@ int DataManager::LoadVolumeData(wxString &filename, int type, int ch_num, int t_
 		}
 	}
 
+	//a reader already in the list may be converting a prefetched frame
+	unique_lock<recursive_mutex> reader_lock;
 	if (reader)
 	{
+		reader_lock = unique_lock<recursive_mutex>(reader->GetLock());
 		bool preprocess = false;
 		if (reader->GetSliceSeq() != m_sliceSequence)
 		{
@@ -5235,6 +5267,22 @@ int DataManager::LoadVolumeData(wxString &filename, int type, int ch_num, int t_
 	}
 
 	int chan = reader->GetChanNum();
+
+	//decode all channels together when none of them is loaded yet
+	vector<Nrrd*> all_data;
+	vector<double> all_max_values;
+	vector<double> all_scalar_scales;
+	if (ch_num < 0 && chan > 1 && type != LOAD_TYPE_BRKXML)
+	{
+		bool loaded = false;
+		for (int j = 0; j < m_vd_list.size(); j++)
+			if (m_vd_list[j] && m_vd_list[j]->GetReader() == reader && !m_vd_list[j]->GetDup())
+				loaded = true;
+		if (!loaded)
+			reader->ConvertAllChannels(t_num>=0?t_num:reader->GetCurTime(), true,
+				all_data, all_max_values, all_scalar_scales);
+	}
+
 	for (i=(ch_num>=0?ch_num:0);
 		i<(ch_num>=0?ch_num+1:chan); i++)
 	{
@@ -5254,7 +5302,9 @@ int DataManager::LoadVolumeData(wxString &filename, int type, int ch_num, int t_
 		{
 			VolumeData *vd = new VolumeData();
 			vd->SetSkipBrick(m_skip_brick);
-			Nrrd* data = reader->Convert(t_num>=0?t_num:reader->GetCurTime(), i, true);
+			bool converted = i < all_data.size() && all_data[i];
+			Nrrd* data = converted?all_data[i]:
+				reader->Convert(t_num>=0?t_num:reader->GetCurTime(), i, true);
 			if (!data)
 				continue;
 
@@ -5306,8 +5356,8 @@ int DataManager::LoadVolumeData(wxString &filename, int type, int ch_num, int t_
 				if (zres == 1) vd->SetBaseSpacings(reader->GetXSpc(), reader->GetYSpc(), reader->GetXSpc()*zspcfac);
 				else vd->SetBaseSpacings(reader->GetXSpc(), reader->GetYSpc(), reader->GetZSpc());
 				vd->SetSpcFromFile(valid_spc);
-				vd->SetScalarScale(reader->GetScalarScale());
-				vd->SetMaxValue(reader->GetMaxValue());
+				vd->SetScalarScale(converted?all_scalar_scales[i]:reader->GetScalarScale());
+				vd->SetMaxValue(converted?all_max_values[i]:reader->GetMaxValue());
 				vd->SetCurTime(reader->GetCurTime());
 				vd->SetCurChannel(i);
 				//++
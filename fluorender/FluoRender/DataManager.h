@@ -204,6 +204,9 @@ public:
 	bool GetSkipBrick();
 	//load
 	int Load(Nrrd* data, const wxString &name, const wxString &path, BRKXMLReader *breader = NULL);
+	//load a cropped or subsampled region read by the reader
+	int LoadRegion(BaseReader* reader, int t, int c, const VolumeRegion &region,
+		const wxString &name, const wxString &path);
 	int Replace(Nrrd* data, bool del_tex);
 	int Replace(VolumeData* data);
 	Nrrd* GetVolume(bool ret);
@@ -0,0 +1,1041 @@
+#include <FLIVR/BrickCache.h>
+#include <FLIVR/TextureBrick.h>
+#include <wx/wx.h>
+#include <wx/stdpaths.h>
+#include <wx/dir.h>
+#include "../compatibility.h"
+#include <iostream>
+#include <fstream>
+#include <algorithm>
+#include <unordered_set>
+#include <cerrno>
+#include <ctime>
+
+using namespace std;
+
+namespace FLIVR
+{
+	map<wstring, BrickFileHandles::Handle*> BrickFileHandles::handles_;
+	wxCriticalSection BrickFileHandles::lock_;
+	int BrickFileHandles::max_open_ = 64;
+	unsigned long long BrickFileHandles::clock_ = 0;
+	map<wstring, BrickCache::Entry*> BrickCache::entries_;
+	map<wstring, BrickCache::Entry*> BrickCache::keys_;
+	list<BrickCache::Entry*> BrickCache::lru_;
+	wxCriticalSection BrickCache::lock_;
+	wstring BrickCache::dir_;
+	long long BrickCache::max_size_ = 10LL*1024*1024*1024;
+	long long BrickCache::total_ = 0;
+	bool BrickCache::loaded_ = false;
+	bool BrickCache::revalidate_ = true;
+	int BrickCache::changes_ = 0;
+	set<wstring> BrickCache::parts_;
+
+#define DOWNLOAD_BUFSIZE 8192
+//seconds before a partial download of another instance is removed
+//transfers time out after 10 seconds
+#define PART_EXPIRE 3600
+
+   BrickFileHandles::Handle* BrickFileHandles::acquire(const wstring &filename)
+   {
+	   wxCriticalSectionLocker enter(lock_);
+	   auto itr = handles_.find(filename);
+	   if (itr != handles_.end())
+	   {
+		   itr->second->refs++;
+		   itr->second->last_use = ++clock_;
+		   return itr->second;
+	   }
+
+#ifdef _WIN32
+	   HANDLE fh = CreateFileW(filename.c_str(), GENERIC_READ,
+		   FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+		   NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	   if (fh == INVALID_HANDLE_VALUE) return NULL;
+	   intptr_t fd = (intptr_t)fh;
+#else
+	   int fd = open(ws2s(filename).c_str(), O_RDONLY);
+	   if (fd < 0) return NULL;
+#endif
+	   Handle *h = new Handle;
+	   h->fd = fd;
+	   h->refs = 1;
+	   h->last_use = ++clock_;
+	   handles_[filename] = h;
+	   evict();
+	   return h;
+   }
+
+   void BrickFileHandles::release(Handle* h)
+   {
+	   wxCriticalSectionLocker enter(lock_);
+	   h->refs--;
+	   evict();
+   }
+
+   //close the least recently used handles that are not being read
+   //called with lock_ held
+   void BrickFileHandles::evict()
+   {
+	   while ((int)handles_.size() > max_open_)
+	   {
+		   auto oldest = handles_.end();
+		   for (auto itr = handles_.begin(); itr != handles_.end(); ++itr)
+		   {
+			   if (itr->second->refs > 0) continue;
+			   if (oldest == handles_.end() || itr->second->last_use < oldest->second->last_use)
+				   oldest = itr;
+		   }
+		   if (oldest == handles_.end()) break;
+#ifdef _WIN32
+		   CloseHandle((HANDLE)oldest->second->fd);
+#else
+		   ::close((int)oldest->second->fd);
+#endif
+		   delete oldest->second;
+		   handles_.erase(oldest);
+	   }
+   }
+
+   bool BrickFileHandles::read(const wstring &filename, long long offset, size_t size, char* data)
+   {
+	   Handle *h = acquire(filename);
+	   if (!h) return false;
+
+	   bool result = true;
+	   size_t done = 0;
+	   while (done < size)
+	   {
+#ifdef _WIN32
+		   DWORD chunk = (DWORD)min(size - done, (size_t)(1<<30));
+		   OVERLAPPED ov = {0};
+		   long long pos = offset + (long long)done;
+		   ov.Offset = (DWORD)(pos & 0xFFFFFFFF);
+		   ov.OffsetHigh = (DWORD)(pos >> 32);
+		   DWORD num = 0;
+		   if (!ReadFile((HANDLE)h->fd, data + done, chunk, &num, &ov) || num == 0)
+		   {
+			   result = false;
+			   break;
+		   }
+#else
+		   ssize_t num = pread((int)h->fd, data + done, size - done, (off_t)(offset + done));
+		   if (num < 0 && errno == EINTR) continue;
+		   if (num <= 0)
+		   {
+			   result = false;
+			   break;
+		   }
+#endif
+		   done += (size_t)num;
+	   }
+
+	   release(h);
+	   return result;
+   }
+
+   long long BrickFileHandles::file_size(const wstring &filename)
+   {
+	   Handle *h = acquire(filename);
+	   if (!h) return -1;
+#ifdef _WIN32
+	   LARGE_INTEGER fsize;
+	   long long result = GetFileSizeEx((HANDLE)h->fd, &fsize) ? fsize.QuadPart : -1;
+#else
+	   struct stat st;
+	   long long result = fstat((int)h->fd, &st) == 0 ? (long long)st.st_size : -1;
+#endif
+	   release(h);
+	   return result;
+   }
+
+   void BrickFileHandles::close(const wstring &filename)
+   {
+	   wxCriticalSectionLocker enter(lock_);
+	   auto itr = handles_.find(filename);
+	   if (itr == handles_.end() || itr->second->refs > 0) return;
+#ifdef _WIN32
+	   CloseHandle((HANDLE)itr->second->fd);
+#else
+	   ::close((int)itr->second->fd);
+#endif
+	   delete itr->second;
+	   handles_.erase(itr);
+   }
+
+   void BrickFileHandles::close_all()
+   {
+	   wxCriticalSectionLocker enter(lock_);
+	   int max_open = max_open_;
+	   max_open_ = 0;
+	   evict();
+	   max_open_ = max_open;
+   }
+
+   void BrickFileHandles::set_max_open(int num)
+   {
+	   wxCriticalSectionLocker enter(lock_);
+	   max_open_ = max(num, 1);
+	   evict();
+   }
+
+   //curl callbacks of the downloads
+   size_t BrickCache::write_callback(void *contents, size_t size, size_t nmemb, void *userp)
+   {
+	   ofstream *out = static_cast<std::ofstream *>(userp);
+	   size_t nbytes = size * nmemb;
+	   out->write((char *)contents, nbytes);
+	   return nbytes;
+   }
+
+   int BrickCache::xferinfo(void *p, curl_off_t dltotal, curl_off_t dlnow, curl_off_t ultotal, curl_off_t ulnow)
+   {
+	   wxThread *wxth = (wxThread *)p;
+	   if (wxth && wxth->TestDestroy())
+		   return 1;
+	   return 0;
+   }
+
+   //the cache directory is created on first use
+   //called with lock_ held
+   wstring BrickCache::default_dir()
+   {
+	   wxString expath = wxStandardPaths::Get().GetExecutablePath();
+	   expath = expath.BeforeLast(GETSLASH(),NULL);
+#ifdef _WIN32
+	   wxString dft = expath + "\\vvd_cache";
+	   wxString dft2 = wxStandardPaths::Get().GetUserDataDir() + "\\vvd_cache";
+	   if (!wxDirExists(dft) && wxDirExists(dft2))
+		   dft = dft2;
+	   else if (!wxDirExists(dft))
+		   wxMkdir(dft);
+	   dft += L"\\";
+#else
+	   wxString dft = expath + "/../Resources/vvd_cache";
+	   if (!wxDirExists(dft))
+		   wxMkdir(dft);
+	   dft += L"/";
+#endif
+	   return dft.ToStdWstring();
+   }
+
+   //64-bit FNV-1a of the utf-8 string, as 16 hex digits
+   wstring BrickCache::hash_name(const wstring &str)
+   {
+	   string s = ws2s(str);
+	   unsigned long long h = 14695981039346656037ULL;
+	   for (size_t i = 0; i < s.size(); i++)
+	   {
+		   h ^= (unsigned char)s[i];
+		   h *= 1099511628211ULL;
+	   }
+	   wchar_t name[17];
+	   const wchar_t hex[] = L"0123456789abcdef";
+	   for (int i = 15; i >= 0; i--, h >>= 4)
+		   name[i] = hex[h & 0xF];
+	   name[16] = 0;
+	   return wstring(name);
+   }
+
+   //keep the etag of the last response (redirects send several)
+   size_t BrickCache::header_callback(char *buffer, size_t size, size_t nitems, void *userp)
+   {
+	   size_t len = size * nitems;
+	   string *etag = (string *)userp;
+	   string line(buffer, len);
+	   if (line.compare(0, 5, "HTTP/") == 0)
+		   etag->clear();
+	   else if (len > 5)
+	   {
+		   string name = line.substr(0, 5);
+		   for (size_t i = 0; i < name.size(); i++)
+			   name[i] = tolower(name[i]);
+		   if (name == "etag:")
+		   {
+			   size_t st = line.find_first_not_of(" \t", 5);
+			   size_t ed = line.find_last_not_of(" \t\r\n");
+			   if (st != string::npos && ed != string::npos && ed >= st)
+				   *etag = line.substr(st, ed - st + 1);
+		   }
+	   }
+	   return len;
+   }
+
+   //called with lock_ held
+   BrickCache::Entry* BrickCache::add_entry(const wstring &path, const wstring &key,
+	   const string &etag, long long mtime, long long size)
+   {
+	   Entry *e = new Entry;
+	   e->path = path;
+	   e->key = key;
+	   e->etag = etag;
+	   e->mtime = mtime;
+	   e->size = size;
+	   e->refs = 0;
+	   e->validated = false;
+	   lru_.push_back(e);
+	   e->lru = --lru_.end();
+	   entries_[path] = e;
+	   if (keys_.find(key) == keys_.end())
+		   keys_[key] = e;
+	   total_ += size;
+	   return e;
+   }
+
+   //called with lock_ held
+   void BrickCache::remove_entry(Entry* e)
+   {
+	   BrickFileHandles::close(e->path);
+	   if (wxFileExists(e->path))
+		   wxRemoveFile(e->path);
+	   auto itr = keys_.find(e->key);
+	   if (itr != keys_.end() && itr->second == e)
+		   keys_.erase(itr);
+	   entries_.erase(e->path);
+	   lru_.erase(e->lru);
+	   total_ -= e->size;
+	   delete e;
+	   changes_++;
+   }
+
+   //called with lock_ held
+   void BrickCache::pin(Entry* e)
+   {
+	   e->refs++;
+	   lru_.splice(lru_.begin(), lru_, e->lru);
+   }
+
+   //remove the least recently used files that are not being read
+   //called with lock_ held
+   void BrickCache::evict()
+   {
+	   auto itr = lru_.end();
+	   while (total_ > max_size_ && itr != lru_.begin())
+	   {
+		   --itr;
+		   Entry *e = *itr;
+		   if (e->refs > 0) continue;
+		   auto next = itr;
+		   ++next;
+		   remove_entry(e);
+		   itr = next;
+	   }
+   }
+
+   //index lines: name, size, mtime, etag and key separated by tabs
+   //most recently used first
+   //called with lock_ held
+   void BrickCache::load_index()
+   {
+	   if (loaded_) return;
+	   loaded_ = true;
+	   if (dir_.empty())
+		   dir_ = default_dir();
+
+	   ifstream ifs(ws2s(dir_ + L"index.txt"));
+	   string line;
+	   while (ifs && getline(ifs, line))
+	   {
+		   vector<string> fields;
+		   size_t st = 0;
+		   for (int i = 0; i < 4; i++)
+		   {
+			   size_t ed = line.find('\t', st);
+			   if (ed == string::npos) break;
+			   fields.push_back(line.substr(st, ed - st));
+			   st = ed + 1;
+		   }
+		   if (fields.size() != 4) continue;
+		   string key = line.substr(st);
+		   if (!key.empty() && key[key.size()-1] == '\r')
+			   key.erase(key.size()-1);
+		   wstring path = dir_ + s2ws(fields[0]);
+		   if (entries_.find(path) != entries_.end() || !wxFileExists(path))
+			   continue;
+		   add_entry(path, s2ws(key), fields[3],
+			   strtoll(fields[2].c_str(), NULL, 10), strtoll(fields[1].c_str(), NULL, 10));
+	   }
+
+	   //downloads interrupted by a crash
+	   //parts are named after the process writing them. other instances
+	   //may share the directory, their parts are kept until they expire
+	   wxArrayString parts;
+	   wxDir::GetAllFiles(dir_, &parts, "*.part*", wxDIR_FILES);
+	   wstring own = wxString::Format(".part%lu_", wxGetProcessId()).ToStdWstring();
+	   time_t now = time(NULL);
+	   for (size_t i = 0; i < parts.GetCount(); i++)
+	   {
+		   wstring name = parts[i].ToStdWstring();
+		   bool active = false;
+		   for (auto itr = parts_.begin(); itr != parts_.end() && !active; ++itr)
+			   active = name.compare(0, itr->size(), *itr) == 0 &&
+				   (name.size() == itr->size() || name[itr->size()] == L'_');
+		   if (active)
+			   continue;
+		   if (name.find(own) != wstring::npos ||
+			   now - wxFileModificationTime(parts[i]) > PART_EXPIRE)
+			   wxRemoveFile(parts[i]);
+	   }
+
+	   evict();
+   }
+
+   //called with lock_ held
+   void BrickCache::write_index()
+   {
+	   if (!loaded_) return;
+	   wstring tmpname = dir_ + L"index.tmp";
+	   ofstream ofs(ws2s(tmpname), ios::binary);
+	   if (!ofs) return;
+	   for (auto itr = lru_.begin(); itr != lru_.end(); ++itr)
+	   {
+		   Entry *e = *itr;
+		   ofs << ws2s(e->path.substr(dir_.size())) << '\t' << e->size << '\t' <<
+			   e->mtime << '\t' << e->etag << '\t' << ws2s(e->key) << '\n';
+	   }
+	   ofs.close();
+	   if (ofs.fail() || !wxRenameFile(tmpname, dir_ + L"index.txt", true))
+		   return;
+	   changes_ = 0;
+   }
+
+   //bricks packed in a remote file are cached on their own, keyed by their byte range
+   //a space cannot appear in a url
+   wstring BrickCache::key(const FileLocInfo *finfo)
+   {
+	   if (!finfo->is_range())
+		   return finfo->filename;
+	   return finfo->filename + wxString::Format(" bytes=%lld-%lld", (long long)finfo->offset,
+		   (long long)finfo->offset + finfo->datasize - 1).ToStdWstring();
+   }
+
+   struct BrickCache::Download {
+	   struct Part {
+		   wstring key;
+		   long long offset;
+		   long long size;
+	   };
+	   wstring url;
+	   vector<Part> parts;
+	   //requested byte range, -1 for the whole file
+	   long long st;
+	   long long ed;
+	   wstring dir;
+	   wstring tmpname;
+	   string etag;
+	   string new_etag;
+	   ofstream ofs;
+	   struct curl_slist *headers;
+	   CURL *curl;
+   };
+
+   bool BrickCache::lookup(const FileLocInfo *finfo, wstring &filename)
+   {
+	   wxCriticalSectionLocker enter(lock_);
+	   load_index();
+	   auto itr = keys_.find(key(finfo));
+	   if (itr == keys_.end())
+		   return false;
+	   Entry *e = itr->second;
+	   if (!e->validated && revalidate_)
+		   return false;
+	   pin(e);
+	   filename = e->path;
+	   return true;
+   }
+
+   bool BrickCache::has(const FileLocInfo *finfo)
+   {
+	   wxCriticalSectionLocker enter(lock_);
+	   load_index();
+	   auto itr = keys_.find(key(finfo));
+	   return itr != keys_.end() && (itr->second->validated || !revalidate_);
+   }
+
+   BrickCache::Download* BrickCache::begin(const vector<const FileLocInfo*> &finfos, CURL *curl, wxThread *th)
+   {
+	   if (curl == NULL) {
+		   cerr << "curl_easy_init() failed" << endl;
+		   return NULL;
+	   }
+	   if (finfos.empty()) return NULL;
+
+	   Download *d = new Download;
+	   d->url = finfos[0]->filename;
+	   d->headers = NULL;
+	   d->curl = curl;
+	   d->st = -1;
+	   d->ed = -1;
+	   for (size_t i = 0; i < finfos.size(); i++)
+	   {
+		   Download::Part p;
+		   p.key = key(finfos[i]);
+		   p.offset = finfos[i]->is_range() ? finfos[i]->offset : 0;
+		   p.size = finfos[i]->is_range() ? finfos[i]->datasize : -1;
+		   d->parts.push_back(p);
+		   if (!finfos[i]->is_range())
+			   continue;
+		   if (d->st < 0 || p.offset < d->st) d->st = p.offset;
+		   if (d->ed < 0 || p.offset + p.size > d->ed) d->ed = p.offset + p.size;
+	   }
+	   //a whole file and ranges of it are not fetched together
+	   if (d->st >= 0 && d->parts.size() > 1)
+	   {
+		   for (size_t i = 0; i < d->parts.size(); i++)
+		   {
+			   if (d->parts[i].size < 0)
+			   {
+				   delete d;
+				   return NULL;
+			   }
+		   }
+	   }
+
+	   long long mtime = -1;
+	   //downloads of the same url do not share a file
+	   static unsigned long long counter = 0;
+	   {
+		   wxCriticalSectionLocker enter(lock_);
+		   load_index();
+		   //revalidate only when every part is cached with the same validator
+		   for (size_t i = 0; i < d->parts.size(); i++)
+		   {
+			   auto itr = keys_.find(d->parts[i].key);
+			   if (itr == keys_.end() ||
+				   (i > 0 && (itr->second->etag != d->etag || itr->second->mtime != mtime)))
+			   {
+				   d->etag.clear();
+				   mtime = -1;
+				   break;
+			   }
+			   d->etag = itr->second->etag;
+			   mtime = itr->second->mtime;
+		   }
+		   d->dir = dir_;
+		   d->tmpname = d->dir + hash_name(d->url) + L".part" +
+			   wxString::Format("%lu_%llu", wxGetProcessId(), ++counter).ToStdWstring();
+		   parts_.insert(d->tmpname);
+	   }
+	   d->ofs.open(ws2s(d->tmpname).c_str(), ios::binary);
+	   if (!d->ofs)
+	   {
+		   cancel(d);
+		   return NULL;
+	   }
+
+	   curl_easy_reset(curl);
+	   curl_easy_setopt(curl, CURLOPT_URL, wxString(d->url).ToStdString().c_str());
+	   curl_easy_setopt(curl, CURLOPT_TIMEOUT, 10L);
+	   curl_easy_setopt(curl, CURLOPT_USERAGENT, "libcurl-agent/1.0");
+	   curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_callback);
+	   curl_easy_setopt(curl, CURLOPT_WRITEDATA, &d->ofs);
+	   curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, header_callback);
+	   curl_easy_setopt(curl, CURLOPT_HEADERDATA, &d->new_etag);
+	   curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 0);
+	   curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1);
+	   curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1);
+	   curl_easy_setopt(curl, CURLOPT_FILETIME, 1);
+	   curl_easy_setopt(curl, CURLOPT_XFERINFOFUNCTION, xferinfo);
+	   curl_easy_setopt(curl, CURLOPT_XFERINFODATA, th);
+	   curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 0L);
+	   if (d->st >= 0)
+	   {
+		   string range = wxString::Format("%lld-%lld", d->st, d->ed - 1).ToStdString();
+		   curl_easy_setopt(curl, CURLOPT_RANGE, range.c_str());
+	   }
+	   if (!d->etag.empty())
+	   {
+		   d->headers = curl_slist_append(d->headers, ("If-None-Match: " + d->etag).c_str());
+		   curl_easy_setopt(curl, CURLOPT_HTTPHEADER, d->headers);
+	   }
+	   else if (mtime > 0)
+	   {
+		   curl_easy_setopt(curl, CURLOPT_TIMECONDITION, (long)CURL_TIMECOND_IFMODSINCE);
+		   curl_easy_setopt(curl, CURLOPT_TIMEVALUE, (long)mtime);
+	   }
+
+	   return d;
+   }
+
+   void BrickCache::cancel(Download* d)
+   {
+	   if (!d) return;
+	   curl_easy_setopt(d->curl, CURLOPT_HTTPHEADER, NULL);
+	   if (d->headers) curl_slist_free_all(d->headers);
+	   if (d->ofs.is_open()) d->ofs.close();
+	   if (wxFileExists(d->tmpname)) wxRemoveFile(d->tmpname);
+	   {
+		   wxCriticalSectionLocker enter(lock_);
+		   parts_.erase(d->tmpname);
+	   }
+	   delete d;
+   }
+
+   //copy a part of a downloaded range to its own file
+   static bool copy_part(const wstring &src, long long offset, long long size, const wstring &dst)
+   {
+	   ifstream ifs(ws2s(src).c_str(), ios::binary);
+	   ofstream ofs(ws2s(dst).c_str(), ios::binary);
+	   if (!ifs || !ofs) return false;
+	   ifs.seekg(offset, ios_base::beg);
+	   vector<char> buf(DOWNLOAD_BUFSIZE * 16);
+	   while (size > 0 && ifs)
+	   {
+		   size_t num = (size_t)min(size, (long long)buf.size());
+		   ifs.read(&buf[0], num);
+		   if ((size_t)ifs.gcount() != num) return false;
+		   ofs.write(&buf[0], num);
+		   size -= num;
+	   }
+	   ofs.close();
+	   return size == 0 && !ofs.fail();
+   }
+
+   //register a downloaded file under key and pin it
+   //called with lock_ held
+   BrickCache::Entry* BrickCache::store(const wstring &key, const wstring &tmpname,
+	   const string &etag, long long mtime, long long size)
+   {
+	   auto itr = keys_.find(key);
+	   Entry *old = itr != keys_.end() ? itr->second : NULL;
+
+	   //without a validator the same name could not tell changed content from
+	   //the old one, so each such download gets its own file
+	   bool validator = !etag.empty() || mtime > 0;
+	   static unsigned long long stores = 0;
+	   wstring hash_str = key + L"\n" + s2ws(etag) + L"\n" +
+		   wxString::Format("%lld", mtime).ToStdWstring();
+	   if (!validator)
+		   hash_str += wxString::Format("\n%lld\n%llu\n%lld", size, ++stores,
+			   (long long)time(NULL)).ToStdWstring();
+	   wstring path = dir_ + hash_name(hash_str);
+	   auto found = entries_.find(path);
+	   Entry *e = NULL;
+	   if (found != entries_.end() && validator)
+	   {
+		   //same content fetched by another thread
+		   wxRemoveFile(tmpname);
+		   e = found->second;
+	   }
+	   else if (found != entries_.end())
+	   {
+		   //the new data replaces the file
+		   if (!wxRenameFile(tmpname, path, true))
+		   {
+			   wxRemoveFile(tmpname);
+			   return NULL;
+		   }
+		   e = found->second;
+		   total_ += size - e->size;
+		   e->size = size;
+	   }
+	   else
+	   {
+		   if (!wxRenameFile(tmpname, path, true))
+		   {
+			   wxRemoveFile(tmpname);
+			   return NULL;
+		   }
+		   e = add_entry(path, key, etag, mtime, size);
+	   }
+	   keys_[key] = e;
+	   e->validated = true;
+	   pin(e);
+	   if (old && old != e && old->refs == 0)
+		   remove_entry(old);
+	   changes_++;
+	   return e;
+   }
+
+   bool BrickCache::finish(Download* d, CURLcode ret, vector<wstring> &filenames)
+   {
+	   filenames.assign(d ? d->parts.size() : 0, wstring());
+	   if (!d) return false;
+	   long code = 0, filetime = -1, unmet = 0;
+	   curl_easy_getinfo(d->curl, CURLINFO_RESPONSE_CODE, &code);
+	   curl_easy_getinfo(d->curl, CURLINFO_FILETIME, &filetime);
+	   curl_easy_getinfo(d->curl, CURLINFO_CONDITION_UNMET, &unmet);
+	   long long size = (long long)d->ofs.tellp();
+	   d->ofs.close();
+
+	   if (ret != CURLE_OK || d->ofs.fail())
+	   {
+		   if (ret != CURLE_ABORTED_BY_CALLBACK)
+			   cerr << "curl_easy_perform() failed." << curl_easy_strerror(ret) << endl;
+		   cancel(d);
+		   return false;
+	   }
+
+	   bool not_modified = code == 304 || unmet;
+	   //split the parts of a range out of the download before taking the lock
+	   //a server that ignores the range sends the whole file
+	   vector<wstring> tmpnames(d->parts.size(), d->tmpname);
+	   vector<long long> sizes(d->parts.size(), size);
+	   if (!not_modified && d->st >= 0)
+	   {
+		   long long base = code == 206 ? d->st : 0;
+		   for (size_t i = 0; i < d->parts.size(); i++)
+		   {
+			   Download::Part &p = d->parts[i];
+			   sizes[i] = p.size;
+			   if (p.offset - base + p.size > size)
+				   tmpnames[i].clear();
+			   else if (d->parts.size() == 1 && base == p.offset && size == p.size)
+				   continue;
+			   else
+			   {
+				   tmpnames[i] = d->tmpname + wxString::Format("_%d", (int)i).ToStdWstring();
+				   if (!copy_part(d->tmpname, p.offset - base, p.size, tmpnames[i]))
+				   {
+					   if (wxFileExists(tmpnames[i])) wxRemoveFile(tmpnames[i]);
+					   tmpnames[i].clear();
+				   }
+			   }
+		   }
+	   }
+
+	   bool result = false;
+	   {
+		   wxCriticalSectionLocker enter(lock_);
+		   //the cache was moved or cleared during the download
+		   bool moved = d->dir != dir_;
+		   for (size_t i = 0; i < d->parts.size(); i++)
+		   {
+			   if (moved || tmpnames[i].empty())
+				   continue;
+			   Entry *e = NULL;
+			   if (not_modified)
+			   {
+				   auto itr = keys_.find(d->parts[i].key);
+				   if (itr != keys_.end())
+				   {
+					   e = itr->second;
+					   e->validated = true;
+					   pin(e);
+				   }
+			   }
+			   else
+				   e = store(d->parts[i].key, tmpnames[i], d->new_etag, filetime, sizes[i]);
+			   if (e)
+			   {
+				   filenames[i] = e->path;
+				   result = true;
+			   }
+		   }
+		   if (result)
+		   {
+			   evict();
+			   if (changes_ >= 64)
+				   write_index();
+		   }
+	   }
+
+	   //left over when the whole download was split into parts
+	   for (size_t i = 0; i < tmpnames.size(); i++)
+		   if (!tmpnames[i].empty() && wxFileExists(tmpnames[i]))
+			   wxRemoveFile(tmpnames[i]);
+	   cancel(d);
+	   return result;
+   }
+
+   bool BrickCache::acquire(const FileLocInfo *finfo, wstring &filename, CURL *curl, wxThread *th)
+   {
+	   if (lookup(finfo, filename))
+		   return true;
+	   Download *d = begin(vector<const FileLocInfo*>(1, finfo), curl, th);
+	   if (!d) return false;
+	   CURLcode ret = curl_easy_perform(curl);
+	   vector<wstring> filenames;
+	   if (!finish(d, ret, filenames))
+		   return false;
+	   filename = filenames[0];
+	   return true;
+   }
+
+   void BrickCache::release(const wstring &filename)
+   {
+	   wxCriticalSectionLocker enter(lock_);
+	   auto itr = entries_.find(filename);
+	   if (itr == entries_.end()) return;
+	   itr->second->refs--;
+	   evict();
+   }
+
+   void BrickCache::save_index()
+   {
+	   wxCriticalSectionLocker enter(lock_);
+	   if (changes_ > 0)
+		   write_index();
+   }
+
+   void BrickCache::clear()
+   {
+	   wxCriticalSectionLocker enter(lock_);
+	   load_index();
+	   long long max_size = max_size_;
+	   max_size_ = 0;
+	   evict();
+	   max_size_ = max_size;
+	   write_index();
+   }
+
+   void BrickCache::set_dir(const wstring &dir)
+   {
+	   wxCriticalSectionLocker enter(lock_);
+	   if (changes_ > 0)
+		   write_index();
+	   for (auto itr = lru_.begin(); itr != lru_.end(); ++itr)
+		   delete *itr;
+	   lru_.clear();
+	   entries_.clear();
+	   keys_.clear();
+	   total_ = 0;
+	   changes_ = 0;
+	   loaded_ = false;
+	   dir_ = dir;
+	   if (!dir_.empty() && dir_[dir_.size()-1] != GETSLASH())
+		   dir_ += GETSLASH();
+	   if (!dir_.empty() && !wxDirExists(dir_))
+		   wxMkdir(dir_);
+   }
+
+   wstring BrickCache::get_dir()
+   {
+	   wxCriticalSectionLocker enter(lock_);
+	   load_index();
+	   return dir_;
+   }
+
+   void BrickCache::set_max_size(long long size)
+   {
+	   wxCriticalSectionLocker enter(lock_);
+	   max_size_ = max(size, 0LL);
+	   if (loaded_) evict();
+   }
+
+   long long BrickCache::get_max_size()
+   {
+	   wxCriticalSectionLocker enter(lock_);
+	   return max_size_;
+   }
+
+   void BrickCache::set_revalidate(bool val)
+   {
+	   wxCriticalSectionLocker enter(lock_);
+	   revalidate_ = val;
+   }
+
+
+   BrickDownloader::BrickDownloader()
+   {
+	   multi_ = NULL;
+	   max_transfers_ = 8;
+   }
+
+   BrickDownloader::~BrickDownloader()
+   {
+	   close();
+   }
+
+   bool BrickDownloader::full()
+   {
+	   return (int)handles_.size() >= max_transfers_;
+   }
+
+   bool BrickDownloader::attach(const FileLocInfo *finfo, TextureBrick *brick)
+   {
+	   auto itr = transfers_.find(BrickCache::key(finfo));
+	   if (itr == transfers_.end())
+		   return false;
+	   vector<Part> &parts = itr->second->parts;
+	   for (size_t i = 0; i < parts.size(); i++)
+	   {
+		   if (parts[i].key != itr->first)
+			   continue;
+		   if (find(parts[i].bricks.begin(), parts[i].bricks.end(), brick) == parts[i].bricks.end())
+			   parts[i].bricks.push_back(brick);
+		   break;
+	   }
+	   return true;
+   }
+
+   bool BrickDownloader::add(const vector<const FileLocInfo*> &finfos, const vector<TextureBrick*> &bricks)
+   {
+	   //join the transfers already fetching some of them
+	   vector<const FileLocInfo*> rest;
+	   vector<TextureBrick*> rest_bricks;
+	   for (size_t i = 0; i < finfos.size(); i++)
+	   {
+		   if (!attach(finfos[i], bricks[i]))
+		   {
+			   rest.push_back(finfos[i]);
+			   rest_bricks.push_back(bricks[i]);
+		   }
+	   }
+	   if (rest.empty()) return true;
+	   if (full()) return false;
+
+	   if (!multi_)
+	   {
+		   multi_ = curl_multi_init();
+		   if (!multi_) return false;
+		   //reuse connections to the same host and multiplex them on http/2
+		   curl_multi_setopt(multi_, CURLMOPT_MAX_HOST_CONNECTIONS, (long)max_transfers_);
+#ifdef CURLPIPE_MULTIPLEX
+		   curl_multi_setopt(multi_, CURLMOPT_PIPELINING, (long)CURLPIPE_MULTIPLEX);
+#endif
+	   }
+
+	   CURL *curl = NULL;
+	   if (!idle_.empty())
+	   {
+		   curl = idle_.back();
+		   idle_.pop_back();
+	   }
+	   else
+		   curl = curl_easy_init();
+	   BrickCache::Download *dl = BrickCache::begin(rest, curl);
+	   if (!dl)
+	   {
+		   if (curl) idle_.push_back(curl);
+		   return false;
+	   }
+	   if (curl_multi_add_handle(multi_, curl) != CURLM_OK)
+	   {
+		   BrickCache::cancel(dl);
+		   idle_.push_back(curl);
+		   return false;
+	   }
+
+	   Transfer *t = new Transfer;
+	   t->curl = curl;
+	   t->dl = dl;
+	   for (size_t i = 0; i < rest.size(); i++)
+	   {
+		   Part p;
+		   p.key = BrickCache::key(rest[i]);
+		   p.bricks.push_back(rest_bricks[i]);
+		   t->parts.push_back(p);
+		   transfers_[p.key] = t;
+	   }
+	   handles_[curl] = t;
+	   return true;
+   }
+
+   void BrickDownloader::remove(Transfer *t)
+   {
+	   curl_multi_remove_handle(multi_, t->curl);
+	   idle_.push_back(t->curl);
+	   handles_.erase(t->curl);
+	   for (size_t i = 0; i < t->parts.size(); i++)
+	   {
+		   auto itr = transfers_.find(t->parts[i].key);
+		   if (itr != transfers_.end() && itr->second == t)
+			   transfers_.erase(itr);
+	   }
+	   delete t;
+   }
+
+   void BrickDownloader::perform(vector<Result> &done, int timeout)
+   {
+	   if (!multi_ || handles_.empty()) return;
+
+	   int running = 0;
+	   curl_multi_perform(multi_, &running);
+	   int left = 0;
+	   CURLMsg *msg = curl_multi_info_read(multi_, &left);
+	   if (!msg && running > 0 && timeout > 0)
+	   {
+		   curl_multi_wait(multi_, NULL, 0, timeout, NULL);
+		   curl_multi_perform(multi_, &running);
+		   msg = curl_multi_info_read(multi_, &left);
+	   }
+
+	   for (; msg; msg = curl_multi_info_read(multi_, &left))
+	   {
+		   if (msg->msg != CURLMSG_DONE) continue;
+		   CURL *curl = msg->easy_handle;
+		   CURLcode ret = msg->data.result;
+		   auto itr = handles_.find(curl);
+		   if (itr == handles_.end()) continue;
+		   Transfer *t = itr->second;
+
+		   vector<Part> parts = t->parts;
+		   BrickCache::Download *dl = t->dl;
+		   remove(t);
+		   vector<wstring> filenames;
+		   BrickCache::finish(dl, ret, filenames);
+		   for (size_t i = 0; i < parts.size(); i++)
+		   {
+			   Result r;
+			   r.key = parts[i].key;
+			   r.filename = i < filenames.size() ? filenames[i] : wstring();
+			   r.bricks = parts[i].bricks;
+			   done.push_back(r);
+		   }
+	   }
+   }
+
+   void BrickDownloader::cancel_except(const vector<TextureBrick*> &keep)
+   {
+	   if (handles_.empty()) return;
+
+	   unordered_set<TextureBrick*> wanted(keep.begin(), keep.end());
+	   vector<Transfer*> stale;
+	   for (auto itr = handles_.begin(); itr != handles_.end(); ++itr)
+	   {
+		   bool used = false;
+		   vector<Part> &parts = itr->second->parts;
+		   for (size_t i = 0; i < parts.size(); i++)
+		   {
+			   vector<TextureBrick*> &bricks = parts[i].bricks;
+			   for (size_t j = bricks.size(); j-- > 0; )
+			   {
+				   if (wanted.find(bricks[j]) == wanted.end())
+					   bricks.erase(bricks.begin() + j);
+			   }
+			   if (!bricks.empty())
+				   used = true;
+		   }
+		   if (!used)
+			   stale.push_back(itr->second);
+	   }
+	   for (size_t i = 0; i < stale.size(); i++)
+	   {
+		   BrickCache::Download *dl = stale[i]->dl;
+		   remove(stale[i]);
+		   BrickCache::cancel(dl);
+	   }
+   }
+
+   void BrickDownloader::cancel_all()
+   {
+	   while (!handles_.empty())
+	   {
+		   BrickCache::Download *dl = handles_.begin()->second->dl;
+		   remove(handles_.begin()->second);
+		   BrickCache::cancel(dl);
+	   }
+   }
+
+   void BrickDownloader::close()
+   {
+	   cancel_all();
+	   for (size_t i = 0; i < idle_.size(); i++)
+		   curl_easy_cleanup(idle_[i]);
+	   idle_.clear();
+	   if (multi_)
+	   {
+		   curl_multi_cleanup(multi_);
+		   multi_ = NULL;
+	   }
+   }
+
+   void BrickDownloader::set_max_transfers(int num)
+   {
+	   max_transfers_ = max(num, 1);
+	   if (multi_)
+		   curl_multi_setopt(multi_, CURLMOPT_MAX_HOST_CONNECTIONS, (long)max_transfers_);
+   }
+
+} // namespace FLIVR
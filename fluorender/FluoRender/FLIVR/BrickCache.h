@@ -0,0 +1,170 @@
+#ifndef SLIVR_BrickCache_h
+#define SLIVR_BrickCache_h
+
+#include <wx/thread.h>
+#include <curl/curl.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <list>
+#include <set>
+#include <stdint.h>
+
+namespace FLIVR
+{
+	class FileLocInfo;
+	class TextureBrick;
+
+	//open brick files shared by all readers
+	//reads take an offset and do not move a shared file position, so packed
+	//bricks are read without opening the file again or locking around a seek
+	class BrickFileHandles {
+	public:
+		static bool read(const std::wstring &filename, long long offset, size_t size, char* data);
+		static long long file_size(const std::wstring &filename);
+		static void close(const std::wstring &filename);
+		static void close_all();
+		static void set_max_open(int num);
+	private:
+		struct Handle {
+			intptr_t fd;
+			int refs;
+			unsigned long long last_use;
+		};
+		static Handle* acquire(const std::wstring &filename);
+		static void release(Handle* h);
+		static void evict();
+
+		static std::map<std::wstring, Handle*> handles_;
+		static wxCriticalSection lock_;
+		static int max_open_;
+		static unsigned long long clock_;
+	};
+
+	//downloaded bricks of remote datasets, kept on disk across sessions
+	//files are named after a hash of the url, the byte range of packed bricks
+	//and the validator (etag or last-modified), and are listed in an index file
+	//the least recently used files are removed when the cache is over its cap
+	class BrickCache {
+	public:
+		//get the local copy of a brick, downloading it if it is not cached
+		//entries from an earlier session are revalidated with a conditional
+		//request once. the file is kept until release() is called
+		//a cached range holds only the bytes of the brick
+		static bool acquire(const FileLocInfo *finfo, std::wstring &filename, CURL *curl, wxThread *th=NULL);
+		static void release(const std::wstring &filename);
+		static std::wstring key(const FileLocInfo *finfo);
+		//the steps of acquire() for callers that run the transfer themselves
+		struct Download;
+		//get a cached copy that needs no request, pinned like acquire()
+		static bool lookup(const FileLocInfo *finfo, std::wstring &filename);
+		static bool has(const FileLocInfo *finfo);
+		//set up curl to download bricks of one url into the cache
+		//packed bricks are fetched with one request for the range covering them
+		static Download* begin(const std::vector<const FileLocInfo*> &finfos, CURL *curl, wxThread *th=NULL);
+		//store the finished transfer and delete d
+		//filenames has a pinned file for each brick, empty if it failed
+		static bool finish(Download* d, CURLcode ret, std::vector<std::wstring> &filenames);
+		static void cancel(Download* d);
+		static void save_index();
+		static void clear();
+		static void set_dir(const std::wstring &dir);
+		static std::wstring get_dir();
+		static void set_max_size(long long size);
+		static long long get_max_size();
+		static void set_revalidate(bool val);
+	private:
+		struct Entry {
+			std::wstring path;
+			std::wstring key;
+			std::string etag;
+			long long mtime;
+			long long size;
+			int refs;
+			bool validated;
+			std::list<Entry*>::iterator lru;
+		};
+		static void load_index();
+		static void write_index();
+		static Entry* add_entry(const std::wstring &path, const std::wstring &key,
+			const std::string &etag, long long mtime, long long size);
+		static Entry* store(const std::wstring &key, const std::wstring &tmpname,
+			const std::string &etag, long long mtime, long long size);
+		static void remove_entry(Entry* e);
+		static void pin(Entry* e);
+		static void evict();
+		static std::wstring default_dir();
+		static std::wstring hash_name(const std::wstring &str);
+		static size_t header_callback(char *buffer, size_t size, size_t nitems, void *userp);
+		static size_t write_callback(void *contents, size_t size, size_t nmemb, void *userp);
+		static int xferinfo(void *p, curl_off_t dltotal, curl_off_t dlnow, curl_off_t ultotal, curl_off_t ulnow);
+
+		static std::map<std::wstring, Entry*> entries_;
+		static std::map<std::wstring, Entry*> keys_;
+		static std::list<Entry*> lru_;
+		static wxCriticalSection lock_;
+		static std::wstring dir_;
+		static long long max_size_;
+		static long long total_;
+		static bool loaded_;
+		static bool revalidate_;
+		static int changes_;
+		//partial downloads of this process in flight
+		static std::set<std::wstring> parts_;
+	};
+
+	//keeps several remote brick downloads in flight on one curl multi handle
+	//so the latency of each request is not paid in turn
+	//finished files are stored in BrickCache
+	//not thread safe, used by the loader thread
+	class BrickDownloader {
+	public:
+		struct Result {
+			std::wstring key;
+			//pinned in BrickCache, empty if the download failed
+			std::wstring filename;
+			std::vector<TextureBrick*> bricks;
+		};
+
+		BrickDownloader();
+		~BrickDownloader();
+
+		//start downloading bricks of one url
+		//packed bricks are fetched together with a range request
+		//bricks already in flight are added to the ones waiting for them
+		bool add(const std::vector<const FileLocInfo*> &finfos, const std::vector<TextureBrick*> &bricks);
+		//wait for a transfer in flight, false if there is none for finfo
+		bool attach(const FileLocInfo *finfo, TextureBrick *brick);
+		bool full();
+		int size() {return (int)handles_.size();}
+		//run the transfers, waiting up to timeout ms if none finished
+		void perform(std::vector<Result> &done, int timeout);
+		//stop the transfers that none of the bricks in keep is waiting for
+		void cancel_except(const std::vector<TextureBrick*> &keep);
+		void cancel_all();
+		//cancel all and free the connections
+		void close();
+		void set_max_transfers(int num);
+		int get_max_transfers() {return max_transfers_;}
+	private:
+		struct Part {
+			std::wstring key;
+			std::vector<TextureBrick*> bricks;
+		};
+		struct Transfer {
+			CURL *curl;
+			BrickCache::Download *dl;
+			std::vector<Part> parts;
+		};
+		void remove(Transfer *t);
+
+		CURLM *multi_;
+		//by the key of each brick
+		std::map<std::wstring, Transfer*> transfers_;
+		std::map<CURL*, Transfer*> handles_;
+		std::vector<CURL*> idle_;
+		int max_transfers_;
+	};
+}
+
+#endif // SLIVR_BrickCache_h
@@ -0,0 +1,240 @@
+#include "BrickIndex.h"
+#include "TextureBrick.h"
+#include <algorithm>
+#include <climits>
+
+namespace FLIVR
+{
+	BrickIndex::BrickIndex() :
+		grid_(false)
+	{
+		for (int a = 0; a < 3; a++)
+		{
+			dim_[a] = 0;
+			origin_[a] = 0;
+		}
+	}
+
+	BrickIndex::~BrickIndex()
+	{
+	}
+
+	void BrickIndex::clear()
+	{
+		boxes_.clear();
+		grid_ = false;
+		for (int a = 0; a < 3; a++)
+		{
+			dim_[a] = 0;
+			origin_[a] = 0;
+			first_[a].clear();
+			count_[a].clear();
+		}
+		cells_.clear();
+		nodes_.clear();
+		order_.clear();
+	}
+
+	void BrickIndex::build(const std::vector<TextureBrick*> &bricks)
+	{
+		std::vector<Box> boxes(bricks.size());
+		for (size_t i = 0; i < bricks.size(); i++)
+		{
+			TextureBrick *b = bricks[i];
+			Box &box = boxes[i];
+			box.min[0] = b->ox(); box.max[0] = b->ox() + b->nx();
+			box.min[1] = b->oy(); box.max[1] = b->oy() + b->ny();
+			box.min[2] = b->oz(); box.max[2] = b->oz() + b->nz();
+		}
+		build(boxes);
+	}
+
+	void BrickIndex::build(const std::vector<Box> &boxes)
+	{
+		clear();
+		boxes_ = boxes;
+		if (boxes_.empty())
+			return;
+
+		grid_ = build_grid();
+		if (grid_)
+			return;
+
+		for (int a = 0; a < 3; a++)
+		{
+			first_[a].clear();
+			count_[a].clear();
+		}
+		cells_.clear();
+		order_.resize(boxes_.size());
+		for (size_t i = 0; i < order_.size(); i++)
+			order_[i] = int(i);
+		nodes_.reserve(boxes_.size() / 2 + 1);
+		build_node(0, int(order_.size()));
+	}
+
+	//the bricks form a grid if the start of a brick on an axis decides its
+	//end, and each combination of starts is used by exactly one brick
+	bool BrickIndex::build_grid()
+	{
+		std::vector<int> starts[3], ends[3];
+		for (int a = 0; a < 3; a++)
+		{
+			for (size_t i = 0; i < boxes_.size(); i++)
+				starts[a].push_back(boxes_[i].min[a]);
+			std::sort(starts[a].begin(), starts[a].end());
+			starts[a].erase(std::unique(starts[a].begin(), starts[a].end()), starts[a].end());
+			dim_[a] = int(starts[a].size());
+			ends[a].assign(dim_[a], INT_MIN);
+			origin_[a] = starts[a][0];
+		}
+		if ((long long)dim_[0] * dim_[1] * dim_[2] != (long long)boxes_.size())
+			return false;
+
+		cells_.assign(boxes_.size(), -1);
+		for (size_t i = 0; i < boxes_.size(); i++)
+		{
+			int c[3];
+			for (int a = 0; a < 3; a++)
+			{
+				c[a] = int(std::lower_bound(starts[a].begin(), starts[a].end(),
+					boxes_[i].min[a]) - starts[a].begin());
+				if (ends[a][c[a]] == INT_MIN)
+					ends[a][c[a]] = boxes_[i].max[a];
+				else if (ends[a][c[a]] != boxes_[i].max[a])
+					return false;
+			}
+			int id = (c[2] * dim_[1] + c[1]) * dim_[0] + c[0];
+			if (cells_[id] >= 0)
+				return false;
+			cells_[id] = int(i);
+		}
+
+		for (int a = 0; a < 3; a++)
+		{
+			//ends have to grow with the starts for the covering cells to be
+			//a contiguous range
+			for (int c = 1; c < dim_[a]; c++)
+				if (ends[a][c] <= ends[a][c-1])
+					return false;
+			int extent = ends[a][dim_[a]-1] - origin_[a];
+			first_[a].assign(extent, -1);
+			count_[a].assign(extent, 0);
+			for (int c = 0; c < dim_[a]; c++)
+			{
+				for (int v = starts[a][c]; v < ends[a][c]; v++)
+				{
+					int vi = v - origin_[a];
+					if (first_[a][vi] < 0)
+						first_[a][vi] = c;
+					if (count_[a][vi] == 255)
+						return false;
+					count_[a][vi]++;
+				}
+			}
+		}
+		return true;
+	}
+
+	int BrickIndex::build_node(int first, int count)
+	{
+		Node node;
+		node.left = node.right = -1;
+		node.first = first;
+		node.count = count;
+		node.box = boxes_[order_[first]];
+		for (int i = first + 1; i < first + count; i++)
+		{
+			const Box &b = boxes_[order_[i]];
+			for (int a = 0; a < 3; a++)
+			{
+				node.box.min[a] = std::min(node.box.min[a], b.min[a]);
+				node.box.max[a] = std::max(node.box.max[a], b.max[a]);
+			}
+		}
+		int id = int(nodes_.size());
+		nodes_.push_back(node);
+		if (count <= 4)
+			return id;
+
+		//split at the median of the brick centers on the longest axis
+		int axis = 0;
+		for (int a = 1; a < 3; a++)
+			if (node.box.max[a] - node.box.min[a] > node.box.max[axis] - node.box.min[axis])
+				axis = a;
+		int half = count / 2;
+		const std::vector<Box> &boxes = boxes_;
+		std::nth_element(order_.begin() + first, order_.begin() + first + half,
+			order_.begin() + first + count,
+			[&boxes, axis](int i, int j) {
+				return boxes[i].min[axis] + boxes[i].max[axis] <
+					boxes[j].min[axis] + boxes[j].max[axis]; });
+		int left = build_node(first, half);
+		int right = build_node(first + half, count - half);
+		nodes_[id].left = left;
+		nodes_[id].right = right;
+		return id;
+	}
+
+	int BrickIndex::find(int x, int y, int z) const
+	{
+		if (boxes_.empty())
+			return -1;
+		int p[3] = {x, y, z};
+
+		if (grid_)
+		{
+			int f[3], n[3];
+			for (int a = 0; a < 3; a++)
+			{
+				int vi = p[a] - origin_[a];
+				if (vi < 0 || vi >= int(first_[a].size()) || first_[a][vi] < 0)
+					return -1;
+				f[a] = first_[a][vi];
+				n[a] = count_[a][vi];
+			}
+			//a single cell unless the voxel is on the overlap of bricks
+			int result = -1;
+			for (int k = f[2]; k < f[2] + n[2]; k++)
+			for (int j = f[1]; j < f[1] + n[1]; j++)
+			for (int i = f[0]; i < f[0] + n[0]; i++)
+			{
+				int id = cells_[(k * dim_[1] + j) * dim_[0] + i];
+				if (result < 0 || id < result)
+					result = id;
+			}
+			return result;
+		}
+
+		int result = -1;
+		int stack[64];
+		int top = 0;
+		stack[top++] = 0;
+		while (top > 0)
+		{
+			const Node &node = nodes_[stack[--top]];
+			if (p[0] < node.box.min[0] || p[0] >= node.box.max[0] ||
+				p[1] < node.box.min[1] || p[1] >= node.box.max[1] ||
+				p[2] < node.box.min[2] || p[2] >= node.box.max[2])
+				continue;
+			if (node.left < 0)
+			{
+				for (int i = node.first; i < node.first + node.count; i++)
+				{
+					int id = order_[i];
+					const Box &b = boxes_[id];
+					if (p[0] >= b.min[0] && p[0] < b.max[0] &&
+						p[1] >= b.min[1] && p[1] < b.max[1] &&
+						p[2] >= b.min[2] && p[2] < b.max[2] &&
+						(result < 0 || id < result))
+						result = id;
+				}
+				continue;
+			}
+			stack[top++] = node.left;
+			stack[top++] = node.right;
+		}
+		return result;
+	}
+
+} // End namespace FLIVR
@@ -0,0 +1,64 @@
+#ifndef SLIVR_BrickIndex_h
+#define SLIVR_BrickIndex_h
+
+#include <vector>
+
+namespace FLIVR
+{
+	class TextureBrick;
+
+	//finds the brick holding a voxel
+	//bricks on a regular grid are looked up from their grid coordinates,
+	//other layouts go through a bounding volume hierarchy
+	//where bricks overlap, the brick with the lowest index is returned
+	class BrickIndex
+	{
+	public:
+		//voxel range of a brick, max is exclusive
+		struct Box
+		{
+			int min[3];
+			int max[3];
+		};
+
+		BrickIndex();
+		~BrickIndex();
+
+		void build(const std::vector<TextureBrick*> &bricks);
+		void build(const std::vector<Box> &boxes);
+		void clear();
+		//index of the brick, -1 if no brick holds the voxel
+		int find(int x, int y, int z) const;
+		int size() const {return int(boxes_.size());}
+		bool is_grid() const {return grid_;}
+
+	private:
+		std::vector<Box> boxes_;
+
+		//regular grid
+		bool grid_;
+		int dim_[3];
+		int origin_[3];
+		//first grid coordinate holding each voxel coordinate, -1 for none,
+		//and the number of grid coordinates holding it
+		std::vector<int> first_[3];
+		std::vector<unsigned char> count_[3];
+		//brick of each grid cell
+		std::vector<int> cells_;
+
+		//bounding volume hierarchy
+		struct Node
+		{
+			Box box;
+			int left, right;	//children, -1 for a leaf
+			int first, count;	//bricks of a leaf in order_
+		};
+		std::vector<Node> nodes_;
+		std::vector<int> order_;
+
+		bool build_grid();
+		int build_node(int first, int count);
+	};
+
+} // End namespace FLIVR
+#endif
@@ -0,0 +1,323 @@
+#include "BrickLOD.h"
+#include <queue>
+#include <algorithm>
+#include <cmath>
+#include <glm/gtc/matrix_inverse.hpp>
+
+namespace FLIVR
+{
+	BrickLOD::BrickLOD() :
+		mv_(1.0f),
+		mvp_(1.0f),
+		eye_(0.0f),
+		persp_(false),
+		pix_per_unit_(1.0),
+		pixel_err_(1.0),
+		budget_(0)
+	{
+	}
+
+	BrickLOD::~BrickLOD()
+	{
+	}
+
+	void BrickLOD::clear()
+	{
+		levels_.clear();
+	}
+
+	void BrickLOD::add_level(int nx, int ny, int nz, const std::vector<LODBrick> &bricks)
+	{
+		Level level;
+		level.nx = nx > 0 ? nx : 1;
+		level.ny = ny > 0 ? ny : 1;
+		level.nz = nz > 0 ? nz : 1;
+		level.bricks = bricks;
+		levels_.push_back(level);
+		if (levels_.size() > 1)
+			link_children(int(levels_.size()) - 1);
+		else
+		{
+			Level &finest = levels_.back();
+			finest.groups.resize(finest.bricks.size());
+			for (size_t i = 0; i < finest.bricks.size(); i++)
+			{
+				finest.groups[i].bricks.push_back(int(i));
+				finest.groups[i].size = finest.bricks[i].size;
+			}
+		}
+	}
+
+	static int find_root(std::vector<int> &root, int i)
+	{
+		while (root[i] != i)
+		{
+			root[i] = root[root[i]];
+			i = root[i];
+		}
+		return i;
+	}
+
+	//a group of the finer level belongs to the bricks of the level lv that
+	//its bricks overlap by more than a voxel of lv, these bricks are merged
+	//into one group, bricks of the level are put in a uniform grid first
+	void BrickLOD::link_children(int lv)
+	{
+		Level &coarse = levels_[lv];
+		Level &fine = levels_[lv-1];
+		coarse.groups.clear();
+		if (coarse.bricks.empty())
+			return;
+
+		double ex = 1.0, ey = 1.0, ez = 1.0;
+		for (size_t i = 0; i < coarse.bricks.size(); i++)
+		{
+			Vector d = coarse.bricks[i].bbox.diagonal();
+			if (d.x() > 0.0 && d.x() < ex) ex = d.x();
+			if (d.y() > 0.0 && d.y() < ey) ey = d.y();
+			if (d.z() > 0.0 && d.z() < ez) ez = d.z();
+		}
+		int g[3] = {
+			std::min(std::max(int(ceil(1.0/ex)), 1), 256),
+			std::min(std::max(int(ceil(1.0/ey)), 1), 256),
+			std::min(std::max(int(ceil(1.0/ez)), 1), 256)};
+		std::vector<std::vector<int> > grid(g[0]*g[1]*g[2]);
+
+		for (size_t i = 0; i < coarse.bricks.size(); i++)
+		{
+			const BBox &b = coarse.bricks[i].bbox;
+			int lo[3], hi[3];
+			for (int a = 0; a < 3; a++)
+			{
+				lo[a] = std::min(std::max(int(floor(b.min()(a)*g[a])), 0), g[a]-1);
+				hi[a] = std::min(std::max(int(ceil(b.max()(a)*g[a]))-1, lo[a]), g[a]-1);
+			}
+			for (int z = lo[2]; z <= hi[2]; z++)
+			for (int y = lo[1]; y <= hi[1]; y++)
+			for (int x = lo[0]; x <= hi[0]; x++)
+				grid[(z*g[1] + y)*g[0] + x].push_back(int(i));
+		}
+
+		//levels of different sizes do not end on the same voxel, an overlap
+		//within a voxel of the level does not count
+		double voxel[3] = {1.0/coarse.nx, 1.0/coarse.ny, 1.0/coarse.nz};
+		std::vector<int> root(coarse.bricks.size());
+		for (size_t i = 0; i < root.size(); i++)
+			root[i] = int(i);
+		std::vector<int> parent(fine.groups.size(), -1);
+		for (size_t j = 0; j < fine.groups.size(); j++)
+		{
+			const std::vector<int> &members = fine.groups[j].bricks;
+			int best = -1;
+			double best_vol = 0.0;
+			for (size_t m = 0; m < members.size(); m++)
+			{
+				const BBox &b = fine.bricks[members[m]].bbox;
+				int lo[3], hi[3];
+				double tol[3];
+				for (int a = 0; a < 3; a++)
+				{
+					lo[a] = std::min(std::max(int(floor(b.min()(a)*g[a])), 0), g[a]-1);
+					hi[a] = std::min(std::max(int(ceil(b.max()(a)*g[a]))-1, lo[a]), g[a]-1);
+					tol[a] = std::min(voxel[a], (b.max()(a) - b.min()(a)) / 2.0);
+				}
+				for (int z = lo[2]; z <= hi[2]; z++)
+				for (int y = lo[1]; y <= hi[1]; y++)
+				for (int x = lo[0]; x <= hi[0]; x++)
+				{
+					const std::vector<int> &cell = grid[(z*g[1] + y)*g[0] + x];
+					for (size_t k = 0; k < cell.size(); k++)
+					{
+						const BBox &c = coarse.bricks[cell[k]].bbox;
+						double o[3];
+						bool inside = true;
+						for (int a = 0; a < 3; a++)
+						{
+							o[a] = std::min(b.max()(a), c.max()(a)) -
+								std::max(b.min()(a), c.min()(a));
+							if (o[a] <= tol[a])
+								inside = false;
+						}
+						if (o[0] <= 0.0 || o[1] <= 0.0 || o[2] <= 0.0)
+							continue;
+						double vol = o[0] * o[1] * o[2];
+						if (vol > best_vol)
+						{
+							best_vol = vol;
+							best = cell[k];
+						}
+						if (!inside)
+							continue;
+						if (parent[j] < 0)
+							parent[j] = cell[k];
+						else
+							root[find_root(root, cell[k])] = find_root(root, parent[j]);
+					}
+				}
+			}
+			//a brick smaller than a voxel of the level
+			if (parent[j] < 0)
+				parent[j] = best;
+		}
+
+		std::vector<int> group_id(coarse.bricks.size(), -1);
+		for (size_t i = 0; i < coarse.bricks.size(); i++)
+		{
+			int r = find_root(root, int(i));
+			if (group_id[r] < 0)
+			{
+				group_id[r] = int(coarse.groups.size());
+				coarse.groups.push_back(Group());
+				coarse.groups.back().size = 0;
+			}
+			Group &group = coarse.groups[group_id[r]];
+			group.bricks.push_back(int(i));
+			group.size += coarse.bricks[i].size;
+		}
+		for (size_t j = 0; j < fine.groups.size(); j++)
+		{
+			if (parent[j] >= 0)
+				coarse.groups[group_id[find_root(root, parent[j])]].children.push_back(int(j));
+		}
+	}
+
+	void BrickLOD::set_view(const glm::mat4 &mv, const glm::mat4 &proj, int width, int height)
+	{
+		mv_ = mv;
+		mvp_ = proj * mv;
+		//glm::perspective has -1 in the w row, an orthographic projection has 0
+		persp_ = proj[2][3] != 0.0f;
+		glm::vec4 eye = glm::inverse(mv) * glm::vec4(0.0f, 0.0f, 0.0f, 1.0f);
+		eye_ = glm::vec3(eye) / (eye.w != 0.0f ? eye.w : 1.0f);
+		//the axes differ when the pixels are not square
+		pix_per_unit_ = std::max(
+			std::fabs(proj[0][0]) * std::max(width, 1),
+			std::fabs(proj[1][1]) * std::max(height, 1)) / 2.0;
+	}
+
+	//conservative test of the corners against the clipping planes
+	bool BrickLOD::out_of_view(const BBox &bbox)
+	{
+		int out[6] = {0, 0, 0, 0, 0, 0};
+		for (int i = 0; i < 8; i++)
+		{
+			glm::vec4 p = mvp_ * glm::vec4(
+				(i&1) ? bbox.max().x() : bbox.min().x(),
+				(i&2) ? bbox.max().y() : bbox.min().y(),
+				(i&4) ? bbox.max().z() : bbox.min().z(), 1.0);
+			for (int a = 0; a < 3; a++)
+			{
+				if (p[a] < -p.w) out[a*2]++;
+				if (p[a] > p.w) out[a*2+1]++;
+			}
+		}
+		for (int i = 0; i < 6; i++)
+			if (out[i] == 8)
+				return true;
+		return false;
+	}
+
+	double BrickLOD::screen_error(int level, const BBox &bbox)
+	{
+		if (level < 0 || level >= int(levels_.size()) || !bbox.valid())
+			return 0.0;
+		if (out_of_view(bbox))
+			return 0.0;
+
+		const Level &lv = levels_[level];
+		//longest voxel edge in eye coordinates
+		double vx = glm::length(glm::vec3(mv_ * glm::vec4(1.0f/lv.nx, 0.0f, 0.0f, 0.0f)));
+		double vy = glm::length(glm::vec3(mv_ * glm::vec4(0.0f, 1.0f/lv.ny, 0.0f, 0.0f)));
+		double vz = glm::length(glm::vec3(mv_ * glm::vec4(0.0f, 0.0f, 1.0f/lv.nz, 0.0f)));
+		double voxel = std::max(vx, std::max(vy, vz));
+
+		if (!persp_)
+			return voxel * pix_per_unit_;
+
+		Point p(
+			std::min(std::max(double(eye_.x), bbox.min().x()), bbox.max().x()),
+			std::min(std::max(double(eye_.y), bbox.min().y()), bbox.max().y()),
+			std::min(std::max(double(eye_.z), bbox.min().z()), bbox.max().z()));
+		glm::vec4 pe = mv_ * glm::vec4(p.x(), p.y(), p.z(), 1.0);
+		double depth = -pe.z;
+		if (depth < 1e-6)
+			depth = 1e-6;
+		return voxel * pix_per_unit_ / depth;
+	}
+
+	double BrickLOD::group_error(int level, const Group &group)
+	{
+		double err = 0.0;
+		for (size_t i = 0; i < group.bricks.size(); i++)
+			err = std::max(err, screen_error(level,
+				levels_[level].bricks[group.bricks[i]].bbox));
+		return err;
+	}
+
+	int BrickLOD::select(std::vector<LODBrick> &cut)
+	{
+		cut.clear();
+		if (levels_.empty())
+			return -1;
+
+		struct Node
+		{
+			double err;
+			int level;
+			int index;
+			bool operator<(const Node &n) const { return err < n.err; }
+		};
+		std::priority_queue<Node> queue;
+		long long total = 0;
+		int top = int(levels_.size()) - 1;
+		int finest = top;
+
+		for (size_t i = 0; i < levels_[top].groups.size(); i++)
+		{
+			const Group &g = levels_[top].groups[i];
+			Node n = {group_error(top, g), top, int(i)};
+			queue.push(n);
+			total += g.size;
+		}
+
+		//refine the group with the largest error first, so the budget goes
+		//to the bricks that need it most
+		while (!queue.empty())
+		{
+			Node n = queue.top();
+			queue.pop();
+			Level &lv = levels_[n.level];
+			const Group &g = lv.groups[n.index];
+
+			bool refine = n.err > pixel_err_ && n.level > 0 &&
+				!g.children.empty();
+			long long size = 0;
+			if (refine)
+			{
+				for (size_t i = 0; i < g.children.size(); i++)
+					size += levels_[n.level-1].groups[g.children[i]].size;
+				if (budget_ > 0 && total - g.size + size > budget_)
+					refine = false;
+			}
+
+			if (!refine)
+			{
+				for (size_t i = 0; i < g.bricks.size(); i++)
+					cut.push_back(lv.bricks[g.bricks[i]]);
+				if (n.level < finest) finest = n.level;
+				continue;
+			}
+
+			total += size - g.size;
+			for (size_t i = 0; i < g.children.size(); i++)
+			{
+				const Group &c = levels_[n.level-1].groups[g.children[i]];
+				Node m = {group_error(n.level-1, c), n.level-1, g.children[i]};
+				queue.push(m);
+			}
+		}
+
+		return finest;
+	}
+
+} // End namespace FLIVR
@@ -0,0 +1,83 @@
+#ifndef SLIVR_BrickLOD_h
+#define SLIVR_BrickLOD_h
+
+#include <vector>
+#include <glm/glm.hpp>
+#include "BBox.h"
+
+namespace FLIVR
+{
+	//a brick of a multiresolution pyramid
+	struct LODBrick
+	{
+		int level;		//0 is the finest level
+		int index;		//index of the brick in its level
+		BBox bbox;		//0-1 coordinates of the whole volume
+		long long size;	//bytes
+	};
+
+	//selects the bricks to draw from the levels of a pyramid
+	//starting from the coarsest level, a brick is replaced with the bricks of
+	//the finer level inside it while one of its voxels covers more pixels
+	//than the error bound, and the bricks fit in the budget
+	//where the bricks of two levels do not nest, the bricks sharing finer
+	//bricks are replaced together, so the volume is covered once
+	//it makes no GL calls
+	class BrickLOD
+	{
+	public:
+		BrickLOD();
+		~BrickLOD();
+
+		void clear();
+		//levels are added from the finest to the coarsest
+		//nx, ny, nz: voxel numbers of the level
+		void add_level(int nx, int ny, int nz, const std::vector<LODBrick> &bricks);
+		int level_num() {return int(levels_.size());}
+
+		//mv: 0-1 volume coordinates to eye coordinates
+		//width, height: viewport size in pixels
+		void set_view(const glm::mat4 &mv, const glm::mat4 &proj, int width, int height);
+		//pixels a voxel can cover before its brick is refined
+		void set_pixel_error(double err) {pixel_err_ = err;}
+		//bytes of the selected bricks, 0 for no limit
+		void set_budget(long long bytes) {budget_ = bytes;}
+
+		//pixels covered by a voxel of the level at the point of the box closest
+		//to the eye, 0 if the box is out of the view
+		double screen_error(int level, const BBox &bbox);
+		//bricks covering the volume, returns the finest level used
+		int select(std::vector<LODBrick> &cut);
+
+	private:
+		//bricks of a level replaced together, one brick where levels nest
+		struct Group
+		{
+			std::vector<int> bricks;
+			long long size;
+			//groups of the finer level inside the group
+			std::vector<int> children;
+		};
+		struct Level
+		{
+			int nx, ny, nz;
+			std::vector<LODBrick> bricks;
+			std::vector<Group> groups;
+		};
+		std::vector<Level> levels_;
+
+		glm::mat4 mv_;
+		glm::mat4 mvp_;
+		glm::vec3 eye_;		//0-1 volume coordinates
+		bool persp_;
+		double pix_per_unit_;	//pixels per eye unit at depth 1, larger axis
+		double pixel_err_;
+		long long budget_;
+
+		void link_children(int lv);
+		bool out_of_view(const BBox &bbox);
+		double group_error(int level, const Group &group);
+	};
+
+} // End namespace FLIVR
+#endif
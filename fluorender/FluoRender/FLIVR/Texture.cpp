@@ -31,6 +31,7 @@
 #include <FLIVR/TextureRenderer.h>
 #include <FLIVR/Utils.h>
 #include <algorithm>
+#include <zlib.h>
 #include <inttypes.h>
 
 #include <wx/progdlg.h>
@@ -40,6 +41,10 @@ using namespace std;
 namespace FLIVR
 {
 	size_t Texture::mask_undo_num_ = 0;
+	bool Texture::mask_undo_compress_ = true;
+	//edge length of the mask blocks saved for undos
+	static const int MASK_UNDO_BLOCK = 32;
+
 	Texture::Texture() :
         sort_bricks_(true),
         nx_(0),
@@ -69,6 +74,7 @@ namespace FLIVR
 		s_spcy_(1.0),
 		s_spcz_(1.0),
         mask_undo_pointer_(-1),
+		mask_data_(0),
 		filename_(NULL)
 	{
 		for (size_t i = 0; i < TEXTURE_MAX_COMPONENTS; i++)
@@ -83,8 +89,7 @@ namespace FLIVR
 
 	Texture::~Texture()
 	{
-		DeleteCacheFiles();
-
+		clearLOD();
 		if(bricks_){
 			for (int i=0; i<(int)(*bricks_).size(); i++)
 			{
@@ -119,65 +124,36 @@ namespace FLIVR
 		clearPyramid();
 	}
 
-	void Texture::DeleteCacheFiles()
-	{
-		for (int i=0; i<(int)filenames_.size(); i++){
-			for (int j=0; j<(int)filenames_[i].size(); j++){
-				for (int k=0; k<(int)filenames_[i][j].size(); k++){
-					for (int n=0; n<(int)filenames_[i][j][k].size(); n++){
-						if (filenames_[i][j][k][n] && !filenames_[i][j][k][n]->cache_filename.empty())
-						{
-							wxString fpath = filenames_[i][j][k][n]->cache_filename;
-							if(wxFileExists(fpath))
-							{
-								wxRemoveFile(fpath);
-								filenames_[i][j][k][n]->cached = false;
-								filenames_[i][j][k][n]->cache_filename = L"";
-							}
-						}
-					}
-				}
-			}
-		}
-	}
-
 	void Texture::clear_undos()
 	{
 		//mask data now managed by the undos
 		for (size_t i=0; i<mask_undos_.size(); ++i)
+			release_mask_blocks(mask_undos_[i]);
+		mask_undos_.clear();
+		mask_undo_pointer_ = -1;
+		mask_dirty_.clear();
+		if (mask_data_)
 		{
-			if (mask_undos_[i])
-				delete []mask_undos_[i];
-			mask_undos_.clear();
-			mask_undo_pointer_ = -1;
+			delete []mask_data_;
+			mask_data_ = 0;
 		}
 	}
 
 	int Texture::get_brick_id_point(int ix, int iy, int iz)
 	{
-		for (unsigned int i = 0; i < (*bricks_).size(); i++)
-		{
-			int ox = (*bricks_)[i]->ox();
-			int oy = (*bricks_)[i]->oy();
-			int oz = (*bricks_)[i]->oz();
-			int ex = ox + (*bricks_)[i]->nx();
-			int ey = oy + (*bricks_)[i]->ny();
-			int ez = oz + (*bricks_)[i]->nz();
-			
-			if (ix >= ox && iy >= oy && iz >= oz &&
-				ix < ex && iy < ey && iz < ez)
-				return i;
-		}
-
-		return -1;
+		vector<TextureBrick*> &bricks = *level_bricks();
+		if (brick_index_.size() != bricks.size())
+			brick_index_.build(bricks);
+		return brick_index_.find(ix, iy, iz);
 	}
 
 	double Texture::get_brick_original_value(int brick_id, int i, int j, int k, bool normalize)
 	{
-		if (brick_id < 0 || brick_id >= (*bricks_).size())
+		vector<TextureBrick*> &bricks = *level_bricks();
+		if (brick_id < 0 || brick_id >= bricks.size())
 			return 0.0;
 
-		TextureBrick *b = (*bricks_)[brick_id];
+		TextureBrick *b = bricks[brick_id];
 
 		Nrrd* data = get_nrrd(0);
 		if (!data) return 0.0;
@@ -200,7 +176,7 @@ namespace FLIVR
 		{
 			index = (nx)*(ny)*(kk) + (nx)*(jj) + (ii);
 			//tmp_load = !b->isLoaded();
-			FileLocInfo *finfo = GetFileName(b->getID());
+			FileLocInfo *finfo = GetFileName(b);
 			d_ptr = b->tex_data_brk(0, finfo);
 		}
 		else
@@ -233,10 +209,10 @@ namespace FLIVR
 	double Texture::get_brick_original_value(int i, int j, int k, bool normalize)
 	{
 		int bid = get_brick_id_point(i, j, k);
-		if (bid < 0 || bid >= get_brick_num())
+		if (bid < 0 || bid >= level_bricks()->size())
 			return 0.0;
 
-		TextureBrick *b = (*bricks_)[bid];
+		TextureBrick *b = (*level_bricks())[bid];
 		int ii = i - b->ox();
 		int jj = j - b->oy();
 		int kk = k - b->oz();
@@ -244,52 +220,104 @@ namespace FLIVR
 		return get_brick_original_value(bid, ii, jj, kk, normalize);
 	}
 
-	vector<TextureBrick*>* Texture::get_sorted_bricks(
-		Ray& view, bool is_orthographic)
+	//distance of a brick to the eye point, or to the view plane for an
+	//orthographic view, from its nearest (order 1) or farthest (order 0) corner
+	static double view_distance(TextureBrick* b, Ray& view,
+		bool is_orthographic, int order)
 	{
-		if (sort_bricks_)
+		Point minp(b->bbox().min());
+		Point maxp(b->bbox().max());
+		Vector diag(b->bbox().diagonal());
+		minp += diag / 1000.;
+		maxp -= diag / 1000.;
+		Point corner[8];
+		corner[0] = minp;
+		corner[1] = Point(minp.x(), minp.y(), maxp.z());
+		corner[2] = Point(minp.x(), maxp.y(), minp.z());
+		corner[3] = Point(minp.x(), maxp.y(), maxp.z());
+		corner[4] = Point(maxp.x(), minp.y(), minp.z());
+		corner[5] = Point(maxp.x(), minp.y(), maxp.z());
+		corner[6] = Point(maxp.x(), maxp.y(), minp.z());
+		corner[7] = maxp;
+		double d = 0.0;
+		for (unsigned int c = 0; c < 8; c++)
 		{
-			for (unsigned int i = 0; i < (*bricks_).size(); i++)
+			double dd;
+			if (is_orthographic)
 			{
-				Point minp((*bricks_)[i]->bbox().min());
-				Point maxp((*bricks_)[i]->bbox().max());
-				Vector diag((*bricks_)[i]->bbox().diagonal());
-				minp += diag / 1000.;
-				maxp -= diag / 1000.;
-				Point corner[8];
-				corner[0] = minp;
-				corner[1] = Point(minp.x(), minp.y(), maxp.z());
-				corner[2] = Point(minp.x(), maxp.y(), minp.z());
-				corner[3] = Point(minp.x(), maxp.y(), maxp.z());
-				corner[4] = Point(maxp.x(), minp.y(), minp.z());
-				corner[5] = Point(maxp.x(), minp.y(), maxp.z());
-				corner[6] = Point(maxp.x(), maxp.y(), minp.z());
-				corner[7] = maxp;
-				double d = 0.0;
-				for (unsigned int c = 0; c < 8; c++)
-				{
-					double dd;
-					if (is_orthographic)
-					{
-						// orthographic: sort bricks based on distance to the view plane
-						dd = Dot(corner[c], view.direction());
-					}
-					else
-					{
-						// perspective: sort bricks based on distance to the eye point
-						dd = (corner[c] - view.origin()).length();
-					}
-					if (c == 0 ||
-						(TextureRenderer::get_update_order() == 1 && dd < d) ||
-						(TextureRenderer::get_update_order() == 0 && dd > d))
-						d = dd;
-				}
-				(*bricks_)[i]->set_d(d);
+				// orthographic: sort bricks based on distance to the view plane
+				dd = Dot(corner[c], view.direction());
 			}
-			if (TextureRenderer::get_update_order() == 0)
-				std::sort((*bricks_).begin(), (*bricks_).end(), TextureBrick::sort_asc);
-			else if (TextureRenderer::get_update_order() == 1)
-				std::sort((*bricks_).begin(), (*bricks_).end(), TextureBrick::sort_dsc);
+			else
+			{
+				// perspective: sort bricks based on distance to the eye point
+				dd = (corner[c] - view.origin()).length();
+			}
+			if (c == 0 ||
+				(order == 1 && dd < d) ||
+				(order == 0 && dd > d))
+				d = dd;
+		}
+		return d;
+	}
+
+	//sorts the bricks by their distances, far to near if far_first
+	//bricks keep the order of the last sort, and a small camera move only
+	//puts a few of them out of place. insertion sort repairs that in about
+	//linear time, and hands over to a full sort once too many bricks move.
+	//the distances are copied next to the bricks to keep the sort in cache
+	static void repair_sort(vector<TextureBrick*>::iterator first,
+		vector<TextureBrick*>::iterator last, bool far_first)
+	{
+		typedef pair<double, TextureBrick*> Key;
+		vector<Key> keys;
+		keys.reserve(last - first);
+		for (vector<TextureBrick*>::iterator i = first; i != last; ++i)
+			keys.push_back(Key(far_first ? -(*i)->get_d() : (*i)->get_d(), *i));
+
+		size_t moves = 0;
+		size_t max_moves = keys.size() * 4 + 64;
+		for (size_t i = 1; i < keys.size(); i++)
+		{
+			Key k = keys[i];
+			size_t j = i;
+			for (; j > 0 && k.first < keys[j-1].first; --j)
+			{
+				keys[j] = keys[j-1];
+				if (++moves > max_moves)
+					break;
+			}
+			if (moves > max_moves)
+			{
+				keys[j-1] = k;
+				std::sort(keys.begin(), keys.end(),
+					[](const Key &a, const Key &b) {return a.first < b.first;});
+				break;
+			}
+			keys[j] = k;
+		}
+
+		for (size_t i = 0; i < keys.size(); i++)
+			first[i] = keys[i].second;
+	}
+
+	vector<TextureBrick*>* Texture::get_sorted_bricks(
+		Ray& view, bool is_orthographic, bool culled)
+	{
+		if (sort_bricks_)
+		{
+			vector<TextureBrick*> &bricks = *bricks_;
+			int order = TextureRenderer::get_update_order();
+			size_t n = bricks.size();
+			if (culled)
+				n = std::stable_partition(bricks.begin(), bricks.end(),
+					[](TextureBrick* b) {return b->get_disp();}) - bricks.begin();
+			for (size_t i = 0; i < n; i++)
+				bricks[i]->set_d(view_distance(bricks[i], view, is_orthographic, order));
+			if (order == 0)
+				repair_sort(bricks.begin(), bricks.begin() + n, true);
+			else if (order == 1)
+				repair_sort(bricks.begin(), bricks.begin() + n, false);
 
 			sort_bricks_ = false;
 		}
@@ -304,66 +332,28 @@ namespace FLIVR
 		{
 			quota_bricks_.clear();
 			unsigned int i;
-			if (quota >= (int64_t)(*bricks_).size())
-				quota = int((*bricks_).size());
-			else
-			{
-				for (i=0; i<(*bricks_).size(); i++)
-				{
-					Point brick_center = (*bricks_)[i]->bbox().center();
-					double d = (brick_center - center).length();
-					(*bricks_)[i]->set_d(d);
-				}
-				std::sort((*bricks_).begin(), (*bricks_).end(), TextureBrick::sort_dsc);
-			}
-
 			for (i=0; i<(unsigned int)(*bricks_).size(); i++)
 			{
-				if (skip)
-				{
-					if ((*bricks_)[i]->get_priority() == 0)
-						quota_bricks_.push_back((*bricks_)[i]);
-				}
-				else
+				if (!skip || (*bricks_)[i]->get_priority() == 0)
 					quota_bricks_.push_back((*bricks_)[i]);
-				if (quota_bricks_.size() == (size_t)quota)
-					break;
 			}
 
-			for (i = 0; i < quota_bricks_.size(); i++)
+			//only the closest ones are needed, their order is set below
+			if (quota >= 0 && quota < (int64_t)quota_bricks_.size())
 			{
-				Point minp(quota_bricks_[i]->bbox().min());
-				Point maxp(quota_bricks_[i]->bbox().max());
-				Vector diag(quota_bricks_[i]->bbox().diagonal());
-				minp += diag / 1000.;
-				maxp -= diag / 1000.;
-				Point corner[8];
-				corner[0] = minp;
-				corner[1] = Point(minp.x(), minp.y(), maxp.z());
-				corner[2] = Point(minp.x(), maxp.y(), minp.z());
-				corner[3] = Point(minp.x(), maxp.y(), maxp.z());
-				corner[4] = Point(maxp.x(), minp.y(), minp.z());
-				corner[5] = Point(maxp.x(), minp.y(), maxp.z());
-				corner[6] = Point(maxp.x(), maxp.y(), minp.z());
-				corner[7] = maxp;
-				double d = 0.0;
-				for (unsigned int c = 0; c < 8; c++)
+				for (i=0; i<quota_bricks_.size(); i++)
 				{
-					double dd;
-					if (is_orthographic)
-					{
-						// orthographic: sort bricks based on distance to the view plane
-						dd = Dot(corner[c], view.direction());
-					}
-					else
-					{
-						// perspective: sort bricks based on distance to the eye point
-						dd = (corner[c] - view.origin()).length();
-					}
-					if (c == 0 || dd < d) d = dd;
+					Point brick_center = quota_bricks_[i]->bbox().center();
+					double d = (brick_center - center).length();
+					quota_bricks_[i]->set_d(d);
 				}
-				quota_bricks_[i]->set_d(d);
+				std::nth_element(quota_bricks_.begin(), quota_bricks_.begin() + quota,
+					quota_bricks_.end(), TextureBrick::sort_dsc);
+				quota_bricks_.resize(quota);
 			}
+
+			for (i = 0; i < quota_bricks_.size(); i++)
+				quota_bricks_[i]->set_d(view_distance(quota_bricks_[i], view, is_orthographic, 1));
 			if (TextureRenderer::get_update_order() == 0)
 				std::sort(quota_bricks_.begin(), quota_bricks_.end(), TextureBrick::sort_asc);
 			else if (TextureRenderer::get_update_order() == 1)
@@ -538,6 +528,7 @@ namespace FLIVR
 			bricks_ = brks;
 			set_size(size[0], size[1], size[2], numc, numb);
 		}
+		brick_index_.build(*bricks_);
 
 		set_bbox(bb);
 		set_minmax(vmn, vmx, gmn, gmx);
@@ -771,7 +762,10 @@ namespace FLIVR
 
 			if (data_[nmask_])
 			{
-				delete [] data_[nmask_]->data;
+				if ((unsigned char*)data_[nmask_]->data == mask_data_)
+					clear_undos();
+				else
+					delete [] data_[nmask_]->data;
 				data_[nmask_] = NULL;
 			}
 
@@ -845,6 +839,18 @@ namespace FLIVR
 		return (*filename_)[id];
 	}
 
+	FileLocInfo *Texture::GetFileName(TextureBrick *b)
+	{
+		if (!b) return NULL;
+		int lv = b->get_level();
+		vector<FileLocInfo *> *fname = filename_;
+		if (lv >= 0 && lv < pyramid_.size())
+			fname = pyramid_[lv].filenames;
+		int id = b->getID();
+		if (id < 0 || !fname || id >= fname->size()) return NULL;
+		return (*fname)[id];
+	}
+
 	void Texture::set_FrameAndChannel(int fr, int ch)
 	{
 		if (!brkxml_) return;
@@ -883,6 +889,77 @@ namespace FLIVR
 		set_transform(tform);
 	}
 
+	bool Texture::selectLOD(const glm::mat4 &mv, const glm::mat4 &proj,
+		int width, int height, double pixel_err, long long budget)
+	{
+		if (!brkxml_ || pyramid_.empty()) return false;
+
+		if (lod_.level_num() != pyramid_.size())
+		{
+			lod_.clear();
+			for (int i = 0; i < pyramid_.size(); i++)
+			{
+				Nrrd *nv = pyramid_[i].data;
+				int offset = nv->dim > 3 ? 1 : 0;
+				vector<LODBrick> bricks(pyramid_[i].bricks.size());
+				for (int j = 0; j < bricks.size(); j++)
+				{
+					TextureBrick *b = pyramid_[i].bricks[j];
+					bricks[j].level = i;
+					bricks[j].index = j;
+					bricks[j].bbox = b->bbox();
+					bricks[j].size = (long long)b->nx() * b->ny() * b->nz() * b->nb(0);
+				}
+				lod_.add_level(int(nv->axis[offset+0].size),
+					int(nv->axis[offset+1].size),
+					int(nv->axis[offset+2].size), bricks);
+			}
+		}
+
+		lod_.set_view(mv, proj, width, height);
+		lod_.set_pixel_error(pixel_err);
+		lod_.set_budget(budget);
+		vector<LODBrick> cut;
+		int lv = lod_.select(cut);
+		if (lv < 0) return false;
+
+		vector<TextureBrick*> bricks(cut.size());
+		for (int i = 0; i < cut.size(); i++)
+			bricks[i] = pyramid_[cut[i].level].bricks[cut[i].index];
+		sort(bricks.begin(), bricks.end());
+
+		//sizes and spacings follow the finest level in use
+		vector<TextureBrick*> *prev = bricks_;
+		setLevel(lv);
+		if (prev == &lod_bricks_ && bricks == lod_bricks_)
+		{
+			bricks_ = &lod_bricks_;
+			return false;
+		}
+
+		for (int i = 0; i < (*prev).size(); i++)
+			(*prev)[i]->set_disp(false);
+		lod_bricks_.swap(bricks);
+		bricks_ = &lod_bricks_;
+		sort_bricks_ = true;
+		return true;
+	}
+
+	void Texture::clearLOD()
+	{
+		if (bricks_ == &lod_bricks_)
+		{
+			for (int i = 0; i < lod_bricks_.size(); i++)
+				lod_bricks_[i]->set_disp(false);
+			if (pyramid_cur_lv_ >= 0 && pyramid_cur_lv_ < pyramid_.size())
+				bricks_ = &pyramid_[pyramid_cur_lv_].bricks;
+			else
+				bricks_ = &default_vec_;
+			sort_bricks_ = true;
+		}
+		vector<TextureBrick*>().swap(lod_bricks_);
+	}
+
 	bool Texture::buildPyramid(vector<Pyramid_Level> &pyramid, vector<vector<vector<vector<FileLocInfo *>>>> &filenames, bool useURL)
 	{
 		if (pyramid.empty()) return false;
@@ -908,6 +985,7 @@ namespace FLIVR
 			{
 				pyramid_[i].bricks[j]->set_nrrd(pyramid_[i].data, 0);
 				pyramid_[i].bricks[j]->set_nrrd(0, 1);
+				pyramid_[i].bricks[j]->set_level(i);
 			}
 		}
 		setLevel(pyramid_lv_num_ - 1);
@@ -922,6 +1000,9 @@ namespace FLIVR
 
 		if (pyramid_.empty()) return;
 
+		clearLOD();
+		lod_.clear();
+
 		for (int i=0; i<(int)pyramid_.size(); i++)
 		{
 			for (int j=0; j<(int)pyramid_[i].bricks.size(); j++)
@@ -1046,6 +1127,225 @@ namespace FLIVR
 	}
 
 	//mask undo management
+	int Texture::mask_block_num()
+	{
+		int bx = (nx_ + MASK_UNDO_BLOCK - 1) / MASK_UNDO_BLOCK;
+		int by = (ny_ + MASK_UNDO_BLOCK - 1) / MASK_UNDO_BLOCK;
+		int bz = (nz_ + MASK_UNDO_BLOCK - 1) / MASK_UNDO_BLOCK;
+		return bx * by * bz;
+	}
+
+	void Texture::mask_block_range(int id, int &ox, int &oy, int &oz,
+		int &sx, int &sy, int &sz)
+	{
+		int bx = (nx_ + MASK_UNDO_BLOCK - 1) / MASK_UNDO_BLOCK;
+		int by = (ny_ + MASK_UNDO_BLOCK - 1) / MASK_UNDO_BLOCK;
+		ox = id % bx * MASK_UNDO_BLOCK;
+		oy = id / bx % by * MASK_UNDO_BLOCK;
+		oz = id / bx / by * MASK_UNDO_BLOCK;
+		sx = min(MASK_UNDO_BLOCK, nx_ - ox);
+		sy = min(MASK_UNDO_BLOCK, ny_ - oy);
+		sz = min(MASK_UNDO_BLOCK, nz_ - oz);
+	}
+
+	Texture::MaskUndoBlock* Texture::new_mask_block(int id)
+	{
+		int ox, oy, oz, sx, sy, sz;
+		mask_block_range(id, ox, oy, oz, sx, sy, sz);
+
+		MaskUndoBlock* blk = new MaskUndoBlock;
+		blk->data = 0;
+		blk->size = 0;
+		blk->zip = false;
+		blk->refs = 1;
+		blk->value = mask_data_[((size_t)oz*ny_ + oy)*nx_ + ox];
+
+		//most blocks of a mask are empty or full
+		bool uniform = true;
+		for (int z = 0; z < sz && uniform; z++)
+		for (int y = 0; y < sy && uniform; y++)
+		{
+			const unsigned char* row = mask_data_ + ((size_t)(oz+z)*ny_ + oy+y)*nx_ + ox;
+			for (int x = 0; x < sx; x++)
+			{
+				if (row[x] != blk->value)
+				{
+					uniform = false;
+					break;
+				}
+			}
+		}
+		if (uniform)
+			return blk;
+
+		size_t size = (size_t)sx*sy*sz;
+		char* data = new char[size];
+		char* ptr = data;
+		for (int z = 0; z < sz; z++)
+		for (int y = 0; y < sy; y++)
+		{
+			memcpy(ptr, mask_data_ + ((size_t)(oz+z)*ny_ + oy+y)*nx_ + ox, sx);
+			ptr += sx;
+		}
+
+		if (mask_undo_compress_)
+		{
+			uLongf zsize = compressBound((uLong)size);
+			vector<char> zdata(zsize);
+			if (compress2((Bytef*)&zdata[0], &zsize, (const Bytef*)data,
+				(uLong)size, Z_BEST_SPEED) == Z_OK && zsize < size)
+			{
+				delete [] data;
+				data = new char[zsize];
+				memcpy(data, &zdata[0], zsize);
+				size = zsize;
+				blk->zip = true;
+			}
+		}
+		blk->data = data;
+		blk->size = size;
+		return blk;
+	}
+
+	char* Texture::mask_block_voxels(MaskUndoBlock* blk, size_t size)
+	{
+		if (!blk->zip)
+			return blk->data;
+		char* data = new char[size];
+		uLongf len = (uLongf)size;
+		if (uncompress((Bytef*)data, &len, (const Bytef*)blk->data,
+			(uLong)blk->size) != Z_OK)
+			memset(data, 0, size);
+		return data;
+	}
+
+	void Texture::restore_mask_block(MaskUndoBlock* blk, int id)
+	{
+		int ox, oy, oz, sx, sy, sz;
+		mask_block_range(id, ox, oy, oz, sx, sy, sz);
+
+		char* data = blk->data ? mask_block_voxels(blk, (size_t)sx*sy*sz) : 0;
+		const char* ptr = data;
+		for (int z = 0; z < sz; z++)
+		for (int y = 0; y < sy; y++)
+		{
+			unsigned char* row = mask_data_ + ((size_t)(oz+z)*ny_ + oy+y)*nx_ + ox;
+			if (ptr)
+			{
+				memcpy(row, ptr, sx);
+				ptr += sx;
+			}
+			else
+				memset(row, blk->value, sx);
+		}
+		if (data != blk->data)
+			delete [] data;
+	}
+
+	void Texture::unref_mask_block(MaskUndoBlock* blk)
+	{
+		if (blk && --blk->refs == 0)
+		{
+			delete [] blk->data;
+			delete blk;
+		}
+	}
+
+	void Texture::release_mask_blocks(vector<MaskUndoBlock*> &blks)
+	{
+		for (size_t i = 0; i < blks.size(); i++)
+			unref_mask_block(blks[i]);
+		blks.clear();
+	}
+
+	void Texture::mask_changed()
+	{
+		mask_dirty_.assign(mask_block_num(), true);
+	}
+
+	void Texture::mask_changed(int ox, int oy, int oz, int nx, int ny, int nz)
+	{
+		int x0 = max(ox, 0), x1 = min(ox + nx, nx_);
+		int y0 = max(oy, 0), y1 = min(oy + ny, ny_);
+		int z0 = max(oz, 0), z1 = min(oz + nz, nz_);
+		if (x0 >= x1 || y0 >= y1 || z0 >= z1)
+			return;
+		int bx = (nx_ + MASK_UNDO_BLOCK - 1) / MASK_UNDO_BLOCK;
+		int by = (ny_ + MASK_UNDO_BLOCK - 1) / MASK_UNDO_BLOCK;
+		mask_dirty_.resize(mask_block_num(), false);
+		for (int z = z0 / MASK_UNDO_BLOCK; z <= (z1 - 1) / MASK_UNDO_BLOCK; z++)
+		for (int y = y0 / MASK_UNDO_BLOCK; y <= (y1 - 1) / MASK_UNDO_BLOCK; y++)
+		for (int x = x0 / MASK_UNDO_BLOCK; x <= (x1 - 1) / MASK_UNDO_BLOCK; x++)
+			mask_dirty_[(z*by + y)*bx + x] = true;
+	}
+
+	void Texture::write_mask(const unsigned char* data, int ox, int oy, int oz,
+		int nx, int ny, int nz)
+	{
+		if (!mask_data_)
+			return;
+		int bx = (nx_ + MASK_UNDO_BLOCK - 1) / MASK_UNDO_BLOCK;
+		int by = (ny_ + MASK_UNDO_BLOCK - 1) / MASK_UNDO_BLOCK;
+		mask_dirty_.resize(mask_block_num(), false);
+		for (int z = 0; z < nz; z++)
+		for (int y = 0; y < ny; y++)
+		{
+			const unsigned char* src = data + ((size_t)z*ny + y)*nx;
+			unsigned char* dst = mask_data_ + ((size_t)(oz+z)*ny_ + oy+y)*nx_ + ox;
+			int row = ((oz+z) / MASK_UNDO_BLOCK * by + (oy+y) / MASK_UNDO_BLOCK) * bx;
+			//compare the row a block at a time
+			for (int x = 0; x < nx;)
+			{
+				int len = min(nx - x, MASK_UNDO_BLOCK - (ox+x) % MASK_UNDO_BLOCK);
+				if (memcmp(dst + x, src + x, len))
+				{
+					memcpy(dst + x, src + x, len);
+					mask_dirty_[row + (ox+x) / MASK_UNDO_BLOCK] = true;
+				}
+				x += len;
+			}
+		}
+	}
+
+	void Texture::record_mask_blocks(vector<MaskUndoBlock*> &blks)
+	{
+		if (!mask_data_)
+			return;
+		int num = mask_block_num();
+		blks.resize(num, 0);
+		mask_dirty_.resize(num, false);
+		for (int i = 0; i < num; i++)
+		{
+			if (blks[i] && !mask_dirty_[i])
+				continue;
+			MaskUndoBlock* blk = new_mask_block(i);
+			//a block painted over may hold the same value as before
+			if (blks[i] && !blks[i]->data && !blk->data &&
+				blks[i]->value == blk->value)
+			{
+				delete blk;
+				continue;
+			}
+			//leave the block to the other undos sharing it
+			unref_mask_block(blks[i]);
+			blks[i] = blk;
+		}
+		mask_dirty_.assign(num, false);
+	}
+
+	void Texture::switch_mask_blocks(int from)
+	{
+		if (!mask_data_)
+			return;
+		vector<MaskUndoBlock*> &cur = mask_undos_[mask_undo_pointer_];
+		vector<MaskUndoBlock*> &old = mask_undos_[from];
+		for (size_t i = 0; i < cur.size(); i++)
+		{
+			if (cur[i] && (i >= old.size() || cur[i] != old[i]))
+				restore_mask_block(cur[i], int(i));
+		}
+	}
+
 	bool Texture::trim_mask_undos_head()
 	{
 		if (nmask_<=-1 || mask_undo_num_==0)
@@ -1058,7 +1358,7 @@ namespace FLIVR
 			mask_undo_pointer_>0 &&
 			mask_undo_pointer_<mask_undos_.size())
 		{
-			delete []mask_undos_.front();
+			release_mask_blocks(mask_undos_.front());
 			mask_undos_.erase(mask_undos_.begin());
 			mask_undo_pointer_--;
 		}
@@ -1077,7 +1377,7 @@ namespace FLIVR
 			mask_undo_pointer_>=0 &&
 			mask_undo_pointer_<mask_undos_.size()-1)
 		{
-			delete []mask_undos_.back();
+			release_mask_blocks(mask_undos_.back());
 			mask_undos_.pop_back();
 		}
 		return true;
@@ -1106,19 +1406,37 @@ namespace FLIVR
 		if (nmask_<=-1 || mask_undo_num_==0)
 			return;
 
+		//the new mask shares the blocks it has in common with the current one
+		vector<MaskUndoBlock*> blks;
+		if (mask_undo_pointer_>-1 &&
+			mask_undo_pointer_<mask_undos_.size())
+		{
+			record_mask_blocks(mask_undos_[mask_undo_pointer_]);
+			blks = mask_undos_[mask_undo_pointer_];
+			for (size_t i=0; i<blks.size(); ++i)
+				if (blks[i]) blks[i]->refs++;
+		}
+		if (mask_data_ != mask_data)
+		{
+			delete []mask_data_;
+			mask_data_ = (unsigned char*)mask_data;
+			mask_changed();
+		}
+		record_mask_blocks(blks);
+
 		if (mask_undo_pointer_>-1 &&
 			mask_undo_pointer_<mask_undos_.size()-1)
 		{
 			mask_undos_.insert(
 				mask_undos_.begin()+mask_undo_pointer_+1,
-				mask_data);
+				blks);
 			mask_undo_pointer_++;
 			if (!trim_mask_undos_head())
 				trim_mask_undos_tail();
 		}
 		else
 		{
-			mask_undos_.push_back(mask_data);
+			mask_undos_.push_back(blks);
 			mask_undo_pointer_ = mask_undos_.size()-1;
 			trim_mask_undos_head();
 		}
@@ -1132,32 +1450,27 @@ namespace FLIVR
 			mask_undo_pointer_>mask_undos_.size()-1)
 			return;
 
-		//duplicate at pointer position
-		unsigned long long mem_size = (unsigned long long)nx_*
-			(unsigned long long)ny_*(unsigned long long)nz_;
-		void* new_data = (void*)new (std::nothrow) unsigned char[mem_size];
-		memcpy(new_data, mask_undos_[mask_undo_pointer_], size_t(mem_size));
+		//keep the changes made to the mask since the last push
+		record_mask_blocks(mask_undos_[mask_undo_pointer_]);
+		//duplicate at pointer position, blocks are copied when they change
+		vector<MaskUndoBlock*> blks = mask_undos_[mask_undo_pointer_];
+		for (size_t i=0; i<blks.size(); ++i)
+			if (blks[i]) blks[i]->refs++;
 		if (mask_undo_pointer_<mask_undos_.size()-1)
 		{
 			mask_undos_.insert(
 				mask_undos_.begin()+mask_undo_pointer_+1,
-				new_data);
+				blks);
 			mask_undo_pointer_++;
 			if (!trim_mask_undos_head())
 				trim_mask_undos_tail();
 		}
 		else
 		{
-			mask_undos_.push_back(new_data);
+			mask_undos_.push_back(blks);
 			mask_undo_pointer_++;
 			trim_mask_undos_head();
 		}
-
-		//update mask data
-		nrrdWrap_va(data_[nmask_],
-			mask_undos_[mask_undo_pointer_],
-			nrrdTypeUChar, 3, (size_t)nx_,
-			(size_t)ny_, (size_t)nz_);
 	}
 
 	void Texture:: mask_undos_backward()
@@ -1168,14 +1481,14 @@ namespace FLIVR
 			mask_undo_pointer_>mask_undos_.size()-1)
 			return;
 
+		//keep the changes for redo
+		record_mask_blocks(mask_undos_[mask_undo_pointer_]);
+
 		//move pointer
 		mask_undo_pointer_--;
 
 		//update mask data
-		nrrdWrap_va(data_[nmask_],
-			mask_undos_[mask_undo_pointer_],
-			nrrdTypeUChar, 3, (size_t)nx_,
-			(size_t)ny_, (size_t)nz_);
+		switch_mask_blocks(mask_undo_pointer_+1);
 	}
 
 	void Texture::mask_undos_forward()
@@ -1186,14 +1499,13 @@ namespace FLIVR
 			mask_undo_pointer_>mask_undos_.size()-2)
 			return;
 
+		record_mask_blocks(mask_undos_[mask_undo_pointer_]);
+
 		//move pointer
 		mask_undo_pointer_++;
 
 		//update mask data
-		nrrdWrap_va(data_[nmask_],
-			mask_undos_[mask_undo_pointer_],
-			nrrdTypeUChar, 3, (size_t)nx_,
-			(size_t)ny_, (size_t)nz_);
+		switch_mask_blocks(mask_undo_pointer_-1);
 	}
 
 } // namespace FLIVR
\ No newline at end of file
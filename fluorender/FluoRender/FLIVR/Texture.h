@@ -33,6 +33,8 @@
 #include <fstream>
 #include "Transform.h"
 #include "TextureBrick.h"
+#include "BrickLOD.h"
+#include "BrickIndex.h"
 #include "Utils.h"
 
 namespace FLIVR
@@ -45,6 +47,8 @@ namespace FLIVR
 	{
 	public:
 		static size_t mask_undo_num_;
+		//compress the mask blocks saved for undos
+		static bool mask_undo_compress_;
 		Texture();
 		virtual ~Texture();
 
@@ -115,8 +119,9 @@ namespace FLIVR
 		inline void set_transform(Transform tform) { transform_ = tform; }
 
 		// get sorted bricks
+		//culled: only the bricks shown are sorted, the others are moved to the end
 		vector<TextureBrick*>* get_sorted_bricks(
-			Ray& view, bool is_orthographic = false);
+			Ray& view, bool is_orthographic = false, bool culled = false);
 		//get closest bricks
 		vector<TextureBrick*>* get_closest_bricks(
 			Point& center, int quota, bool skip,
@@ -168,6 +173,16 @@ namespace FLIVR
 		void mask_undos_forward();
 		void mask_undos_backward();
 		void clear_undos();
+		//the mask is saved for undos
+		bool mask_tracked() {return mask_data_ != 0;}
+		//mark the voxels of the mask written in memory as changed
+		//changed blocks are saved when the next undo is recorded
+		void mask_changed();
+		void mask_changed(int ox, int oy, int oz, int nx, int ny, int nz);
+		//copy a box of voxels into the mask, blocks whose voxels differ are
+		//marked as changed
+		void write_mask(const unsigned char* data, int ox, int oy, int oz,
+			int nx, int ny, int nz);
 
 		//add one more texture component as the volume mask
 		bool add_empty_mask();
@@ -187,6 +202,8 @@ namespace FLIVR
 		void set_data_file(vector<FileLocInfo *> *fname, int type);
 		int GetFileType() {return filetype_;}
 		FileLocInfo *GetFileName(int id);
+		//file of the brick in its own level
+		FileLocInfo *GetFileName(TextureBrick *b);
 		bool isBrxml() {return brkxml_;}
 		bool isURL() {return useURL_;}
 		bool buildPyramid(vector<Pyramid_Level> &pyramid, vector<vector<vector<vector<FileLocInfo *>>>> &filenames, bool useURL = false);
@@ -197,8 +214,16 @@ namespace FLIVR
 		int GetLevelNum() {return pyramid_.size();}
 		void SetCopyableLevel(int lv) {pyramid_copy_lv_ = lv;}
 		int GetCopyableLevel() {return pyramid_copy_lv_;}
-
-		void DeleteCacheFiles();
+		//draw bricks of mixed levels, each region uses the coarsest level whose
+		//voxels cover at most pixel_err pixels on the screen
+		//mv: 0-1 volume coordinates to eye coordinates
+		//budget: bytes of the bricks, 0 for no limit
+		//returns true if the bricks to draw changed
+		bool selectLOD(const glm::mat4 &mv, const glm::mat4 &proj,
+			int width, int height, double pixel_err, long long budget);
+		//back to the bricks of the current level
+		void clearLOD();
+		bool isLOD() {return bricks_ == &lod_bricks_;}
 
 	protected:
 		void build_bricks(vector<TextureBrick*> &bricks,
@@ -272,12 +297,51 @@ namespace FLIVR
 		//used when brkxml_ is not equal to false.
 		vector<TextureBrick*> default_vec_;
 
+		//bricks of mixed levels
+		BrickLOD lod_;
+		vector<TextureBrick*> lod_bricks_;
+		//bricks of the current level, voxel coordinates are looked up here
+		vector<TextureBrick*>* level_bricks()
+		{return isLOD() ? &pyramid_[pyramid_cur_lv_].bricks : bricks_;}
+		//voxel to brick lookup of the bricks of the current level
+		BrickIndex brick_index_;
+
 		void clearPyramid();
 
 		Nrrd* data_[TEXTURE_MAX_COMPONENTS];
+
 		//undos for mask
-		vector<void*> mask_undos_;
+		//each undo is a list of fixed-size blocks of the mask, blocks that
+		//an operation does not change are shared with the undo before it
+		//block data are allocated with new [], apart from the brick buffers
+		struct MaskUndoBlock
+		{
+			char *data;				//NULL if all voxels are value
+			size_t size;			//size of data
+			bool zip;				//data is zlib compressed
+			unsigned char value;
+			int refs;
+		};
+		vector<vector<MaskUndoBlock*> > mask_undos_;
 		int mask_undo_pointer_;
+		//mask data shown, owned by the undos
+		unsigned char* mask_data_;
+		//blocks changed since the undo at pointer was recorded
+		vector<bool> mask_dirty_;
+
+		int mask_block_num();
+		void mask_block_range(int id, int &ox, int &oy, int &oz,
+			int &sx, int &sy, int &sz);
+		MaskUndoBlock* new_mask_block(int id);
+		//voxels of a block, to be released if it is not the data of the block
+		char* mask_block_voxels(MaskUndoBlock* blk, size_t size);
+		void restore_mask_block(MaskUndoBlock* blk, int id);
+		void unref_mask_block(MaskUndoBlock* blk);
+		void release_mask_blocks(vector<MaskUndoBlock*> &blks);
+		//save the changed blocks of the mask data to an undo
+		void record_mask_blocks(vector<MaskUndoBlock*> &blks);
+		//copy the blocks of the undo at pointer that differ from another undo
+		void switch_mask_blocks(int from);
 	};
 
 } // namespace FLIVR
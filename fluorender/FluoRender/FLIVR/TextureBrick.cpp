@@ -39,6 +39,11 @@
 #include "../compatibility.h"
 #include <setjmp.h>
 #include <zlib.h>
+#include <cerrno>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 #include <wx/stdpaths.h>
 
 using namespace std;
@@ -47,7 +52,16 @@ namespace FLIVR
 {
     CURL* TextureBrick::s_curl_ = NULL;
 	CURL* TextureBrick::s_curlm_ = NULL;
-	map<wstring, wstring> TextureBrick::cache_table_ = map<wstring, wstring>();
+	std::atomic<long long> TextureBrick::poly_cache_total_(0);
+	long long TextureBrick::poly_cache_max_ = 256LL*1024*1024;
+	map<size_t, BrickBufferPool::FreeList> BrickBufferPool::free_;
+	unordered_map<char*, size_t> BrickBufferPool::used_;
+	wxCriticalSection BrickBufferPool::lock_;
+	size_t BrickBufferPool::in_use_ = 0;
+	size_t BrickBufferPool::pooled_ = 0;
+	size_t BrickBufferPool::max_pooled_ = 256*1024*1024;
+	bool BrickBufferPool::huge_pages_ = false;
+	unsigned long long BrickBufferPool::clock_ = 0;
     
    TextureBrick::TextureBrick (Nrrd* n0, Nrrd* n1,
          int nx, int ny, int nz, int nc, int* nb,
@@ -55,7 +69,7 @@ namespace FLIVR
          int mx, int my, int mz,
          const BBox& bbox, const BBox& tbox, const BBox& dbox, int findex, long long offset, long long fsize)
       : nx_(nx), ny_(ny), nz_(nz), nc_(nc), ox_(ox), oy_(oy), oz_(oz),
-      mx_(mx), my_(my), mz_(mz), bbox_(bbox), tbox_(tbox), dbox_(dbox), findex_(findex), offset_(offset), fsize_(fsize)
+      mx_(mx), my_(my), mz_(mz), bbox_(bbox), tbox_(tbox), dbox_(dbox), findex_(findex), level_(0), offset_(offset), fsize_(fsize)
    {
       for (int i=0; i<TEXTURE_MAX_COMPONENTS; i++)
       {
@@ -108,7 +122,8 @@ namespace FLIVR
       data_[0] = 0;
       data_[1] = 0;
 
-	  if (brkdata_) delete [] brkdata_;
+	  BrickBufferPool::release(brkdata_);
+	  clear_poly_cache();
    }
 
    /* The cube is numbered in the following way
@@ -144,6 +159,7 @@ z
 
    void TextureBrick::compute_edge_rays(BBox &bbox)
    {
+      clear_poly_cache();
       // set up vertices
       Point corner[8];
       corner[0] = bbox.min();
@@ -186,6 +202,7 @@ z
 
    void TextureBrick::compute_edge_rays_tex(BBox &bbox)
    {
+      clear_poly_cache();
       // set up vertices
       Point corner[8];
       corner[0] = bbox.min();
@@ -455,6 +472,21 @@ z
          vector<float>& vertex, vector<uint32_t>& index,
          vector<uint32_t>& size)
    {
+      bool order = TextureRenderer::get_update_order();
+      if (poly_cache_hit(view, dt, order))
+      {
+         //indices start from 0 in each call, so the kept slices are
+         //appended as they are
+         view_vector_ = view.direction();
+         vertex.insert(vertex.end(), poly_cache_.vertex.begin(), poly_cache_.vertex.end());
+         index.insert(index.end(), poly_cache_.index.begin(), poly_cache_.index.end());
+         size.insert(size.end(), poly_cache_.size.begin(), poly_cache_.size.end());
+         return;
+      }
+      size_t v0 = vertex.size();
+      size_t i0 = index.size();
+      size_t s0 = size.size();
+
       Point corner[8];
       corner[0] = bbox_.min();
       corner[1] = Point(bbox_.min().x(), bbox_.min().y(), bbox_.max().z());
@@ -476,7 +508,6 @@ z
          if (t > tmax) { maxi = i; tmax = t; }
       }
 
-      bool order = TextureRenderer::get_update_order();
 	  double tanchor = Dot(corner[order?mini:maxi], view.direction());
 	  double tanchor0 = (floor(tanchor/dt)+1)*dt;
 	  double tanchordiff = tanchor - tanchor0;
@@ -484,6 +515,176 @@ z
 	  else tmax -= tanchordiff;
 
       compute_polygons(view, tmin, tmax, dt, vertex, index, size);
+
+      //keep the slices if they fit in the budget
+      PolyCache &pc = poly_cache_;
+      poly_cache_total_ -= pc.bytes;
+      pc.valid = false;
+      pc.bytes = 0;
+      pc.vertex.assign(vertex.begin() + v0, vertex.end());
+      pc.index.assign(index.begin() + i0, index.end());
+      pc.size.assign(size.begin() + s0, size.end());
+      long long bytes = (long long)(pc.vertex.capacity() * sizeof(float) +
+         (pc.index.capacity() + pc.size.capacity()) * sizeof(uint32_t));
+      if (poly_cache_total_.fetch_add(bytes) + bytes > poly_cache_max_)
+      {
+         poly_cache_total_ -= bytes;
+         clear_poly_cache();
+         return;
+      }
+      Point o = view.origin();
+      Vector d = view.direction();
+      pc.o[0] = o.x(); pc.o[1] = o.y(); pc.o[2] = o.z();
+      pc.d[0] = d.x(); pc.d[1] = d.y(); pc.d[2] = d.z();
+      pc.dt = dt;
+      pc.order = order;
+      pc.bytes = bytes;
+      pc.valid = true;
+   }
+
+   bool TextureBrick::poly_cache_hit(Ray& view, double dt, bool order)
+   {
+      const PolyCache &pc = poly_cache_;
+      if (!pc.valid || pc.dt != dt || pc.order != order)
+         return false;
+      Point o = view.origin();
+      Vector d = view.direction();
+      return pc.o[0] == o.x() && pc.o[1] == o.y() && pc.o[2] == o.z() &&
+         pc.d[0] == d.x() && pc.d[1] == d.y() && pc.d[2] == d.z();
+   }
+
+   void TextureBrick::clear_poly_cache()
+   {
+      PolyCache &pc = poly_cache_;
+      poly_cache_total_ -= pc.bytes;
+      pc.valid = false;
+      pc.bytes = 0;
+      vector<float>().swap(pc.vertex);
+      vector<uint32_t>().swap(pc.index);
+      vector<uint32_t>().swap(pc.size);
+   }
+
+   //threads of prepare_polygons, started once and kept waiting for the
+   //next draw
+   class PolyWorkers
+   {
+   public:
+      PolyWorkers() : jobs_(0), view_(0), dt_(0.0), num_(0), next_(0),
+         busy_(0), round_(0), quit_(false)
+      {
+         int n = max(1, (int)std::thread::hardware_concurrency()) - 1;
+         for (int i = 0; i < n; i++)
+            threads_.push_back(std::thread(&PolyWorkers::loop, this));
+      }
+      ~PolyWorkers()
+      {
+         {
+            std::lock_guard<std::mutex> lock(mutex_);
+            quit_ = true;
+         }
+         start_.notify_all();
+         for (size_t i = 0; i < threads_.size(); i++)
+            threads_[i].join();
+      }
+
+      int size() { return int(threads_.size()); }
+
+      //the calling thread works on the jobs too
+      void run(vector<TextureBrick*> &jobs, Ray &view, double dt)
+      {
+         std::lock_guard<std::mutex> run_lock(run_mutex_);
+         {
+            std::lock_guard<std::mutex> lock(mutex_);
+            jobs_ = &jobs;
+            view_ = &view;
+            dt_ = dt;
+            num_ = int(jobs.size());
+            next_ = 0;
+            busy_ = int(threads_.size());
+            round_++;
+         }
+         start_.notify_all();
+         work();
+         std::unique_lock<std::mutex> lock(mutex_);
+         done_.wait(lock, [this]() { return busy_ == 0; });
+         jobs_ = 0;
+         view_ = 0;
+      }
+
+   private:
+      vector<std::thread> threads_;
+      std::mutex run_mutex_;
+      std::mutex mutex_;
+      std::condition_variable start_;
+      std::condition_variable done_;
+      vector<TextureBrick*> *jobs_;
+      Ray *view_;
+      double dt_;
+      int num_;
+      std::atomic<int> next_;
+      int busy_;
+      unsigned long long round_;
+      bool quit_;
+
+      void loop()
+      {
+         unsigned long long round = 0;
+         std::unique_lock<std::mutex> lock(mutex_);
+         while (true)
+         {
+            start_.wait(lock, [&]() { return quit_ || round_ != round; });
+            if (quit_)
+               return;
+            round = round_;
+            lock.unlock();
+            work();
+            lock.lock();
+            if (--busy_ == 0)
+               done_.notify_one();
+         }
+      }
+
+      void work()
+      {
+         Ray ray(*view_);
+         vector<float> vertex;
+         vector<uint32_t> index;
+         vector<uint32_t> size;
+         try
+         {
+            for (int i = next_++; i < num_; i = next_++)
+            {
+               vertex.clear();
+               index.clear();
+               size.clear();
+               (*jobs_)[i]->compute_polygons(ray, dt_, vertex, index, size);
+            }
+         }
+         catch (...)
+         {
+            next_ = num_;
+         }
+      }
+   };
+
+   void TextureBrick::prepare_polygons(const vector<TextureBrick*> &bricks,
+         Ray& view, double dt)
+   {
+      if (poly_cache_max_ <= 0)
+         return;
+      bool order = TextureRenderer::get_update_order();
+      vector<TextureBrick*> jobs;
+      for (size_t i = 0; i < bricks.size(); i++)
+         if (!bricks[i]->poly_cache_hit(view, dt, order))
+            jobs.push_back(bricks[i]);
+      //a few bricks are not worth waking the threads for, they are done
+      //when drawn
+      if (jobs.size() < 8)
+         return;
+      static PolyWorkers workers;
+      if (workers.size() == 0)
+         return;
+      workers.run(jobs, view, dt);
    }
 
    // compute polygon list of edge plane intersections
@@ -523,61 +724,79 @@ z
       up.normalize();
       right = Cross(vdir, up);
       bool order = TextureRenderer::get_update_order();
+
+      //all slices share the plane normal, so the parts of the edge
+      //intersections that do not depend on t are computed once for the
+      //12 edges. the arithmetic is the same as planeIntersectParameter
+      //and parameter of Ray so the vertices do not change
+      FLIVR::Vector vec = -view.direction();
+      double eo[3][12], ed[3][12], to[3][12], td[3][12];
+      double no[12], nv[12];
+      bool cut[12];
+      for (int j=0; j<12; j++)
+      {
+         Point o = edge_[j].origin();
+         Vector d = edge_[j].direction();
+         eo[0][j] = o.x(); eo[1][j] = o.y(); eo[2][j] = o.z();
+         ed[0][j] = d.x(); ed[1][j] = d.y(); ed[2][j] = d.z();
+         no[j] = (vec.x()*o.x() + vec.y()*o.y() + vec.z()*o.z());
+         nv[j] = Dot(vec, d);
+         //parallel to the slices
+         cut[j] = !(fabs(nv[j]) <= 1e-6);
+         if (!cut[j]) nv[j] = 1.0;
+         o = tex_edge_[j].origin();
+         d = tex_edge_[j].direction();
+         to[0][j] = o.x(); to[1][j] = o.y(); to[2][j] = o.z();
+         td[0][j] = d.x(); td[1][j] = d.y(); td[2][j] = d.z();
+      }
+
+      //a slice has at most 6 vertices and 4 triangles
+      if (dt > 0.0 && tmax >= tmin)
+      {
+         size_t slices = size_t((tmax - tmin) / dt) + 1;
+         vertex.reserve(vertex.size() + slices * 36);
+         index.reserve(index.size() + slices * 12);
+         size.reserve(size.size() + slices);
+      }
+
 	  size_t vert_count = 0;
+      double u[12];
       for (double t = order?tmin:tmax;
             order?(t <= tmax):(t >= tmin);
             t += order?dt:-dt)
 	  {
 		  // we compute polys back to front
 		  // find intersections
-		  degree = 0;
-		  double u;
-
-		  FLIVR::Vector vec = -view.direction();
 		  FLIVR::Point pnt = view.parameter(t);
+		  double D = -(vec.x()*pnt.x() + vec.y()*pnt.y() + vec.z()*pnt.z());
+		  for (int j=0; j<12; j++)
+			  u[j] = -(D + no[j])/nv[j];
+
 		  //fʂ̒_bbox̒_ƏdȂƂdh
-		  for (size_t j=0; j<=3; j++)
-		  {
-			  double u;
-			  bool intersects = edge_[j].planeIntersectParameter
-				  (vec, pnt, u);
-			  if (intersects && u >= 0.0 && u <= 1.0)
-			  {
-				  Point p;
-				  p = edge_[j].parameter(u);
-				  vv[degree] = (Vector)p;
-				  p = tex_edge_[j].parameter(u);
-				  tt[degree] = (Vector)p;
-				  degree++;
-			  }
-		  }
-		  for (size_t j=4; j<=11; j++)
+		  degree = 0;
+		  for (int j=0; j<12; j++)
 		  {
-			  double u;
-			  bool intersects = edge_[j].planeIntersectParameter
-				  (vec, pnt, u);
-			  if (intersects && u > 0.0 && u < 1.0)
-			  {
-				  Point p;
-				  p = edge_[j].parameter(u);
-				  vv[degree] = (Vector)p;
-				  p = tex_edge_[j].parameter(u);
-				  tt[degree] = (Vector)p;
-				  degree++;
-			  }
+			  bool inside = j<4 ?
+				  (u[j] >= 0.0 && u[j] <= 1.0) :
+				  (u[j] > 0.0 && u[j] < 1.0);
+			  if (!cut[j] || !inside)
+				  continue;
+			  vv[degree] = Vector(eo[0][j] + ed[0][j]*u[j],
+				  eo[1][j] + ed[1][j]*u[j], eo[2][j] + ed[2][j]*u[j]);
+			  tt[degree] = Vector(to[0][j] + td[0][j]*u[j],
+				  to[1][j] + td[1][j]*u[j], to[2][j] + td[2][j]*u[j]);
+			  degree++;
 		  }
 		  
          if (degree < 3 || degree >6) continue;
 		 bool sorted = degree > 3;
 		 uint32_t idx[6];
 		 if (sorted) {
-			// compute centroids
-			Vector vc(0.0, 0.0, 0.0), tc(0.0, 0.0, 0.0);
+			// compute centroid
+			Vector vc(0.0, 0.0, 0.0);
 			for (int j=0; j<degree; j++)
-			{
-				vc += vv[j]; tc += tt[j];
-			}
-			vc /= (double)degree; tc /= (double)degree;
+				vc += vv[j];
+			vc /= (double)degree;
 
 			// sort vertices
 			double pa[6];
@@ -904,10 +1123,11 @@ z
 	   else
 	   {
 		   int bd = tex_type_size(tex_type(c));
-		   ptr = new unsigned char[(size_t)nx_*(size_t)ny_*(size_t)nz_*(size_t)bd];
+		   ptr = (unsigned char *)BrickBufferPool::alloc((size_t)nx_*(size_t)ny_*(size_t)nz_*(size_t)bd);
+		   if (!ptr) return NULL;
 		   if (!read_brick((char *)ptr, (size_t)nx_*(size_t)ny_*(size_t)nz_*(size_t)bd, finfo))
 		   {
-			   delete [] ptr;
+			   BrickBufferPool::release(ptr);
 			   return NULL;
 		   }
 		   brkdata_ = (void *)ptr;
@@ -1055,174 +1275,39 @@ z
 	   return false;
    }
 
-#define DOWNLOAD_BUFSIZE 8192
-   
-   struct MemoryStruct {
-	   char *memory;
-	   size_t size;
-   };
-   
-   size_t TextureBrick::WriteMemoryCallback(void *contents, size_t size, size_t nmemb, void *userp)
-   {
-	   size_t realsize = size * nmemb;
-	   struct MemoryStruct *mem = (struct MemoryStruct *)userp;
-
-	   mem->memory = (char *)realloc(mem->memory, mem->size + realsize + 1);
-	   if(mem->memory == NULL) {
-		   /* out of memory! */ 
-		   printf("not enough memory (realloc returned NULL)\n");
-		   return 0;
-	   }
-
-	   memcpy(&(mem->memory[mem->size]), contents, realsize);
-	   mem->size += realsize;
-	   mem->memory[mem->size] = 0;
-
-	   return realsize;
-   }
-
-   size_t TextureBrick::WriteFileCallback(void *contents, size_t size, size_t nmemb, void *userp)
-   {
-	   ofstream *out = static_cast<std::ofstream *>(userp);
-	   size_t nbytes = size * nmemb;
-	   out->write((char *)contents, nbytes);
-	   return nbytes;
-   }
-
-   int TextureBrick::xferinfo(void *p, curl_off_t dltotal, curl_off_t dlnow, curl_off_t ultotal, curl_off_t ulnow)
-   {
-	   wxThread *wxth = (wxThread *)p;
-	   if (wxth && wxth->TestDestroy())
-		   return 1;
-	   return 0;
-   }
-
    bool TextureBrick::read_brick_without_decomp(char* &data, size_t &readsize, FileLocInfo* finfo, wxThread *th)
    {
 	   readsize = -1;
 
 	   if (!finfo) return false;
 	   
-	   if (finfo->isurl)
-	   {
-		   bool found_cache = false;
-		   wxString wxcfname = finfo->cache_filename;
-		   if (finfo->cached && wxFileExists(wxcfname))
-			   found_cache = true;
-		   else
-		   {
-			   wstring fcname;
-
-			   auto itr = cache_table_.find(fcname);
-			   if (itr != cache_table_.end())
-			   {
-				   wxcfname = itr->second;
-				   if (wxFileExists(wxcfname))
-						found_cache = true;
-			   }
-
-			   if (found_cache)
-			   {
-				   finfo->cached = true;
-				   finfo->cache_filename = fcname;
-			   }
-		   }
-
-		   if (!found_cache)
-		   {
-			   CURLcode ret;
+	   wstring fn = finfo->filename;
+	   if (finfo->isurl && !BrickCache::acquire(finfo, fn, s_curl_, th))
+		   return false;
+	   //a cached range holds only this brick
+	   long long offset = finfo->is_range() ? 0 : finfo->offset;
 
-			   if (s_curl_ == NULL) {
-				   cerr << "curl_easy_init() failed" << endl;
-				   return false;
-			   }
-			   curl_easy_reset(s_curl_);
-			   curl_easy_setopt(s_curl_, CURLOPT_URL, wxString::wxString(finfo->filename).ToStdString().c_str());
-			   curl_easy_setopt(s_curl_, CURLOPT_TIMEOUT, 10L);
-			   curl_easy_setopt(s_curl_, CURLOPT_USERAGENT, "libcurl-agent/1.0");
-			   curl_easy_setopt(s_curl_, CURLOPT_WRITEFUNCTION, WriteFileCallback);
-			   curl_easy_setopt(s_curl_, CURLOPT_SSL_VERIFYPEER, 0);
-			   curl_easy_setopt(s_curl_, CURLOPT_NOSIGNAL, 1);
-			   curl_easy_setopt(s_curl_, CURLOPT_FAILONERROR, 1);
-			   curl_easy_setopt(s_curl_, CURLOPT_FILETIME, 1);
-			   curl_easy_setopt(s_curl_, CURLOPT_XFERINFOFUNCTION, xferinfo);
-			   curl_easy_setopt(s_curl_, CURLOPT_XFERINFODATA, th);
-			   curl_easy_setopt(s_curl_, CURLOPT_NOPROGRESS, 0L);
-
-			   wxString expath = wxStandardPaths::Get().GetExecutablePath();
-			   expath = expath.BeforeLast(GETSLASH(),NULL);
-#ifdef _WIN32
-			   wxString dft = expath + "\\vvd_cache";
-			   wxString dft2 = wxStandardPaths::Get().GetUserDataDir() + "\\vvd_cache";
-			   if (!wxDirExists(dft) && wxDirExists(dft2))
-				   dft = dft2;
-			   else if (!wxDirExists(dft))
-				   wxMkdir(dft);
-			   dft += L"\\";
-#else
-			   wxString dft = expath + "/../Resources/vvd_cache";
-			   if (!wxDirExists(dft))
-				   wxMkdir(dft);
-			   dft += L"/";
-#endif
-			   wstring randname;
-			   int len = 16;
-			   char s[17];
-			   wxString test;
-			   do {
-				   const char alphanum[] =
-					   "0123456789"
-					   "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
-					   "abcdefghijklmnopqrstuvwxyz";
-
-				   for (int i = 0; i < len; ++i) {
-					   s[i] = alphanum[rand() % (sizeof(alphanum) - 1)];
-				   }
-				   s[len] = 0;
-				   test = dft;
-				   test += s;
-			   } while (wxFileExists(test));
-			   dft += s;
-
-			   wstring cfname = dft.ToStdWstring();
-			   ofstream ofs(ws2s(cfname), ios::binary);
-			   if (!ofs) return false;
-			   curl_easy_setopt(s_curl_, CURLOPT_WRITEDATA, &ofs);
-			   ret = curl_easy_perform(s_curl_);
-			   bool succeeded = false;
-			   if (ret == CURLE_OK)
-				   succeeded = true;
-
-			   ofs.close();
-
-			   if (succeeded)
-			   {
-				   finfo->cached = true;
-				   finfo->cache_filename = cfname;
-				   cache_table_[finfo->filename] = cfname;
-			   }
-			   else
-			   {
-				   if(wxFileExists(cfname)) wxRemoveFile(cfname);
-				   return false;
-			   }
-		   }
+	   bool result = false;
+	   size_t zsize = finfo->datasize;
+	   if (zsize <= 0)
+	   {
+		   long long fsize = BrickFileHandles::file_size(fn);
+		   zsize = fsize > 0 ? (size_t)fsize : 0;
+	   }
+	   char *zdata = zsize > 0 ? BrickBufferPool::alloc(zsize) : NULL;
+	   if (zdata && BrickFileHandles::read(fn, offset, zsize, zdata))
+	   {
+		   data = zdata;
+		   readsize = zsize;
+		   result = true;
 	   }
+	   else
+		   BrickBufferPool::release(zdata);
 
-	   ifstream ifs;
-	   wstring fn = finfo->cached ? finfo->cache_filename : finfo->filename;
-	   ifs.open(ws2s(fn), ios::binary);
-	   if (!ifs) return false;
-	   size_t zsize = finfo->datasize;
-	   if (zsize <= 0) zsize = (size_t)ifs.seekg(0, std::ios::end).tellg();
-	   char *zdata = new char[zsize];
-	   ifs.seekg(finfo->offset, ios_base::beg);
-	   ifs.read((char*)zdata, zsize);
-	   if (ifs) ifs.close();
-	   data = zdata;
-	   readsize = zsize;
+	   if (finfo->isurl)
+		   BrickCache::release(fn);
 
-	   return true;
+	   return result;
    }
 
    bool TextureBrick::decompress_brick(char *out, char* in, size_t out_size, size_t in_size, int type)
@@ -1233,6 +1318,28 @@ z
 	   return false;
    }
 
+   bool TextureBrick::zlib_compressor(char* &out, size_t &out_size, const char* in, size_t in_size, double ratio)
+   {
+	   uLongf zsize = compressBound((uLong)in_size);
+	   char *zdata = BrickBufferPool::alloc(zsize);
+	   if (!zdata) return false;
+	   if (compress2((Bytef *)zdata, &zsize, (const Bytef *)in, (uLong)in_size, Z_BEST_SPEED) != Z_OK ||
+		   (double)zsize > (double)in_size * ratio)
+	   {
+		   BrickBufferPool::release(zdata);
+		   return false;
+	   }
+	   //the bound is about the size of the input, keep only what is used
+	   out = BrickBufferPool::alloc(zsize);
+	   if (out)
+	   {
+		   memcpy(out, zdata, zsize);
+		   out_size = zsize;
+	   }
+	   BrickBufferPool::release(zdata);
+	   return out != NULL;
+   }
+
    struct my_error_mgr {
 	   struct jpeg_error_mgr pub;	/* "public" fields */
 
@@ -1324,28 +1431,156 @@ z
 	   return true;
    }
 
-   void TextureBrick::delete_all_cache_files()
+   void TextureBrick::close_cache_files()
+   {
+	   BrickCache::save_index();
+	   BrickFileHandles::close_all();
+   }
+
+   //4kb pages for small buffers, then 8 classes per power of two
+   //so that compressed bricks of similar sizes share free lists
+   size_t BrickBufferPool::size_class(size_t size)
+   {
+	   const size_t page = 4096;
+	   if (size == 0) size = 1;
+	   if (size <= 16*page)
+		   return (size + page - 1) / page * page;
+	   size_t p = 1;
+	   while ((p << 1) <= size) p <<= 1;
+	   size_t step = p / 8;
+	   return (size + step - 1) / step * step;
+   }
+
+   char* BrickBufferPool::sys_alloc(size_t size)
+   {
+#ifdef MADV_HUGEPAGE
+	   const size_t huge_page = 2*1024*1024;
+	   if (huge_pages_ && size >= huge_page)
+	   {
+		   void *buf = NULL;
+		   if (posix_memalign(&buf, huge_page, size) != 0)
+			   return NULL;
+		   madvise(buf, size, MADV_HUGEPAGE);
+		   return (char*)buf;
+	   }
+#endif
+	   return (char*)malloc(size);
+   }
+
+   char* BrickBufferPool::alloc(size_t size)
    {
-	   for(auto itr = cache_table_.begin(); itr != cache_table_.end(); ++itr)
+	   size_t cls = size_class(size);
 	   {
-		   wxString tmp = itr->second;
-		   if(wxFileExists(tmp)) wxRemoveFile(tmp);
+		   wxCriticalSectionLocker enter(lock_);
+		   auto itr = free_.find(cls);
+		   if (itr != free_.end() && !itr->second.bufs.empty())
+		   {
+			   char *buf = itr->second.bufs.back();
+			   itr->second.bufs.pop_back();
+			   itr->second.last_use = ++clock_;
+			   pooled_ -= cls;
+			   used_[buf] = cls;
+			   in_use_ += cls;
+			   return buf;
+		   }
+	   }
+
+	   char *buf = sys_alloc(cls);
+	   if (!buf)
+	   {
+		   //buffers of other sizes may be holding the memory
+		   trim(0);
+		   buf = sys_alloc(cls);
+		   if (!buf) return NULL;
 	   }
-	   if (!cache_table_.empty()) cache_table_.clear();
+	   wxCriticalSectionLocker enter(lock_);
+	   used_[buf] = cls;
+	   in_use_ += cls;
+	   return buf;
+   }
+
+   void BrickBufferPool::release(void* p)
+   {
+	   if (!p) return;
+	   char *buf = (char*)p;
+	   {
+		   wxCriticalSectionLocker enter(lock_);
+		   auto itr = used_.find(buf);
+		   if (itr == used_.end())
+		   {
+			   //not from the pool; leave it to its owner
+			   assert(0 && "BrickBufferPool::release: unknown buffer");
+			   return;
+		   }
+		   size_t cls = itr->second;
+		   used_.erase(itr);
+		   in_use_ -= cls;
+		   if (pooled_ + cls <= max_pooled_)
+		   {
+			   FreeList &fl = free_[cls];
+			   fl.bufs.push_back(buf);
+			   fl.last_use = ++clock_;
+			   pooled_ += cls;
+			   return;
+		   }
+	   }
+	   free(buf);
+   }
+
+   //the sizes used least recently go first
+   void BrickBufferPool::trim(size_t bytes)
+   {
+	   vector<char*> bufs;
+	   {
+		   wxCriticalSectionLocker enter(lock_);
+		   while (pooled_ > bytes)
+		   {
+			   auto oldest = free_.end();
+			   for (auto itr = free_.begin(); itr != free_.end(); ++itr)
+			   {
+				   if (itr->second.bufs.empty()) continue;
+				   if (oldest == free_.end() || itr->second.last_use < oldest->second.last_use)
+					   oldest = itr;
+			   }
+			   if (oldest == free_.end()) break;
+			   while (!oldest->second.bufs.empty() && pooled_ > bytes)
+			   {
+				   bufs.push_back(oldest->second.bufs.back());
+				   oldest->second.bufs.pop_back();
+				   pooled_ -= oldest->first;
+			   }
+			   if (oldest->second.bufs.empty())
+				   free_.erase(oldest);
+		   }
+	   }
+	   for (size_t i = 0; i < bufs.size(); i++)
+		   free(bufs[i]);
+   }
+
+   void BrickBufferPool::set_max_pooled(size_t bytes)
+   {
+	   {
+		   wxCriticalSectionLocker enter(lock_);
+		   max_pooled_ = bytes;
+	   }
+	   trim(bytes);
+   }
+
+   void BrickBufferPool::get_stats(size_t &in_use, size_t &pooled)
+   {
+	   wxCriticalSectionLocker enter(lock_);
+	   in_use = in_use_;
+	   pooled = pooled_;
    }
 
    bool TextureBrick::raw_brick_reader(char* data, size_t size, const FileLocInfo* finfo)
    {
 	   try
 	   {
-		   ifstream ifs;
-		   ifs.open(ws2s(finfo->filename), ios::binary);
-		   if (!ifs) return false;
 		   if (finfo->datasize > 0 && size != finfo->datasize) return false;
 		   size_t read_size = finfo->datasize > 0 ? finfo->datasize : size;
-		   ifs.seekg(finfo->offset, ios_base::beg); 
-		   ifs.read(data, read_size);
-		   if (ifs) ifs.close();
+		   if (!BrickFileHandles::read(finfo->filename, finfo->offset, read_size, data))
+			   return false;
 /*
 		   FILE* fp = fopen(ws2s(finfo->filename).c_str(), "rb");
 		   if (!fp) return false;
@@ -1374,200 +1609,88 @@ z
 	   return true;
    }
 
-   bool TextureBrick::raw_brick_reader_url(char* data, size_t size, const FileLocInfo* finfo)
+   //remote bricks are read from their copy in BrickCache
+   //a cached range holds only the bytes of the brick
+   bool TextureBrick::fetch_url_brick(const FileLocInfo* finfo, FileLocInfo &local)
    {
-	   CURLcode ret;
-	   struct MemoryStruct chunk;
-	   chunk.memory = (char *)malloc(1);  /* will be grown as needed by the realloc above */ 
-	   chunk.size = 0;
-
-	   if (s_curl_ == NULL) {
-		   cerr << "curl_easy_init() failed" << endl;
-		   return false;
-	   }
-	   curl_easy_reset(s_curl_);
-	   curl_easy_setopt(s_curl_, CURLOPT_URL, wxString::wxString(finfo->filename).ToStdString().c_str());
-	   curl_easy_setopt(s_curl_, CURLOPT_TIMEOUT, 10L);
-	   curl_easy_setopt(s_curl_, CURLOPT_USERAGENT, "libcurl-agent/1.0");
-	   curl_easy_setopt(s_curl_, CURLOPT_WRITEFUNCTION, WriteMemoryCallback);
-	   curl_easy_setopt(s_curl_, CURLOPT_WRITEDATA, &chunk);
-	   //sAؖ؂Ȃ
-	   curl_easy_setopt(s_curl_, CURLOPT_SSL_VERIFYPEER, 0);
-	   ret = curl_easy_perform(s_curl_);
-	   if (ret != CURLE_OK) {
-		   cerr << "curl_easy_perform() failed." << curl_easy_strerror(ret) << endl;
+	   local = *finfo;
+	   local.isurl = false;
+	   if (!BrickCache::acquire(finfo, local.filename, s_curl_))
 		   return false;
-	   }
-	   if(chunk.size != size) return false;
-
-	   memcpy(data, chunk.memory, size);
-
-	   if(chunk.memory)
-		   free(chunk.memory);
-
+	   if (finfo->is_range())
+		   local.offset = 0;
 	   return true;
    }
 
-   bool TextureBrick::jpeg_brick_reader(char* data, size_t size, const FileLocInfo* finfo)
+   bool TextureBrick::raw_brick_reader_url(char* data, size_t size, const FileLocInfo* finfo)
    {
-	   jpeg_decompress_struct cinfo;
-	   struct my_error_mgr jerr;
-	   
-       FILE *fp = 0;
-	   if (!WFOPEN(&fp, finfo->filename.c_str(), L"rb"))
-           return false;
-
-	   cinfo.err = jpeg_std_error(&jerr.pub);
-	   jerr.pub.error_exit = my_error_exit;
-	   /* Establish the setjmp return context for my_error_exit to use. */
-	   if (setjmp(jerr.setjmp_buffer)) {
-		   /* If we get here, the JPEG code has signaled an error.
-		   * We need to clean up the JPEG object, close the input file, and return.
-		   */
-		   jpeg_destroy_decompress(&cinfo);
-		   fclose(fp);
+	   FileLocInfo local;
+	   if (!fetch_url_brick(finfo, local))
 		   return false;
-	   }
-	   jpeg_create_decompress(&cinfo);
+	   bool result = raw_brick_reader(data, size, &local);
+	   BrickCache::release(local.filename);
+	   return result;
+   }
 
-	   fseek(fp, finfo->offset, SEEK_SET);
-	   jpeg_stdio_src(&cinfo, fp);
-	   jpeg_read_header(&cinfo, TRUE);
-	   jpeg_start_decompress(&cinfo);
-	   
-	   if(cinfo.jpeg_color_space != JCS_GRAYSCALE || cinfo.output_components != 1) longjmp(jerr.setjmp_buffer, 1);
-	   
-	   size_t jpgsize = cinfo.output_width * cinfo.output_height;
-	   if (jpgsize != size) longjmp(jerr.setjmp_buffer, 1);
-	   unsigned char *ptr[1];
-	   ptr[0] = (unsigned char *)data;
-	   while (cinfo.output_scanline < cinfo.output_height) {
-		   ptr[0] = (unsigned char *)data + cinfo.output_scanline * cinfo.output_width;
-		   jpeg_read_scanlines(&cinfo, ptr, 1);
+   bool TextureBrick::jpeg_brick_reader(char* data, size_t size, const FileLocInfo* finfo)
+   {
+	   size_t jsize = finfo->datasize;
+	   if (jsize <= 0)
+	   {
+		   long long fsize = BrickFileHandles::file_size(finfo->filename);
+		   if (fsize <= finfo->offset) return false;
+		   jsize = (size_t)(fsize - finfo->offset);
 	   }
+	   char *jdata = BrickBufferPool::alloc(jsize);
+	   if (!jdata) return false;
+	   bool result = BrickFileHandles::read(finfo->filename, finfo->offset, jsize, jdata) &&
+		   jpeg_decompressor(data, jdata, size, jsize);
+	   BrickBufferPool::release(jdata);
 
-	   jpeg_destroy_decompress(&cinfo);
-	   fclose(fp);
-	   
-	   return true;
+	   return result;
    }
 
    bool TextureBrick::jpeg_brick_reader_url(char* data, size_t size, const FileLocInfo* finfo)
    {
-	   jpeg_decompress_struct cinfo;
-	   struct my_error_mgr jerr;
-	   
-	   CURLcode ret;
-	   struct MemoryStruct chunk;
-	   chunk.memory = (char *)malloc(1);
-	   chunk.size = 0;
-
-	   if (s_curl_ == NULL) {
-		   cerr << "curl_easy_init() failed" << endl;
-		   return false;
-	   }
-	   curl_easy_reset(s_curl_);
-	   curl_easy_setopt(s_curl_, CURLOPT_URL, wxString::wxString(finfo->filename).ToStdString().c_str());
-	   curl_easy_setopt(s_curl_, CURLOPT_TIMEOUT, 10L);
-	   curl_easy_setopt(s_curl_, CURLOPT_USERAGENT, "libcurl-agent/1.0");
-	   curl_easy_setopt(s_curl_, CURLOPT_WRITEFUNCTION, WriteMemoryCallback);
-	   curl_easy_setopt(s_curl_, CURLOPT_WRITEDATA, &chunk);
-	   //sAؖ؂Ȃ
-	   curl_easy_setopt(s_curl_, CURLOPT_SSL_VERIFYPEER, 0);
-	   ret = curl_easy_perform(s_curl_);
-	   if (ret != CURLE_OK) {
-		   cerr << "curl_easy_perform() failed." << curl_easy_strerror(ret) << endl;
+	   FileLocInfo local;
+	   if (!fetch_url_brick(finfo, local))
 		   return false;
-	   }
-	   
-	   cinfo.err = jpeg_std_error(&jerr.pub);
-	   jerr.pub.error_exit = my_error_exit;
-	   /* Establish the setjmp return context for my_error_exit to use. */
-	   if (setjmp(jerr.setjmp_buffer)) {
-		   /* If we get here, the JPEG code has signaled an error.
-		   * We need to clean up the JPEG object, close the input file, and return.
-		   */
-		   jpeg_destroy_decompress(&cinfo);
-		   return false;
-	   }
-	   jpeg_create_decompress(&cinfo);
-	   jpeg_mem_src(&cinfo, (unsigned char *)chunk.memory, chunk.size);
-	   //jpeg_mem_src(&cinfo, (unsigned char *)mem_buf.GetData(), mem_buf.GetDataLen());
-	   jpeg_read_header(&cinfo, TRUE);
-	   jpeg_start_decompress(&cinfo);
-	   
-	   if(cinfo.jpeg_color_space != JCS_GRAYSCALE || cinfo.output_components != 1) longjmp(jerr.setjmp_buffer, 1);
-	   
-	   size_t jpgsize = cinfo.output_width * cinfo.output_height;
-	   if (jpgsize != size) longjmp(jerr.setjmp_buffer, 1);
-	   unsigned char *ptr[1];
-	   ptr[0] = (unsigned char *)data;
-	   while (cinfo.output_scanline < cinfo.output_height) {
-		   ptr[0] = (unsigned char *)data + cinfo.output_scanline * cinfo.output_width;
-		   jpeg_read_scanlines(&cinfo, ptr, 1);
-	   }
-
-	   jpeg_destroy_decompress(&cinfo);
-	   
-	   if(chunk.memory)
-		   free(chunk.memory);
-	   	   
-	   return true;
+	   bool result = jpeg_brick_reader(data, size, &local);
+	   BrickCache::release(local.filename);
+	   return result;
    }
 
    bool TextureBrick::zlib_brick_reader(char* data, size_t size, const FileLocInfo* finfo)
    {
-	   try
-	   {
-		   ifstream ifs;
-		   ifs.open(ws2s(finfo->filename), ios::binary);
-		   if (!ifs) return false;
-		   
-		   size_t zsize = finfo->datasize;
-		   if (zsize <= 0) zsize = (size_t)ifs.seekg(0, std::ios::end).tellg();
-		   
-		   unsigned char *zdata = new unsigned char[zsize];
-		   ifs.seekg(finfo->offset, ios_base::beg);
-		   ifs.read((char*)zdata, zsize);
-		   if (ifs) ifs.close();
-
-		   z_stream zInfo = {0};
-		   zInfo.total_in  = zInfo.avail_in  = zsize;
-		   zInfo.total_out = zInfo.avail_out = size;
-		   zInfo.next_in  = zdata;
-		   zInfo.next_out = (Bytef *)data;
-
-		   int nErr, nOut = -1;
-		   nErr = inflateInit( &zInfo );
-		   if ( nErr == Z_OK ) {
-			   nErr = inflate( &zInfo, Z_FINISH );
-			   if ( nErr == Z_STREAM_END ) {
-				   nOut = zInfo.total_out;
-			   }
-		   }
-		   inflateEnd( &zInfo );
-		   delete [] zdata;
-
-		   if (nOut != size || nErr != Z_STREAM_END)
-			   return false;
-	   }
-	   catch (std::exception &e)
+	   size_t zsize = finfo->datasize;
+	   if (zsize <= 0)
 	   {
-		   cerr << typeid(e).name() << "\n" << e.what() << endl;
-		   return false;
+		   long long fsize = BrickFileHandles::file_size(finfo->filename);
+		   if (fsize <= 0) return false;
+		   zsize = (size_t)fsize;
 	   }
+	   char *zdata = BrickBufferPool::alloc(zsize);
+	   if (!zdata) return false;
+	   bool result = BrickFileHandles::read(finfo->filename, finfo->offset, zsize, zdata) &&
+		   zlib_decompressor(data, zdata, size, zsize);
+	   BrickBufferPool::release(zdata);
 
-	   return true;
+	   return result;
    }
 
    bool TextureBrick::zlib_brick_reader_url(char* data, size_t size, const FileLocInfo* finfo)
    {
-	   return true;
+	   FileLocInfo local;
+	   if (!fetch_url_brick(finfo, local))
+		   return false;
+	   bool result = zlib_brick_reader(data, size, &local);
+	   BrickCache::release(local.filename);
+	   return result;
    }
 
    void TextureBrick::freeBrkData()
    {
-	   if (brkdata_) delete [] brkdata_;
+	   BrickBufferPool::release(brkdata_);
 	   brkdata_ = NULL;
    }
 } // end namespace FLIVR
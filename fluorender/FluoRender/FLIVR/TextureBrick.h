@@ -34,6 +34,7 @@
 #include "Ray.h"
 #include "BBox.h"
 #include "Plane.h"
+#include "BrickCache.h"
 
 #include <wx/thread.h>
 
@@ -43,6 +44,9 @@
 #include <nrrd.h>
 #include <stdint.h>
 #include <map>
+#include <list>
+#include <unordered_map>
+#include <atomic>
 #include <curl/curl.h>
 
 namespace FLIVR {
@@ -66,6 +70,9 @@ namespace FLIVR {
 #define BRICK_FILE_TYPE_JPEG	2
 #define BRICK_FILE_TYPE_ZLIB	3
 
+//bins of the value histograms of bricks
+#define BRICK_STAT_BINS	16
+
 	
 	class FileLocInfo {
 	public:
@@ -76,8 +83,8 @@ namespace FLIVR {
 			datasize = 0;
 			type = 0;
 			isurl = false;
-			cached = false;
-			cache_filename = L"";
+			minval = maxval = binsize = 0.0;
+			occupancy = 0;
 		}
 		FileLocInfo(std::wstring filename_, int offset_, int datasize_, int type_, bool isurl_)
 		{
@@ -86,8 +93,8 @@ namespace FLIVR {
 			datasize = datasize_;
 			type = type_;
 			isurl = isurl_;
-			cached = false;
-			cache_filename = L"";
+			minval = maxval = binsize = 0.0;
+			occupancy = 0;
 		}
 		FileLocInfo(const FileLocInfo &copy)
 		{
@@ -96,8 +103,32 @@ namespace FLIVR {
 			datasize = copy.datasize;
 			type = copy.type;
 			isurl = copy.isurl;
-			cached = copy.cached;
-			cache_filename = copy.cache_filename;
+			minval = copy.minval;
+			maxval = copy.maxval;
+			binsize = copy.binsize;
+			occupancy = copy.occupancy;
+		}
+
+		//a brick packed in a remote file is fetched with a range request
+		bool is_range() const {return isurl && datasize > 0;}
+
+		//false if no voxel of the brick is within lo-hi (0-1)
+		//bricks without a value summary may hold anything
+		bool has_values(double lo, double hi) const
+		{
+			if (!occupancy)
+				return true;
+			if (hi < minval || lo > maxval)
+				return false;
+			if (binsize <= 0.0)
+				return true;
+			int b0 = lo > minval ? int((lo - minval) / binsize) : 0;
+			int b1 = int((hi - minval) / binsize);
+			b1 = b1 < BRICK_STAT_BINS ? b1 : BRICK_STAT_BINS-1;
+			for (int i = b0; i <= b1; i++)
+				if (occupancy & (1u << i))
+					return true;
+			return false;
 		}
 
 		std::wstring filename;
@@ -105,8 +136,12 @@ namespace FLIVR {
 		int datasize;
 		int type; //1-raw; 2-jpeg; 3-zlib;
 		bool isurl;
-		bool cached;
-		std::wstring cache_filename;
+		//value summary normalized to 0-1, from the brick stats of the vvd
+		//bin i holds the values from minval+i*binsize, 0 occupancy if unknown
+		double minval;
+		double maxval;
+		double binsize;
+		unsigned int occupancy;
 	};
 
 	class TextureBrick
@@ -203,6 +238,8 @@ namespace FLIVR {
 			vector<double>& vertex, vector<double>& texcoord,
 			vector<int>& size);
 
+		//the slices are kept and returned again while the view ray, dt and
+		//the update order stay the same
 		void compute_polygons(Ray& view, double dt,
 			vector<float>& vertex, vector<uint32_t>& index,
 			vector<uint32_t>& size);
@@ -210,6 +247,13 @@ namespace FLIVR {
 			double tmin, double tmax, double dt,
 			vector<float>& vertex, vector<uint32_t>& index,
 			vector<uint32_t>& size);
+		//computes the slices of the bricks on all threads before they are drawn
+		static void prepare_polygons(const vector<TextureBrick*> &bricks,
+			Ray& view, double dt);
+		void clear_poly_cache();
+		//bytes of the slices kept by all bricks
+		static void set_poly_cache_max(long long bytes) {poly_cache_max_ = bytes;}
+		static long long get_poly_cache_size() {return poly_cache_total_;}
 
 
 		void get_polygon(int tid, int &size_v, float* &v, int &size_i, uint32_t* &i);
@@ -240,6 +284,9 @@ namespace FLIVR {
 		void set_id_in_loadedbrks(int id) {id_in_loadedbrks = id;};
 		int get_id_in_loadedbrks() {return id_in_loadedbrks;}
 		int getID() {return findex_;}
+		//pyramid level of the brick (brkxml)
+		int get_level() {return level_;}
+		void set_level(int lv) {level_ = lv;}
 		const void *getBrickData() {return brkdata_;}
 
 		double dt() {return dt_;}
@@ -273,7 +320,10 @@ namespace FLIVR {
 		static bool decompress_brick(char *out, char* in, size_t out_size, size_t in_size, int type);
 		static bool jpeg_decompressor(char *out, char* in, size_t out_size, size_t in_size);
 		static bool zlib_decompressor(char *out, char* in, size_t out_size, size_t in_size);
-		static void delete_all_cache_files();
+		//fast zlib compression of brick data into a buffer from BrickBufferPool
+		//false if it does not make the data smaller by at least ratio
+		static bool zlib_compressor(char* &out, size_t &out_size, const char* in, size_t in_size, double ratio=0.9);
+		static void close_cache_files();
 
 		void prevent_tex_deletion(bool val) {prevent_tex_deletion_ = val;}
 		bool is_tex_deletion_prevented() {return prevent_tex_deletion_;}
@@ -288,9 +338,7 @@ namespace FLIVR {
 		bool jpeg_brick_reader_url(char* data, size_t size, const FileLocInfo* finfo);
 		bool zlib_brick_reader_url(char* data, size_t size, const FileLocInfo* finfo);
 
-		static size_t WriteMemoryCallback(void *contents, size_t size, size_t nmemb, void *userp);
-		static size_t WriteFileCallback(void *contents, size_t size, size_t nmemb, void *userp);
-		static int xferinfo(void *p, curl_off_t dltotal, curl_off_t dlnow, curl_off_t ultotal, curl_off_t ulnow);
+		static bool fetch_url_brick(const FileLocInfo* finfo, FileLocInfo &local);
 
 		//! bbox edges
 		Ray edge_[12]; 
@@ -335,6 +383,7 @@ namespace FLIVR {
 		bool prevent_tex_deletion_;
 
 		int findex_;
+		int level_;
 
 		double dt_;
 		int timax_, timin_;
@@ -349,10 +398,61 @@ namespace FLIVR {
 		vector<int> size_integ_i_;
 
 		bool disp_;
+
+		//slices of the last compute_polygons
+		struct PolyCache
+		{
+			bool valid;
+			double o[3], d[3];
+			double dt;
+			bool order;
+			long long bytes;
+			vector<float> vertex;
+			vector<uint32_t> index;
+			vector<uint32_t> size;
+			PolyCache() : valid(false), dt(0.0), order(true), bytes(0) {}
+		};
+		PolyCache poly_cache_;
+		static std::atomic<long long> poly_cache_total_;
+		static long long poly_cache_max_;
+		bool poly_cache_hit(Ray& view, double dt, bool order);
         
         static CURL *s_curl_;
 		static CURLM *s_curlm_;
-		static std::map<std::wstring, std::wstring> cache_table_;
+	};
+
+	//buffers for brick data, read and decompressed, recycled by size
+	//bricks of a level share a few sizes, so released buffers are kept in
+	//free lists and handed out again instead of going back to the heap
+	//only buffers allocated here may be released; others are rejected
+	class BrickBufferPool {
+	public:
+		//NULL if the memory cannot be allocated
+		static char* alloc(size_t size);
+		static void release(void* buf);
+		//return pooled buffers to the system until at most bytes are kept
+		static void trim(size_t bytes);
+		static void set_max_pooled(size_t bytes);
+		//back large buffers with huge pages where the system supports it
+		static void set_huge_pages(bool val) {huge_pages_ = val;}
+		//bytes handed out and bytes kept for reuse
+		static void get_stats(size_t &in_use, size_t &pooled);
+	private:
+		struct FreeList {
+			std::vector<char*> bufs;
+			unsigned long long last_use;
+		};
+		static size_t size_class(size_t size);
+		static char* sys_alloc(size_t size);
+
+		static std::map<size_t, FreeList> free_;
+		static std::unordered_map<char*, size_t> used_;
+		static wxCriticalSection lock_;
+		static size_t in_use_;
+		static size_t pooled_;
+		static size_t max_pooled_;
+		static bool huge_pages_;
+		static unsigned long long clock_;
 	};
 
 	struct Pyramid_Level {
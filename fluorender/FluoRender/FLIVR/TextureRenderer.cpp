@@ -1771,7 +1771,7 @@ namespace FLIVR
 								}
 							}
 
-							FileLocInfo *finfo = tex_->GetFileName(brick->getID());
+							FileLocInfo *finfo = tex_->GetFileName(brick);
 							void *texdata = brick->tex_data_brk(c, finfo);
 							if (texdata)
 							{
@@ -580,6 +580,31 @@ namespace FLIVR
 		return dt;
 	}
 
+	bool VolumeRenderer::get_visible_range(double &lo, double &hi)
+	{
+		//labels and index colors are drawn regardless of the values
+		if (ml_mode_ > 2 || colormap_mode_ == 3 || scalar_scale_ <= 0.0)
+			return false;
+
+		//same as the transfer function of the shaders, with the soft threshold
+		double l = lo_thresh_ - sw_;
+		double h = hi_thresh_ + sw_;
+		if (inv_)
+		{
+			lo = (1.0 - h) / scalar_scale_;
+			hi = (1.0 - l) / scalar_scale_;
+		}
+		else
+		{
+			lo = l / scalar_scale_;
+			hi = h / scalar_scale_;
+		}
+		//keep the values on the edges
+		lo -= 1e-6;
+		hi += 1e-6;
+		return true;
+	}
+
 	bool VolumeRenderer::test_against_view_clip(const BBox &bbox, const BBox &tbox, const BBox &dbox, bool persp)
 	{
 		if (!test_against_view(bbox, persp))
@@ -1186,6 +1211,20 @@ namespace FLIVR
 		if (mask_)  bmode = TEXTURE_RENDER_MODE_MASK;
 		if (label_) bmode = TEXTURE_RENDER_MODE_LABEL;
 
+		//slices of the bricks to draw are computed on all threads first
+		vector<TextureBrick*> poly_bricks;
+		for (unsigned int i=0; i < bricks->size(); i++)
+		{
+			TextureBrick* b = (*bricks)[i];
+			if (mem_swap_ && start_update_loop_ && !done_update_loop_ &&
+				b->drawn(bmode))
+				continue;
+			if (!b->get_disp() || b->get_priority()>0)
+				continue;
+			poly_bricks.push_back(b);
+		}
+		TextureBrick::prepare_polygons(poly_bricks, view_ray, dt);
+
 		for (unsigned int i=0; i < bricks->size(); i++)
 		{
 			//comment off when debug_ds
@@ -2342,6 +2381,8 @@ namespace FLIVR
 						dst_p = z_st_dst_p + mask_zpitch;
 					}
 				}
+				tex_->mask_changed(b->ox(), b->oy(), b->oz(),
+					brick_x, brick_y, brick_z);
 
 				delete[] out_cl_buf;
 				delete[] out_cl_final_buf;
@@ -2653,6 +2694,8 @@ namespace FLIVR
 					dst_p = z_st_dst_p + mask_zpitch;
 				}
 			}
+			tex_->mask_changed(b->ox(), b->oy(), b->oz(),
+				brick_x, brick_y, brick_z);
 
 			delete[] out_cl_buf;
 			delete[] out_cl_final_buf;
@@ -3056,22 +3099,36 @@ namespace FLIVR
 		if (c<0 || c>=TEXTURE_MAX_COMPONENTS)
 			return;
 
+		//a mask saved for undos is compared as it is copied back,
+		//so that only the blocks a paint changed are saved
+		bool tracked = tex_->mask_tracked();
+		vector<unsigned char> buf;
+
 		for (unsigned int i=0; i<bricks->size(); i++)
 		{
+			TextureBrick* b = (*bricks)[i];
 			load_brick_mask(bricks, i);
 			glActiveTexture(GL_TEXTURE0+c);
 
 			// download texture data
-			int sx = (*bricks)[i]->sx();
-			int sy = (*bricks)[i]->sy();
+			int sx = tracked ? b->nx() : b->sx();
+			int sy = tracked ? b->ny() : b->sy();
 			glPixelStorei(GL_PACK_ROW_LENGTH, sx);
 			glPixelStorei(GL_PACK_IMAGE_HEIGHT, sy);
 			glPixelStorei(GL_PACK_ALIGNMENT, 1);
 
-			GLenum type = (*bricks)[i]->tex_type(c);
-			void* data = (*bricks)[i]->tex_data(c);
+			GLenum type = b->tex_type(c);
+			void* data = b->tex_data(c);
+			if (tracked)
+			{
+				buf.resize((size_t)b->nx()*b->ny()*b->nz());
+				data = &buf[0];
+			}
 			glGetTexImage(GL_TEXTURE_3D, 0, GL_RED,
 				type, data);
+			if (tracked)
+				tex_->write_mask(&buf[0], b->ox(), b->oy(), b->oz(),
+					b->nx(), b->ny(), b->nz());
 
 			glPixelStorei(GL_PACK_ROW_LENGTH, 0);
 			glPixelStorei(GL_PACK_IMAGE_HEIGHT, 0);
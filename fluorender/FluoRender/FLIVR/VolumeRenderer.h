@@ -211,6 +211,9 @@ namespace FLIVR
 		{ m_use_fog = use_fog; m_fog_intensity = fog_intensity; m_fog_start = fog_start; m_fog_end = fog_end; }
 
 		bool test_against_view_clip(const BBox &bbox, const BBox &tbox, const BBox &dbox, bool persp);
+		//range of texture values (0-1) drawn with any opacity by the transfer function
+		//false if values outside of it may be visible too
+		bool get_visible_range(double &lo, double &hi);
 		void set_clip_quaternion(Quaternion q){ m_q_cl = q; }
 
 		friend class MultiVolumeRenderer;
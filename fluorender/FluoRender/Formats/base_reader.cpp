@@ -50,153 +50,123 @@ DEALINGS IN THE SOFTWARE.
  */
 
 #include "base_reader.h"
+#include <cstring>
+#include <new>
 
-int BaseReader::LZWDecode(tidata_t tif, tidata_t op0, tsize_t occ0)
-{
-	//initialize codec state
-	LZWCodecState *sp = new LZWCodecState;
-	//sp->predictor = m_predictor;
-	sp->stride = 1;
-	//sp->rowsize = m_x_size;
-	sp->dec_codetab = new code_t[CSIZE*sizeof(code_t)];
-	int icode = 255;
-	do
-	{
-		sp->dec_codetab[icode].value = icode;
-		sp->dec_codetab[icode].firstchar = icode;
-		sp->dec_codetab[icode].length = 1;
-		sp->dec_codetab[icode].next = NULL;
-	} while (icode--);
-	sp->maxcode = MAXCODE(BITS_MIN)-1;
-	sp->nbits = BITS_MIN;
-	sp->nextbits = 0;
-	sp->nextdata = 0;
-	sp->dec_restart = 0;
-	sp->dec_nbitsmask = MAXCODE(BITS_MIN);
-	sp->dec_bitsleft = occ0 << 3;
-	sp->dec_free_entp = sp->dec_codetab + CODE_FIRST;
-	memset(sp->dec_free_entp, 0, (CSIZE-CODE_FIRST)*sizeof(code_t));
-	sp->dec_oldcodep = &sp->dec_codetab[-1];
-	sp->dec_maxcodep = &sp->dec_codetab[sp->dec_nbitsmask-1];
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define BASE_READER_SSE2
+#endif
 
-	char *op = (char*) op0;
-	long occ = (long) occ0;
-	char *tp;
-	unsigned char *bp;
+//Every string in the code table is a run of bytes already written
+//to the output (the previous string plus one more byte), so the table
+//only keeps where each string starts and how long it is. Decoding a
+//code is then a single copy from earlier output instead of walking a
+//linked list backwards one byte at a time.
+int BaseReader::LZWDecode(tidata_t tif, tidata_t op0, tsize_t occ0, tsize_t icc)
+{
+	lzw_ent_t codetab[CSIZE];
+	unsigned char *bp = (unsigned char *)tif;
+	bool bounded = icc >= 0;
+	unsigned char *bpend = bp + (bounded ? icc : 0);
+	unsigned char *op = (unsigned char *)op0;
+	unsigned char *opend = op + occ0;
+	unsigned long nextdata = 0;
+	long nextbits = 0;
+	long nbits = BITS_MIN;
+	long nbitsmask = MAXCODE(BITS_MIN);
+	long free_ent = CODE_FIRST;
+	tsize_t old_len = 0;	/* 0 right after a clear code */
 	hcode_t code;
-	int len;
-	long nbits, nextbits, nextdata, nbitsmask;
-	code_t *codep, *free_entp, *maxcodep, *oldcodep;
-
-	bp = (unsigned char *)tif;
-	nbits = sp->nbits;
-	nextdata = sp->nextdata;
-	nextbits = sp->nextbits;
-	nbitsmask = sp->dec_nbitsmask;
-	oldcodep = sp->dec_oldcodep;
-	free_entp = sp->dec_free_entp;
-	maxcodep = sp->dec_maxcodep;
 
-	while (occ > 0)
+	while (op < opend)
 	{
-		GetNextCode(sp, bp, code);
-		//NextCode(tif, sp, bp, code, GetNextCode);
-		if (code == CODE_EOI)
+		/* a truncated strip ends like one without an EOI code */
+		if (bounded && nextbits < nbits &&
+			bpend - bp < (nbits - nextbits + 7) / 8)
 			break;
+		while (nextbits < nbits)
+		{
+			nextdata = (nextdata<<8) | *bp++;
+			nextbits += 8;
+		}
+		code = (hcode_t)((nextdata >> (nextbits-nbits)) & nbitsmask);
+		nextbits -= nbits;
+
+		if (code < 256)
+		{
+			if (old_len > 0)
+			{
+				if (free_ent >= CSIZE)
+					return 0;
+				codetab[free_ent].offset = (tsize_t)(op - op0) - old_len;
+				codetab[free_ent].length = old_len + 1;
+				if (++free_ent > nbitsmask-1)
+				{
+					if (++nbits > BITS_MAX)		/* should not happen */
+						nbits = BITS_MAX;
+					nbitsmask = MAXCODE(nbits);
+				}
+			}
+			*op++ = (unsigned char)code;
+			old_len = 1;
+			continue;
+		}
 		if (code == CODE_CLEAR)
 		{
-			free_entp = sp->dec_codetab + CODE_FIRST;
+			free_ent = CODE_FIRST;
 			nbits = BITS_MIN;
 			nbitsmask = MAXCODE(BITS_MIN);
-			maxcodep = sp->dec_codetab + nbitsmask-1;
-			GetNextCode(sp, bp, code);
-			//NextCode(tif, sp, bp, code, GetNextCode);
-			if (code == CODE_EOI)
-				break;
-			*op++ = (char)code, occ--;
-			oldcodep = sp->dec_codetab + code;
+			old_len = 0;
 			continue;
 		}
-		codep = sp->dec_codetab + code;
-
-		/*
-	 	 * Add the new entry to the code table.
-	 	 */
-		if (free_entp < &sp->dec_codetab[0] ||
-			free_entp >= &sp->dec_codetab[CSIZE])
-			return 0;
-
-		free_entp->next = oldcodep;
-		if (free_entp->next < &sp->dec_codetab[0] ||
-			free_entp->next >= &sp->dec_codetab[CSIZE])
+		if (code == CODE_EOI)
+			break;
+		if (old_len == 0 || code > free_ent || free_ent >= CSIZE)
 			return 0;
 
-		free_entp->firstchar = free_entp->next->firstchar;
-		free_entp->length = free_entp->next->length+1;
-		free_entp->value = (codep < free_entp) ?
-		    codep->firstchar : free_entp->firstchar;
-		if (++free_entp > maxcodep)
+		/*
+		 * Add the new entry to the code table. If the code is the
+		 * one being defined, this also makes it available below.
+		 */
+		codetab[free_ent].offset = (tsize_t)(op - op0) - old_len;
+		codetab[free_ent].length = old_len + 1;
+		if (++free_ent > nbitsmask-1)
 		{
 			if (++nbits > BITS_MAX)		/* should not happen */
 				nbits = BITS_MAX;
 			nbitsmask = MAXCODE(nbits);
-			maxcodep = sp->dec_codetab + nbitsmask-1;
 		}
-		oldcodep = codep;
-		if (code >= 256)
+
+		const unsigned char *src = op0 + codetab[code].offset;
+		tsize_t len = codetab[code].length;
+		tsize_t room = (tsize_t)(opend - op);
+		old_len = len;
+		if (len <= 16 && room >= 16 && src + len <= op)
+		{
+			/* short strings are moved 16 bytes at once, the extra
+			   bytes are overwritten by the output that follows */
+			unsigned char tmp[16];
+			memcpy(tmp, src, 16);
+			memcpy(op, tmp, 16);
+		}
+		else
 		{
-			/*
-			 * Code maps to a string, copy string
-			 * value to output (written in reverse).
-			 */
-			if(codep->length == 0)
-				return 0;
-			if (codep->length > occ)
+			if (len > room)
+				len = room;
+			if (src + len <= op)
+				memcpy(op, src, len);
+			else
 			{
-				/*
-				 * String is too long for decode buffer,
-				 * locate portion that will fit, copy to
-				 * the decode buffer, and setup restart
-				 * logic for the next decoding call.
-				 */
-				sp->dec_codep = codep;
-				do
-				{
-					codep = codep->next;
-				} while (codep && codep->length > occ);
-				if (codep)
-				{
-					sp->dec_restart = occ;
-					tp = op + occ;
-					do
-					{
-						*--tp = codep->value;
-						codep = codep->next;
-					} while (--occ && codep);
-				}
-				break;
+				/* string overlaps itself, copy forward */
+				for (tsize_t i = 0; i < len; i++)
+					op[i] = src[i];
 			}
-			len = codep->length;
-			tp = op + len;
-			do
-			{
-				int t;
-				--tp;
-				t = codep->value;
-				codep = codep->next;
-				*tp = t;
-			} while (codep && tp > op);
-			if (codep)
-				break;
-			op += len, occ -= len;
-		} else
-			*op++ = (char)code, occ--;
+		}
+		op += len;
 	}
 
-	delete []sp->dec_codetab;
-	delete sp;
-
-	if (occ > 0)
+	if (op < opend)
 		return 0;
 
 	return (1);
@@ -212,7 +182,29 @@ void BaseReader::DecodeAcc8(tidata_t cp0, tsize_t cc, tsize_t stride)
         /*
          * Pipeline the most common cases.
          */
-        if (stride == 3)  {
+        if (stride == 1) {
+            //running sum over the whole row
+            unsigned char* up = (unsigned char*) cp0;
+            unsigned char sum = 0;
+            tsize_t i = 0;
+#ifdef BASE_READER_SSE2
+            __m128i carry = _mm_setzero_si128();
+            for (; i + 16 <= cc; i += 16) {
+                __m128i x = _mm_loadu_si128((__m128i*)(up+i));
+                x = _mm_add_epi8(x, _mm_slli_si128(x, 1));
+                x = _mm_add_epi8(x, _mm_slli_si128(x, 2));
+                x = _mm_add_epi8(x, _mm_slli_si128(x, 4));
+                x = _mm_add_epi8(x, _mm_slli_si128(x, 8));
+                x = _mm_add_epi8(x, carry);
+                _mm_storeu_si128((__m128i*)(up+i), x);
+                carry = _mm_set1_epi8((char)(_mm_extract_epi16(x, 7) >> 8));
+            }
+            if (i > 0)
+                sum = up[i-1];
+#endif
+            for (; i < cc; i++)
+                up[i] = sum = (unsigned char)(sum + up[i]);
+        } else if (stride == 3)  {
             unsigned int cr = cp[0];
             unsigned int cg = cp[1];
             unsigned int cb = cp[2];
@@ -253,26 +245,153 @@ void BaseReader::DecodeAcc8(tidata_t cp0, tsize_t cc, tsize_t stride)
 
 //Decode horizontal differencing
 //(Some image formats use horizontal differencing predictor for LZW compression)
-void BaseReader::DecodeAcc16(tidata_t cp0, tsize_t cc, tsize_t stride)
+void BaseReader::DecodeAcc16(tidata_t cp0, tsize_t cc, tsize_t stride, bool swap)
 {
     uint16* wp = (uint16*) cp0;
     tsize_t wc = cc / 2;
-    
-    if((cc%(2*stride))!=0) return;
-    
-    if (wc > stride) {
-        wc -= stride;
-        do {
-            REPEAT4(stride, wp[stride] += wp[0]; wp++)
-            wc -= stride;
-        } while (wc > 0);
+    tsize_t i = 0;
+
+    if((cc%(2*stride))!=0 || wc <= stride) {
+        if (swap)
+            for (i = 0; i < wc; i++)
+                wp[i] = (uint16)((wp[i]<<8) | (wp[i]>>8));
+        return;
+    }
+
+    if (stride == 1) {
+        //running sum over the whole row
+        uint16 sum = 0;
+#ifdef BASE_READER_SSE2
+        __m128i carry = _mm_setzero_si128();
+        for (; i + 8 <= wc; i += 8) {
+            __m128i x = _mm_loadu_si128((__m128i*)(wp+i));
+            if (swap)
+                x = _mm_or_si128(_mm_slli_epi16(x, 8), _mm_srli_epi16(x, 8));
+            x = _mm_add_epi16(x, _mm_slli_si128(x, 2));
+            x = _mm_add_epi16(x, _mm_slli_si128(x, 4));
+            x = _mm_add_epi16(x, _mm_slli_si128(x, 8));
+            x = _mm_add_epi16(x, carry);
+            _mm_storeu_si128((__m128i*)(wp+i), x);
+            carry = _mm_set1_epi16((short)_mm_extract_epi16(x, 7));
+        }
+        if (i > 0)
+            sum = wp[i-1];
+#endif
+        for (; i < wc; i++) {
+            uint16 v = swap ? (uint16)((wp[i]<<8) | (wp[i]>>8)) : wp[i];
+            wp[i] = sum = (uint16)(sum + v);
+        }
+        return;
     }
+
+    if (swap)
+        for (i = 0; i < wc; i++)
+            wp[i] = (uint16)((wp[i]<<8) | (wp[i]>>8));
+    wc -= stride;
+    do {
+        REPEAT4(stride, wp[stride] += wp[0]; wp++)
+        wc -= stride;
+    } while (wc > 0);
 }
 
 Nrrd* BaseReader::Convert(bool get_max) { return Convert(0,get_max); }
 
 Nrrd* BaseReader::Convert(int c, bool get_max) { return Convert(0,c,get_max); }
 
+//readers keep the current channel's state in members, so by default
+//channels are converted one after another on the calling thread
+void BaseReader::ConvertAllChannels(int t, bool get_max, vector<Nrrd*> &data,
+	vector<double> &max_values, vector<double> &scalar_scales)
+{
+	int chan_num = GetChanNum();
+	data.assign(chan_num, 0);
+	max_values.assign(chan_num, 0.0);
+	scalar_scales.assign(chan_num, 1.0);
+	for (int c=0; c<chan_num; c++)
+	{
+		data[c] = Convert(t, c, get_max);
+		max_values[c] = GetMaxValue();
+		scalar_scales[c] = GetScalarScale();
+	}
+}
+
+//readers without a native region path convert the whole volume first
+Nrrd* BaseReader::ConvertRegion(int t, int c, bool get_max, VolumeRegion region)
+{
+	Nrrd* data = Convert(t, c, get_max);
+	if (!data || data->dim != 3)
+		return data;
+	int nx = (int)data->axis[0].size;
+	int ny = (int)data->axis[1].size;
+	int nz = (int)data->axis[2].size;
+	region.Clip(nx, ny, nz);
+	if (region.IsWhole(nx, ny, nz))
+		return data;
+	Nrrd* result = CropRegion(data, region);
+	nrrdNuke(data);
+	return result;
+}
+
+void BaseReader::CopyRegionSlice(const void* slice, size_t nx, size_t elem_size,
+	const VolumeRegion &region, void* dst, int zi)
+{
+	size_t rx = region.GetXSize();
+	size_t ry = region.GetYSize();
+	unsigned char* out = (unsigned char*)dst + (size_t)zi*rx*ry*elem_size;
+	for (int y=region.y0; y<region.y1; y+=region.sy)
+	{
+		const unsigned char* row = (const unsigned char*)slice +
+			((size_t)y*nx + region.x0)*elem_size;
+		if (region.sx == 1)
+			memcpy(out, row, rx*elem_size);
+		else if (elem_size == 1)
+		{
+			for (size_t x=0; x<rx; x++)
+				out[x] = row[x*region.sx];
+		}
+		else
+		{
+			for (size_t x=0; x<rx; x++)
+				memcpy(out+x*elem_size, row+x*region.sx*elem_size, elem_size);
+		}
+		out += rx*elem_size;
+	}
+}
+
+Nrrd* BaseReader::WrapRegion(void* val, int type, const VolumeRegion &region)
+{
+	size_t rx = region.GetXSize();
+	size_t ry = region.GetYSize();
+	size_t rz = region.GetZSize();
+	double spcx = GetXSpc()*region.sx;
+	double spcy = GetYSpc()*region.sy;
+	double spcz = GetZSpc()*region.sz;
+	Nrrd* data = nrrdNew();
+	nrrdWrap(data, val, type, 3, rx, ry, rz);
+	nrrdAxisInfoSet(data, nrrdAxisInfoSpacing, spcx, spcy, spcz);
+	nrrdAxisInfoSet(data, nrrdAxisInfoMax, spcx*rx, spcy*ry, spcz*rz);
+	nrrdAxisInfoSet(data, nrrdAxisInfoMin, 0.0, 0.0, 0.0);
+	nrrdAxisInfoSet(data, nrrdAxisInfoSize, rx, ry, rz);
+	return data;
+}
+
+Nrrd* BaseReader::CropRegion(Nrrd* data, const VolumeRegion &region)
+{
+	size_t elem_size = nrrdElementSize(data);
+	size_t nx = data->axis[0].size;
+	size_t ny = data->axis[1].size;
+	size_t mem_size = (size_t)region.GetXSize()*region.GetYSize()*
+		region.GetZSize()*elem_size;
+	unsigned char* val = new (std::nothrow) unsigned char[mem_size];
+	if (!val)
+		return 0;
+	int zi = 0;
+	for (int z=region.z0; z<region.z1; z+=region.sz)
+		CopyRegionSlice((unsigned char*)data->data + (size_t)z*nx*ny*elem_size,
+			nx, elem_size, region, val, zi++);
+	return WrapRegion(val, data->type, region);
+}
+
 int BaseReader::LoadOffset(int offset)
 {
    if (m_batch_list.size() <=1) return -1; 
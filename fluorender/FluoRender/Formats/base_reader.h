@@ -31,6 +31,7 @@ DEALINGS IN THE SOFTWARE.
 #include <string>
 #include <nrrd.h>
 #include <vector>
+#include <mutex>
 
 using namespace std;
 
@@ -39,6 +40,47 @@ using namespace std;
 	#define nrrdAxisInfoSet nrrdAxisInfoSet_va
 #endif
 
+//a voxel box [x0, x1) x [y0, y1) x [z0, z1), sampled every sx, sy and sz voxels
+struct VolumeRegion
+{
+	int x0, y0, z0;
+	int x1, y1, z1;
+	int sx, sy, sz;
+
+	VolumeRegion() :
+		x0(0), y0(0), z0(0), x1(0), y1(0), z1(0), sx(1), sy(1), sz(1) {}
+	VolumeRegion(int xmin, int ymin, int zmin, int xmax, int ymax, int zmax,
+		int xstride=1, int ystride=1, int zstride=1) :
+		x0(xmin), y0(ymin), z0(zmin), x1(xmax), y1(ymax), z1(zmax),
+		sx(xstride), sy(ystride), sz(zstride) {}
+
+	//clamp to a volume of nx*ny*nz, an empty box selects the whole axis
+	void Clip(int nx, int ny, int nz)
+	{
+		if (x1 <= x0) {x0 = 0; x1 = nx;}
+		if (y1 <= y0) {y0 = 0; y1 = ny;}
+		if (z1 <= z0) {z0 = 0; z1 = nz;}
+		x0 = x0<0?0:x0; x1 = x1>nx?nx:x1;
+		y0 = y0<0?0:y0; y1 = y1>ny?ny:y1;
+		z0 = z0<0?0:z0; z1 = z1>nz?nz:z1;
+		sx = sx<1?1:sx; sy = sy<1?1:sy; sz = sz<1?1:sz;
+	}
+	bool IsEmpty() const
+	{
+		return x1<=x0 || y1<=y0 || z1<=z0;
+	}
+	bool IsWhole(int nx, int ny, int nz) const
+	{
+		return x0==0 && y0==0 && z0==0 &&
+			x1==nx && y1==ny && z1==nz &&
+			sx==1 && sy==1 && sz==1;
+	}
+	//size of the result
+	int GetXSize() const {return IsEmpty()?0:(x1-x0+sx-1)/sx;}
+	int GetYSize() const {return IsEmpty()?0:(y1-y0+sy-1)/sy;}
+	int GetZSize() const {return IsEmpty()?0:(z1-z0+sz-1)/sz;}
+};
+
 class BaseReader
 {
 public:
@@ -62,12 +104,21 @@ public:
 	virtual Nrrd* Convert(bool get_max);			//Convert the data to nrrd
 	virtual Nrrd* Convert(int c, bool get_max);		//convert the specified channel to nrrd
 	virtual Nrrd* Convert(int t, int c, bool get_max) = 0;//convert the specified channel and time point to nrrd
+	//convert all channels of the specified time point to nrrds
+	//max value and scalar scale of each channel are returned alongside
+	virtual void ConvertAllChannels(int t, bool get_max, vector<Nrrd*> &data,
+		vector<double> &max_values, vector<double> &scalar_scales);
+	//convert a region of the specified channel and time point to nrrd
+	//spacings of the result are multiplied by the strides
+	virtual Nrrd* ConvertRegion(int t, int c, bool get_max, VolumeRegion region);
 	virtual wstring GetCurName(int t, int c) = 0;//for a 4d sequence, get the file name for specified time and channel
 
 	virtual wstring GetPathName() = 0;
 	virtual wstring GetDataName() = 0;
 	virtual int GetTimeNum() = 0;
 	virtual int GetCurTime() = 0;
+	//put back the current time after converting a frame for someone else
+	virtual void SetCurTime(int t) {}
 	virtual int GetChanNum() = 0;
 	virtual double GetExcitationWavelength(int chan) = 0;
 	virtual int GetSliceNum() = 0;
@@ -126,6 +177,13 @@ public:
 		m_info = info;
 	}
 
+	//a reader is shared by the views and the 4d frame prefetch
+	//a thread holds the lock while it converts with the reader or changes its files
+	recursive_mutex &GetLock()
+	{
+		return m_lock;
+	}
+
 protected:
 	wstring m_id_string;	//the path and file name used to read files
 	//resizing
@@ -142,6 +200,8 @@ protected:
 
 	wstring m_info;
 
+	recursive_mutex m_lock;
+
 	//all the decoding stuff
 	#define MAXCODE(n)	((1L<<(n))-1)
 	#define	BITS_MIN	9		/* start with 9 bits */
@@ -157,58 +217,11 @@ protected:
 	typedef	tidataval_t* tidata_t;		/* reference to internal image data */
 	typedef	uint16 tsample_t;			/* sample number */
 	typedef uint16 hcode_t;			/* codes fit in 16 bits */
-	typedef struct code_ent
-	{
-		struct code_ent *next;
-		unsigned short	length;		/* string len, including this token */
-		unsigned char	value;		/* data value */
-		unsigned char	firstchar;	/* first token of string */
-	} code_t;
 	typedef struct
 	{
-		long	hash;
-		hcode_t	code;
-	} hash_t;
-	typedef struct
-	{
-		int		predictor;	/* predictor tag value */
-		int		stride;		/* sample stride over data */
-		tsize_t		rowsize;	/* tile/strip row size */
-
-		unsigned short	nbits;		/* # of bits/code */
-		unsigned short	maxcode;	/* maximum code for lzw_nbits */
-		unsigned short	free_ent;	/* next free entry in hash table */
-		long		nextdata;	/* next bits of i/o */
-		long		nextbits;	/* # of valid bits in lzw_nextdata */
-
-		/* Decoding specific data */
-		long	dec_nbitsmask;		/* lzw_nbits 1 bits, right adjusted */
-		long	dec_restart;		/* restart count */
-		long	dec_bitsleft;		/* available bits in raw data */
-		code_t*	dec_codep;		/* current recognized code */
-		code_t*	dec_oldcodep;		/* previously recognized code */
-		code_t*	dec_free_entp;		/* next free entry */
-		code_t*	dec_maxcodep;		/* max available entry */
-		code_t*	dec_codetab;		/* kept separate for small machines */
-	} LZWCodecState;
-	#define	NextCode(_tif, _sp, _bp, _code, _get) {				\
-		if ((_sp)->dec_bitsleft < nbits) {				\
-			_code = CODE_EOI;					\
-		} else {							\
-			_get(_sp,_bp,_code);					\
-			(_sp)->dec_bitsleft -= nbits;				\
-		}								\
-	}
-	#define	GetNextCode(sp, bp, code) {				\
-		nextdata = (nextdata<<8) | *(bp)++;			\
-		nextbits += 8;						\
-		if (nextbits < nbits) {					\
-			nextdata = (nextdata<<8) | *(bp)++;		\
-			nextbits += 8;					\
-		}							\
-		code = (hcode_t)((nextdata >> (nextbits-nbits)) & nbitsmask);	\
-		nextbits -= nbits;					\
-	}
+		tsize_t	offset;		/* where the string was first written */
+		tsize_t	length;		/* string len */
+	} lzw_ent_t;
 	#define REPEAT4(n, op)		\
 		switch (n) {		\
 		default: { int i; for (i = n-4; i > 0; i--) { op; } } \
@@ -219,9 +232,21 @@ protected:
 		case 0:  ;			\
 	}
 
-	int LZWDecode(tidata_t tif, tidata_t op0, tsize_t occ0);
+	//region reading
+	//copy the samples of a region from slice zi of a whole slice
+	static void CopyRegionSlice(const void* slice, size_t nx, size_t elem_size,
+		const VolumeRegion &region, void* dst, int zi);
+	//wrap the region's voxels into a nrrd
+	Nrrd* WrapRegion(void* val, int type, const VolumeRegion &region);
+	//crop a whole volume to a region
+	Nrrd* CropRegion(Nrrd* data, const VolumeRegion &region);
+
+	//icc: bytes of compressed input, decoding stops when they run out
+	//-1 if the input is not bounded
+	int LZWDecode(tidata_t tif, tidata_t op0, tsize_t occ0, tsize_t icc=-1);
 	void DecodeAcc8(tidata_t cp0, tsize_t cc, tsize_t stride);
-	void DecodeAcc16(tidata_t cp0, tsize_t cc, tsize_t stride);
+	//swap: the samples are byte swapped before accumulating
+	void DecodeAcc16(tidata_t cp0, tsize_t cc, tsize_t stride, bool swap=false);
 };
 
 #endif//_BASE_READER_H_
\ No newline at end of file
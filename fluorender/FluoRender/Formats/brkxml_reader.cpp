@@ -258,6 +258,20 @@ void BRKXMLReader::Preprocess()
 			loadMetadata(m_ex_metadata_path);
 	}
 
+	if (root->Attribute("brickStatsPath"))
+	{
+		wstring stats_path = s2ws(root->Attribute("brickStatsPath"));
+		bool is_rel = false;
+#ifdef _WIN32
+		if (stats_path.length() > 2 && stats_path[1] != L':')
+			is_rel = true;
+#else
+		if (stats_path.length() > 0 && stats_path[0] != L'/')
+			is_rel = true;
+#endif
+		ReadBrickStats(is_rel ? cur_dir_name + stats_path : stats_path);
+	}
+
 	SetInfo();
 
 	//OutputInfo();
@@ -338,6 +352,8 @@ void BRKXMLReader::ReadLevel(tinyxml2::XMLElement* lvNode, LevelInfo &lvinfo)
 		strValue = lvNode->Attribute("FileType");
 		if (strValue == "RAW") lvinfo.file_type = BRICK_FILE_TYPE_RAW;
 		else if (strValue == "JPEG") lvinfo.file_type = BRICK_FILE_TYPE_JPEG;
+		else if (strValue == "ZLIB") lvinfo.file_type = BRICK_FILE_TYPE_ZLIB;
+		else lvinfo.file_type = BRICK_FILE_TYPE_NONE;
 	}
 	else lvinfo.file_type = BRICK_FILE_TYPE_NONE;
 
@@ -489,7 +505,7 @@ void BRKXMLReader::ReadFilenames(tinyxml2::XMLElement* fileRootNode, vector<vect
 					if (str.length() >= 2 && str[1] != L':')
 						rel = true;
 #else
-					if (m_ex_metadata_path[0] != L'/')
+					if (str.length() > 0 && str[0] != '/')
 						rel = true;
 #endif
 				}
@@ -545,6 +561,71 @@ void BRKXMLReader::ReadFilenames(tinyxml2::XMLElement* fileRootNode, vector<vect
 	}
 }
 
+void BRKXMLReader::ReadBrickStats(const wstring &file)
+{
+	tinyxml2::XMLDocument doc;
+	if (doc.LoadFile(ws2s(file).c_str()) != 0)
+		return;
+
+	tinyxml2::XMLElement *root = doc.RootElement();
+	if (!root || strcmp(root->Name(), "BrickStats"))
+		return;
+	int bins = BRICK_STAT_BINS;
+	if (root->Attribute("bins"))
+		bins = STOI(root->Attribute("bins"));
+
+	tinyxml2::XMLElement *lvNode = root->FirstChildElement("Level");
+	for (; lvNode; lvNode = lvNode->NextSiblingElement("Level"))
+	{
+		int lv = STOI(lvNode->Attribute("lv"));
+		if (lv < 0 || lv >= m_pyramid.size())
+			continue;
+		LevelInfo &lvinfo = m_pyramid[lv];
+		if (lvinfo.bit_depth <= 0 || lvinfo.bit_depth > 16)
+			continue;
+		double scale = 1.0 / ((1 << lvinfo.bit_depth) - 1);
+
+		tinyxml2::XMLElement *child = lvNode->FirstChildElement("Stat");
+		for (; child; child = child->NextSiblingElement("Stat"))
+		{
+			int frame = STOI(child->Attribute("frame"));
+			int channel = STOI(child->Attribute("channel"));
+			int id = STOI(child->Attribute("brickID"));
+			if (frame < 0 || frame >= lvinfo.filename.size() ||
+				channel < 0 || channel >= lvinfo.filename[frame].size() ||
+				id < 0 || id >= lvinfo.filename[frame][channel].size() ||
+				!lvinfo.filename[frame][channel][id])
+				continue;
+			FLIVR::FileLocInfo *finfo = lvinfo.filename[frame][channel][id];
+
+			int minval = STOI(child->Attribute("min"));
+			int maxval = STOI(child->Attribute("max"));
+			finfo->minval = minval * scale;
+			finfo->maxval = maxval * scale;
+			finfo->binsize = (maxval - minval + 1) * scale / BRICK_STAT_BINS;
+
+			//bins of any number are mapped to the bins kept
+			finfo->occupancy = 0;
+			if (bins > 0 && child->Attribute("hist"))
+			{
+				istringstream iss(child->Attribute("hist"));
+				long long count;
+				for (int i = 0; i < bins && iss >> count; i++)
+				{
+					if (count <= 0)
+						continue;
+					int b0 = i * BRICK_STAT_BINS / bins;
+					int b1 = ((i + 1) * BRICK_STAT_BINS - 1) / bins;
+					for (int j = b0; j <= b1; j++)
+						finfo->occupancy |= 1u << j;
+				}
+			}
+			if (!finfo->occupancy)
+				finfo->occupancy = (1u << BRICK_STAT_BINS) - 1;
+		}
+	}
+}
+
 bool BRKXMLReader::loadMetadata(const wstring &file)
 {
 	string str;
@@ -5,9 +5,36 @@
 #include <string>
 #include <sstream>
 #include <stack>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#include <jpeglib.h>
+#include <setjmp.h>
+#include <zlib.h>
 
 BRKXMLWriter::BRKXMLWriter()
 {
+	m_data = 0;
+	m_reader = 0;
+	m_spcx = 1.0;
+	m_spcy = 1.0;
+	m_spcz = 1.0;
+	m_use_spacings = false;
+	m_compression = false;
+	m_file_type = BRICK_FILE_TYPE_RAW;
+	m_jpeg_quality = 90;
+	m_brick_w = 256;
+	m_brick_h = 256;
+	m_brick_d = 256;
+	m_max_level = 0;
+	m_thread_num = max(1, (int)std::thread::hardware_concurrency());
+	//offsets are read as int
+	m_pack_size = 1LL<<30;
+	m_bytes = 1;
+	m_frame = 0;
+	m_channel = 0;
+	m_error = false;
+
 	tinyxml2::XMLDeclaration* decl = m_md_doc.NewDeclaration();
 
 	m_md_doc.InsertEndChild(decl);
@@ -22,18 +49,771 @@ BRKXMLWriter::~BRKXMLWriter()
 
 void BRKXMLWriter::SetData(Nrrd* data)
 {
+	m_data = data;
+	m_reader = 0;
 }
 
 void BRKXMLWriter::SetSpacings(double spcx, double spcy, double spcz)
 {
+	m_spcx = spcx;
+	m_spcy = spcy;
+	m_spcz = spcz;
+	m_use_spacings = true;
 }
 
 void BRKXMLWriter::SetCompression(bool value)
 {
+	m_compression = value;
+	m_file_type = value?BRICK_FILE_TYPE_ZLIB:BRICK_FILE_TYPE_RAW;
+}
+
+void BRKXMLWriter::SetReader(BaseReader* reader)
+{
+	m_reader = reader;
+	m_data = 0;
+}
+
+void BRKXMLWriter::SetFileType(int type)
+{
+	m_file_type = type;
+	m_compression = type != BRICK_FILE_TYPE_RAW;
+}
+
+void BRKXMLWriter::SetJpegQuality(int quality)
+{
+	m_jpeg_quality = max(1, min(quality, 100));
+}
+
+void BRKXMLWriter::SetBrickSize(int w, int h, int d)
+{
+	//bricks overlap by one voxel
+	m_brick_w = max(w, 2);
+	m_brick_h = max(h, 2);
+	m_brick_d = max(d, 2);
+}
+
+void BRKXMLWriter::SetMaxLevelNum(int num)
+{
+	m_max_level = max(num, 0);
+}
+
+void BRKXMLWriter::SetThreadNum(int num)
+{
+	m_thread_num = max(num, 1);
 }
 
 void BRKXMLWriter::Save(wstring filename, int mode)
 {
+	int nx, ny, nz;
+	int frames, chans;
+	double spcx = 1.0, spcy = 1.0, spcz = 1.0;
+	int type;
+
+	m_error = true;
+	if (m_data)
+	{
+		if (m_data->dim != 3 || !m_data->data)
+			return;
+		nx = int(m_data->axis[0].size);
+		ny = int(m_data->axis[1].size);
+		nz = int(m_data->axis[2].size);
+		type = m_data->type;
+		frames = 1;
+		chans = 1;
+		if (AIR_EXISTS(m_data->axis[0].spacing) && m_data->axis[0].spacing > 0.0)
+			spcx = m_data->axis[0].spacing;
+		if (AIR_EXISTS(m_data->axis[1].spacing) && m_data->axis[1].spacing > 0.0)
+			spcy = m_data->axis[1].spacing;
+		if (AIR_EXISTS(m_data->axis[2].spacing) && m_data->axis[2].spacing > 0.0)
+			spcz = m_data->axis[2].spacing;
+	}
+	else if (m_reader)
+	{
+		//some readers only know the sizes after reading
+		Nrrd* probe = m_reader->ConvertRegion(0, 0, false, VolumeRegion(0, 0, 0, 0, 0, 1));
+		if (!probe)
+			return;
+		nx = int(probe->axis[0].size);
+		ny = int(probe->axis[1].size);
+		type = probe->type;
+		nrrdNuke(probe);
+		nz = m_reader->GetSliceNum();
+		frames = m_reader->GetTimeNum();
+		chans = m_reader->GetChanNum();
+		if (m_reader->IsSpcInfoValid())
+		{
+			spcx = m_reader->GetXSpc();
+			spcy = m_reader->GetYSpc();
+			spcz = m_reader->GetZSpc();
+		}
+	}
+	else
+		return;
+
+	if (m_use_spacings)
+	{
+		spcx = m_spcx;
+		spcy = m_spcy;
+		spcz = m_spcz;
+	}
+	if (type == nrrdTypeUChar)
+		m_bytes = 1;
+	else if (type == nrrdTypeUShort)
+		m_bytes = 2;
+	else
+		return;
+	if (nx <= 0 || ny <= 0 || nz <= 0 || frames <= 0 || chans <= 0)
+		return;
+	//jpeg bricks are 8-bit grayscale
+	if (m_file_type == BRICK_FILE_TYPE_JPEG && m_bytes != 1)
+		m_file_type = BRICK_FILE_TYPE_ZLIB;
+
+	BuildLevels(nx, ny, nz, spcx, spcy, spcz);
+
+	//separate path and name
+	size_t pos = filename.find_last_of(GETSLASH());
+	m_dir = pos==wstring::npos?L"":filename.substr(0, pos+1);
+	m_name = pos==wstring::npos?filename:filename.substr(pos+1);
+	pos = m_name.find_last_of(L'.');
+	if (pos != wstring::npos)
+		m_name = m_name.substr(0, pos);
+
+	for (int t = 0; t < frames; t++)
+	{
+		for (int c = 0; c < chans; c++)
+		{
+			if (!WriteVolume(t, c))
+				return;
+		}
+	}
+
+	WriteXML(filename, frames, chans);
+}
+
+//halve the axes much finer than the coarsest one, otherwise all of them
+void BRKXMLWriter::BuildLevels(int nx, int ny, int nz, double spcx, double spcy, double spcz)
+{
+	m_levels.clear();
+
+	LevelDesc lvd;
+	lvd.w = nx;
+	lvd.h = ny;
+	lvd.d = nz;
+	lvd.fx = lvd.fy = lvd.fz = 1;
+	lvd.xspc = spcx;
+	lvd.yspc = spcy;
+	lvd.zspc = spcz;
+	BuildBricks(lvd);
+	m_levels.push_back(lvd);
+
+	while (m_max_level <= 0 || (int)m_levels.size() < m_max_level)
+	{
+		LevelDesc prev = m_levels.back();
+		if (prev.w <= m_brick_w && prev.h <= m_brick_h && prev.d <= m_brick_d)
+			break;
+
+		int size[3] = {prev.w, prev.h, prev.d};
+		double spc[3] = {prev.xspc, prev.yspc, prev.zspc};
+		int f[3] = {1, 1, 1};
+		double max_spc = 0.0;
+		int i;
+		for (i = 0; i < 3; i++)
+			if (size[i] > 1) max_spc = max(max_spc, spc[i]);
+		bool fine = false;
+		for (i = 0; i < 3; i++)
+		{
+			if (size[i] > 1 && spc[i]*2.0 <= max_spc)
+			{
+				f[i] = 2;
+				fine = true;
+			}
+		}
+		if (!fine)
+		{
+			for (i = 0; i < 3; i++)
+				if (size[i] > 1) f[i] = 2;
+		}
+
+		lvd.fx = f[0];
+		lvd.fy = f[1];
+		lvd.fz = f[2];
+		lvd.w = (prev.w + f[0] - 1) / f[0];
+		lvd.h = (prev.h + f[1] - 1) / f[1];
+		lvd.d = (prev.d + f[2] - 1) / f[2];
+		lvd.xspc = prev.xspc * f[0];
+		lvd.yspc = prev.yspc * f[1];
+		lvd.zspc = prev.zspc * f[2];
+		BuildBricks(lvd);
+		m_levels.push_back(lvd);
+	}
+}
+
+//texture and bounding boxes of a brick along one axis, as Texture::build_bricks
+static void BrickBox(int i, int m, int b, int sz,
+	double &t0, double &t1, double &b0, double &b1)
+{
+	t0 = i?(0.5 / m):0.0;
+	t1 = (m < b || sz - i == b)?1.0:(1.0 - 0.5 / m);
+	b0 = i?((i + 0.5) / sz):0.0;
+	b1 = (sz - i == b)?1.0:min((i + b - 0.5) / sz, 1.0);
+}
+
+void BRKXMLWriter::BuildBricks(LevelDesc &lvd)
+{
+	lvd.bw = min(m_brick_w, lvd.w);
+	lvd.bh = min(m_brick_h, lvd.h);
+	lvd.bd = min(m_brick_d, lvd.d);
+	lvd.bricks.clear();
+	lvd.rows.clear();
+	lvd.files.clear();
+
+	int i, j, k;
+	for (k = 0; k < lvd.d; k += lvd.bd)
+	{
+		if (k) k--;
+		lvd.rows.push_back((int)lvd.bricks.size());
+		for (j = 0; j < lvd.h; j += lvd.bh)
+		{
+			if (j) j--;
+			for (i = 0; i < lvd.w; i += lvd.bw)
+			{
+				if (i) i--;
+				BrickDesc b;
+				b.id = (int)lvd.bricks.size();
+				b.x = i;
+				b.y = j;
+				b.z = k;
+				b.w = min(lvd.bw, lvd.w - i);
+				b.h = min(lvd.bh, lvd.h - j);
+				b.d = min(lvd.bd, lvd.d - k);
+				BrickBox(i, b.w, lvd.bw, lvd.w, b.tx0, b.tx1, b.bx0, b.bx1);
+				BrickBox(j, b.h, lvd.bh, lvd.h, b.ty0, b.ty1, b.by0, b.by1);
+				BrickBox(k, b.d, lvd.bd, lvd.d, b.tz0, b.tz1, b.bz0, b.bz1);
+				lvd.bricks.push_back(b);
+			}
+		}
+	}
+}
+
+bool BRKXMLWriter::WriteVolume(int t, int c)
+{
+	m_frame = t;
+	m_channel = c;
+	m_error = false;
+
+	m_states.resize(m_levels.size());
+	for (size_t i = 0; i < m_states.size(); i++)
+	{
+		LevelState &st = m_states[i];
+		st.slab.clear();
+		st.z0 = 0;
+		st.zn = 0;
+		st.next_z = 0;
+		st.pending.clear();
+		st.row = 0;
+		st.fp = 0;
+		st.pack = 0;
+		st.fpos = 0;
+	}
+
+	LevelDesc &l0 = m_levels[0];
+	size_t slice_size = (size_t)l0.w * l0.h * m_bytes;
+	if (m_data)
+	{
+		for (int z = 0; z < l0.d && !m_error; z++)
+			FeedSlice(0, (unsigned char*)m_data->data + slice_size*z);
+	}
+	else
+	{
+		//one brick row of slices at a time
+		int chunk = l0.bd;
+		int type = m_bytes==1?nrrdTypeUChar:nrrdTypeUShort;
+		Nrrd* cur = m_reader->ConvertRegion(t, c, false,
+			VolumeRegion(0, 0, 0, 0, 0, chunk));
+		for (int z0 = 0; z0 < l0.d && !m_error; z0 += chunk)
+		{
+			int zn = min(chunk, l0.d - z0);
+			//read the next slab while this one is bricked
+			Nrrd* next = 0;
+			std::thread read_thread;
+			if (z0 + chunk < l0.d)
+				read_thread = std::thread([&]() {
+					next = m_reader->ConvertRegion(t, c, false,
+						VolumeRegion(0, 0, z0+chunk, 0, 0, z0+2*chunk));
+				});
+
+			if (!cur || !cur->data || cur->type != type ||
+				int(cur->axis[0].size) != l0.w ||
+				int(cur->axis[1].size) != l0.h ||
+				int(cur->axis[2].size) != zn)
+				m_error = true;
+			for (int z = 0; z < zn && !m_error; z++)
+				FeedSlice(0, (unsigned char*)cur->data + slice_size*z);
+
+			if (read_thread.joinable())
+				read_thread.join();
+			if (cur)
+				nrrdNuke(cur);
+			cur = next;
+		}
+		if (cur)
+			nrrdNuke(cur);
+	}
+
+	for (size_t i = 0; i < m_states.size(); i++)
+		ClosePack(m_states[i]);
+	return !m_error;
+}
+
+//average fx*fy voxels of one or two slices
+template <typename T>
+static void DownsampleSlice(const T* s0, const T* s1, int w, int h,
+	int fx, int fy, T* out)
+{
+	int w2 = (w + fx - 1) / fx;
+	int h2 = (h + fy - 1) / fy;
+	for (int y2 = 0; y2 < h2; y2++)
+	{
+		int y1 = min(y2*fy + fy, h);
+		for (int x2 = 0; x2 < w2; x2++)
+		{
+			int x1 = min(x2*fx + fx, w);
+			unsigned int sum = 0;
+			unsigned int cnt = 0;
+			for (int y = y2*fy; y < y1; y++)
+			{
+				size_t index = (size_t)y * w;
+				for (int x = x2*fx; x < x1; x++)
+				{
+					sum += s0[index + x];
+					cnt++;
+					if (s1)
+					{
+						sum += s1[index + x];
+						cnt++;
+					}
+				}
+			}
+			out[(size_t)y2 * w2 + x2] = T((sum + cnt/2) / cnt);
+		}
+	}
+}
+
+void BRKXMLWriter::FeedSlice(int lv, const unsigned char* slice)
+{
+	LevelDesc &lvd = m_levels[lv];
+	LevelState &st = m_states[lv];
+	size_t slice_size = (size_t)lvd.w * lvd.h * m_bytes;
+	int z = st.next_z++;
+
+	//buffer the slices of the current brick row
+	if (st.zn == 0)
+		st.z0 = z;
+	st.slab.insert(st.slab.end(), slice, slice + slice_size);
+	st.zn++;
+	if (st.row < (int)lvd.rows.size())
+	{
+		const BrickDesc &b = lvd.bricks[lvd.rows[st.row]];
+		if (z == b.z + b.d - 1)
+			WriteBrickRow(lv);
+	}
+	if (m_error || lv + 1 >= (int)m_levels.size())
+		return;
+
+	//pass the slice down the pyramid
+	LevelDesc &next = m_levels[lv+1];
+	const unsigned char* s0 = slice;
+	const unsigned char* s1 = 0;
+	if (next.fz == 2)
+	{
+		if (z % 2 == 0 && z < lvd.d - 1)
+		{
+			st.pending.assign(slice, slice + slice_size);
+			return;
+		}
+		if (z % 2 == 1)
+		{
+			s0 = &st.pending[0];
+			s1 = slice;
+		}
+	}
+	vector<unsigned char> out((size_t)next.w * next.h * m_bytes);
+	if (m_bytes == 1)
+		DownsampleSlice<unsigned char>(s0, s1, lvd.w, lvd.h,
+			next.fx, next.fy, &out[0]);
+	else
+		DownsampleSlice<unsigned short>((const unsigned short*)s0,
+			(const unsigned short*)s1, lvd.w, lvd.h,
+			next.fx, next.fy, (unsigned short*)&out[0]);
+	FeedSlice(lv+1, &out[0]);
+}
+
+void BRKXMLWriter::WriteBrickRow(int lv)
+{
+	LevelDesc &lvd = m_levels[lv];
+	LevelState &st = m_states[lv];
+	int first = lvd.rows[st.row];
+	int last = st.row + 1 < (int)lvd.rows.size()?
+		lvd.rows[st.row+1]:(int)lvd.bricks.size();
+	int num = last - first;
+
+	//cut and compress the bricks of the row on all threads
+	vector<vector<unsigned char> > outs(num);
+	vector<FileDesc> stats(num);
+	std::atomic<int> next_job(0);
+	std::atomic<bool> failed(false);
+	auto work = [&]() {
+		vector<unsigned char> buf;
+		try
+		{
+			for (int i = next_job++; i < num; i = next_job++)
+			{
+				const BrickDesc &b = lvd.bricks[first + i];
+				size_t row_size = (size_t)b.w * m_bytes;
+				buf.resize(row_size * b.h * b.d);
+				for (int z = 0; z < b.d; z++)
+				for (int y = 0; y < b.h; y++)
+				{
+					size_t index = ((size_t)(b.z + z - st.z0) * lvd.h + b.y + y) * lvd.w + b.x;
+					memcpy(&buf[((size_t)z * b.h + y) * row_size],
+						&st.slab[index * m_bytes], row_size);
+				}
+				BrickStats(&buf[0], (size_t)b.w * b.h * b.d,
+					stats[i].minval, stats[i].maxval, stats[i].hist);
+				if (!CompressBrick(&buf[0], b.w, b.h, b.d, outs[i]))
+					failed = true;
+			}
+		}
+		catch (...)
+		{
+			failed = true;
+			next_job = num;
+		}
+	};
+	int thread_num = min(m_thread_num, num);
+	if (thread_num <= 1)
+		work();
+	else
+	{
+		vector<std::thread> workers;
+		for (int i = 0; i < thread_num; i++)
+			workers.push_back(std::thread(work));
+		for (size_t i = 0; i < workers.size(); i++)
+			workers[i].join();
+	}
+	if (failed)
+		m_error = true;
+
+	//append to the pack file in brick order
+	for (int i = 0; i < num && !m_error; i++)
+	{
+		vector<unsigned char> &data = outs[i];
+		if (st.fp && st.fpos > 0 && st.fpos + (long long)data.size() > m_pack_size)
+		{
+			ClosePack(st);
+			st.pack++;
+		}
+		if (!st.fp)
+		{
+			wostringstream oss;
+			oss << m_name << L"_t" << m_frame << L"_c" << m_channel << L"_lv" << lv;
+			if (st.pack)
+				oss << L"_" << st.pack;
+			if (m_file_type == BRICK_FILE_TYPE_ZLIB)
+				oss << L".zlib";
+			else if (m_file_type == BRICK_FILE_TYPE_JPEG)
+				oss << L".jpg";
+			else
+				oss << L".raw";
+			st.filepath = oss.str();
+			st.fpos = 0;
+			if (!WFOPEN(&st.fp, (m_dir + st.filepath).c_str(), L"wb"))
+			{
+				st.fp = 0;
+				m_error = true;
+				break;
+			}
+		}
+		if (fwrite(&data[0], 1, data.size(), st.fp) != data.size())
+		{
+			m_error = true;
+			break;
+		}
+		FileDesc fd = stats[i];
+		fd.frame = m_frame;
+		fd.channel = m_channel;
+		fd.brick = first + i;
+		fd.filepath = st.filepath;
+		fd.offset = st.fpos;
+		fd.size = (long long)data.size();
+		lvd.files.push_back(fd);
+		st.fpos += fd.size;
+	}
+
+	//keep the overlapping slice for the next row
+	st.row++;
+	if (st.row < (int)lvd.rows.size())
+	{
+		int drop = lvd.bricks[lvd.rows[st.row]].z - st.z0;
+		size_t slice_size = (size_t)lvd.w * lvd.h * m_bytes;
+		st.slab.erase(st.slab.begin(), st.slab.begin() + slice_size*drop);
+		st.z0 += drop;
+		st.zn -= drop;
+	}
+	else
+	{
+		st.slab.clear();
+		st.zn = 0;
+	}
+}
+
+struct brkxml_jpeg_error_mgr
+{
+	struct jpeg_error_mgr pub;
+	jmp_buf setjmp_buffer;
+	unsigned char* mem;		//kept here to be freed after an error
+};
+
+METHODDEF(void) brkxml_jpeg_error_exit(j_common_ptr cinfo)
+{
+	(*cinfo->err->output_message) (cinfo);
+	longjmp(((brkxml_jpeg_error_mgr*)cinfo->err)->setjmp_buffer, 1);
+}
+
+//encode 8-bit data as a grayscale jpeg of w*h
+static bool JpegCompress(const unsigned char* in, int w, int h, int quality,
+	vector<unsigned char> &out)
+{
+	jpeg_compress_struct cinfo;
+	brkxml_jpeg_error_mgr jerr;
+	unsigned long mem_size = 0;
+	jerr.mem = NULL;
+	cinfo.err = jpeg_std_error(&jerr.pub);
+	jerr.pub.error_exit = brkxml_jpeg_error_exit;
+	if (setjmp(jerr.setjmp_buffer))
+	{
+		jpeg_destroy_compress(&cinfo);
+		if (jerr.mem)
+			free(jerr.mem);
+		return false;
+	}
+	jpeg_create_compress(&cinfo);
+	jpeg_mem_dest(&cinfo, &jerr.mem, &mem_size);
+	cinfo.image_width = w;
+	cinfo.image_height = h;
+	cinfo.input_components = 1;
+	cinfo.in_color_space = JCS_GRAYSCALE;
+	jpeg_set_defaults(&cinfo);
+	jpeg_set_quality(&cinfo, quality, TRUE);
+	jpeg_start_compress(&cinfo, TRUE);
+	while (cinfo.next_scanline < cinfo.image_height)
+	{
+		JSAMPROW row = (JSAMPROW)(in + (size_t)cinfo.next_scanline * w);
+		jpeg_write_scanlines(&cinfo, &row, 1);
+	}
+	jpeg_finish_compress(&cinfo);
+	out.assign(jerr.mem, jerr.mem + mem_size);
+	jpeg_destroy_compress(&cinfo);
+	free(jerr.mem);
+	return true;
+}
+
+bool BRKXMLWriter::CompressBrick(const unsigned char* src, int w, int h, int d,
+	vector<unsigned char> &out)
+{
+	size_t size = (size_t)w * h * d * m_bytes;
+	if (m_file_type == BRICK_FILE_TYPE_ZLIB)
+	{
+		uLongf len = compressBound((uLong)size);
+		out.resize(len);
+		if (compress2(&out[0], &len, src, (uLong)size, Z_DEFAULT_COMPRESSION) != Z_OK)
+			return false;
+		out.resize(len);
+	}
+	else if (m_file_type == BRICK_FILE_TYPE_JPEG)
+	{
+		//the slices are stacked vertically; the reader takes any shape of
+		//the same size, so rows are joined when the image gets too tall
+		int rows = h * d;
+		int k = 1;
+		while (rows / k > 65500 || rows % k)
+			k++;
+		return JpegCompress(src, w*k, rows/k, m_jpeg_quality, out);
+	}
+	else
+		out.assign(src, src + size);
+	return true;
+}
+
+void BRKXMLWriter::BrickStats(const unsigned char* src, size_t count,
+	int &minval, int &maxval, vector<long long> &hist)
+{
+	const unsigned short* src16 = (const unsigned short*)src;
+	minval = m_bytes==1?src[0]:src16[0];
+	maxval = minval;
+	for (size_t i = 1; i < count; i++)
+	{
+		int v = m_bytes==1?src[i]:src16[i];
+		minval = min(minval, v);
+		maxval = max(maxval, v);
+	}
+
+	hist.assign(BRICK_STAT_BINS, 0);
+	long long range = (long long)maxval - minval + 1;
+	for (size_t i = 0; i < count; i++)
+	{
+		int v = m_bytes==1?src[i]:src16[i];
+		hist[(size_t)((v - minval) * BRICK_STAT_BINS / range)]++;
+	}
+}
+
+void BRKXMLWriter::ClosePack(LevelState &state)
+{
+	if (state.fp)
+		fclose(state.fp);
+	state.fp = 0;
+}
+
+void BRKXMLWriter::WriteXML(wstring filename, int frames, int chans)
+{
+	const char* type_str = "RAW";
+	if (m_file_type == BRICK_FILE_TYPE_ZLIB)
+		type_str = "ZLIB";
+	else if (m_file_type == BRICK_FILE_TYPE_JPEG)
+		type_str = "JPEG";
+
+	m_doc.Clear();
+	m_doc.InsertEndChild(m_doc.NewDeclaration());
+	tinyxml2::XMLElement* root = m_doc.NewElement("BRK");
+	root->SetAttribute("nChannel", chans);
+	root->SetAttribute("nFrame", frames);
+	root->SetAttribute("nLevel", (int)m_levels.size());
+	m_doc.InsertEndChild(root);
+
+	//saved next to the vvd file
+	wstring stats_name = m_name + L"_stats.xml";
+	if (WriteStats(m_dir + stats_name))
+		root->SetAttribute("brickStatsPath", ws2s(stats_name).c_str());
+
+	for (int lv = 0; lv < (int)m_levels.size(); lv++)
+	{
+		LevelDesc &lvd = m_levels[lv];
+		tinyxml2::XMLElement* lvnode = m_doc.NewElement("Level");
+		lvnode->SetAttribute("lv", lv);
+		lvnode->SetAttribute("imageW", lvd.w);
+		lvnode->SetAttribute("imageH", lvd.h);
+		lvnode->SetAttribute("imageD", lvd.d);
+		lvnode->SetAttribute("xspc", lvd.xspc);
+		lvnode->SetAttribute("yspc", lvd.yspc);
+		lvnode->SetAttribute("zspc", lvd.zspc);
+		lvnode->SetAttribute("bitDepth", m_bytes*8);
+		lvnode->SetAttribute("FileType", type_str);
+		root->InsertEndChild(lvnode);
+
+		tinyxml2::XMLElement* bricks = m_doc.NewElement("Bricks");
+		bricks->SetAttribute("brick_baseW", lvd.bw);
+		bricks->SetAttribute("brick_baseH", lvd.bh);
+		bricks->SetAttribute("brick_baseD", lvd.bd);
+		lvnode->InsertEndChild(bricks);
+		for (size_t i = 0; i < lvd.bricks.size(); i++)
+		{
+			BrickDesc &b = lvd.bricks[i];
+			tinyxml2::XMLElement* brick = m_doc.NewElement("Brick");
+			brick->SetAttribute("id", b.id);
+			brick->SetAttribute("width", b.w);
+			brick->SetAttribute("height", b.h);
+			brick->SetAttribute("depth", b.d);
+			brick->SetAttribute("st_x", b.x);
+			brick->SetAttribute("st_y", b.y);
+			brick->SetAttribute("st_z", b.z);
+			tinyxml2::XMLElement* tbox = m_doc.NewElement("tbox");
+			tbox->SetAttribute("x0", b.tx0);
+			tbox->SetAttribute("y0", b.ty0);
+			tbox->SetAttribute("z0", b.tz0);
+			tbox->SetAttribute("x1", b.tx1);
+			tbox->SetAttribute("y1", b.ty1);
+			tbox->SetAttribute("z1", b.tz1);
+			brick->InsertEndChild(tbox);
+			tinyxml2::XMLElement* bbox = m_doc.NewElement("bbox");
+			bbox->SetAttribute("x0", b.bx0);
+			bbox->SetAttribute("y0", b.by0);
+			bbox->SetAttribute("z0", b.bz0);
+			bbox->SetAttribute("x1", b.bx1);
+			bbox->SetAttribute("y1", b.by1);
+			bbox->SetAttribute("z1", b.bz1);
+			brick->InsertEndChild(bbox);
+			bricks->InsertEndChild(brick);
+		}
+
+		tinyxml2::XMLElement* files = m_doc.NewElement("Files");
+		lvnode->InsertEndChild(files);
+		for (size_t i = 0; i < lvd.files.size(); i++)
+		{
+			FileDesc &fd = lvd.files[i];
+			tinyxml2::XMLElement* file = m_doc.NewElement("File");
+			file->SetAttribute("frame", fd.frame);
+			file->SetAttribute("channel", fd.channel);
+			file->SetAttribute("brickID", fd.brick);
+			file->SetAttribute("filepath", ws2s(fd.filepath).c_str());
+			file->SetAttribute("offset", (int)fd.offset);
+			file->SetAttribute("datasize", (int)fd.size);
+			file->SetAttribute("filetype", type_str);
+			files->InsertEndChild(file);
+		}
+	}
+
+	FILE *fp = NULL;
+	fp = WFOPEN(&fp, filename.c_str(), L"w");
+	if (fp)
+	{
+		if (m_doc.SaveFile(fp) != tinyxml2::XML_SUCCESS)
+			m_error = true;
+		fclose(fp);
+	}
+	else
+		m_error = true;
+}
+
+bool BRKXMLWriter::WriteStats(wstring filename)
+{
+	tinyxml2::XMLDocument doc;
+	doc.InsertEndChild(doc.NewDeclaration());
+	tinyxml2::XMLElement* root = doc.NewElement("BrickStats");
+	root->SetAttribute("bins", BRICK_STAT_BINS);
+	doc.InsertEndChild(root);
+
+	for (int lv = 0; lv < (int)m_levels.size(); lv++)
+	{
+		LevelDesc &lvd = m_levels[lv];
+		tinyxml2::XMLElement* lvnode = doc.NewElement("Level");
+		lvnode->SetAttribute("lv", lv);
+		root->InsertEndChild(lvnode);
+		for (size_t i = 0; i < lvd.files.size(); i++)
+		{
+			FileDesc &fd = lvd.files[i];
+			ostringstream oss;
+			for (size_t j = 0; j < fd.hist.size(); j++)
+				oss << (j?" ":"") << fd.hist[j];
+			tinyxml2::XMLElement* stat = doc.NewElement("Stat");
+			stat->SetAttribute("frame", fd.frame);
+			stat->SetAttribute("channel", fd.channel);
+			stat->SetAttribute("brickID", fd.brick);
+			stat->SetAttribute("min", fd.minval);
+			stat->SetAttribute("max", fd.maxval);
+			stat->SetAttribute("hist", oss.str().c_str());
+			lvnode->InsertEndChild(stat);
+		}
+	}
+
+	bool result = false;
+	FILE *fp = NULL;
+	fp = WFOPEN(&fp, filename.c_str(), L"w");
+	if (fp)
+	{
+		result = doc.SaveFile(fp) == tinyxml2::XML_SUCCESS;
+		fclose(fp);
+	}
+	return result;
 }
 
 class MyXMLVisitor: public tinyxml2::XMLVisitor
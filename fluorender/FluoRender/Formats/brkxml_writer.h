@@ -3,11 +3,23 @@
 
 #include <vector>
 #include <base_writer.h>
+#include <base_reader.h>
 #include <tinyxml2.h>
 #include <boost/property_tree/ptree.hpp>
 #include <boost/optional.hpp>
 #include <map>
 
+//same values as FLIVR/TextureBrick.h, which needs GL and can't be used headless
+#ifndef BRICK_FILE_TYPE_NONE
+#define BRICK_FILE_TYPE_NONE	0
+#define BRICK_FILE_TYPE_RAW		1
+#define BRICK_FILE_TYPE_JPEG	2
+#define BRICK_FILE_TYPE_ZLIB	3
+#endif
+#ifndef BRICK_STAT_BINS
+#define BRICK_STAT_BINS	16
+#endif
+
 class BRKXMLWriter : public BaseWriter
 {
 public:
@@ -16,8 +28,22 @@ public:
 
 	void SetData(Nrrd* data);
 	void SetSpacings(double spcx, double spcy, double spcz);
-	void SetCompression(bool value);
-	void Save(wstring filename, int mode);
+	void SetCompression(bool value);//true: zlib; false: raw
+	void Save(wstring filename, int mode);//build the pyramid and save bricks and vvd xml; mode is unused
+	bool GetError() {return m_error;}//true if the last Save failed
+	//convert all frames and channels of a reader
+	//the volume is read slab by slab, so it does not need to fit in memory
+	void SetReader(BaseReader* reader);
+	//BRICK_FILE_TYPE_RAW, BRICK_FILE_TYPE_ZLIB or BRICK_FILE_TYPE_JPEG
+	//jpeg only takes 8-bit data; 16-bit data is saved with zlib instead
+	void SetFileType(int type);
+	void SetJpegQuality(int quality);
+	//base brick size including the one-voxel overlap
+	void SetBrickSize(int w, int h, int d);
+	//maximum level number, 0 to build levels until one brick holds the volume
+	void SetMaxLevelNum(int num);
+	//threads cutting and compressing bricks
+	void SetThreadNum(int num);
 	//save only a vvd_xml file with metadata
 	void SaveVVDXML_Metadata(wstring filepath, tinyxml2::XMLDocument *vvd, tinyxml2::XMLDocument *metadata=NULL);
 	//save only a vvd_xml file with external metadata
@@ -30,9 +56,86 @@ private:
 	void buildROITreeXML(const boost::property_tree::wptree& tree, const map<int,vector<int>>& palette, const wstring& parent=wstring(), tinyxml2::XMLElement *lvNode=NULL);
 
 	Nrrd* m_data;
+	BaseReader* m_reader;
 	double m_spcx, m_spcy, m_spcz;
 	bool m_use_spacings;
 	bool m_compression;
+	int m_file_type;
+	int m_jpeg_quality;
+	int m_brick_w, m_brick_h, m_brick_d;
+	int m_max_level;
+	int m_thread_num;
+	long long m_pack_size;	//bricks are packed in files of up to this size
+
+	struct BrickDesc
+	{
+		int id;
+		int x, y, z;		//start position
+		int w, h, d;		//size
+		double tx0, ty0, tz0, tx1, ty1, tz1;//tbox
+		double bx0, by0, bz0, bx1, by1, bz1;//bbox
+	};
+	struct FileDesc
+	{
+		int frame;
+		int channel;
+		int brick;
+		wstring filepath;	//relative to the vvd file
+		long long offset;
+		long long size;
+		//value summary saved in the brick stats sidecar
+		int minval, maxval;
+		vector<long long> hist;
+	};
+	struct LevelDesc
+	{
+		int w, h, d;
+		int fx, fy, fz;		//downsampling factors from the previous level
+		double xspc, yspc, zspc;
+		int bw, bh, bd;		//base brick size
+		vector<BrickDesc> bricks;//z rows first, then y, then x
+		vector<int> rows;	//first brick of each z row
+		vector<FileDesc> files;
+	};
+	vector<LevelDesc> m_levels;
+
+	//streaming state of a level while one frame and channel is converted
+	struct LevelState
+	{
+		vector<unsigned char> slab;		//buffered slices from z0
+		int z0;
+		int zn;
+		int next_z;						//next slice to come
+		vector<unsigned char> pending;	//even slice waiting for its pair
+		int row;						//next brick row
+		FILE* fp;						//current pack file
+		wstring filepath;
+		int pack;
+		long long fpos;
+	};
+	vector<LevelState> m_states;
+	wstring m_dir;
+	wstring m_name;
+	int m_bytes;	//bytes per voxel
+	int m_frame;
+	int m_channel;
+	bool m_error;
+
+	void BuildLevels(int nx, int ny, int nz, double spcx, double spcy, double spcz);
+	void BuildBricks(LevelDesc &lvd);
+	bool WriteVolume(int t, int c);
+	//slices enter level 0 in order and flow down the pyramid
+	void FeedSlice(int lv, const unsigned char* slice);
+	void WriteBrickRow(int lv);
+	bool CompressBrick(const unsigned char* src, int w, int h, int d,
+		vector<unsigned char> &out);
+	//min, max and a histogram of BRICK_STAT_BINS bins from min to max
+	void BrickStats(const unsigned char* src, size_t count,
+		int &minval, int &maxval, vector<long long> &hist);
+	void ClosePack(LevelState &state);
+	void WriteXML(wstring filename, int frames, int chans);
+	//the brick stats sidecar, read by BRKXMLReader to skip empty bricks
+	bool WriteStats(wstring filename);
 	
 	tinyxml2::XMLDocument m_doc;
 	tinyxml2::XMLDocument m_md_doc;
@@ -29,6 +29,7 @@ DEALINGS IN THE SOFTWARE.
 #include "../compatibility.h"
 #include "lsm_reader.h"
 #include <sstream>
+#include <algorithm>
 
 //#include <fstream>
 //#include <bitset>
@@ -689,8 +690,6 @@ Nrrd* LSMReader::Convert(int t, int c, bool get_max)
    if (!WFOPEN(&pfile, m_path_name.c_str(), L"rb"))
       return 0;
 
-   int i, j;
-
    if (t>=0 && t<m_time_num &&
          c>=0 && c<m_chan_num &&
          m_slice_num > 0 &&
@@ -699,102 +698,187 @@ Nrrd* LSMReader::Convert(int t, int c, bool get_max)
          t<(int)m_lsm_info.size() &&
          c<(int)m_lsm_info[t].size())
    {
-      //allocate memory for nrrd
-      switch (m_datatype)
+      void *val = AllocChannel();
+      if (val)
       {
-      case 1://8-bit
-         {
-            unsigned long long mem_size = (unsigned long long)m_x_size*
-               (unsigned long long)m_y_size*(unsigned long long)m_slice_num;
-            unsigned char *val = new (std::nothrow) unsigned char[mem_size];
-            ChannelInfo *cinfo = &m_lsm_info[t][c];
-            for (i=0; i<(int)cinfo->size(); i++)
-            {
-               if (m_l4gb?  
-                     FSEEK64(pfile, ((uint64_t((*cinfo)[i].offset_high))<<32)+(*cinfo)[i].offset, SEEK_SET)==0:
-                     fseek(pfile, (*cinfo)[i].offset, SEEK_SET)==0)
-               {
-                  unsigned int val_pos = m_x_size*m_y_size*i;
-                  if (m_compression==1)
-                     fread(val+val_pos, sizeof(unsigned char), (*cinfo)[i].size, pfile);
-                  else if (m_compression==5)
-                  {
-                     unsigned char* tif = new (std::nothrow) unsigned char[(*cinfo)[i].size];
-                     fread(tif, sizeof(unsigned char), (*cinfo)[i].size, pfile);
-                     LZWDecode(tif, val+val_pos, (*cinfo)[i].size);
-                     for (j=0; j<m_y_size; j++)
-                        DecodeAcc8(val+val_pos+j*m_x_size, m_x_size,1);
-                     delete []tif;
-                  }
-               }
-            }
-            //create nrrd
-            data = nrrdNew();
-            nrrdWrap(data, val, nrrdTypeUChar, 3, (size_t)m_x_size, (size_t)m_y_size, (size_t)m_slice_num);
-            nrrdAxisInfoSet(data, nrrdAxisInfoSpacing, m_xspc, m_yspc, m_zspc);
-            nrrdAxisInfoSet(data, nrrdAxisInfoMax, m_xspc*m_x_size, m_yspc*m_y_size, m_zspc*m_slice_num);
-            nrrdAxisInfoSet(data, nrrdAxisInfoMin, 0.0, 0.0, 0.0);
-            nrrdAxisInfoSet(data, nrrdAxisInfoSize, (size_t)m_x_size, (size_t)m_y_size, (size_t)m_slice_num);
-         }
-         break;
-      case 2://16-bit
-      case 3:
-         {
-            unsigned long long mem_size = (unsigned long long)m_x_size*
-               (unsigned long long)m_y_size*(unsigned long long)m_slice_num;
-            unsigned short *val = new (std::nothrow) unsigned short[mem_size];
-            ChannelInfo *cinfo = &m_lsm_info[t][c];
-            for (i=0; i<(int)cinfo->size(); i++)
-            {
-               if (m_l4gb?
-                     FSEEK64(pfile, ((uint64_t((*cinfo)[i].offset_high))<<32)+(*cinfo)[i].offset, SEEK_SET)==0:
-                     fseek(pfile, (*cinfo)[i].offset, SEEK_SET)==0)
-               {
-                  unsigned int val_pos = m_x_size*m_y_size*i;
-                  if (m_compression==1)
-                     fread(val+val_pos, sizeof(unsigned char), (*cinfo)[i].size, pfile);
-                  else if (m_compression==5)
-                  {
-                     unsigned char* tif = new (std::nothrow) unsigned char[(*cinfo)[i].size];
-					 fread(tif, sizeof(unsigned char), (*cinfo)[i].size, pfile);
+         ChannelInfo *cinfo = &m_lsm_info[t][c];
+         for (int i=0; i<(int)cinfo->size(); i++)
+            ReadSlice(pfile, (*cinfo)[i], val, i);
+         data = WrapChannel(val);
+      }
+   }
 
-					 LZWDecode(tif, (tidata_t)(val+val_pos), (*cinfo)[i].size);
-/*
-					 ofstream ofs("lsm_c.txt");
-					 for (int k = 0; k < m_x_size; k++){
-						 ofs << ' ' << static_cast<std::bitset<8>>((val+val_pos)[k]);
-						 if (k % 16 == 15) ofs << '\n';
-					 }
-					 ofs.close();
-*/
-					 for (j=0; j<m_y_size; j++)
-                        DecodeAcc16((tidata_t)(val+val_pos+j*m_x_size), m_x_size*2,1);
-/*
-					 ofs.open("lsm_dec.txt");
-					 for (int k = 0; k < m_x_size; k++){
-						 ofs << ' ' << static_cast<std::bitset<8>>((val+val_pos)[k]);
-						 if (k % 16 == 15) ofs << '\n';
-					 }
-					 ofs.close();
-*/
-                     delete []tif;
-                  }
-               }
-            }
-            //create nrrd
-            data = nrrdNew();
-            nrrdWrap(data, val, nrrdTypeUShort, 3, (size_t)m_x_size, (size_t)m_y_size, (size_t)m_slice_num);
-            nrrdAxisInfoSet(data, nrrdAxisInfoSpacing, m_xspc, m_yspc, m_zspc);
-            nrrdAxisInfoSet(data, nrrdAxisInfoMax, m_xspc*m_x_size, m_yspc*m_y_size, m_zspc*m_slice_num);
-            nrrdAxisInfoSet(data, nrrdAxisInfoMin, 0.0, 0.0, 0.0);
-            nrrdAxisInfoSet(data, nrrdAxisInfoSize, (size_t)m_x_size, (size_t)m_y_size, (size_t)m_slice_num);
-         }
-         break;
+   fclose(pfile);
+
+   return data;
+}
+
+//the slices of all channels are stored next to each other in the file,
+//so reading them slice by slice walks the file once from front to back
+void LSMReader::ConvertAllChannels(int t, bool get_max, vector<Nrrd*> &data,
+      vector<double> &max_values, vector<double> &scalar_scales)
+{
+   data.assign(m_chan_num, 0);
+   max_values.assign(m_chan_num, m_max_value);
+   scalar_scales.assign(m_chan_num, m_scalar_scale);
+
+   if (t<0 || t>=m_time_num ||
+         m_slice_num <= 0 ||
+         m_x_size <= 0 ||
+         m_y_size <= 0 ||
+         t>=(int)m_lsm_info.size() ||
+         m_chan_num>(int)m_lsm_info[t].size())
+      return;
+
+   FILE* pfile = 0;
+   if (!WFOPEN(&pfile, m_path_name.c_str(), L"rb"))
+      return;
+
+   int c;
+   vector<void*> vals(m_chan_num, (void*)0);
+   for (c=0; c<m_chan_num; c++)
+      vals[c] = AllocChannel();
+   for (int i=0; i<m_slice_num; i++)
+   {
+      for (c=0; c<m_chan_num; c++)
+      {
+         ChannelInfo *cinfo = &m_lsm_info[t][c];
+         if (vals[c] && i<(int)cinfo->size())
+            ReadSlice(pfile, (*cinfo)[i], vals[c], i);
       }
    }
+   for (c=0; c<m_chan_num; c++)
+   {
+      if (vals[c])
+         data[c] = WrapChannel(vals[c]);
+   }
 
    fclose(pfile);
+}
 
+void* LSMReader::AllocChannel()
+{
+   unsigned long long mem_size = (unsigned long long)m_x_size*
+      (unsigned long long)m_y_size*(unsigned long long)m_slice_num;
+   switch (m_datatype)
+   {
+   case 1://8-bit
+      return new (std::nothrow) unsigned char[mem_size];
+   case 2://16-bit
+   case 3:
+      return new (std::nothrow) unsigned short[mem_size];
+   }
+   return 0;
+}
+
+void LSMReader::ReadSlice(FILE* pfile, SliceInfo &sinfo, void* val, int z,
+      int y0, int y1)
+{
+   int j;
+   bool eight_bit = m_datatype == 1;
+   unsigned long long val_pos = (unsigned long long)m_x_size*m_y_size*z;
+   tidata_t dst = eight_bit?
+      (tidata_t)((unsigned char*)val+val_pos):
+      (tidata_t)((unsigned short*)val+val_pos);
+   //uncompressed slices can skip the rows outside y0 to y1
+   unsigned int skip = 0;
+   unsigned int size = sinfo.size;
+   if (m_compression==1)
+   {
+      unsigned int row_size = m_x_size*(eight_bit?1:2);
+      if (y1 < 0 || y1 > m_y_size)
+         y1 = m_y_size;
+      skip = y0>0?y0*row_size:0;
+      if (skip >= sinfo.size)
+         return;
+      size = min(sinfo.size-skip, (y1-y0)*row_size);
+   }
+   if (!(m_l4gb?
+         FSEEK64(pfile, ((uint64_t(sinfo.offset_high))<<32)+sinfo.offset+skip, SEEK_SET)==0:
+         fseek(pfile, sinfo.offset+skip, SEEK_SET)==0))
+      return;
+
+   if (m_compression==1)
+      fread(dst+skip, sizeof(unsigned char), size, pfile);
+   else if (m_compression==5)
+   {
+      unsigned char* tif = new (std::nothrow) unsigned char[sinfo.size];
+      if (!tif)
+         return;
+      fread(tif, sizeof(unsigned char), sinfo.size, pfile);
+      LZWDecode(tif, dst, (tsize_t)m_x_size*m_y_size*(eight_bit?1:2));
+      for (j=0; j<m_y_size; j++)
+      {
+         if (eight_bit)
+            DecodeAcc8(dst+j*m_x_size, m_x_size, 1);
+         else
+            DecodeAcc16(dst+j*m_x_size*2, m_x_size*2, 1);
+      }
+      delete []tif;
+   }
+}
+
+Nrrd* LSMReader::ConvertRegion(int t, int c, bool get_max, VolumeRegion region)
+{
+   if (!(t>=0 && t<m_time_num &&
+         c>=0 && c<m_chan_num &&
+         m_slice_num > 0 &&
+         m_x_size > 0 &&
+         m_y_size > 0 &&
+         t<(int)m_lsm_info.size() &&
+         c<(int)m_lsm_info[t].size()))
+      return 0;
+   if (m_datatype != 1 && m_datatype != 2 && m_datatype != 3)
+      return 0;
+   region.Clip(m_x_size, m_y_size, m_slice_num);
+   if (region.IsEmpty())
+      return 0;
+
+   FILE* pfile = 0;
+   if (!WFOPEN(&pfile, m_path_name.c_str(), L"rb"))
+      return 0;
+
+   bool eight_bit = m_datatype == 1;
+   size_t elem_size = eight_bit?1:2;
+   unsigned long long mem_size = (unsigned long long)region.GetXSize()*
+      (unsigned long long)region.GetYSize()*(unsigned long long)region.GetZSize();
+   void* val = eight_bit?
+      (void*)(new (std::nothrow) unsigned char[mem_size]):
+      (void*)(new (std::nothrow) unsigned short[mem_size]);
+   vector<unsigned char> slice((size_t)m_x_size*m_y_size*elem_size);
+   if (!val)
+   {
+      fclose(pfile);
+      return 0;
+   }
+   memset(val, 0, mem_size*elem_size);
+
+   ChannelInfo *cinfo = &m_lsm_info[t][c];
+   int zi = 0;
+   for (int z=region.z0; z<region.z1; z+=region.sz, zi++)
+   {
+      if (z >= (int)cinfo->size())
+         break;
+      ReadSlice(pfile, (*cinfo)[z], &slice[0], 0, region.y0, region.y1);
+      CopyRegionSlice(&slice[0], m_x_size, elem_size, region, val, zi);
+   }
+
+   fclose(pfile);
+
+   return WrapRegion(val, eight_bit?nrrdTypeUChar:nrrdTypeUShort, region);
+}
+
+Nrrd* LSMReader::WrapChannel(void* val)
+{
+   Nrrd *data = nrrdNew();
+   if (m_datatype == 1)
+      nrrdWrap(data, val, nrrdTypeUChar, 3, (size_t)m_x_size, (size_t)m_y_size, (size_t)m_slice_num);
+   else
+      nrrdWrap(data, val, nrrdTypeUShort, 3, (size_t)m_x_size, (size_t)m_y_size, (size_t)m_slice_num);
+   nrrdAxisInfoSet(data, nrrdAxisInfoSpacing, m_xspc, m_yspc, m_zspc);
+   nrrdAxisInfoSet(data, nrrdAxisInfoMax, m_xspc*m_x_size, m_yspc*m_y_size, m_zspc*m_slice_num);
+   nrrdAxisInfoSet(data, nrrdAxisInfoMin, 0.0, 0.0, 0.0);
+   nrrdAxisInfoSet(data, nrrdAxisInfoSize, (size_t)m_x_size, (size_t)m_y_size, (size_t)m_slice_num);
    return data;
 }
 
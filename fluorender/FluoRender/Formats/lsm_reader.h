@@ -51,12 +51,16 @@ public:
 	void SetBatch(bool batch);
 	int LoadBatch(int index);
 	Nrrd* Convert(int t, int c, bool get_max);
+	void ConvertAllChannels(int t, bool get_max, vector<Nrrd*> &data,
+		vector<double> &max_values, vector<double> &scalar_scales);
+	Nrrd* ConvertRegion(int t, int c, bool get_max, VolumeRegion region);
 	wstring GetCurName(int t, int c);
 
 	wstring GetPathName() {return m_path_name;}
 	wstring GetDataName() {return m_data_name;}
 	int GetTimeNum() {return m_time_num;}
 	int GetCurTime() {return m_cur_time;}
+	void SetCurTime(int t) {m_cur_time = t;}
 	int GetChanNum() {return m_chan_num;}
 	double GetExcitationWavelength(int chan);
 	int GetSliceNum() {return m_slice_num;}
@@ -117,6 +121,13 @@ private:
 
 private:
 	void ReadLsmInfo(FILE* pfile, unsigned char* pdata, unsigned int size);
+	//allocate the voxels of one channel, 0 if the data type is not supported
+	void* AllocChannel();
+	//read and decode one slice of a channel into z of its volume
+	//only rows y0 to y1 are needed, y1<0 for all the rows
+	void ReadSlice(FILE* pfile, SliceInfo &sinfo, void* val, int z,
+		int y0=0, int y1=-1);
+	Nrrd* WrapChannel(void* val);
 
 };
 
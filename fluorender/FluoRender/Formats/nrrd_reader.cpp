@@ -109,6 +109,10 @@ void NRRDReader::Preprocess()
 			begin = -1;
 	}
 	//build 4d sequence
+	bool save_index = false;
+	SeqIndex index(path);
+	wstring key = L"nrrd:" + name.substr(0, begin+id_len+1);
+	vector<SeqIndex::GroupInfo> groups;
 	if (begin == -1 || !m_enable_4d_seq)
 	{
 		TimeDataInfo info;
@@ -117,6 +121,19 @@ void NRRDReader::Preprocess()
 		m_4d_seq.push_back(info);
 		m_cur_time = 0;
 	}
+	else if (index.Load(key, groups))
+	{
+		//sorted sequence from the sidecar index
+		for (size_t i = 0; i < groups.size(); i++)
+		{
+			if (groups[i].files.empty())
+				continue;
+			TimeDataInfo info;
+			info.filenumber = groups[i].number;
+			info.filename = groups[i].files[0].name;
+			m_4d_seq.push_back(info);
+		}
+	}
 	else
 	{
 		//search time sequence files
@@ -133,10 +150,23 @@ void NRRDReader::Preprocess()
 			info.filename = list.at(i);
 			m_4d_seq.push_back(info);
 		}
+		save_index = true;
 	}
 	if (m_4d_seq.size() > 0)
 	{
 		std::sort(m_4d_seq.begin(), m_4d_seq.end(), NRRDReader::nrrd_sort);
+		if (save_index)
+		{
+			groups.resize(m_4d_seq.size());
+			for (size_t i = 0; i < m_4d_seq.size(); i++)
+			{
+				groups[i].number = m_4d_seq[i].filenumber;
+				groups[i].files.resize(1);
+				groups[i].files[0].name = m_4d_seq[i].filename;
+				groups[i].files[0].number = m_4d_seq[i].filenumber;
+			}
+			index.Save(key, groups);
+		}
 		for (int t=0; t<(int)m_4d_seq.size(); t++)
 		{
 			if (m_4d_seq[t].filename == m_path_name)
@@ -153,6 +183,8 @@ void NRRDReader::Preprocess()
 	m_chan_num = 1;
 	//get time number
 	m_time_num = (int)m_4d_seq.size();
+	m_short_min.assign(m_time_num, -1);
+	m_short_max.assign(m_time_num, -1);
 }
 
 void NRRDReader::SetSliceSeq(bool ss)
@@ -220,8 +252,6 @@ Nrrd* NRRDReader::Convert(int t, int c, bool get_max)
 	if (t<0 || t>=m_time_num)
 		return 0;
 
-	size_t i;
-
 	wstring str_name = m_4d_seq[t].filename;
 	m_data_name = str_name.substr(str_name.find_last_of(GETSLASH())+1);
 	FILE* nrrd_file = 0;
@@ -246,6 +276,185 @@ Nrrd* NRRDReader::Convert(int t, int c, bool get_max)
 		return 0;
 	}
 
+	ReadSizeSpacing(output);
+
+	size_t voxelnum = (size_t)m_slice_num * (size_t)m_x_size * (size_t)m_y_size;
+    size_t data_size = voxelnum;
+	if (output->type == nrrdTypeUShort || output->type == nrrdTypeShort)
+		data_size *= 2;
+	output->data = new unsigned char[data_size];
+
+	//if (data_size >= 1073741824UL)
+	//	get_max = false;
+
+	if (nrrdRead(output, nrrd_file, NULL))
+	{
+		delete [] output->data;
+		nrrdNix(output);
+		fclose(nrrd_file);
+		return 0;
+	}
+	
+	if (output->dim == 2)
+	{
+		output->dim = 3;
+		output->axis[2].size = 1;
+		output->axis[2].spacing = 1.0;
+		output->axis[0].spaceDirection[2] = 0.0;
+		output->axis[1].spaceDirection[2] = 0.0;
+		output->axis[2].spaceDirection[0] = 0.0;
+		output->axis[2].spaceDirection[1] = 0.0;
+		output->axis[2].spaceDirection[2] = 1.0;
+	}
+
+	if (!ToUnsigned(output, voxelnum, get_max))
+	{
+		delete []output->data;
+		nrrdNix(output);
+		fclose(nrrd_file);
+		return 0;
+	}
+
+	m_cur_time = t;
+	fclose(nrrd_file);
+
+	SetInfo();
+
+	return output;
+}
+
+//raw data attached to the header is read row by row in place,
+//other encodings have to be decoded whole
+Nrrd* NRRDReader::ConvertRegion(int t, int c, bool get_max, VolumeRegion region)
+{
+	if (t<0 || t>=m_time_num)
+		return 0;
+
+	wstring str_name = m_4d_seq[t].filename;
+	m_data_name = str_name.substr(str_name.find_last_of(GETSLASH())+1);
+	FILE* nrrd_file = 0;
+	if (!WFOPEN(&nrrd_file, str_name.c_str(), L"rb"))
+		return 0;
+
+	Nrrd *header = nrrdNew();
+	NrrdIoState *nio = nrrdIoStateNew();
+	nrrdIoStateSet(nio, nrrdIoStateSkipData, AIR_TRUE);
+	if (nrrdRead(header, nrrd_file, nio))
+	{
+		nrrdIoStateNix(nio);
+		nrrdNix(header);
+		fclose(nrrd_file);
+		return 0;
+	}
+	bool in_place = nio->encoding == nrrdEncodingRaw &&
+		nio->dataFNArr->len == 0 &&
+		(header->dim == 3 || header->dim == 2) &&
+		(header->type == nrrdTypeUChar || header->type == nrrdTypeChar ||
+		header->type == nrrdTypeUShort || header->type == nrrdTypeShort);
+	bool swap = nio->endian != airEndianUnknown && nio->endian != airMyEndian;
+	int64_t data_offset = FTELL64(nrrd_file);
+	nio = nrrdIoStateNix(nio);
+	if (!in_place || data_offset < 0)
+	{
+		nrrdNix(header);
+		fclose(nrrd_file);
+		return BaseReader::ConvertRegion(t, c, get_max, region);
+	}
+
+	ReadSizeSpacing(header);
+	region.Clip(m_x_size, m_y_size, m_slice_num);
+	if (region.IsEmpty())
+	{
+		nrrdNix(header);
+		fclose(nrrd_file);
+		return 0;
+	}
+
+	size_t elem_size = nrrdElementSize(header);
+	size_t rx = region.GetXSize();
+	size_t ry = region.GetYSize();
+	size_t voxelnum = rx * ry * (size_t)region.GetZSize();
+	unsigned char* val = new (std::nothrow) unsigned char[voxelnum*elem_size];
+	if (!val)
+	{
+		nrrdNix(header);
+		fclose(nrrd_file);
+		return 0;
+	}
+	memset(val, 0, voxelnum*elem_size);
+
+	//whole rows of consecutive lines are read with one call per slice
+	bool whole_rows = region.x0 == 0 && region.x1 == m_x_size &&
+		region.sx == 1 && region.sy == 1;
+	size_t row_len = (rx-1)*region.sx+1;
+	vector<unsigned char> row(row_len*elem_size);
+	unsigned char* out = val;
+	for (int z=region.z0; z<region.z1; z+=region.sz)
+	{
+		if (whole_rows)
+		{
+			int64_t pos = data_offset +
+				((int64_t)z*m_y_size + region.y0)*m_x_size*elem_size;
+			if (FSEEK64(nrrd_file, pos, SEEK_SET)==0)
+				fread(out, elem_size, rx*ry, nrrd_file);
+			out += rx*ry*elem_size;
+			continue;
+		}
+		for (int y=region.y0; y<region.y1; y+=region.sy)
+		{
+			int64_t pos = data_offset +
+				(((int64_t)z*m_y_size + y)*m_x_size + region.x0)*elem_size;
+			if (FSEEK64(nrrd_file, pos, SEEK_SET)==0)
+			{
+				if (region.sx == 1)
+					fread(out, elem_size, rx, nrrd_file);
+				else if (fread(&row[0], elem_size, row_len, nrrd_file) == row_len)
+				{
+					for (size_t x=0; x<rx; x++)
+						memcpy(out+x*elem_size, &row[x*region.sx*elem_size], elem_size);
+				}
+			}
+			out += rx*elem_size;
+		}
+	}
+	int type = header->type;
+	//signed data is shifted by the min of the frame, not of the region
+	int range[2] = {-1, -1};
+	if (type == nrrdTypeShort &&
+		t < (int)m_short_min.size() &&
+		(m_short_min[t] >= 0 ||
+		ReadShortRange(nrrd_file, data_offset, swap, t)))
+	{
+		range[0] = m_short_min[t];
+		range[1] = m_short_max[t];
+	}
+	fclose(nrrd_file);
+
+	if (swap && elem_size == 2)
+	{
+		unsigned short* sval = (unsigned short*)val;
+		for (size_t i=0; i<voxelnum; i++)
+			sval[i] = (sval[i]>>8) | (sval[i]<<8);
+	}
+
+	nrrdNix(header);
+	Nrrd *output = WrapRegion(val, type, region);
+	if (!ToUnsigned(output, voxelnum, get_max, range[0]>=0?range:NULL))
+	{
+		delete []val;
+		nrrdNix(output);
+		return 0;
+	}
+
+	m_cur_time = t;
+
+	SetInfo();
+
+	return output;
+}
+
+void NRRDReader::ReadSizeSpacing(Nrrd* output)
+{
 	if (output->dim == 2)
 	{
 		output->axis[2].size = 1;
@@ -297,35 +506,41 @@ Nrrd* NRRDReader::Convert(int t, int c, bool get_max)
 		m_yspc = 1.0;
 		m_zspc = 1.0;
 	}
-	size_t voxelnum = (size_t)m_slice_num * (size_t)m_x_size * (size_t)m_y_size;
-    size_t data_size = voxelnum;
-	if (output->type == nrrdTypeUShort || output->type == nrrdTypeShort)
-		data_size *= 2;
-	output->data = new unsigned char[data_size];
-
-	//if (data_size >= 1073741824UL)
-	//	get_max = false;
+}
 
-	if (nrrdRead(output, nrrd_file, NULL))
-	{
-		delete [] output->data;
-		nrrdNix(output);
-		fclose(nrrd_file);
-		return 0;
-	}
-	
-	if (output->dim == 2)
+//one pass over the raw data of a frame
+bool NRRDReader::ReadShortRange(FILE* nrrd_file, int64_t data_offset, bool swap, int t)
+{
+	if (FSEEK64(nrrd_file, data_offset, SEEK_SET) != 0)
+		return false;
+	size_t total = (size_t)m_slice_num * (size_t)m_x_size * (size_t)m_y_size;
+	vector<unsigned short> buf((size_t)min(total, (size_t)1<<20));
+	int min_value = 65535, max_value = 0;
+	while (total > 0)
 	{
-		output->dim = 3;
-		output->axis[2].size = 1;
-		output->axis[2].spacing = 1.0;
-		output->axis[0].spaceDirection[2] = 0.0;
-		output->axis[1].spaceDirection[2] = 0.0;
-		output->axis[2].spaceDirection[0] = 0.0;
-		output->axis[2].spaceDirection[1] = 0.0;
-		output->axis[2].spaceDirection[2] = 1.0;
+		size_t num = min(total, buf.size());
+		if (fread(&buf[0], 2, num, nrrd_file) != num)
+			return false;
+		for (size_t i=0; i<num; i++)
+		{
+			unsigned short v = buf[i];
+			if (swap)
+				v = (v>>8) | (v<<8);
+			int n = (short)v + 32768;
+			min_value = n < min_value ? n : min_value;
+			max_value = n > max_value ? n : max_value;
+		}
+		total -= num;
 	}
+	m_short_min[t] = min_value;
+	m_short_max[t] = max_value;
+	return true;
+}
 
+//turn signed data into unsigned and find the max value
+bool NRRDReader::ToUnsigned(Nrrd* output, size_t voxelnum, bool get_max, const int* range)
+{
+	size_t i;
 	// turn signed into unsigned
 	if (output->type == nrrdTypeChar) {
 		for (i=0; i<voxelnum; i++) {
@@ -338,13 +553,20 @@ Nrrd* NRRDReader::Convert(int t, int c, bool get_max)
 	m_max_value = 0.0;
 	// turn signed into unsigned
 	unsigned short min_value = 32768, n;
+	if (range && output->type == nrrdTypeShort)
+	{
+		min_value = (unsigned short)range[0];
+		m_max_value = range[1];
+		get_max = false;
+	}
 	if (output->type == nrrdTypeShort || (output->type == nrrdTypeUShort && get_max)) {
 		for (i=0; i<voxelnum; i++) {
 			if (output->type == nrrdTypeShort) {
 				short val = ((short*)output->data)[i];
 				n = val + 32768;
 				((unsigned short*)output->data)[i] = n;
-				min_value = (n < min_value)?n:min_value;
+				if (!range)
+					min_value = (n < min_value)?n:min_value;
 			} else {
 				n =  ((unsigned short*)output->data)[i];
 			}
@@ -384,19 +606,9 @@ Nrrd* NRRDReader::Convert(int t, int c, bool get_max)
         }
 	}
 	else
-	{
-		delete []output->data;
-		nrrdNix(output);
-		fclose(nrrd_file);
-		return 0;
-	}
-
-	m_cur_time = t;
-	fclose(nrrd_file);
+		return false;
 
-	SetInfo();
-
-	return output;
+	return true;
 }
 
 bool NRRDReader::nrrd_sort(const TimeDataInfo& info1, const TimeDataInfo& info2)
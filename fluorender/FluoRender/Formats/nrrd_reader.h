@@ -29,6 +29,7 @@ DEALINGS IN THE SOFTWARE.
 #define _NRRD_READER_H_
 
 #include <base_reader.h>
+#include <seq_index.h>
 #include <stdio.h>
 //#include <windows.h>
 #include <vector>
@@ -53,12 +54,14 @@ public:
 	void SetBatch(bool batch);
 	int LoadBatch(int index);
 	Nrrd* Convert(int t, int c, bool get_max);
+	Nrrd* ConvertRegion(int t, int c, bool get_max, VolumeRegion region);
 	wstring GetCurName(int t, int c);
 
 	wstring GetPathName() {return m_path_name;}
 	wstring GetDataName() {return m_data_name;}
 	int GetTimeNum() {return m_time_num;}
 	int GetCurTime() {return m_cur_time;}
+	void SetCurTime(int t) {m_cur_time = t;}
 	int GetChanNum() {return m_chan_num;}
 	double GetExcitationWavelength(int chan) {return 0.0;}
 	int GetSliceNum() {return m_slice_num;}
@@ -102,10 +105,22 @@ private:
 	//time sequence id
 	wstring m_time_id;
 
+	//min and max of signed 16-bit frames after the shift to unsigned,
+	//-1 if not read yet. regions of a frame are all shifted by its min
+	vector<int> m_short_min;
+	vector<int> m_short_max;
+
 	bool m_enable_4d_seq;
 
 private:
 	static bool nrrd_sort(const TimeDataInfo& info1, const TimeDataInfo& info2);
+	//read sizes and spacings from the header
+	void ReadSizeSpacing(Nrrd* output);
+	//range: min and max of the whole frame for signed 16-bit data,
+	//NULL to use the ones of output
+	bool ToUnsigned(Nrrd* output, size_t voxelnum, bool get_max, const int* range=NULL);
+	//find the range of a signed 16-bit frame stored raw at data_offset
+	bool ReadShortRange(FILE* nrrd_file, int64_t data_offset, bool swap, int t);
 };
 
 #endif//_NRRD_READER_H_
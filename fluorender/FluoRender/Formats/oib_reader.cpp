@@ -762,15 +762,7 @@ Nrrd *OIBReader::Convert(int t, int c, bool get_max)
 			if (val && sl_num == m_slice_num)
 			{
 				//ok
-				data = nrrdNew();
-				nrrdWrap(data, val, nrrdTypeUShort, 3, (size_t)m_x_size, (size_t)m_y_size, 
-					(size_t)m_slice_num);
-				nrrdAxisInfoSet(data, nrrdAxisInfoSpacing, m_xspc, m_yspc, m_zspc);
-				nrrdAxisInfoSet(data, nrrdAxisInfoMax, m_xspc*m_x_size, m_yspc*m_y_size, 
-					m_zspc*m_slice_num);
-				nrrdAxisInfoSet(data, nrrdAxisInfoMin, 0.0, 0.0, 0.0);
-				nrrdAxisInfoSet(data, nrrdAxisInfoSize, (size_t)m_x_size,
-					(size_t)m_y_size, (size_t)m_slice_num);
+				data = WrapChannel(val);
 			} else {
 				//something is wrong
 				if (val)
@@ -788,6 +780,163 @@ Nrrd *OIBReader::Convert(int t, int c, bool get_max)
 	return data;
 }
 
+//the storage is opened and its directory parsed once for all channels,
+//then the slice streams are read slice by slice, one channel after another
+void OIBReader::ConvertAllChannels(int t, bool get_max, vector<Nrrd*> &data,
+	vector<double> &max_values, vector<double> &scalar_scales)
+{
+	data.assign(m_chan_num, 0);
+	max_values.assign(m_chan_num, m_max_value);
+	scalar_scales.assign(m_chan_num, m_scalar_scale);
+
+	if (!(t>=0 && t<m_time_num &&
+		m_chan_num > 0 &&
+		m_slice_num > 0 &&
+		m_x_size > 0 &&
+		m_y_size > 0) ||
+		m_chan_num > (int)m_oib_info[t].dataset.size())
+		return;
+
+	wstring path_name = m_type==0?m_path_name:m_oib_info[t].filename;
+	POLE::Storage pStg(ws2s(path_name).c_str());
+	if (!pStg.open())
+		return;
+
+	int c;
+	unsigned long long mem_size = (unsigned long long)m_x_size*
+		(unsigned long long)m_y_size*(unsigned long long)m_slice_num;
+	vector<unsigned short*> vals(m_chan_num, (unsigned short*)0);
+	vector<int> sl_nums(m_chan_num, 0);
+	for (c=0; c<m_chan_num; c++)
+		vals[c] = new (std::nothrow) unsigned short[mem_size];
+	//one buffer is reused for the streams
+	vector<unsigned char> stream_data;
+
+	std::list<std::string> entries = pStg.entries();
+	for (std::list<std::string>::iterator it = entries.begin();
+		it != entries.end(); ++it)
+	{
+		if (!pStg.isDirectory(*it))
+			continue;
+		size_t stream_num = pStg.GetAllStreams(*it).size();
+		for (int z=0; z<m_slice_num && z<int(stream_num); z++)
+		{
+			for (c=0; c<m_chan_num; c++)
+			{
+				ChannelInfo *cinfo = &m_oib_info[t].dataset[c];
+				if (!vals[c] || z >= int(cinfo->size()))
+					continue;
+				std::string name = (*it) + std::string("/") + ws2s((*cinfo)[z].stream_name);
+				POLE::Stream pStm(&pStg, name);
+				if (pStm.eof() || pStm.fail())
+					continue;
+				size_t sz = pStm.size();
+				if (stream_data.size() < sz)
+					stream_data.resize(sz);
+				if (sz && pStm.read(&stream_data[0], sz))
+				{
+					ReadTiff(&stream_data[0], vals[c], z);
+					sl_nums[c]++;
+				}
+			}
+		}
+	}
+	pStg.close();
+
+	if (m_max_value > 0.0)
+		m_scalar_scale = 65535.0 / m_max_value;
+
+	for (c=0; c<m_chan_num; c++)
+	{
+		if (vals[c] && sl_nums[c] == m_slice_num)
+			data[c] = WrapChannel(vals[c]);
+		else if (vals[c])
+			delete []vals[c];
+		max_values[c] = m_max_value;
+		scalar_scales[c] = m_scalar_scale;
+	}
+
+	m_cur_time = t;
+}
+
+Nrrd* OIBReader::WrapChannel(unsigned short *val)
+{
+	Nrrd *data = nrrdNew();
+	nrrdWrap(data, val, nrrdTypeUShort, 3, (size_t)m_x_size, (size_t)m_y_size,
+		(size_t)m_slice_num);
+	nrrdAxisInfoSet(data, nrrdAxisInfoSpacing, m_xspc, m_yspc, m_zspc);
+	nrrdAxisInfoSet(data, nrrdAxisInfoMax, m_xspc*m_x_size, m_yspc*m_y_size,
+		m_zspc*m_slice_num);
+	nrrdAxisInfoSet(data, nrrdAxisInfoMin, 0.0, 0.0, 0.0);
+	nrrdAxisInfoSet(data, nrrdAxisInfoSize, (size_t)m_x_size,
+		(size_t)m_y_size, (size_t)m_slice_num);
+	return data;
+}
+
+//only the streams of the requested slices are read
+Nrrd* OIBReader::ConvertRegion(int t, int c, bool get_max, VolumeRegion region)
+{
+	if (!(t>=0 && t<m_time_num &&
+		c>=0 && c<m_chan_num &&
+		m_slice_num > 0 &&
+		m_x_size > 0 &&
+		m_y_size > 0))
+		return 0;
+	region.Clip(m_x_size, m_y_size, m_slice_num);
+	if (region.IsEmpty())
+		return 0;
+
+	wstring path_name = m_type==0?m_path_name:m_oib_info[t].filename;
+	POLE::Storage pStg(ws2s(path_name).c_str());
+	if (!pStg.open())
+		return 0;
+
+	unsigned long long mem_size = (unsigned long long)region.GetXSize()*
+		(unsigned long long)region.GetYSize()*(unsigned long long)region.GetZSize();
+	unsigned short *val = new (std::nothrow) unsigned short[mem_size];
+	if (!val)
+	{
+		pStg.close();
+		return 0;
+	}
+	memset(val, 0, mem_size*sizeof(unsigned short));
+	vector<unsigned short> slice((size_t)m_x_size*m_y_size);
+
+	ChannelInfo *cinfo = &m_oib_info[t].dataset[c];
+	std::list<std::string> entries = pStg.entries();
+	for (std::list<std::string>::iterator it = entries.begin();
+		it != entries.end(); ++it)
+	{
+		if (!pStg.isDirectory(*it))
+			continue;
+		int zi = 0;
+		for (int z=region.z0; z<region.z1 && z<int(cinfo->size()); z+=region.sz, zi++)
+		{
+			std::string name = (*it) + std::string("/") + ws2s((*cinfo)[z].stream_name);
+			POLE::Stream pStm(&pStg, name);
+			if (pStm.eof() || pStm.fail())
+				continue;
+			size_t sz = pStm.size();
+			unsigned char *pbyData = new (std::nothrow) unsigned char[sz];
+			if (!pbyData)
+				continue;
+			if (pStm.read(pbyData, sz))
+			{
+				ReadTiff(pbyData, &slice[0], 0);
+				CopyRegionSlice(&slice[0], m_x_size, sizeof(unsigned short), region, val, zi);
+			}
+			delete[] pbyData;
+		}
+	}
+	pStg.close();
+
+	if (m_max_value > 0.0)
+		m_scalar_scale = 65535.0 / m_max_value;
+
+	m_cur_time = t;
+	return WrapRegion(val, nrrdTypeUShort, region);
+}
+
 wstring OIBReader::GetCurName(int t, int c)
 {
    return m_type==0?wstring(L""):m_oib_info[t].filename;
@@ -54,12 +54,16 @@ class OIBReader : public BaseReader
       void SetBatch(bool batch);
 	  int LoadBatch(int index);
       Nrrd* Convert(int t, int c, bool get_max);
+      void ConvertAllChannels(int t, bool get_max, vector<Nrrd*> &data,
+         vector<double> &max_values, vector<double> &scalar_scales);
+      Nrrd* ConvertRegion(int t, int c, bool get_max, VolumeRegion region);
       wstring GetCurName(int t, int c);
 
       wstring GetPathName() {return m_path_name;}
       wstring GetDataName() {return m_data_name;}
       int GetTimeNum() {return m_time_num;}
       int GetCurTime() {return m_cur_time;}
+      void SetCurTime(int t) {m_cur_time = t;}
       int GetChanNum() {return m_chan_num;}
       double GetExcitationWavelength(int chan);
       int GetSliceNum() {return m_slice_num;}
@@ -130,6 +134,7 @@ class OIBReader : public BaseReader
 	void ReadOibInfo(unsigned char* pbyData, size_t size);
 	void ReadOif(unsigned char* pbyData, size_t size);
 	void ReadTiff(unsigned char* pbyData, unsigned short *val, int z);
+	Nrrd* WrapChannel(unsigned short *val);
 };
 
 #endif//_OIB_READER_H_
@@ -118,26 +118,46 @@ void OIFReader::Preprocess()
    }
    else
    {
-      //search time sequence files
-      std::vector<std::wstring> list;
-      int tmp = 0;
-      FIND_FILES(path,L".oif",list,tmp,name.substr(0,begin+id_len+1));
-      for(size_t i = 0; i < list.size(); i++) {
-         size_t start_idx = list.at(i).find(m_time_id) + id_len;
-         size_t end_idx   = list.at(i).find(L".oif");
-         size_t size = end_idx - start_idx;
-         std::wstring fileno = list.at(i).substr(start_idx, size);
-         TimeDataInfo info;
-         info.filenumber = WSTOI(fileno);
-         info.filename = list.at(i);
-         m_oif_info.push_back(info);
+      SeqIndex index(path);
+      wstring key = L"oif:" + name.substr(0,begin+id_len+1);
+      vector<SeqIndex::GroupInfo> groups;
+      bool indexed = index.Load(key, groups);
+      if (indexed)
+      {
+         //sorted sequence from the sidecar index
+         for (size_t i = 0; i < groups.size(); i++)
+         {
+            TimeDataInfo info;
+            info.filenumber = groups[i].number;
+            info.filename = groups[i].name;
+            m_oif_info.push_back(info);
+         }
+      }
+      else
+      {
+         //search time sequence files
+         std::vector<std::wstring> list;
+         int tmp = 0;
+         FIND_FILES(path,L".oif",list,tmp,name.substr(0,begin+id_len+1));
+         for(size_t i = 0; i < list.size(); i++) {
+            size_t start_idx = list.at(i).find(m_time_id) + id_len;
+            size_t end_idx   = list.at(i).find(L".oif");
+            size_t size = end_idx - start_idx;
+            std::wstring fileno = list.at(i).substr(start_idx, size);
+            TimeDataInfo info;
+            info.filenumber = WSTOI(fileno);
+            info.filename = list.at(i);
+            m_oif_info.push_back(info);
+         }
       }
 
       if (m_oif_info.size() > 0)
       {
          m_type = 1;
          std::sort(m_oif_info.begin(), m_oif_info.end(), OIFReader::oif_sort);
-         ReadSequenceOif();
+         ReadSequenceOif(groups);
+         if (!indexed)
+            index.Save(key, groups);
       }
       else
       {
@@ -173,8 +193,11 @@ void OIFReader::ReadSingleOif()
       ReadTifSequence(list.at(f));
 }
 
-void OIFReader::ReadSequenceOif()
+void OIFReader::ReadSequenceOif(vector<SeqIndex::GroupInfo> &groups)
 {
+   bool scan = groups.size() != m_oif_info.size();
+   if (scan)
+      groups.resize(m_oif_info.size());
    for (int i=0; i<(int)m_oif_info.size(); i++)
    {
       wstring path_name = m_oif_info[i].filename;
@@ -185,7 +208,23 @@ void OIFReader::ReadSequenceOif()
 
       m_subdir_name = path_name + L".files" + GETSLASH();
       std::vector<std::wstring> list;
-      FIND_FILES(m_subdir_name,L".tif",list,m_oif_t);
+      if (scan)
+      {
+         FIND_FILES(m_subdir_name,L".tif",list,m_oif_t);
+         groups[i].number = m_oif_info[i].filenumber;
+         groups[i].name = path_name;
+         groups[i].files.resize(list.size());
+         for(size_t f = 0; f < list.size(); f++)
+         {
+            groups[i].files[f].name = list.at(f);
+            groups[i].files[f].number = int(f);
+         }
+      }
+      else
+      {
+         for(size_t f = 0; f < groups[i].files.size(); f++)
+            list.push_back(groups[i].files[f].name);
+      }
       //read file sequence
       for(size_t f = 0; f < list.size(); f++)
          ReadTifSequence(list.at(f), i);
@@ -672,6 +711,62 @@ Nrrd* OIFReader::Convert(int t, int c, bool get_max)
    return data;
 }
 
+//only the files of the sampled slices are read
+Nrrd* OIFReader::ConvertRegion(int t, int c, bool get_max, VolumeRegion region)
+{
+   if (!(t>=0 && t<m_time_num &&
+         c>=0 && c<m_chan_num &&
+         m_slice_num>0 &&
+         m_x_size>0 &&
+         m_y_size>0))
+      return 0;
+   region.Clip(m_x_size, m_y_size, m_slice_num);
+   if (region.IsEmpty())
+      return 0;
+
+   unsigned long long mem_size = (unsigned long long)region.GetXSize()*
+      (unsigned long long)region.GetYSize()*(unsigned long long)region.GetZSize();
+   unsigned short *val = new (std::nothrow) unsigned short[mem_size];
+   if (!val)
+      return 0;
+   memset(val, 0, mem_size*sizeof(unsigned short));
+   vector<unsigned short> slice((size_t)m_x_size*m_y_size);
+
+   ChannelInfo *cinfo = &m_oif_info[t].dataset[c];
+   int zi = 0;
+   for (int z=region.z0; z<region.z1 && z<int(cinfo->size()); z+=region.sz, zi++)
+   {
+      wstring file_name = (*cinfo)[z];
+
+      //open file
+      ifstream is;
+#ifdef _WIN32
+      is.open(file_name.c_str(), ios::binary);
+#else
+      is.open(ws2s(file_name).c_str(), ios::binary);
+#endif
+      if (!is.is_open())
+         continue;
+      is.seekg(0, ios::end);
+      size_t size = is.tellg();
+      char *pbyData = new char[size];
+      is.seekg(0, ios::beg);
+      is.read(pbyData, size);
+      is.close();
+
+      ReadTiff(pbyData, &slice[0], 0);
+      CopyRegionSlice(&slice[0], m_x_size, sizeof(unsigned short), region, val, zi);
+
+      delete []pbyData;
+   }
+
+   if (m_max_value > 0.0)
+      m_scalar_scale = 65535.0 / m_max_value;
+
+   m_cur_time = t;
+   return WrapRegion(val, nrrdTypeUShort, region);
+}
+
 wstring OIFReader::GetCurName(int t, int c)
 {
    return m_oif_info[t].dataset[c][0];
@@ -799,14 +894,16 @@ void OIFReader::ReadTiff(char *pbyData, unsigned short *val, int z)
       strips = s_num1;
 
       unsigned int val_pos = z*m_x_size*m_y_size;
-      for (int i=0; i<strips; i++)
+      for (int i=0; i<strips && i*rows<m_y_size; i++)
       {
          unsigned int data_pos = strip_offsets[i];
          unsigned int data_size = strip_bytes[i];
+         //the last strip may hold fewer rows
+         unsigned int strip_size = m_x_size*min(rows, m_y_size-i*rows)*2;
          if (compression == 1)//no copmression
-            memcpy((void*)(val+val_pos), (void*)(pbyData+data_pos), data_size);
+            memcpy((void*)(val+val_pos), (void*)(pbyData+data_pos), min(data_size, strip_size));
          else if (compression == 5)
-            LZWDecode((tidata_t)(pbyData+data_pos), (tidata_t)(val+val_pos), m_x_size*rows*2);
+            LZWDecode((tidata_t)(pbyData+data_pos), (tidata_t)(val+val_pos), strip_size);
          val_pos += rows*m_x_size;
       }
    }
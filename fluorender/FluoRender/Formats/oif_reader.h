@@ -29,6 +29,7 @@ DEALINGS IN THE SOFTWARE.
 #define _OIF_READER_H_
 
 #include <base_reader.h>
+#include <seq_index.h>
 #include <stdio.h>
 //#include <windows.h>
 #include <vector>
@@ -55,12 +56,14 @@ public:
 	void SetBatch(bool batch);
 	int LoadBatch(int index);
 	Nrrd* Convert(int t, int c, bool get_max);
+	Nrrd* ConvertRegion(int t, int c, bool get_max, VolumeRegion region);
 	wstring GetCurName(int t, int c);
 
 	wstring GetPathName() {return m_path_name;}
 	wstring GetDataName() {return m_data_name;}
 	int GetTimeNum() {return m_time_num;}
 	int GetCurTime() {return m_cur_time;}
+	void SetCurTime(int t) {m_cur_time = t;}
 	int GetChanNum() {return m_chan_num;}
 	double GetExcitationWavelength(int chan);
 	int GetSliceNum() {return m_slice_num;}
@@ -116,7 +119,9 @@ private:
 private:
 	static bool oif_sort(const TimeDataInfo& info1, const TimeDataInfo& info2);
 	void ReadSingleOif();
-	void ReadSequenceOif();
+	//groups holds the file lists of the time points from a sidecar index
+	//if empty, the lists are found by scanning and stored in groups
+	void ReadSequenceOif(vector<SeqIndex::GroupInfo> &groups);
 	void ReadTifSequence(wstring file_name, int t=0);
 	void ReadOif();
 	void ReadOifLine(wstring oneline);
@@ -662,7 +662,7 @@ double PVXMLReader::GetExcitationWavelength(int chan)
 	return 0.0;
 }
 
-bool PVXMLReader::ConvertN(int c, TimeDataInfo* time_data_info, unsigned short *val)
+bool PVXMLReader::ConvertN(int c, TimeDataInfo* time_data_info, unsigned short *val, int z0, int z1)
 {
 	int i, j, k;
 	for (i=0; i<(int)time_data_info->size(); i++)
@@ -674,6 +674,8 @@ bool PVXMLReader::ConvertN(int c, TimeDataInfo* time_data_info, unsigned short *
 
 			if ((size_t)c >= frame_info->channels.size())
 				continue;
+			if (frame_info->z < z0 || frame_info->z >= z1)
+				continue;
 
 			unsigned long long frame_size = (unsigned long long)(frame_info->x_size) *
 				(unsigned long long)(frame_info->y_size);
@@ -706,7 +708,7 @@ bool PVXMLReader::ConvertN(int c, TimeDataInfo* time_data_info, unsigned short *
 					delete []pbyData;
 
 				//copy frame val to val
-				unsigned long long index = (unsigned long long)m_x_size*m_y_size*frame_info->z + m_x_size*(m_y_size-frame_info->y-frame_info->y_size) + frame_info->x;
+				unsigned long long index = (unsigned long long)m_x_size*m_y_size*(frame_info->z-z0) + m_x_size*(m_y_size-frame_info->y-frame_info->y_size) + frame_info->x;
 				long frame_index = 0;
 				if (m_flip_y)
 					frame_index = frame_info->x_size * (frame_info->y_size-1);
@@ -729,7 +731,7 @@ bool PVXMLReader::ConvertN(int c, TimeDataInfo* time_data_info, unsigned short *
 	return true;
 }
 
-bool PVXMLReader::ConvertS(int c, TimeDataInfo* time_data_info, unsigned short *val)
+bool PVXMLReader::ConvertS(int c, TimeDataInfo* time_data_info, unsigned short *val, int z0, int z1)
 {
 	int cur_chan = 0;
 	size_t i, j, k;
@@ -745,6 +747,8 @@ bool PVXMLReader::ConvertS(int c, TimeDataInfo* time_data_info, unsigned short *
 				FrameInfo *frame_info = &((sequence_info->frames)[j]);
 				if ((size_t)index >= frame_info->channels.size())
 					continue;
+				if (frame_info->z < z0 || frame_info->z >= z1)
+					continue;
 
 				unsigned long long frame_size = (unsigned long long)(frame_info->x_size) *
 					(unsigned long long)(frame_info->y_size);
@@ -777,7 +781,7 @@ bool PVXMLReader::ConvertS(int c, TimeDataInfo* time_data_info, unsigned short *
 						delete []pbyData;
 
 					//copy frame val to val
-					unsigned long long index = (unsigned long long)m_x_size*m_y_size*frame_info->z + m_x_size*(m_y_size-frame_info->y-frame_info->y_size) + frame_info->x;
+					unsigned long long index = (unsigned long long)m_x_size*m_y_size*(frame_info->z-z0) + m_x_size*(m_y_size-frame_info->y-frame_info->y_size) + frame_info->x;
 					long frame_index = 0;
 					if (m_flip_y)
 						frame_index = frame_info->x_size * (frame_info->y_size-1);
@@ -825,9 +829,9 @@ Nrrd *PVXMLReader::Convert(int t, int c, bool get_max)
 		TimeDataInfo* time_data_info = &(m_pvxml_info[t]);
 		
 		if (m_sep_seq)
-			ConvertS(c, time_data_info, val);
+			ConvertS(c, time_data_info, val, 0, m_slice_num);
 		else
-			ConvertN(c, time_data_info, val);
+			ConvertN(c, time_data_info, val, 0, m_slice_num);
 
 		if (val)
 		{
@@ -851,6 +855,60 @@ Nrrd *PVXMLReader::Convert(int t, int c, bool get_max)
 	if (m_max_value > 0.0)
 		m_scalar_scale = 65535.0 / m_max_value;
 
+	ValidateSpacings();
+	return data;
+}
+
+//tiles are placed slice by slice, so only the slices of the region are decoded
+Nrrd* PVXMLReader::ConvertRegion(int t, int c, bool get_max, VolumeRegion region)
+{
+	int chan_num = m_sep_seq?m_group_num:m_chan_num;
+	if (!(t>=0 && t<m_time_num &&
+		c>=0 && c<chan_num &&
+		m_slice_num>0 &&
+		m_x_size>0 &&
+		m_y_size>0))
+		return 0;
+	region.Clip(m_x_size, m_y_size, m_slice_num);
+	if (region.IsEmpty())
+		return 0;
+
+	unsigned long long slice_size = (unsigned long long)m_x_size*m_y_size;
+	unsigned long long slab_size = slice_size*(region.z1-region.z0);
+	unsigned short *slab = new (std::nothrow) unsigned short[slab_size];
+	if (!slab) return 0;
+	memset(slab, 0, sizeof(unsigned short)*slab_size);
+
+	TimeDataInfo* time_data_info = &(m_pvxml_info[t]);
+	if (m_sep_seq)
+		ConvertS(c, time_data_info, slab, region.z0, region.z1);
+	else
+		ConvertN(c, time_data_info, slab, region.z0, region.z1);
+
+	unsigned long long mem_size = (unsigned long long)region.GetXSize()*
+		(unsigned long long)region.GetYSize()*(unsigned long long)region.GetZSize();
+	unsigned short *val = new (std::nothrow) unsigned short[mem_size];
+	if (!val)
+	{
+		delete []slab;
+		return 0;
+	}
+	int zi = 0;
+	for (int z=region.z0; z<region.z1; z+=region.sz, zi++)
+		CopyRegionSlice(slab+slice_size*(z-region.z0), m_x_size,
+			sizeof(unsigned short), region, val, zi);
+	delete []slab;
+
+	m_cur_time = t;
+	if (m_max_value > 0.0)
+		m_scalar_scale = 65535.0 / m_max_value;
+
+	ValidateSpacings();
+	return WrapRegion(val, nrrdTypeUShort, region);
+}
+
+void PVXMLReader::ValidateSpacings()
+{
 	if (m_xspc>0.0 && m_xspc<100.0 &&
 		m_yspc>0.0 && m_yspc<100.0)
 	{
@@ -865,7 +923,6 @@ Nrrd *PVXMLReader::Convert(int t, int c, bool get_max)
 		m_yspc = 1.0;
 		m_zspc = 1.0;
 	}
-	return data;
 }
 
 void PVXMLReader::ReadTiff(char *pbyData, unsigned short *val)
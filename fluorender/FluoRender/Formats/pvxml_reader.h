@@ -53,12 +53,14 @@ public:
 	void SetBatch(bool batch);
 	int LoadBatch(int index);
 	Nrrd* Convert(int t, int c, bool get_max);
+	Nrrd* ConvertRegion(int t, int c, bool get_max, VolumeRegion region);
 	wstring GetCurName(int t, int c);
 
 	wstring GetPathName() {return m_path_name;}
 	wstring GetDataName() {return m_data_name;}
 	int GetTimeNum() {return m_time_num;}
 	int GetCurTime() {return m_cur_time;}
+	void SetCurTime(int t) {m_cur_time = t;}
 	int GetChanNum()
 	{if (m_sep_seq) return m_group_num; else return m_chan_num;}
 	double GetExcitationWavelength(int chan);
@@ -201,8 +203,10 @@ private:
 	bool m_flip_y;
 
 private:
-	bool ConvertS(int c, TimeDataInfo* time_data_info, unsigned short *val);
-	bool ConvertN(int c, TimeDataInfo* time_data_info, unsigned short *val);
+	//frames outside [z0, z1) are skipped, val holds z1-z0 slices
+	bool ConvertS(int c, TimeDataInfo* time_data_info, unsigned short *val, int z0, int z1);
+	bool ConvertN(int c, TimeDataInfo* time_data_info, unsigned short *val, int z0, int z1);
+	void ValidateSpacings();
 	void ReadSystemConfig(wxXmlNode *systemNode);
 	void UpdateStateShard(wxXmlNode *stateNode);
 	void ReadKey(wxXmlNode *keyNode);
@@ -0,0 +1,325 @@
+/*
+For more information, please see: http://software.sci.utah.edu
+
+The MIT License
+
+Copyright (c) 2014 Scientific Computing and Imaging Institute,
+University of Utah.
+
+
+Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the "Software"),
+to deal in the Software without restriction, including without limitation
+the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.
+*/
+#include "seq_index.h"
+#include "../compatibility.h"
+#include <cstring>
+
+#define SEQ_INDEX_NAME		L".vvd_seq.idx"
+#define SEQ_INDEX_MAGIC		"VVDSEQ01"
+#define SEQ_INDEX_ENDIAN	0x01020304
+#define SEQ_INDEX_MTIME_POS	12		//after the magic and the endian mark
+#define SEQ_INDEX_MAX_ENTRY	16		//older sequences are dropped
+
+static void PutU32(vector<char> &buf, uint32_t v)
+{
+	buf.insert(buf.end(), (char*)&v, (char*)&v+sizeof(v));
+}
+
+static void PutI64(vector<char> &buf, int64_t v)
+{
+	buf.insert(buf.end(), (char*)&v, (char*)&v+sizeof(v));
+}
+
+static void PutF64(vector<char> &buf, double v)
+{
+	buf.insert(buf.end(), (char*)&v, (char*)&v+sizeof(v));
+}
+
+//names inside dir are stored relative to it
+static void PutStr(vector<char> &buf, const wstring &str, const wstring &dir)
+{
+	bool rel = !dir.empty() && str.compare(0, dir.size(), dir) == 0;
+	string utf8 = ws2s(rel?str.substr(dir.size()):str);
+	buf.push_back(rel?1:0);
+	PutU32(buf, (uint32_t)utf8.size());
+	buf.insert(buf.end(), utf8.begin(), utf8.end());
+}
+
+static bool GetU32(const char* &p, const char* end, uint32_t &v)
+{
+	if (end - p < (int64_t)sizeof(v))
+		return false;
+	memcpy(&v, p, sizeof(v));
+	p += sizeof(v);
+	return true;
+}
+
+static bool GetI32(const char* &p, const char* end, int &v)
+{
+	uint32_t u;
+	if (!GetU32(p, end, u))
+		return false;
+	v = (int)u;
+	return true;
+}
+
+static bool GetI64(const char* &p, const char* end, int64_t &v)
+{
+	if (end - p < (int64_t)sizeof(v))
+		return false;
+	memcpy(&v, p, sizeof(v));
+	p += sizeof(v);
+	return true;
+}
+
+static bool GetF64(const char* &p, const char* end, double &v)
+{
+	if (end - p < (int64_t)sizeof(v))
+		return false;
+	memcpy(&v, p, sizeof(v));
+	p += sizeof(v);
+	return true;
+}
+
+static bool GetStr(const char* &p, const char* end, wstring &str, const wstring &dir)
+{
+	if (p >= end)
+		return false;
+	bool rel = *p++ != 0;
+	uint32_t len;
+	if (!GetU32(p, end, len) || end - p < (int64_t)len)
+		return false;
+	str = s2ws(string(p, len));
+	if (rel)
+		str = dir + str;
+	p += len;
+	return true;
+}
+
+SeqIndex::SeqIndex(const wstring &dir) :
+	m_dir(dir)
+{
+	if (!m_dir.empty() && m_dir.back() != GETSLASH())
+		m_dir.push_back(GETSLASH());
+	m_file = m_dir + SEQ_INDEX_NAME;
+	m_mtime = GET_MTIME(m_dir);
+}
+
+SeqIndex::~SeqIndex()
+{
+}
+
+bool SeqIndex::Load(const wstring &key, vector<GroupInfo> &groups)
+{
+	vector<Entry> entries;
+	if (!ReadEntries(entries))
+		return false;
+	for (size_t i = 0; i < entries.size(); i++)
+	{
+		if (entries[i].key == key)
+		{
+			groups.swap(entries[i].groups);
+			return !groups.empty();
+		}
+	}
+	return false;
+}
+
+bool SeqIndex::Save(const wstring &key, const vector<GroupInfo> &groups)
+{
+	//files may have been added while the caller was scanning
+	if (m_mtime == 0 || GET_MTIME(m_dir) != m_mtime)
+		return false;
+
+	vector<Entry> entries;
+	if (!ReadEntries(entries))
+		entries.clear();
+	for (size_t i = 0; i < entries.size(); i++)
+	{
+		if (entries[i].key == key)
+		{
+			entries.erase(entries.begin()+i);
+			break;
+		}
+	}
+	if (entries.size() >= SEQ_INDEX_MAX_ENTRY)
+		entries.erase(entries.begin(),
+			entries.begin()+(entries.size()-SEQ_INDEX_MAX_ENTRY+1));
+	Entry entry;
+	entry.key = key;
+	entry.groups = groups;
+	entries.push_back(entry);
+
+	return WriteEntries(entries);
+}
+
+bool SeqIndex::ReadEntries(vector<Entry> &entries)
+{
+	if (m_mtime == 0)
+		return false;
+
+	FILE* fp = 0;
+	if (!WFOPEN(&fp, m_file.c_str(), L"rb"))
+		return false;
+	vector<char> buf;
+	FSEEK64(fp, 0, SEEK_END);
+	int64_t size = FTELL64(fp);
+	FSEEK64(fp, 0, SEEK_SET);
+	if (size > 0)
+	{
+		buf.resize(size);
+		if (fread(&buf[0], 1, size, fp) != (size_t)size)
+			buf.clear();
+	}
+	fclose(fp);
+	if (buf.size() < SEQ_INDEX_MTIME_POS + sizeof(int64_t) + sizeof(uint32_t))
+		return false;
+
+	const char* p = &buf[0];
+	const char* end = p + buf.size();
+	if (memcmp(p, SEQ_INDEX_MAGIC, 8))
+		return false;
+	p += 8;
+	uint32_t endian;
+	int64_t mtime;
+	uint32_t entry_num;
+	if (!GetU32(p, end, endian) ||
+		!GetI64(p, end, mtime) ||
+		!GetU32(p, end, entry_num))
+		return false;
+	if (endian != SEQ_INDEX_ENDIAN || mtime != m_mtime)
+		return false;
+	//an entry takes at least its key and two counts
+	if (entry_num > (uint32_t)((end - p) / (1 + 3*sizeof(uint32_t))))
+		return false;
+
+	entries.resize(entry_num);
+	for (uint32_t i = 0; i < entry_num; i++)
+	{
+		Entry &entry = entries[i];
+		uint32_t group_num, file_num, file_cnt = 0;
+		if (!GetStr(p, end, entry.key, L"") ||
+			!GetU32(p, end, group_num) ||
+			!GetU32(p, end, file_num) ||
+			group_num > (uint32_t)(end - p))
+			return false;
+		entry.groups.resize(group_num);
+		for (uint32_t j = 0; j < group_num; j++)
+		{
+			GroupInfo &group = entry.groups[j];
+			HeaderInfo &header = group.header;
+			uint32_t num;
+			if (p >= end)
+				return false;
+			header.valid = *p++ != 0;
+			if (!GetI32(p, end, group.number) ||
+				!GetI32(p, end, group.type) ||
+				!GetStr(p, end, group.name, m_dir) ||
+				!GetI32(p, end, header.chan_num) ||
+				!GetI32(p, end, header.x_size) ||
+				!GetI32(p, end, header.y_size) ||
+				!GetI32(p, end, header.slice_num) ||
+				!GetI32(p, end, header.bits) ||
+				!GetF64(p, end, header.xspc) ||
+				!GetF64(p, end, header.yspc) ||
+				!GetF64(p, end, header.zspc) ||
+				!GetF64(p, end, header.max_value) ||
+				!GetU32(p, end, num) ||
+				num > (uint32_t)(end - p))
+				return false;
+			group.files.resize(num);
+			for (uint32_t k = 0; k < num; k++)
+			{
+				if (!GetStr(p, end, group.files[k].name, m_dir) ||
+					!GetI32(p, end, group.files[k].number))
+					return false;
+			}
+			file_cnt += num;
+		}
+		//a truncated or partly written index is dropped
+		if (file_cnt != file_num)
+			return false;
+	}
+
+	return true;
+}
+
+bool SeqIndex::WriteEntries(vector<Entry> &entries)
+{
+	vector<char> buf;
+	buf.insert(buf.end(), SEQ_INDEX_MAGIC, SEQ_INDEX_MAGIC+8);
+	PutU32(buf, SEQ_INDEX_ENDIAN);
+	PutI64(buf, m_mtime);
+	PutU32(buf, (uint32_t)entries.size());
+	for (size_t i = 0; i < entries.size(); i++)
+	{
+		Entry &entry = entries[i];
+		uint32_t file_num = 0;
+		for (size_t j = 0; j < entry.groups.size(); j++)
+			file_num += (uint32_t)entry.groups[j].files.size();
+		PutStr(buf, entry.key, L"");
+		PutU32(buf, (uint32_t)entry.groups.size());
+		PutU32(buf, file_num);
+		for (size_t j = 0; j < entry.groups.size(); j++)
+		{
+			GroupInfo &group = entry.groups[j];
+			HeaderInfo &header = group.header;
+			buf.push_back(header.valid?1:0);
+			PutU32(buf, (uint32_t)group.number);
+			PutU32(buf, (uint32_t)group.type);
+			PutStr(buf, group.name, m_dir);
+			PutU32(buf, (uint32_t)header.chan_num);
+			PutU32(buf, (uint32_t)header.x_size);
+			PutU32(buf, (uint32_t)header.y_size);
+			PutU32(buf, (uint32_t)header.slice_num);
+			PutU32(buf, (uint32_t)header.bits);
+			PutF64(buf, header.xspc);
+			PutF64(buf, header.yspc);
+			PutF64(buf, header.zspc);
+			PutF64(buf, header.max_value);
+			PutU32(buf, (uint32_t)group.files.size());
+			for (size_t k = 0; k < group.files.size(); k++)
+			{
+				PutStr(buf, group.files[k].name, m_dir);
+				PutU32(buf, (uint32_t)group.files[k].number);
+			}
+		}
+	}
+
+	FILE* fp = 0;
+	if (!WFOPEN(&fp, m_file.c_str(), L"wb"))
+		return false;
+	bool result = fwrite(&buf[0], 1, buf.size(), fp) == buf.size();
+	fclose(fp);
+	if (!result)
+		return false;
+
+	//creating the index changes the directory time, rewriting it in place does not
+	int64_t mtime = GET_MTIME(m_dir);
+	if (mtime != m_mtime)
+	{
+		if (!WFOPEN(&fp, m_file.c_str(), L"r+b"))
+			return false;
+		FSEEK64(fp, SEQ_INDEX_MTIME_POS, SEEK_SET);
+		result = fwrite(&mtime, sizeof(mtime), 1, fp) == 1;
+		fclose(fp);
+		m_mtime = mtime;
+	}
+
+	return result;
+}
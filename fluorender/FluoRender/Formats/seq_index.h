@@ -0,0 +1,102 @@
+/*
+For more information, please see: http://software.sci.utah.edu
+
+The MIT License
+
+Copyright (c) 2014 Scientific Computing and Imaging Institute,
+University of Utah.
+
+
+Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the "Software"),
+to deal in the Software without restriction, including without limitation
+the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.
+*/
+#ifndef _SEQ_INDEX_H_
+#define _SEQ_INDEX_H_
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+using namespace std;
+
+//sidecar index of the file sequences in a dataset directory
+//readers store the sorted layout of a time or slice sequence and the header
+//info they have read, so reopening the dataset skips the directory scan
+//the index is valid while the modification time of the directory is unchanged
+class SeqIndex
+{
+public:
+	struct FileInfo
+	{
+		wstring name;		//full path
+		int number;			//slice or file number
+	};
+	struct HeaderInfo
+	{
+		bool valid;			//the header of this time point has been read
+		int chan_num;
+		int x_size;
+		int y_size;
+		int slice_num;
+		int bits;
+		double xspc;
+		double yspc;
+		double zspc;
+		double max_value;
+
+		HeaderInfo() :
+			valid(false), chan_num(0), x_size(0), y_size(0), slice_num(0),
+			bits(0), xspc(1.0), yspc(1.0), zspc(1.0), max_value(0.0) {}
+	};
+	struct GroupInfo		//one time point
+	{
+		int number;			//file number of the time point
+		int type;			//reader specific
+		wstring name;		//file of the time point, e.g. its oif file
+		vector<FileInfo> files;
+		HeaderInfo header;
+
+		GroupInfo() : number(0), type(0) {}
+	};
+
+	//the modification time of dir is taken here, so construct before scanning
+	SeqIndex(const wstring &dir);
+	~SeqIndex();
+
+	//get the sequence stored under key, false if there is no valid entry
+	bool Load(const wstring &key, vector<GroupInfo> &groups);
+	//store a sequence under key
+	//nothing is written if the directory has changed since construction
+	bool Save(const wstring &key, const vector<GroupInfo> &groups);
+
+private:
+	struct Entry
+	{
+		wstring key;
+		vector<GroupInfo> groups;
+	};
+
+	wstring m_dir;			//with trailing slash
+	wstring m_file;			//index file
+	int64_t m_mtime;		//directory time at construction
+
+	bool ReadEntries(vector<Entry> &entries);
+	bool WriteEntries(vector<Entry> &entries);
+};
+
+#endif//_SEQ_INDEX_H_
@@ -28,6 +28,10 @@ DEALINGS IN THE SOFTWARE.
 #include "tif_reader.h"
 #include "../compatibility.h"
 #include <sstream>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <exception>
 
 TIFReader::TIFReader()
 {
@@ -59,12 +63,15 @@ TIFReader::TIFReader()
    current_page_ = current_offset_ = 0;
    swap_ = false;
    isBig_ = false;
+   use_map_ = true;
+   m_thread_num = max(1, (int)std::thread::hardware_concurrency());
+   tiff_map_.data = NULL;
+   tiff_map_.size = 0;
 }
 
 TIFReader::~TIFReader()
 {
-   if (tiff_stream.is_open())
-      tiff_stream.close();
+   CloseTiff();
 }
 
 void TIFReader::SetFile(string &file)
@@ -85,6 +92,11 @@ void TIFReader::SetFile(wstring &file)
    m_id_string = m_path_name;
 }
 
+void TIFReader::SetMemoryMapped(bool mapped)
+{
+   use_map_ = mapped;
+}
+
 void TIFReader::Preprocess()
 {
    int i;
@@ -117,101 +129,132 @@ void TIFReader::Preprocess()
       else
          begin = -1;
    }
-   //build 4d sequence
-   if (begin == -1 || !m_time_seq)
-   {
-      TimeDataInfo info;
-      SliceInfo sliceinfo;
-      sliceinfo.slice = path + name;  //temporary name
-      sliceinfo.slicenumber = 0;
-      info.slices.push_back(sliceinfo);
-      info.filenumber = 0;
-      m_4d_seq.push_back(info);
-      m_cur_time = 0;
-   }
+   //a sequence found by scanning the directory is kept in a sidecar index
+   bool use_index = (begin != -1 && m_time_seq) || m_slice_seq;
+   SeqIndex index(path);
+   wstring key = L"tif:";
+   if (m_slice_seq)
+      key += L"slice:";
+   key += (begin != -1 && m_time_seq)?name.substr(0, begin+id_len):name;
+   vector<SeqIndex::GroupInfo> groups;
+   if (use_index && index.Load(key, groups))
+      FromSeqIndex(groups);
    else
    {
-      //search time sequence files
-      std::vector< std::wstring> list;
-      FIND_FILES(path,L".tif",list, m_cur_time,name.substr(0,begin + id_len ));
-      begin += path.length();
-      for(size_t f = 0; f < list.size(); f++) {
-         TimeDataInfo inf;
-         std::wstring str = list.at(f);
-         std::wstring t_num;
-         size_t j;
-         for(j = begin+id_len;j<str.size();j++)
-         {
-            wchar_t c = str[j];
-            if (iswdigit(c))
-               t_num.push_back(c);
-            else break;
-         }
-         if (t_num.size() > 0)
-            inf.filenumber = WSTOI(t_num);
-         else
-            inf.filenumber = 0;
+      groups.clear();
+      //build 4d sequence
+      if (begin == -1 || !m_time_seq)
+      {
+         TimeDataInfo info;
          SliceInfo sliceinfo;
-         sliceinfo.slice = str;
+         sliceinfo.slice = path + name;  //temporary name
          sliceinfo.slicenumber = 0;
-         inf.slices.push_back(sliceinfo);
-         m_4d_seq.push_back(inf);
+         info.slices.push_back(sliceinfo);
+         info.type = 0;
+         info.filenumber = 0;
+         m_4d_seq.push_back(info);
+         m_cur_time = 0;
       }
-   }
-   if (m_4d_seq.size() > 0)
-      std::sort(m_4d_seq.begin(), m_4d_seq.end(), TIFReader::tif_sort);
-
-   //build 3d slice sequence
-   for (int t=0; t<(int)m_4d_seq.size(); t++)
-   {
-      wstring slice_str = m_4d_seq[t].slices[0].slice;
+      else
+      {
+         //search time sequence files
+         std::vector< std::wstring> list;
+         FIND_FILES(path,L".tif",list, m_cur_time,name.substr(0,begin + id_len ));
+         begin += path.length();
+         for(size_t f = 0; f < list.size(); f++) {
+            TimeDataInfo inf;
+            std::wstring str = list.at(f);
+            std::wstring t_num;
+            size_t j;
+            for(j = begin+id_len;j<str.size();j++)
+            {
+               wchar_t c = str[j];
+               if (iswdigit(c))
+                  t_num.push_back(c);
+               else break;
+            }
+            if (t_num.size() > 0)
+               inf.filenumber = WSTOI(t_num);
+            else
+               inf.filenumber = 0;
+            SliceInfo sliceinfo;
+            sliceinfo.slice = str;
+            sliceinfo.slicenumber = 0;
+            inf.slices.push_back(sliceinfo);
+            inf.type = 0;
+            m_4d_seq.push_back(inf);
+         }
+      }
+      if (m_4d_seq.size() > 0)
+         std::sort(m_4d_seq.begin(), m_4d_seq.end(), TIFReader::tif_sort);
 
-      if (m_slice_seq)
+      //build 3d slice sequence
+      for (int t=0; t<(int)m_4d_seq.size(); t++)
       {
-         //extract common string in name
-         size_t pos2 = slice_str.find_last_of(L'.');
-         size_t begin2 = 0;
-         int64_t end2 = -1;
-         for (i=int(pos2)-1; i>=0; i--)
+         wstring slice_str = m_4d_seq[t].slices[0].slice;
+
+         if (m_slice_seq)
          {
-            if (iswdigit(slice_str[i]) && end2==-1)
-               end2 = i;
-            if (!iswdigit(slice_str[i]) && end2!=-1)
+            //extract common string in name
+            size_t pos2 = slice_str.find_last_of(L'.');
+            size_t begin2 = 0;
+            int64_t end2 = -1;
+            for (i=int(pos2)-1; i>=0; i--)
+            {
+               if (iswdigit(slice_str[i]) && end2==-1)
+                  end2 = i;
+               if (!iswdigit(slice_str[i]) && end2!=-1)
+               {
+                  begin2 = i;
+                  break;
+               }
+            }
+            if (end2!=-1)
             {
-               begin2 = i;
-               break;
+               //search slice sequence
+               std::vector<std::wstring> list;
+               std::wstring regex = slice_str.substr(0,begin2+1);
+               FIND_FILES(path,L".tif",list,m_cur_time,regex);
+               m_4d_seq[t].type = 1;
+               m_4d_seq[t].slices.clear();
+               for(size_t f = 0; f < list.size(); f++) {
+                  size_t start_idx = begin2+1;
+                  size_t end_idx   = list.at(f).find(L".tif");
+                  size_t size = end_idx - start_idx;
+                  std::wstring fileno = list.at(f).substr(start_idx, size);
+                  SliceInfo slice;
+                  slice.slice = list.at(f);
+                  slice.slicenumber = WSTOI(fileno);
+                  m_4d_seq[t].slices.push_back(slice);
+               }
+               if (m_4d_seq[t].slices.size() > 0)
+                  std::sort(m_4d_seq[t].slices.begin(),
+                        m_4d_seq[t].slices.end(),
+                        TIFReader::tif_slice_sort);
             }
          }
-         if (end2!=-1)
+         else
          {
-            //search slice sequence
-            std::vector<std::wstring> list;
-            std::wstring regex = slice_str.substr(0,begin2+1);
-            FIND_FILES(path,L".tif",list,m_cur_time,regex);
-            m_4d_seq[t].type = 1;
-			m_4d_seq[t].slices.clear();
-            for(size_t f = 0; f < list.size(); f++) {
-               size_t start_idx = begin2+1;
-               size_t end_idx   = list.at(f).find(L".tif");
-               size_t size = end_idx - start_idx;
-               std::wstring fileno = list.at(f).substr(start_idx, size);
-               SliceInfo slice;
-               slice.slice = list.at(f);
-               slice.slicenumber = WSTOI(fileno);
-               m_4d_seq[t].slices.push_back(slice);
-            }
-            if (m_4d_seq[t].slices.size() > 0)
-               std::sort(m_4d_seq[t].slices.begin(),
-                     m_4d_seq[t].slices.end(),
-                     TIFReader::tif_slice_sort);
+            m_4d_seq[t].type = 0;
+            m_4d_seq[t].slices[0].slice = slice_str;
+            if (m_4d_seq[t].slices[0].slice == m_path_name)
+               m_cur_time = t;
          }
       }
-      else
+   }
+
+   //find the current time point
+   m_cur_time = 0;
+   for (int t=0; t<(int)m_4d_seq.size(); t++)
+   {
+      for (size_t s=0; s<m_4d_seq[t].slices.size(); s++)
       {
-         m_4d_seq[t].type = 0;
-         m_4d_seq[t].slices[0].slice = slice_str;
-         if (m_4d_seq[t].slices[0].slice == m_path_name)
+         if (m_4d_seq[t].slices[s].slice == m_path_name)
+         {
             m_cur_time = t;
+            t = (int)m_4d_seq.size();
+            break;
+         }
       }
    }
 
@@ -222,23 +265,85 @@ void TIFReader::Preprocess()
          m_cur_time<(int)m_4d_seq.size() &&
          m_4d_seq[m_cur_time].slices.size()>0)
    {
+      if (m_cur_time<(int)groups.size() &&
+            groups[m_cur_time].header.valid)
+      {
+         m_chan_num = groups[m_cur_time].header.chan_num;
+         return;
+      }
       wstring tiff_name = m_4d_seq[m_cur_time].slices[0].slice;
+      SeqIndex::HeaderInfo header;
       if (tiff_name.size()>0)
       {
          OpenTiff(tiff_name);
-         m_chan_num = GetTiffField(kSamplesPerPixelTag,NULL,0);
-         if (m_chan_num == 0 &&
-               GetTiffField(kImageWidthTag,NULL,0) > 0&&
-               GetTiffField(kImageLengthTag,NULL,0) > 0) {
-            m_chan_num = 1;
+         if (page_ifds_.size() > 0)
+         {
+            const TiffIFDInfo &ifd = ifds_[page_ifds_[0]];
+            m_chan_num = ifd.samples;
+            if (m_chan_num == 0 &&
+                  ifd.width > 0 &&
+                  ifd.height > 0) {
+               m_chan_num = 1;
+            }
+            header.valid = true;
+            header.chan_num = m_chan_num;
+            header.x_size = (int)ifd.width;
+            header.y_size = (int)ifd.height;
+            header.slice_num = m_4d_seq[m_cur_time].type==1?
+               (int)m_4d_seq[m_cur_time].slices.size():
+               (int)page_ifds_.size();
+            header.bits = (int)ifd.bits;
          }
+         else m_chan_num = 0;
          CloseTiff();
       }
       else m_chan_num = 0;
+
+      if (use_index)
+      {
+         if (groups.size() != m_4d_seq.size())
+            ToSeqIndex(groups);
+         groups[m_cur_time].header = header;
+         index.Save(key, groups);
+      }
    }
    else m_chan_num = 0;
 }
 
+void TIFReader::FromSeqIndex(vector<SeqIndex::GroupInfo> &groups)
+{
+   m_4d_seq.resize(groups.size());
+   for (size_t t=0; t<groups.size(); t++)
+   {
+      TimeDataInfo &info = m_4d_seq[t];
+      info.type = groups[t].type;
+      info.filenumber = groups[t].number;
+      info.slices.resize(groups[t].files.size());
+      for (size_t s=0; s<groups[t].files.size(); s++)
+      {
+         info.slices[s].slice = groups[t].files[s].name;
+         info.slices[s].slicenumber = groups[t].files[s].number;
+      }
+   }
+}
+
+void TIFReader::ToSeqIndex(vector<SeqIndex::GroupInfo> &groups)
+{
+   groups.resize(m_4d_seq.size());
+   for (size_t t=0; t<m_4d_seq.size(); t++)
+   {
+      TimeDataInfo &info = m_4d_seq[t];
+      groups[t].type = info.type;
+      groups[t].number = info.filenumber;
+      groups[t].files.resize(info.slices.size());
+      for (size_t s=0; s<info.slices.size(); s++)
+      {
+         groups[t].files[s].name = info.slices[s].slice;
+         groups[t].files[s].number = info.slices[s].slicenumber;
+      }
+   }
+}
+
 uint64_t TIFReader::GetTiffField(
       const uint64_t in_tag, void * buf, uint64_t size)
 {
@@ -567,6 +672,37 @@ Nrrd* TIFReader::Convert(int t, int c, bool get_max)
    return data;
 }
 
+Nrrd* TIFReader::ConvertRegion(int t, int c, bool get_max, VolumeRegion region)
+{
+   if (t<0 || t>=m_time_num ||
+         c<0 || c>=m_chan_num)
+      return 0;
+
+   TimeDataInfo chan_info = m_4d_seq[t];
+   m_data_name = chan_info.slices[0].slice.substr(
+         chan_info.slices[0].slice.find_last_of(GETSLASH())+1);
+   Nrrd* data = ReadTiffRegion(chan_info.slices, c, get_max, region);
+   m_cur_time = t;
+   return data;
+}
+
+void TIFReader::ConvertAllChannels(int t, bool get_max, vector<Nrrd*> &data,
+      vector<double> &max_values, vector<double> &scalar_scales)
+{
+   data.clear();
+   max_values.clear();
+   scalar_scales.clear();
+   if (t<0 || t>=m_time_num || m_chan_num<=0)
+      return;
+
+   TimeDataInfo chan_info = m_4d_seq[t];
+   m_data_name = chan_info.slices[0].slice.substr(
+         chan_info.slices[0].slice.find_last_of(GETSLASH())+1);
+   ReadTiff(chan_info.slices, 0, m_chan_num, get_max,
+         data, max_values, scalar_scales);
+   m_cur_time = t;
+}
+
 wstring TIFReader::GetCurName(int t, int c)
 {
    if (t>=0 && t<(int64_t)m_4d_seq.size())
@@ -587,116 +723,291 @@ bool TIFReader::tif_slice_sort(const SliceInfo& info1, const SliceInfo& info2)
 
 uint64_t TIFReader::GetNumTiffPages()
 {
-   uint64_t count = 0;
-   uint64_t save_offset = current_offset_;
-   uint64_t save_page = current_page_;
-   ResetTiff();
-   while (true) {
-      // count it if it's not a thumbnail
-      if (GetTiffField(kSubFileTypeTag,NULL,0) != 1) count++;
-      current_offset_ = GetTiffField(kNextPageOffsetTag,NULL,0);
-      if (current_offset_ == 0) break;
-   }
-   current_offset_ = save_offset;
-   current_page_ = save_page;
-   return count;
+   if (!tiff_stream.is_open())
+      throw std::runtime_error( "TIFF file not open for reading." );
+   return static_cast<uint64_t>(page_ifds_.size());
 }
 
 void TIFReader::GetTiffStrip(uint64_t page, uint64_t strip,
       void * data, uint64_t strip_size)
 {
-   //make sure we are on the correct page,
-   //reset if ahead
-   if (current_page_ > page)
-      ResetTiff();
-   // fast forward if we are behind.
-   while (current_page_ < page) {
-      tiff_stream.seekg(current_offset_,tiff_stream.beg);
-      if (GetTiffField(kSubFileTypeTag,NULL,0) != 1) current_page_ ++;
-      current_offset_ = GetTiffField(kNextPageOffsetTag,NULL,0);
-   }
+   if (page >= page_ifds_.size())
+      throw std::runtime_error( "TIFF page out of range." );
+   //the IFD table gives us the page directly
+   const TiffIFDInfo &ifd = ifds_[page_ifds_[page]];
+   current_page_ = page;
+   current_offset_ = ifd.offset;
+   DecodeTiffStrip(ifd, strip, data, strip_size);
+}
+
+void TIFReader::DecodeTiffStrip(const TiffIFDInfo &ifd, uint64_t strip,
+      void * data, uint64_t strip_size)
+{
+   if (strip >= ifd.strip_offsets.size() ||
+         strip >= ifd.strip_counts.size())
+      return;
    //get the byte count and the strip offset to read data from.
-   uint64_t byte_count = GetTiffStripOffsetOrCount(kStripBytesCountTag,strip);
-   tiff_stream.seekg(GetTiffStripOffsetOrCount(
-            kStripOffsetsTag,strip),tiff_stream.beg);
-   //actually read the data now
-   char *temp = new char[byte_count];
-   tiff_stream.read((char*)temp,byte_count);
-   bool eight_bits = 8 == GetTiffField(kBitsPerSampleTag,NULL,0);
-   if (swap_ && !eight_bits) {
-	   short * temp2 = reinterpret_cast<short*>(temp);
-	   for (size_t sh = 0; sh < byte_count / 2; sh++)
-		   temp2[sh] = SwapShort(temp2[sh]);
-   }
-   //get compression tag, decompress if necessary
-   uint64_t tmp = GetTiffField(kCompressionTag,NULL,0);
-   uint64_t prediction = GetTiffField(kPredictionTag,NULL,0);
-   uint64_t bits = GetTiffField(kSamplesPerPixelTag,NULL,0);
-   bits = bits==0?1:bits;
-   tsize_t stride = (GetTiffField(kPlanarConfigurationTag,NULL,0) == 2)?1:bits;
-   //uint64_t rows_per_strip = GetTiffField(kRowsPerStripTag,NULL,0);
-   uint64_t rows_per_strip = strip_size /
-	   GetTiffField(kImageWidthTag,NULL,0) /
-	   bits;
-   bool isCompressed = tmp == 5;
-    if (isCompressed) {
-        LZWDecode((tidata_t)temp, (tidata_t)data, strip_size);
-        if (prediction == 2) {
-        for (size_t j=0; j < rows_per_strip; j++)
-            if (eight_bits)
-                DecodeAcc8((tidata_t)data+j*m_x_size*bits, m_x_size*bits,stride);
-            else
-                DecodeAcc16((tidata_t)data+j*m_x_size*bits*2, m_x_size*bits*2,stride);
-        }
-    }
-   else
-      memcpy(data,temp,byte_count);
-   delete[] temp;
+   uint64_t byte_count = ifd.strip_counts[strip];
+   uint64_t strip_offset = ifd.strip_offsets[strip];
+   bool eight_bits = 8 == ifd.bits;
+   uint64_t bits = ifd.samples==0?1:ifd.samples;
+   tsize_t stride = (ifd.planar == 2)?1:bits;
+   bool isCompressed = ifd.compression == 5;
+   bool swapped = false;
+   if (tiff_map_.data && strip_offset >= tiff_map_.size) {
+      //a truncated file, strips are decoded on several threads when the
+      //file is mapped so the shared stream is not used
+      memset(data, 0, strip_size);
+      return;
+   }
+   if (tiff_map_.data) {
+      //read straight from the mapping
+      byte_count = min(byte_count, tiff_map_.size - strip_offset);
+      const char* src = tiff_map_.data + strip_offset;
+      if (isCompressed)
+         LZWDecode((tidata_t)src, (tidata_t)data, strip_size,
+               (tsize_t)byte_count);
+      else if (swap_ && !eight_bits) {
+         //fuse the byte swap into the copy
+         uint64_t count = min(byte_count,strip_size) / 2;
+         uint16_t * dst = reinterpret_cast<uint16_t*>(data);
+         for (uint64_t sh = 0; sh < count; sh++) {
+            uint16_t value;
+            memcpy(&value,src+sh*2,sizeof(uint16_t));
+            dst[sh] = SwapShort(value);
+         }
+         swapped = true;
+      } else
+         memcpy(data,src,min(byte_count,strip_size));
+   } else {
+      tiff_stream.clear();
+      tiff_stream.seekg(strip_offset,tiff_stream.beg);
+      if (isCompressed) {
+         //actually read the data now
+         char *temp = new char[byte_count];
+         tiff_stream.read((char*)temp,byte_count);
+         LZWDecode((tidata_t)temp, (tidata_t)data, strip_size,
+               (tsize_t)tiff_stream.gcount());
+         delete[] temp;
+      } else {
+         //uncompressed strips go straight into the buffer
+         tiff_stream.read((char*)data,min(byte_count,strip_size));
+      }
+   }
+   uint64_t row_size = ifd.width * bits * (eight_bits?1:2);
+   uint64_t predicted = 0;
+   if (isCompressed && ifd.predictor == 2 && row_size > 0) {
+      //the 16-bit byte swap is done in the same pass
+      uint64_t rows_per_strip = strip_size / row_size;
+      for (size_t j=0; j < rows_per_strip; j++)
+         if (eight_bits)
+            DecodeAcc8((tidata_t)data+j*row_size, row_size,stride);
+         else
+            DecodeAcc16((tidata_t)data+j*row_size, row_size,stride,
+                  swap_ && !swapped);
+      predicted = rows_per_strip * row_size;
+   }
+   //byte order applies to the decoded samples
+   if (swap_ && !eight_bits && !swapped) {
+      uint16_t * temp2 = reinterpret_cast<uint16_t*>(data);
+      for (size_t sh = predicted / 2; sh < strip_size / 2; sh++)
+         temp2[sh] = SwapShort(temp2[sh]);
+   }
 }
 
 uint64_t TIFReader::GetTiffStripOffsetOrCount(uint64_t tag, uint64_t strip)
 {
-   //search for the offset that tells us the byte count for this strip
-   uint64_t type = GetTiffField(tag,NULL,kType);
-   switch (type) {
-   case kLong8:
-	   type = 8;
-	   break;
-   case kLong: 
-	   type = 4;
-	   break;
-   default:
-	   type = 2;
-	   break;
-   }
-   uint64_t offset = GetTiffField(tag, NULL,kOffset);
-   uint64_t address = GetTiffField(tag, NULL,kValueAddress);
-   uint64_t cnt = GetTiffField(tag, NULL, kCount);
-   // if the values do not fit into the tag data, jump to them
-   if (cnt * type > (isBig_?8:4)) {
-      tiff_stream.seekg(offset+type*strip, tiff_stream.beg);
+   if (current_page_ >= page_ifds_.size())
+      return 0;
+   const TiffIFDInfo &ifd = ifds_[page_ifds_[current_page_]];
+   const vector<uint64_t> &values = (tag == kStripBytesCountTag)?
+      ifd.strip_counts:ifd.strip_offsets;
+   return strip<values.size()?values[strip]:0;
+}
+
+void TIFReader::ReadTiffEntryValues(const char* entry, vector<uint64_t> &values)
+{
+   values.clear();
+   uint16_t type = 0;
+   memcpy(&type,entry,sizeof(uint16_t));
+   if (swap_) type = SwapShort(type);
+   uint64_t cnt = 0;
+   if (isBig_) {
+      memcpy(&cnt,entry+2,sizeof(uint64_t));
+      if (swap_) cnt = SwapLong(cnt);
    } else {
-	  //otherwise, return the value of interest within the tag
-      tiff_stream.seekg(address+type*strip, tiff_stream.beg);
+      uint32_t tmp = 0;
+      memcpy(&tmp,entry+2,sizeof(uint32_t));
+      if (swap_) tmp = SwapWord(tmp);
+      cnt = static_cast<uint64_t>(tmp);
    }
-   uint64_t value = 0;
-   uint32_t tmp = 0;
-   uint16_t tmp2 = 0;
+   uint64_t type_size;
    switch (type) {
+   case kByte:
+      type_size = 1;
+      break;
+   case kShort:
+      type_size = 2;
+      break;
+   case kLong:
+      type_size = 4;
+      break;
    case kLong8:
-      tiff_stream.read((char*)&value,sizeof(uint64_t));
-      value = (swap_)?SwapLong(value):value;
-	  break;
-   case kLong: 
-      tiff_stream.read((char*)&tmp,sizeof(uint32_t));
-      value = static_cast<uint64_t>((swap_)?SwapWord(tmp):tmp);
-	  break;
+   case kSLong8:
+   case kIFD8:
+      type_size = 8;
+      break;
    default:
-      tiff_stream.read((char*)&tmp2,sizeof(uint16_t));
-      value = static_cast<uint64_t>((swap_)?SwapShort(tmp2):tmp2);
-	  break;
+      return;
+   }
+   if (cnt == 0)
+      return;
+   //values are stored in the entry if they fit, otherwise at an offset
+   const char* value_field = entry + (isBig_?10:6);
+   uint64_t byte_count = cnt * type_size;
+   vector<char> buf;
+   const char* src = value_field;
+   if (byte_count > (isBig_?8u:4u)) {
+      uint64_t offset = 0;
+      if (isBig_) {
+         memcpy(&offset,value_field,sizeof(uint64_t));
+         if (swap_) offset = SwapLong(offset);
+      } else {
+         uint32_t tmp = 0;
+         memcpy(&tmp,value_field,sizeof(uint32_t));
+         if (swap_) tmp = SwapWord(tmp);
+         offset = static_cast<uint64_t>(tmp);
+      }
+      buf.resize(byte_count);
+      tiff_stream.clear();
+      tiff_stream.seekg(offset,tiff_stream.beg);
+      tiff_stream.read(&buf[0],byte_count);
+      if (static_cast<uint64_t>(tiff_stream.gcount()) != byte_count)
+         return;
+      src = &buf[0];
+   }
+   values.resize(cnt);
+   for (uint64_t i = 0; i < cnt; i++) {
+      const char* p = src + i*type_size;
+      switch (type_size) {
+      case 1:
+         values[i] = static_cast<uint64_t>(*(const uint8_t*)p);
+         break;
+      case 2:
+         {
+            uint16_t v;
+            memcpy(&v,p,sizeof(uint16_t));
+            values[i] = static_cast<uint64_t>(swap_?SwapShort(v):v);
+         }
+         break;
+      case 4:
+         {
+            uint32_t v;
+            memcpy(&v,p,sizeof(uint32_t));
+            values[i] = static_cast<uint64_t>(swap_?SwapWord(v):v);
+         }
+         break;
+      default:
+         {
+            uint64_t v;
+            memcpy(&v,p,sizeof(uint64_t));
+            values[i] = swap_?SwapLong(v):v;
+         }
+         break;
+      }
    }
-   return value;
+}
+
+void TIFReader::ParseTiffIFDs()
+{
+   if (!tiff_stream.is_open())
+      throw std::runtime_error( "TIFF file not open for reading." );
+   ifds_.clear();
+   page_ifds_.clear();
+   char multiplier = isBig_?20:12;
+   char next_size = isBig_?8:4;
+   uint64_t offset = current_offset_;
+   set<uint64_t> visited;
+   vector<char> block;
+   vector<uint64_t> values;
+   //a corrupt chain may point back to an IFD already seen
+   while (offset != 0 && visited.insert(offset).second) {
+      tiff_stream.clear();
+      tiff_stream.seekg(offset,tiff_stream.beg);
+      uint64_t num_entries = 0;
+      if (isBig_) {
+         tiff_stream.read((char*)&num_entries,sizeof(uint64_t));
+         if (swap_) num_entries = SwapLong(num_entries);
+      } else {
+         uint16_t temp = 0;
+         tiff_stream.read((char*)&temp,sizeof(uint16_t));
+         if (swap_) temp = SwapShort(temp);
+         num_entries = static_cast<uint64_t>(temp);
+      }
+      if (!tiff_stream || num_entries > 0xFFFF)
+         break;
+      //read all entries and the next IFD offset at once
+      uint64_t block_size = multiplier*num_entries + next_size;
+      block.resize(block_size);
+      tiff_stream.read(&block[0],block_size);
+      if (static_cast<uint64_t>(tiff_stream.gcount()) != block_size)
+         break;
+
+      TiffIFDInfo info;
+      info.offset = offset;
+      info.subfile_type = info.width = info.height = 0;
+      info.bits = info.samples = info.compression = 0;
+      info.predictor = info.planar = info.rows_per_strip = 0;
+      for (uint64_t i = 0; i < num_entries; i++) {
+         const char* entry = &block[multiplier*i];
+         uint16_t tag = 0;
+         memcpy(&tag,entry,sizeof(uint16_t));
+         if (swap_) tag = SwapShort(tag);
+         uint64_t *field = 0;
+         switch (tag) {
+         case kSubFileTypeTag: field = &info.subfile_type; break;
+         case kImageWidthTag: field = &info.width; break;
+         case kImageLengthTag: field = &info.height; break;
+         case kBitsPerSampleTag: field = &info.bits; break;
+         case kCompressionTag: field = &info.compression; break;
+         case kPredictionTag: field = &info.predictor; break;
+         case kPlanarConfigurationTag: field = &info.planar; break;
+         case kSamplesPerPixelTag: field = &info.samples; break;
+         case kRowsPerStripTag: field = &info.rows_per_strip; break;
+         case kStripOffsetsTag:
+            ReadTiffEntryValues(entry+2,info.strip_offsets);
+            continue;
+         case kStripBytesCountTag:
+            ReadTiffEntryValues(entry+2,info.strip_counts);
+            continue;
+         default:
+            continue;
+         }
+         ReadTiffEntryValues(entry+2,values);
+         if (values.size() > 0) *field = values[0];
+      }
+      //a missing rows per strip means the whole image is one strip
+      if (info.rows_per_strip == 0 || info.rows_per_strip > info.height)
+         info.rows_per_strip = info.height;
+
+      uint64_t next_offset = 0;
+      if (isBig_) {
+         memcpy(&next_offset,&block[multiplier*num_entries],sizeof(uint64_t));
+         if (swap_) next_offset = SwapLong(next_offset);
+      } else {
+         uint32_t temp = 0;
+         memcpy(&temp,&block[multiplier*num_entries],sizeof(uint32_t));
+         if (swap_) temp = SwapWord(temp);
+         next_offset = static_cast<uint64_t>(temp);
+      }
+
+      ifds_.push_back(info);
+      // count it if it's not a thumbnail
+      if (info.subfile_type != 1)
+         page_ifds_.push_back(ifds_.size()-1);
+      offset = next_offset;
+   }
+   tiff_stream.clear();
 }
 
 void TIFReader::ResetTiff()
@@ -737,39 +1048,216 @@ void TIFReader::OpenTiff(std::wstring name)
    // make sure this is a proper tiff and set the state.
    if (isBig_ || tiff_num == kRegularTiff || swap_) {
       ResetTiff();
+      ParseTiffIFDs();
+      ResetTiff();
+      CLOSE_MAPPED_FILE(tiff_map_);
+      if (use_map_)
+         OPEN_MAPPED_FILE(name, tiff_map_);
    } else {
       throw std::runtime_error( "TIFF file formatted incorrectly. Wrong Type." );
    }
 }
 
-void TIFReader::CloseTiff() { if (tiff_stream.is_open()) tiff_stream.close(); }
+void TIFReader::CloseTiff()
+{
+   if (tiff_stream.is_open()) tiff_stream.close();
+   CLOSE_MAPPED_FILE(tiff_map_);
+   ifds_.clear();
+   page_ifds_.clear();
+}
 
-Nrrd* TIFReader::ReadTiff(std::vector<SliceInfo> &filelist,
-      int c, bool get_max) {
-   uint64_t numPages = static_cast<uint64_t>(filelist.size());
-   if (numPages <= 0)
+void TIFReader::ReadTiffStrip(const TiffOutput &out, uint64_t pageindex,
+      uint64_t page, uint64_t strip, void* buf, vector<int> &max_values)
+{
+   if (page >= page_ifds_.size())
+      return;
+   const TiffIFDInfo &ifd = ifds_[page_ifds_[page]];
+   bool eight_bit = out.bits == 8;
+   long long valindex;
+   if (out.samples > 1) {
+      DecodeTiffStrip(ifd, strip, buf, out.strip_size);
+      uint64_t num_pixels = out.strip_size/out.samples/(eight_bit?1:2);
+      uint64_t indexinpage = strip*num_pixels;
+      if (indexinpage >= out.pagepixels)
+         return;
+      num_pixels = min(num_pixels, out.pagepixels-indexinpage);
+      valindex = pageindex*out.pagepixels + indexinpage;
+      //the strip is decoded once and split into every requested channel
+      for (size_t k=0; k<out.val.size(); k++) {
+         uint64_t sample = out.c + k;
+         if (eight_bit) {
+            uint8_t* src = (uint8_t*)buf + sample;
+            uint8_t* dst = (uint8_t*)out.val[k] + valindex;
+            for (uint64_t i=0; i<num_pixels; i++)
+               dst[i] = src[i*out.samples];
+         } else {
+            uint16_t* src = (uint16_t*)buf + sample;
+            uint16_t* dst = (uint16_t*)out.val[k] + valindex;
+            int max_value = max_values[k];
+            for (uint64_t i=0; i<num_pixels; i++) {
+               dst[i] = src[i*out.samples];
+               if (dst[i] > max_value)
+                  max_value = dst[i];
+            }
+            if (out.get_max)
+               max_values[k] = max_value;
+         }
+      }
+   } else {
+      valindex = pageindex*out.pagepixels +
+         strip*out.strip_size/(eight_bit?1:2);
+      //the last strip of a page may hold fewer rows
+      uint64_t strip_size_used = out.strip_size;
+      if ((strip+1)*out.rowsperstrip > out.height)
+         strip_size_used = out.height>strip*out.rowsperstrip?
+            (out.height-strip*out.rowsperstrip)*out.width*(out.bits/8):0;
+      if (strip_size_used > 0)
+      {
+         if (eight_bit)
+            DecodeTiffStrip(ifd, strip,
+                  (uint8_t*)out.val[0]+valindex,strip_size_used);
+         else
+            DecodeTiffStrip(ifd, strip,
+                  (uint16_t*)out.val[0]+valindex,strip_size_used);
+      }
+   }
+}
+
+void TIFReader::ReadTiffSlice(const TiffOutput &out, wstring filename,
+      uint64_t pageindex, void* buf, vector<int> &max_values)
+{
+   //each slice gets its own reader so slices can be read concurrently
+   TIFReader reader;
+   reader.SetMemoryMapped(use_map_);
+   reader.OpenTiff(filename);
+   if (reader.page_ifds_.size() > 0) {
+      uint64_t num_strips =
+         reader.ifds_[reader.page_ifds_[0]].strip_offsets.size();
+      for (uint64_t strip=0; strip<num_strips; strip++)
+         reader.ReadTiffStrip(out, pageindex, 0, strip, buf, max_values);
+   }
+   reader.CloseTiff();
+}
+
+void TIFReader::ReadTiffPageRegion(uint64_t page, int c,
+      const VolumeRegion &region, void* val, int zi,
+      vector<unsigned char> &buf)
+{
+   size_t rx = region.GetXSize();
+   size_t ry = region.GetYSize();
+   if (page >= page_ifds_.size())
+      return;
+   const TiffIFDInfo &ifd = ifds_[page_ifds_[page]];
+   size_t elem_size = ifd.bits/8;
+   uint64_t samples = ifd.samples==0?1:ifd.samples;
+   uint64_t pixel_size = samples*elem_size;
+   uint64_t row_size = ifd.width*pixel_size;
+   uint64_t rps = ifd.rows_per_strip;
+   unsigned char* out = (unsigned char*)val + zi*rx*ry*elem_size;
+   if (rps == 0 || row_size == 0 || (uint64_t)c >= samples ||
+         ifd.width < (uint64_t)region.x1 || ifd.height < (uint64_t)region.y1)
+      return;
+   uint64_t strip_size = rps*row_size;
+   if (buf.size() < strip_size)
+      buf.resize(strip_size);
+
+   //only the strips holding sampled rows are decoded
+   uint64_t last_strip = (region.y1-1)/rps;
+   for (uint64_t strip=region.y0/rps; strip<=last_strip; strip++) {
+      uint64_t row0 = strip*rps;
+      uint64_t row1 = min(row0+rps, (uint64_t)region.y1);
+      uint64_t y = region.y0;
+      if (row0 > y)
+         y += (row0-y+region.sy-1)/region.sy*region.sy;
+      if (y >= row1)
+         continue;
+      DecodeTiffStrip(ifd, strip, &buf[0], strip_size);
+      for (; y<row1; y+=region.sy) {
+         const unsigned char* src = &buf[0] + (y-row0)*row_size +
+            region.x0*pixel_size + c*elem_size;
+         unsigned char* dst = out + (y-region.y0)/region.sy*rx*elem_size;
+         if (pixel_size == elem_size && region.sx == 1)
+            memcpy(dst, src, rx*elem_size);
+         else
+            for (size_t x=0; x<rx; x++)
+               memcpy(dst+x*elem_size, src+x*region.sx*pixel_size, elem_size);
+      }
+   }
+}
+
+Nrrd* TIFReader::ReadTiffRegion(vector<SliceInfo> &filelist, int c,
+      bool get_max, VolumeRegion region)
+{
+   if (filelist.size() == 0)
+      return 0;
+   bool sequence = filelist.size() > 1;
+   OpenTiff(filelist[0].slice);
+   if (page_ifds_.size() == 0) {
+      CloseTiff();
       return 0;
-   wstring filename = filelist[0].slice;
-   OpenTiff(filename.c_str());
-   bool sequence = numPages > 1;
-   if (!sequence) {
-      if (get_max)
-         numPages = GetNumTiffPages();
-      else
-         numPages = m_slice_num;
    }
+   const TiffIFDInfo &first_ifd = ifds_[page_ifds_[0]];
+   uint64_t width = first_ifd.width;
+   uint64_t height = first_ifd.height;
+   uint64_t bits = first_ifd.bits;
+   uint64_t num_pages = sequence?filelist.size():page_ifds_.size();
+   ReadTiffSpacing();
+   m_x_size = width;
+   m_y_size = height;
+   m_slice_num = num_pages;
+   region.Clip(width, height, num_pages);
+   if (region.IsEmpty() || (bits != 8 && bits != 16)) {
+      CloseTiff();
+      return 0;
+   }
+   if (sequence) CloseTiff();
 
-   uint64_t width = GetTiffField(kImageWidthTag,NULL,0);
-   uint64_t height = GetTiffField(kImageLengthTag,NULL,0);
-   uint64_t bits = GetTiffField(kBitsPerSampleTag,NULL,0);
-   uint64_t samples = GetTiffField(kSamplesPerPixelTag,NULL,0);
-   if (samples == 0 && width > 0 && height > 0) samples = 1;
+   bool eight_bit = bits == 8;
+   unsigned long long total_size = (unsigned long long)region.GetXSize()*
+      (unsigned long long)region.GetYSize()*(unsigned long long)region.GetZSize();
+   void *val = eight_bit?(void*)(new unsigned char[total_size]):
+      (void*)(new unsigned short[total_size]);
+   //pages that do not match the first one stay black
+   memset(val, 0, total_size*(eight_bit?1:2));
+
+   vector<unsigned char> buf;
+   int zi = 0;
+   for (int z=region.z0; z<region.z1; z+=region.sz, zi++) {
+      if (sequence) {
+         TIFReader reader;
+         reader.SetMemoryMapped(use_map_);
+         reader.OpenTiff(filelist[z].slice);
+         reader.ReadTiffPageRegion(0, c, region, val, zi, buf);
+         reader.CloseTiff();
+      } else
+         ReadTiffPageRegion(z, c, region, val, zi, buf);
+   }
+   if (!sequence) CloseTiff();
 
+   Nrrd *nrrdout = WrapRegion(val,
+         eight_bit?nrrdTypeUChar:nrrdTypeUShort, region);
+   if (!eight_bit) {
+      if (get_max) {
+         m_max_value = 0.0;
+         for (size_t i=0; i<total_size; i++) {
+            double value = ((unsigned short*)val)[i];
+            m_max_value = value>m_max_value ? value : m_max_value;
+         }
+      }
+      if (m_max_value > 0.0) m_scalar_scale = 65535.0 / m_max_value;
+      else m_scalar_scale = 1.0;
+   } else m_max_value = 255.0;
+
+   SetInfo();
+
+   return nrrdout;
+}
+
+void TIFReader::ReadTiffSpacing()
+{
    float x_res = 0.0, y_res = 0.0, z_res = 0.0;
    GetTiffField(kXResolutionTag,&x_res,sizeof(float));
    GetTiffField(kYResolutionTag,&y_res,sizeof(float));
-   uint64_t rowsperstrip = GetTiffField(kRowsPerStripTag,NULL,0);
-   uint64_t strip_size = rowsperstrip * width * samples * (bits/8);
 
    char img_desc[256];
    GetTiffField(kImageDescriptionTag, img_desc, 256);
@@ -794,6 +1282,54 @@ Nrrd* TIFReader::ReadTiff(std::vector<SliceInfo> &filelist,
       m_yspc = 1.0;
       m_zspc = 1.0;
    }
+}
+
+Nrrd* TIFReader::ReadTiff(std::vector<SliceInfo> &filelist,
+      int c, bool get_max) {
+   vector<Nrrd*> data;
+   vector<double> max_values, scalar_scales;
+   ReadTiff(filelist, c, 1, get_max, data, max_values, scalar_scales);
+   return data.empty()?0:data[0];
+}
+
+void TIFReader::ReadTiff(std::vector<SliceInfo> &filelist,
+      int c, int chans, bool get_max, vector<Nrrd*> &data,
+      vector<double> &max_values, vector<double> &scalar_scales) {
+   data.clear();
+   max_values.clear();
+   scalar_scales.clear();
+   uint64_t numPages = static_cast<uint64_t>(filelist.size());
+   if (numPages <= 0)
+      return;
+   wstring filename = filelist[0].slice;
+   OpenTiff(filename.c_str());
+   bool sequence = numPages > 1;
+   if (!sequence) {
+      if (get_max)
+         numPages = GetNumTiffPages();
+      else
+         numPages = m_slice_num;
+   }
+
+   if (page_ifds_.size() == 0) {
+      CloseTiff();
+      return;
+   }
+   const TiffIFDInfo &first_ifd = ifds_[page_ifds_[0]];
+   uint64_t width = first_ifd.width;
+   uint64_t height = first_ifd.height;
+   uint64_t bits = first_ifd.bits;
+   uint64_t samples = first_ifd.samples;
+   if (samples == 0 && width > 0 && height > 0) samples = 1;
+   if (c < 0 || (uint64_t)c >= samples) {
+      CloseTiff();
+      return;
+   }
+   chans = (int)min((uint64_t)chans, samples-c);
+
+   ReadTiffSpacing();
+   uint64_t rowsperstrip = first_ifd.rows_per_strip;
+   uint64_t strip_size = rowsperstrip * width * samples * (bits/8);
 
    if (m_resize_type == 1 && m_alignment > 1) {
       m_x_size = (width/m_alignment+(width%m_alignment?1:0))*m_alignment;
@@ -808,120 +1344,151 @@ Nrrd* TIFReader::ReadTiff(std::vector<SliceInfo> &filelist,
 
    if (sequence) CloseTiff();
 
-   Nrrd *nrrdout = nrrdNew();
-
    //allocate memory
-   void *val = 0;
    bool eight_bit = bits == 8;
 
    unsigned long long total_size = (unsigned long long)m_x_size*
 	   (unsigned long long)m_y_size*(unsigned long long)numPages;
-   //val = malloc(total_size * (eight_bit?1:2));
-   val = eight_bit?(void*)(new unsigned char[total_size]):
-	   (void*)(new unsigned short[total_size]);
-   if (!val)
-      throw std::runtime_error( "Unable to allocate memory to read TIFF." );
-
-   int max_value = 0;
-
-   void* buf = 0;
-   if (samples > 1)
-      buf = malloc(strip_size);
+   TiffOutput out;
+   for (int k=0; k<chans; k++) {
+      //val = malloc(total_size * (eight_bit?1:2));
+      void* val = eight_bit?(void*)(new unsigned char[total_size]):
+         (void*)(new unsigned short[total_size]);
+      if (!val)
+         throw std::runtime_error( "Unable to allocate memory to read TIFF." );
+      out.val.push_back(val);
+   }
 
-   for (uint64_t pageindex=0; pageindex < numPages; pageindex++)
-   {
-      if (sequence) {
-         filename = filelist[pageindex].slice;
-         OpenTiff(filename);
+   vector<int> max_value(chans, 0);
+
+   out.pagepixels = pagepixels;
+   out.width = width;
+   out.height = height;
+   out.bits = bits;
+   out.samples = samples;
+   out.rowsperstrip = rowsperstrip;
+   out.strip_size = strip_size;
+   out.c = c;
+   out.get_max = get_max;
+
+   //a job is a strip of the open file, or a whole file of a sequence
+   vector<pair<uint64_t, uint64_t> > jobs;
+   if (sequence) {
+      for (uint64_t pageindex=0; pageindex < numPages; pageindex++)
+         jobs.push_back(make_pair(pageindex, (uint64_t)0));
+   } else {
+      //thumbnails are not in the page table
+      for (uint64_t pageindex=0; pageindex < numPages &&
+            pageindex < page_ifds_.size(); pageindex++) {
+         uint64_t num_strips = ifds_[page_ifds_[pageindex]].strip_offsets.size();
+         for (uint64_t strip=0; strip<num_strips; strip++)
+            jobs.push_back(make_pair(pageindex, strip));
       }
-      //this is a thumbnail, skip
-      if (GetTiffField(kSubFileTypeTag,NULL,0) == 1) {
-         if (sequence) CloseTiff();
-         continue;
+   }
+   //strips can only be read concurrently from a mapped file
+   uint64_t thread_num = (sequence || tiff_map_.data)?m_thread_num:1;
+   thread_num = min(thread_num, (uint64_t)jobs.size());
+
+   if (thread_num <= 1) {
+      void* buf = 0;
+      if (samples > 1)
+         buf = malloc(strip_size);
+      for (size_t i=0; i<jobs.size(); i++) {
+         if (sequence)
+            ReadTiffSlice(out, filelist[jobs[i].first].slice,
+                  jobs[i].first, buf, max_value);
+         else
+            ReadTiffStrip(out, jobs[i].first, jobs[i].first,
+                  jobs[i].second, buf, max_value);
       }
-
-      uint64_t num_strips = GetTiffField(kStripOffsetsTag, NULL,kCount);
-
-      //read file
-      for (uint64_t strip=0; strip<num_strips; strip++)
-      {
-         long long valindex;
-         int indexinpage;
-         if (samples > 1) {
-            GetTiffStrip(sequence?0:pageindex, strip, buf,strip_size);
-            int num_pixels = strip_size/samples/(eight_bit?1:2);
-            indexinpage = strip*num_pixels;
-            valindex = pageindex*pagepixels + indexinpage;
-            for (int i=0; i<num_pixels; i++) {
-               if (indexinpage++ >= pagepixels) break;
-               if (eight_bit)
-                  memcpy((uint8_t*)val+valindex,
-                        (uint8_t*)buf+samples*i+c,sizeof(uint8_t));
-               else
-                  memcpy((uint16_t*)val+valindex,
-                        (uint16_t*)buf+samples*i+c,sizeof(uint16_t));
-               if (!eight_bit && get_max &&
-                     *((uint16_t*)val+valindex) > max_value)
-                  max_value = *((uint16_t*)val+valindex);
-               valindex++;
+      if (buf)
+         free(buf);
+   } else {
+      std::atomic<size_t> next_job(0);
+      std::mutex result_mutex;
+      std::exception_ptr error;
+      vector<std::thread> workers;
+      for (uint64_t t=0; t<thread_num; t++) {
+         workers.push_back(std::thread([&]() {
+            void* buf = 0;
+            if (samples > 1)
+               buf = malloc(strip_size);
+            vector<int> worker_max(out.val.size(), 0);
+            try {
+               for (size_t i = next_job++; i < jobs.size(); i = next_job++) {
+                  if (sequence)
+                     ReadTiffSlice(out, filelist[jobs[i].first].slice,
+                           jobs[i].first, buf, worker_max);
+                  else
+                     ReadTiffStrip(out, jobs[i].first, jobs[i].first,
+                           jobs[i].second, buf, worker_max);
+               }
+            } catch (...) {
+               std::lock_guard<std::mutex> lock(result_mutex);
+               if (!error) error = std::current_exception();
+               next_job = jobs.size();
             }
-         } else {
-            valindex = pageindex*pagepixels +
-               strip*strip_size/(eight_bit?1:2);
-			uint64_t strip_size_used = strip_size;
-			if (valindex+strip_size >= total_size)
-				strip_size_used = total_size-valindex;
-			if (strip_size_used > 0)
-			{
-				if (eight_bit)
-				   GetTiffStrip(sequence?0:pageindex, strip,
-						 (uint8_t*)val+valindex,strip_size_used);
-				else
-				   GetTiffStrip(sequence?0:pageindex, strip,
-						 (uint16_t*)val+valindex,strip_size_used);
-			}
+            if (buf)
+               free(buf);
+            std::lock_guard<std::mutex> lock(result_mutex);
+            for (size_t k=0; k<worker_max.size(); k++)
+               max_value[k] = max(max_value[k], worker_max[k]);
+         }));
+      }
+      for (size_t t=0; t<workers.size(); t++)
+         workers[t].join();
+      if (error) {
+         if (!sequence) CloseTiff();
+         for (size_t k=0; k<out.val.size(); k++) {
+            if (eight_bit)
+               delete[] (unsigned char*)out.val[k];
+            else
+               delete[] (unsigned short*)out.val[k];
          }
+         std::rethrow_exception(error);
       }
-      if (sequence) CloseTiff();
    }
 
-   if (samples > 1 && buf)
-      free(buf);
    if (!sequence) CloseTiff();
 
-   //write to nrrd
-   if (eight_bit)
-      nrrdWrap(nrrdout, (uint8_t*)val, nrrdTypeUChar,
-            3, (size_t)m_x_size, (size_t)m_y_size, (size_t)numPages);
-   else
-      nrrdWrap(nrrdout, (uint16_t*)val, nrrdTypeUShort,
-            3, (size_t)m_x_size, (size_t)m_y_size, (size_t)numPages);
-   nrrdAxisInfoSet(nrrdout, nrrdAxisInfoSpacing, m_xspc, m_yspc, m_zspc);
-   nrrdAxisInfoSet(nrrdout, nrrdAxisInfoMax, m_xspc*m_x_size,
-         m_yspc*m_y_size, m_zspc*numPages);
-   nrrdAxisInfoSet(nrrdout, nrrdAxisInfoMin, 0.0, 0.0, 0.0);
-   nrrdAxisInfoSet(nrrdout, nrrdAxisInfoSize, (size_t)m_x_size,
-         (size_t)m_y_size, (size_t)numPages);
-
-   if (!eight_bit) {
-      if (get_max) {
-         if (samples > 1)
-            m_max_value = max_value;
-         else {
-            double value;
-            for (size_t i=0; i<(size_t)m_slice_num*(size_t)m_x_size*(size_t)m_y_size; i++) {
-               value= ((unsigned short*)nrrdout->data)[i];
-               m_max_value = value>m_max_value ? value : m_max_value;
+   for (int k=0; k<chans; k++) {
+      //write to nrrd
+      Nrrd *nrrdout = nrrdNew();
+      if (eight_bit)
+         nrrdWrap(nrrdout, (uint8_t*)out.val[k], nrrdTypeUChar,
+               3, (size_t)m_x_size, (size_t)m_y_size, (size_t)numPages);
+      else
+         nrrdWrap(nrrdout, (uint16_t*)out.val[k], nrrdTypeUShort,
+               3, (size_t)m_x_size, (size_t)m_y_size, (size_t)numPages);
+      nrrdAxisInfoSet(nrrdout, nrrdAxisInfoSpacing, m_xspc, m_yspc, m_zspc);
+      nrrdAxisInfoSet(nrrdout, nrrdAxisInfoMax, m_xspc*m_x_size,
+            m_yspc*m_y_size, m_zspc*numPages);
+      nrrdAxisInfoSet(nrrdout, nrrdAxisInfoMin, 0.0, 0.0, 0.0);
+      nrrdAxisInfoSet(nrrdout, nrrdAxisInfoSize, (size_t)m_x_size,
+            (size_t)m_y_size, (size_t)numPages);
+
+      if (!eight_bit) {
+         if (get_max) {
+            if (samples > 1)
+               m_max_value = max_value[k];
+            else {
+               double value;
+               for (size_t i=0; i<(size_t)m_slice_num*(size_t)m_x_size*(size_t)m_y_size; i++) {
+                  value= ((unsigned short*)nrrdout->data)[i];
+                  m_max_value = value>m_max_value ? value : m_max_value;
+               }
             }
          }
-      }
-      if (m_max_value > 0.0) m_scalar_scale = 65535.0 / m_max_value;
-	  else m_scalar_scale = 1.0;
-   } else m_max_value = 255.0;
+         if (m_max_value > 0.0) m_scalar_scale = 65535.0 / m_max_value;
+         else m_scalar_scale = 1.0;
+      } else m_max_value = 255.0;
 
-   SetInfo();
+      data.push_back(nrrdout);
+      max_values.push_back(m_max_value);
+      scalar_scales.push_back(m_scalar_scale);
+   }
 
-   return nrrdout;
+   SetInfo();
 }
 
 void TIFReader::SetInfo()
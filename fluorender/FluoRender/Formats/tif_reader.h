@@ -29,12 +29,15 @@ DEALINGS IN THE SOFTWARE.
 #define _TIF_READER_H_
 
 #include <base_reader.h>
+#include <seq_index.h>
+#include "../compatibility.h"
 #include <cstdio>
 #include <vector>
 #include <fstream>
 #include <iostream>
 #include <stdexcept>
 #include <algorithm>
+#include <set>
 #include <stdint.h>
 
 using namespace std;
@@ -54,6 +57,22 @@ public:
 	void SetTimeId(wstring &id);
 	wstring GetTimeId();
 	void Preprocess();
+	/**
+	 * Turns reading through a memory mapping of the file on or off.
+	 * Strips are then copied or decoded straight from the mapping.
+	 * Falls back to stream reads if the file cannot be mapped.
+	 * @param mapped True to map files when they are opened.
+	 */
+	void SetMemoryMapped(bool mapped);
+	bool GetMemoryMapped() {return use_map_;}
+	/**
+	 * Sets how many threads decode strips and pages in ReadTiff.
+	 * Strips of a single file are decoded in parallel only when
+	 * it is memory mapped, files of a sequence always are.
+	 * @param num The number of threads, 1 decodes on the calling thread.
+	 */
+	void SetThreadNum(int num) {m_thread_num = num<1?1:num;}
+	int GetThreadNum() {return m_thread_num;}
 	/**
 	 * Finds the tag value given by \@tag of a tiff on the current page.
 	 * @param tag The tag to look for in the header.
@@ -124,7 +143,8 @@ public:
 	 */
 	uint64_t GetNumTiffPages();
 	/**
-	 * Gets the specified offset for the strip offset or count.
+	 * Gets the specified offset for the strip offset or count
+	 * of the current page.
 	 * @param tag The tag for either the offset or the count.
 	 * @param strip The strip number to get the correct count/offset.
 	 * @return The count or strip offset determined by @strip.
@@ -133,11 +153,15 @@ public:
 	void SetBatch(bool batch);
 	int LoadBatch(int index);
 	Nrrd* Convert(int t, int c, bool get_max);
+	void ConvertAllChannels(int t, bool get_max, vector<Nrrd*> &data,
+		vector<double> &max_values, vector<double> &scalar_scales);
+	Nrrd* ConvertRegion(int t, int c, bool get_max, VolumeRegion region);
 	wstring GetCurName(int t, int c);
 
 	wstring GetPathName() {return m_path_name;}
 	wstring GetDataName() {return m_data_name;}
 	int GetCurTime() {return m_cur_time;}
+	void SetCurTime(int t) {m_cur_time = t;}
 	int GetTimeNum() {return m_time_num;}
 	int GetChanNum() {return m_chan_num;}
 	double GetExcitationWavelength(int chan) {return 0.0;}
@@ -186,6 +210,7 @@ private:
 	double m_zspc;
 	double m_max_value;
 	double m_scalar_scale;
+	int m_thread_num;
 
 	//time sequence id
 	wstring m_time_id;
@@ -197,6 +222,44 @@ private:
 	uint64_t current_offset_;
 	/** Tells us if the data is little endian */
 	bool swap_;
+	/** Map files instead of reading strips through the stream */
+	bool use_map_;
+	/** The mapping of the open tiff, data is null if not mapped */
+	MAPPED_FILE tiff_map_;
+	/** The header fields of one IFD, parsed once when the tiff is opened */
+	struct TiffIFDInfo
+	{
+		uint64_t offset;		//file offset of the IFD
+		uint64_t subfile_type;	//1 for thumbnails
+		uint64_t width;
+		uint64_t height;
+		uint64_t bits;			//bits per sample
+		uint64_t samples;		//samples per pixel
+		uint64_t compression;
+		uint64_t predictor;
+		uint64_t planar;		//planar configuration
+		uint64_t rows_per_strip;
+		vector<uint64_t> strip_offsets;
+		vector<uint64_t> strip_counts;
+	};
+	/** Where ReadTiff puts the decoded strips */
+	struct TiffOutput
+	{
+		vector<void*> val;		//output volumes, one per channel
+		uint64_t pagepixels;	//pixels of one output page
+		uint64_t width;
+		uint64_t height;
+		uint64_t bits;
+		uint64_t samples;
+		uint64_t rowsperstrip;
+		uint64_t strip_size;	//uncompressed bytes of a full strip
+		int c;					//channel of the first output
+		bool get_max;
+	};
+	/** All IFDs of the open tiff in file order */
+	vector<TiffIFDInfo> ifds_;
+	/** The IFD index of each page, thumbnails excluded */
+	vector<uint64_t> page_ifds_;
 	/** The tiff tag for subfile type */
 	static const uint64_t kSubFileTypeTag = 254;
 	/** The tiff tag for image width */
@@ -262,8 +325,96 @@ private:
 
 	static bool tif_sort(const TimeDataInfo& info1, const TimeDataInfo& info2);
 	static bool tif_slice_sort(const SliceInfo& info1, const SliceInfo& info2);
+	/**
+	 * Builds the 4D sequence from the groups of a sidecar index.
+	 * @param groups The time points stored in the index.
+	 */
+	void FromSeqIndex(vector<SeqIndex::GroupInfo> &groups);
+	/**
+	 * Stores the 4D sequence in the groups of a sidecar index.
+	 * @param groups The time points to store in the index.
+	 */
+	void ToSeqIndex(vector<SeqIndex::GroupInfo> &groups);
+	/**
+	 * Walks the IFD chain of the open tiff once and fills the IFD table.
+	 * @throws An exception if a tiff is not open.
+	 */
+	void ParseTiffIFDs();
+	/**
+	 * Reads the values of one IFD entry.
+	 * @param entry The raw bytes of the entry, tag excluded.
+	 * @param values The list to store the values in.
+	 */
+	void ReadTiffEntryValues(const char* entry, vector<uint64_t> &values);
+	/**
+	 * Reads and decodes one strip of an IFD. Only reads the tiff state,
+	 * so it can run on several threads when the file is mapped.
+	 * @param ifd The IFD the strip belongs to.
+	 * @param strip Which strip to read.
+	 * @param data The location of the buffer to store data.
+	 * @param strip_size The uncompressed size.
+	 */
+	void DecodeTiffStrip(const TiffIFDInfo &ifd, uint64_t strip,
+		void * data, uint64_t strip_size);
+	/**
+	 * Decodes one strip into its place in the output volume.
+	 * @param out The output layout.
+	 * @param pageindex The page in the output volume.
+	 * @param page The page in the open tiff.
+	 * @param strip Which strip to read.
+	 * @param buf A strip sized buffer for interleaved samples.
+	 * @param max_values The max value of each output, updated if computed.
+	 */
+	void ReadTiffStrip(const TiffOutput &out, uint64_t pageindex,
+		uint64_t page, uint64_t strip, void* buf, vector<int> &max_values);
+	/**
+	 * Opens one file of a slice sequence and decodes its first page.
+	 * @param out The output layout.
+	 * @param filename The file of the slice.
+	 * @param pageindex The page in the output volume.
+	 * @param buf A strip sized buffer for interleaved samples.
+	 * @param max_values The max value of each output, updated if computed.
+	 */
+	void ReadTiffSlice(const TiffOutput &out, wstring filename,
+		uint64_t pageindex, void* buf, vector<int> &max_values);
+	/**
+	 * Decodes the strips of a page that hold rows of a region.
+	 * @param page The page in the open tiff.
+	 * @param c The channel to extract.
+	 * @param region The region to read.
+	 * @param val The output volume of the region.
+	 * @param zi The slice of the region to write.
+	 * @param buf A buffer for the decoded strips.
+	 */
+	void ReadTiffPageRegion(uint64_t page, int c, const VolumeRegion &region,
+		void* val, int zi, vector<unsigned char> &buf);
+	/**
+	 * Reads a region of a channel, skipping pages and strips outside it.
+	 * @param filelist The files of the slices.
+	 * @param c The channel to read.
+	 * @param get_max Whether to compute the max value.
+	 * @param region The region to read.
+	 * @return The volume of the region.
+	 */
+	Nrrd* ReadTiffRegion(vector<SliceInfo> &filelist, int c, bool get_max,
+		VolumeRegion region);
+	/** Reads the spacings from the tags of the open tiff */
+	void ReadTiffSpacing();
 	//read tiff
 	Nrrd* ReadTiff(vector<SliceInfo> &filelist, int c, bool get_max);
+	/**
+	 * Reads the channels c to c+chans-1 in one pass over the strips.
+	 * @param filelist The files of the slices.
+	 * @param c The first channel to read.
+	 * @param chans How many channels to read.
+	 * @param get_max Whether to compute the max values.
+	 * @param data The volume of each channel read.
+	 * @param max_values The max value of each channel read.
+	 * @param scalar_scales The scalar scale of each channel read.
+	 */
+	void ReadTiff(vector<SliceInfo> &filelist, int c, int chans,
+		bool get_max, vector<Nrrd*> &data,
+		vector<double> &max_values, vector<double> &scalar_scales);
 };
 
 #endif//_TIF_READER_H_
@@ -0,0 +1,250 @@
+/*
+For more information, please see: http://software.sci.utah.edu
+
+The MIT License
+
+Copyright (c) 2014 Scientific Computing and Imaging Institute,
+University of Utah.
+
+
+Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the "Software"),
+to deal in the Software without restriction, including without limitation
+the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.
+*/
+
+
+
+//test of the brick download cache against a local http server
+//the server answers range and conditional requests, so no network access is needed
+
+#include "Tests/TestServer.h"
+#include "compatibility.h"
+#include "FLIVR/BrickCache.h"
+#include "FLIVR/TextureBrick.h"
+#include <wx/init.h>
+#include <wx/filename.h>
+#include <wx/dir.h>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+using namespace std;
+using namespace FLIVR;
+
+static int failed = 0;
+#define CHECK(cond) \
+	do { \
+		if (!(cond)) \
+		{ \
+			fprintf(stderr, "line %d: %s\n", __LINE__, #cond); \
+			failed++; \
+		} \
+	} while (0)
+
+static string MakeData(size_t size, unsigned int seed)
+{
+	string data(size, 0);
+	for (size_t i = 0; i < size; i++)
+	{
+		seed = seed * 1103515245u + 12345u;
+		data[i] = (char)(seed >> 16);
+	}
+	return data;
+}
+
+static string ReadFile(const wstring &name)
+{
+	ifstream ifs(ws2s(name).c_str(), ios::binary);
+	return string(istreambuf_iterator<char>(ifs), istreambuf_iterator<char>());
+}
+
+static void WriteFile(const wstring &name)
+{
+	ofstream ofs(ws2s(name).c_str(), ios::binary);
+	ofs << "part";
+}
+
+static int CountParts(const wstring &dir)
+{
+	wxArrayString parts;
+	return (int)wxDir::GetAllFiles(dir, &parts, "*.part*", wxDIR_FILES);
+}
+
+int main()
+{
+	wxInitializer initializer;
+	if (!initializer.IsOk())
+	{
+		fprintf(stderr, "Failed to initialize wxWidgets.\n");
+		return 1;
+	}
+	curl_global_init(CURL_GLOBAL_ALL);
+
+	TestServer server;
+	if (!server.start())
+	{
+		fprintf(stderr, "Failed to start the http server.\n");
+		return 1;
+	}
+	string a = MakeData(100000, 1);
+	string b = MakeData(50000, 2);
+	server.set_file("/a.raw", a, "\"a1\"");
+	server.set_file("/b.raw", b, "\"b1\"");
+	wstring url_a = s2ws(server.url("/a.raw"));
+	wstring url_b = s2ws(server.url("/b.raw"));
+
+	unsigned long pid = wxGetProcessId();
+	wstring dir = (wxFileName::GetTempDir() + GETSLASH() +
+		wxString::Format("vvd_cache_test_%lu", pid)).ToStdWstring();
+	BrickCache::set_dir(dir);
+	dir = BrickCache::get_dir();
+	CURL *curl = curl_easy_init();
+	wstring fn;
+
+	//a whole file is downloaded once
+	FileLocInfo whole(url_a, 0, 0, BRICK_FILE_TYPE_RAW, true);
+	CHECK(BrickCache::acquire(&whole, fn, curl) && ReadFile(fn) == a);
+	BrickCache::release(fn);
+	CHECK(BrickCache::acquire(&whole, fn, curl) && ReadFile(fn) == a);
+	BrickCache::release(fn);
+	CHECK(server.requests() == 1);
+
+	//a packed brick is fetched with a range request and cached on its own
+	FileLocInfo brick(url_a, 1000, 500, BRICK_FILE_TYPE_RAW, true);
+	CHECK(BrickCache::acquire(&brick, fn, curl) && ReadFile(fn) == a.substr(1000, 500));
+	BrickCache::release(fn);
+	CHECK(server.last_range() == "bytes=1000-1499");
+	CHECK(server.requests() == 2);
+
+	//bricks of one file are fetched with one request
+	FileLocInfo b0(url_b, 0, 300, BRICK_FILE_TYPE_RAW, true);
+	FileLocInfo b1(url_b, 5000, 700, BRICK_FILE_TYPE_RAW, true);
+	vector<const FileLocInfo*> finfos;
+	finfos.push_back(&b0);
+	finfos.push_back(&b1);
+	BrickCache::Download *d = BrickCache::begin(finfos, curl);
+	CHECK(d != NULL);
+	vector<wstring> fns;
+	if (d)
+		CHECK(BrickCache::finish(d, curl_easy_perform(curl), fns));
+	CHECK(fns.size() == 2 &&
+		ReadFile(fns[0]) == b.substr(0, 300) &&
+		ReadFile(fns[1]) == b.substr(5000, 700));
+	for (size_t i = 0; i < fns.size(); i++)
+		if (!fns[i].empty())
+			BrickCache::release(fns[i]);
+	CHECK(server.last_range() == "bytes=0-5699");
+	CHECK(server.requests() == 3);
+
+	//a server without range support sends the whole file
+	server.set_ranges(false);
+	FileLocInfo b2(url_b, 20000, 1000, BRICK_FILE_TYPE_RAW, true);
+	CHECK(BrickCache::acquire(&b2, fn, curl) && ReadFile(fn) == b.substr(20000, 1000));
+	BrickCache::release(fn);
+	server.set_ranges(true);
+
+	//a missing file fails and leaves no partial download
+	FileLocInfo missing(s2ws(server.url("/none.raw")), 0, 0, BRICK_FILE_TYPE_RAW, true);
+	CHECK(!BrickCache::acquire(&missing, fn, curl));
+	CHECK(CountParts(dir) == 0);
+
+	//when the index is loaded, parts left by this process and expired parts
+	//of other instances are removed, parts of running instances are kept
+	BrickCache::save_index();
+	wstring own = dir + wxString::Format("0000.part%lu_1", pid).ToStdWstring();
+	wstring other = dir + wxString::Format("0001.part%lu_1", pid + 1).ToStdWstring();
+	wstring expired = dir + wxString::Format("0002.part%lu_2", pid + 1).ToStdWstring();
+	WriteFile(own);
+	WriteFile(other);
+	WriteFile(expired);
+	wxDateTime old = wxDateTime::Now() - wxTimeSpan::Hours(2);
+	wxFileName(expired).SetTimes(&old, &old, NULL);
+	BrickCache::set_dir(dir);
+	BrickCache::get_dir();
+	CHECK(!wxFileExists(own));
+	CHECK(wxFileExists(other));
+	CHECK(!wxFileExists(expired));
+	wxRemoveFile(other);
+
+	//files cached in an earlier session are revalidated once
+	int requests = server.requests();
+	CHECK(BrickCache::acquire(&brick, fn, curl) && ReadFile(fn) == a.substr(1000, 500));
+	BrickCache::release(fn);
+	CHECK(BrickCache::acquire(&brick, fn, curl) && ReadFile(fn) == a.substr(1000, 500));
+	BrickCache::release(fn);
+	CHECK(server.requests() == requests + 1);
+	CHECK(server.not_modified() == 1);
+
+	//a changed file is downloaded again
+	string a2 = MakeData(100000, 3);
+	server.set_file("/a.raw", a2, "\"a2\"");
+	BrickCache::set_dir(dir);
+	CHECK(BrickCache::acquire(&brick, fn, curl) && ReadFile(fn) == a2.substr(1000, 500));
+	BrickCache::release(fn);
+
+	//a file without a validator is downloaded again after a restart and
+	//the new content replaces the old one
+	string c = MakeData(2000, 4);
+	string c2 = MakeData(2000, 5);
+	server.set_file("/c.raw", c, "");
+	FileLocInfo nocheck(s2ws(server.url("/c.raw")), 0, 0, BRICK_FILE_TYPE_RAW, true);
+	CHECK(BrickCache::acquire(&nocheck, fn, curl) && ReadFile(fn) == c);
+	BrickCache::release(fn);
+	server.set_file("/c.raw", c2, "");
+	BrickCache::set_dir(dir);
+	CHECK(BrickCache::acquire(&nocheck, fn, curl) && ReadFile(fn) == c2);
+	BrickCache::release(fn);
+	CHECK(CountParts(dir) == 0);
+
+	//without revalidation the cached copy is used as it is
+	BrickCache::set_dir(dir);
+	BrickCache::set_revalidate(false);
+	requests = server.requests();
+	CHECK(BrickCache::acquire(&whole, fn, curl) && ReadFile(fn) == a);
+	BrickCache::release(fn);
+	CHECK(server.requests() == requests);
+	BrickCache::set_revalidate(true);
+
+	//over the cap, the least recently used files are removed
+	//unless they are being read
+	BrickCache::clear();
+	BrickCache::set_max_size(1200);
+	wstring fn0, fn1, fn2;
+	CHECK(BrickCache::acquire(&b0, fn0, curl));
+	BrickCache::release(fn0);
+	CHECK(BrickCache::acquire(&b1, fn1, curl));
+	CHECK(BrickCache::acquire(&b2, fn2, curl));
+	CHECK(!wxFileExists(fn0));
+	CHECK(wxFileExists(fn1));
+	BrickCache::release(fn1);
+	CHECK(!wxFileExists(fn1));
+	CHECK(wxFileExists(fn2));
+	BrickCache::release(fn2);
+
+	BrickCache::clear();
+	BrickFileHandles::close_all();
+	curl_easy_cleanup(curl);
+	server.stop();
+	curl_global_cleanup();
+	wxFileName::Rmdir(dir, wxPATH_RMDIR_RECURSIVE);
+
+	if (failed)
+		fprintf(stderr, "%d checks failed\n", failed);
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,218 @@
+/*
+For more information, please see: http://software.sci.utah.edu
+
+The MIT License
+
+Copyright (c) 2014 Scientific Computing and Imaging Institute,
+University of Utah.
+
+
+Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the "Software"),
+to deal in the Software without restriction, including without limitation
+the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.
+*/
+
+
+
+//test of the concurrent brick downloads and of reading the cached ranges
+//packed bricks of a remote file are fetched with one range request, and a
+//remote brick is read at offset 0 of its cached copy like a local one
+
+#include "Tests/TestServer.h"
+#include "compatibility.h"
+#include "FLIVR/BrickCache.h"
+#include "FLIVR/TextureBrick.h"
+#include <wx/init.h>
+#include <wx/filename.h>
+#include <wx/dir.h>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+using namespace std;
+using namespace FLIVR;
+
+static int failed = 0;
+#define CHECK(cond) \
+	do { \
+		if (!(cond)) \
+		{ \
+			fprintf(stderr, "line %d: %s\n", __LINE__, #cond); \
+			failed++; \
+		} \
+	} while (0)
+
+//the downloader only passes the bricks through
+static char brick_ids[16];
+static TextureBrick* Brick(int i) { return (TextureBrick*)(brick_ids + i); }
+
+static string MakeData(size_t size, unsigned int seed)
+{
+	string data(size, 0);
+	for (size_t i = 0; i < size; i++)
+	{
+		seed = seed * 1103515245u + 12345u;
+		data[i] = (char)(seed >> 16);
+	}
+	return data;
+}
+
+//what the url readers of TextureBrick do with a downloaded brick
+static string ReadBrick(const FileLocInfo &finfo, const wstring &filename)
+{
+	long long offset = finfo.is_range() ? 0 : finfo.offset;
+	long long size = finfo.datasize > 0 ? finfo.datasize :
+		BrickFileHandles::file_size(filename) - offset;
+	if (size <= 0)
+		return string();
+	string data((size_t)size, 0);
+	if (!BrickFileHandles::read(filename, offset, (size_t)size, &data[0]))
+		return string();
+	return data;
+}
+
+static void Finish(BrickDownloader &dl, vector<BrickDownloader::Result> &done)
+{
+	for (int i = 0; i < 1000 && dl.size() > 0; i++)
+		dl.perform(done, 100);
+}
+
+static const BrickDownloader::Result* Find(const vector<BrickDownloader::Result> &done, const FileLocInfo &finfo)
+{
+	for (size_t i = 0; i < done.size(); i++)
+		if (done[i].key == BrickCache::key(&finfo))
+			return &done[i];
+	return NULL;
+}
+
+int main()
+{
+	wxInitializer initializer;
+	if (!initializer.IsOk())
+	{
+		fprintf(stderr, "Failed to initialize wxWidgets.\n");
+		return 1;
+	}
+	curl_global_init(CURL_GLOBAL_ALL);
+
+	TestServer server;
+	if (!server.start())
+	{
+		fprintf(stderr, "Failed to start the http server.\n");
+		return 1;
+	}
+	string packed = MakeData(40000, 1);
+	string whole = MakeData(6000, 2);
+	server.set_file("/packed.vvd", packed, "\"p1\"");
+	server.set_file("/whole.raw", whole, "\"w1\"");
+	wstring url_p = s2ws(server.url("/packed.vvd"));
+	wstring url_w = s2ws(server.url("/whole.raw"));
+
+	unsigned long pid = wxGetProcessId();
+	wstring dir = (wxFileName::GetTempDir() + GETSLASH() +
+		wxString::Format("vvd_download_test_%lu", pid)).ToStdWstring();
+	BrickCache::set_dir(dir);
+	dir = BrickCache::get_dir();
+
+	vector<FileLocInfo> bricks;
+	for (int i = 0; i < 4; i++)
+		bricks.push_back(FileLocInfo(url_p, 2000 + i * 5000, 3000 + i * 100, BRICK_FILE_TYPE_RAW, true));
+	vector<const FileLocInfo*> finfos;
+	vector<TextureBrick*> ids;
+	for (int i = 0; i < 4; i++)
+	{
+		finfos.push_back(&bricks[i]);
+		ids.push_back(Brick(i));
+	}
+
+	//the packed bricks of a file are one transfer with one range request
+	BrickDownloader dl;
+	CHECK(dl.add(finfos, ids));
+	CHECK(dl.size() == 1);
+	//a brick in flight is joined instead of fetched again
+	CHECK(dl.attach(&bricks[1], Brick(8)));
+	CHECK(dl.add(vector<const FileLocInfo*>(1, &bricks[2]), vector<TextureBrick*>(1, Brick(9))));
+	CHECK(dl.size() == 1);
+	vector<BrickDownloader::Result> done;
+	Finish(dl, done);
+	CHECK(server.requests() == 1);
+	CHECK(server.last_range() == "bytes=2000-20299");
+	CHECK(done.size() == 4);
+	for (int i = 0; i < 4; i++)
+	{
+		const BrickDownloader::Result *r = Find(done, bricks[i]);
+		CHECK(r && !r->filename.empty());
+		if (!r || r->filename.empty())
+			continue;
+		CHECK(ReadBrick(bricks[i], r->filename) == packed.substr(bricks[i].offset, bricks[i].datasize));
+		CHECK(BrickFileHandles::file_size(r->filename) == bricks[i].datasize);
+		CHECK(r->bricks.size() == (i == 1 || i == 2 ? 2 : 1) && r->bricks[0] == Brick(i));
+		BrickCache::release(r->filename);
+	}
+	CHECK(!dl.attach(&bricks[0], Brick(0)));
+
+	//downloaded bricks are read from the cache without a request
+	wstring fn;
+	CHECK(BrickCache::lookup(&bricks[3], fn) &&
+		ReadBrick(bricks[3], fn) == packed.substr(bricks[3].offset, bricks[3].datasize));
+	BrickCache::release(fn);
+	CHECK(server.requests() == 1);
+
+	//a whole file is read from its offset
+	FileLocInfo wfinfo(url_w, 1000, 0, BRICK_FILE_TYPE_RAW, true);
+	done.clear();
+	CHECK(dl.add(vector<const FileLocInfo*>(1, &wfinfo), vector<TextureBrick*>(1, Brick(4))));
+	Finish(dl, done);
+	CHECK(done.size() == 1 && !done[0].filename.empty());
+	if (done.size() == 1 && !done[0].filename.empty())
+	{
+		CHECK(ReadBrick(wfinfo, done[0].filename) == whole.substr(1000));
+		BrickCache::release(done[0].filename);
+	}
+	CHECK(server.last_range().empty());
+
+	//no more transfers than the limit
+	BrickCache::clear();
+	dl.set_max_transfers(1);
+	CHECK(dl.add(vector<const FileLocInfo*>(1, &bricks[0]), vector<TextureBrick*>(1, Brick(0))));
+	CHECK(dl.full());
+	CHECK(!dl.add(vector<const FileLocInfo*>(1, &wfinfo), vector<TextureBrick*>(1, Brick(4))));
+
+	//transfers no brick is waiting for are stopped and leave no files
+	dl.cancel_except(vector<TextureBrick*>(1, Brick(5)));
+	CHECK(dl.size() == 0);
+	wxArrayString parts;
+	CHECK(wxDir::GetAllFiles(dir, &parts, "*.part*", wxDIR_FILES) == 0);
+
+	//a failed download gives an empty file name
+	FileLocInfo missing(s2ws(server.url("/none.vvd")), 0, 100, BRICK_FILE_TYPE_RAW, true);
+	done.clear();
+	CHECK(dl.add(vector<const FileLocInfo*>(1, &missing), vector<TextureBrick*>(1, Brick(6))));
+	Finish(dl, done);
+	CHECK(done.size() == 1 && done[0].filename.empty() && done[0].bricks.size() == 1);
+
+	dl.close();
+	BrickCache::clear();
+	BrickFileHandles::close_all();
+	server.stop();
+	curl_global_cleanup();
+	wxFileName::Rmdir(dir, wxPATH_RMDIR_RECURSIVE);
+
+	if (failed)
+		fprintf(stderr, "%d checks failed\n", failed);
+	return failed ? 1 : 0;
+}
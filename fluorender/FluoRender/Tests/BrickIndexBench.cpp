@@ -0,0 +1,211 @@
+/*
+For more information, please see: http://software.sci.utah.edu
+
+The MIT License
+
+Copyright (c) 2014 Scientific Computing and Imaging Institute,
+University of Utah.
+
+
+Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the "Software"),
+to deal in the Software without restriction, including without limitation
+the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.
+*/
+
+
+
+
+//benchmark of the voxel to brick lookup of BrickIndex
+//bricks are laid out as Texture::build_bricks does, overlapping by a voxel,
+//and as random splits of a volume, which take the hierarchy instead of the
+//grid. every lookup is checked against a scan of all bricks, which is how
+//Texture::get_brick_id_point worked before the index
+
+#include "FLIVR/BrickIndex.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <vector>
+
+using namespace std;
+using namespace FLIVR;
+
+typedef BrickIndex::Box Box;
+
+//keeps the lookups from being optimized away
+static volatile long long sink;
+
+static Box MakeBox(int x, int y, int z, int nx, int ny, int nz)
+{
+	Box b;
+	b.min[0] = x; b.max[0] = x + nx;
+	b.min[1] = y; b.max[1] = y + ny;
+	b.min[2] = z; b.max[2] = z + nz;
+	return b;
+}
+
+//bricks start every size-1 voxels, so neighbors share a voxel
+static void GridBoxes(vector<Box> &boxes, int sx, int sy, int sz, int size)
+{
+	for (int k = 0; k < sz; k += size)
+	{
+		if (k) k--;
+		for (int j = 0; j < sy; j += size)
+		{
+			if (j) j--;
+			for (int i = 0; i < sx; i += size)
+			{
+				if (i) i--;
+				boxes.push_back(MakeBox(i, j, k,
+					min(size, sx-i), min(size, sy-j), min(size, sz-k)));
+			}
+		}
+	}
+}
+
+//a volume cut at random positions until there are num bricks
+static void SplitBoxes(vector<Box> &boxes, int sx, int sy, int sz, int num, mt19937 &rng)
+{
+	boxes.push_back(MakeBox(0, 0, 0, sx, sy, sz));
+	while ((int)boxes.size() < num)
+	{
+		size_t i = rng() % boxes.size();
+		Box b = boxes[i];
+		int a = 0;
+		for (int k = 1; k < 3; k++)
+			if (b.max[k] - b.min[k] > b.max[a] - b.min[a])
+				a = k;
+		int len = b.max[a] - b.min[a];
+		if (len < 4)
+			continue;
+		int cut = b.min[a] + len/4 + int(rng() % (len/2));
+		Box h = b;
+		b.max[a] = cut;
+		h.min[a] = cut;
+		boxes[i] = b;
+		boxes.push_back(h);
+	}
+}
+
+static int Scan(const vector<Box> &boxes, int x, int y, int z)
+{
+	for (size_t i = 0; i < boxes.size(); i++)
+	{
+		const Box &b = boxes[i];
+		if (x >= b.min[0] && x < b.max[0] &&
+			y >= b.min[1] && y < b.max[1] &&
+			z >= b.min[2] && z < b.max[2])
+			return int(i);
+	}
+	return -1;
+}
+
+static double Seconds(chrono::steady_clock::time_point t0)
+{
+	return chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+}
+
+//returns the number of lookups that differ from the scan
+static int Run(const char* name, const vector<Box> &boxes,
+	int sx, int sy, int sz, int num, mt19937 &rng)
+{
+	BrickIndex index;
+	auto t0 = chrono::steady_clock::now();
+	index.build(boxes);
+	double t_build = Seconds(t0);
+
+	//some points fall just outside the volume
+	vector<int> p(num * 3);
+	for (int i = 0; i < num; i++)
+	{
+		p[i*3] = int(rng() % (sx + 8)) - 4;
+		p[i*3+1] = int(rng() % (sy + 8)) - 4;
+		p[i*3+2] = int(rng() % (sz + 8)) - 4;
+	}
+
+	long long sum = 0;
+	t0 = chrono::steady_clock::now();
+	for (int i = 0; i < num; i++)
+		sum += index.find(p[i*3], p[i*3+1], p[i*3+2]);
+	double t_find = Seconds(t0);
+
+	//the scan is slow, it is timed on fewer points
+	int scan_num = max(1, min(num, int(20000000 / boxes.size())));
+	t0 = chrono::steady_clock::now();
+	for (int i = 0; i < scan_num; i++)
+		sum += Scan(boxes, p[i*3], p[i*3+1], p[i*3+2]);
+	double t_scan = Seconds(t0);
+
+	sink = sum;
+
+	int check_num = max(1, min(num, int(200000000 / boxes.size())));
+	int wrong = 0;
+	for (int i = 0; i < check_num; i++)
+		if (index.find(p[i*3], p[i*3+1], p[i*3+2]) !=
+			Scan(boxes, p[i*3], p[i*3+1], p[i*3+2]))
+			wrong++;
+
+	printf("%-26s %7d bricks %-4s build %7.2f ms  find %8.1f ns  scan %10.1f ns\n",
+		name, (int)boxes.size(), index.is_grid() ? "grid" : "bvh", t_build * 1e3,
+		t_find * 1e9 / num, t_scan * 1e9 / scan_num);
+	if (wrong)
+		fprintf(stderr, "%s: %d lookups differ from the scan\n", name, wrong);
+	return wrong;
+}
+
+int main(int argc, char* argv[])
+{
+	int num = 200000;
+	for (int i = 1; i < argc; i++)
+	{
+		if (!strcmp(argv[i], "-n") && i + 1 < argc)
+			num = max(1, atoi(argv[++i]));
+		else
+		{
+			fprintf(stderr, "Usage: %s [-n <lookups>]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	mt19937 rng(1);
+	int failed = 0;
+	vector<Box> boxes;
+
+	GridBoxes(boxes, 2048, 2048, 512, 64);
+	failed += Run("grid 64", boxes, 2048, 2048, 512, num, rng);
+	boxes.clear();
+	GridBoxes(boxes, 8192, 8192, 1024, 256);
+	failed += Run("grid 256", boxes, 8192, 8192, 1024, num, rng);
+	boxes.clear();
+	GridBoxes(boxes, 8192, 8192, 2048, 128);
+	failed += Run("grid 128", boxes, 8192, 8192, 2048, num, rng);
+
+	int splits[3] = {2000, 20000, 100000};
+	for (int i = 0; i < 3; i++)
+	{
+		boxes.clear();
+		SplitBoxes(boxes, 4096, 4096, 512, splits[i], rng);
+		char name[32];
+		snprintf(name, sizeof(name), "random splits %d", splits[i]);
+		failed += Run(name, boxes, 4096, 4096, 512, num, rng);
+	}
+
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,237 @@
+/*
+For more information, please see: http://software.sci.utah.edu
+
+The MIT License
+
+Copyright (c) 2014 Scientific Computing and Imaging Institute,
+University of Utah.
+
+
+Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the "Software"),
+to deal in the Software without restriction, including without limitation
+the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.
+*/
+
+
+
+
+//test of the mixed-level brick selection along synthetic camera paths
+//every cut has to cover the volume once, refine toward the eye and keep to
+//the budget, also for levels whose bricks do not nest
+
+#include "FLIVR/BrickLOD.h"
+#include <glm/gtc/matrix_transform.hpp>
+#include <cmath>
+#include <cstdio>
+#include <vector>
+
+using namespace std;
+using namespace FLIVR;
+
+static int failed = 0;
+#define CHECK(cond) \
+	do { \
+		if (!(cond)) \
+		{ \
+			fprintf(stderr, "line %d: %s\n", __LINE__, #cond); \
+			failed++; \
+		} \
+	} while (0)
+
+#define WIDTH 800
+#define HEIGHT 600
+
+//bricks of n voxels along each axis of a level of size voxels
+static vector<LODBrick> MakeLevel(int level, int size, int n)
+{
+	vector<LODBrick> bricks;
+	for (int z = 0; z < size; z += n)
+	for (int y = 0; y < size; y += n)
+	for (int x = 0; x < size; x += n)
+	{
+		LODBrick b;
+		b.level = level;
+		b.index = int(bricks.size());
+		b.bbox = BBox(
+			Point(double(x)/size, double(y)/size, double(z)/size),
+			Point(double(min(x+n, size))/size, double(min(y+n, size))/size,
+			double(min(z+n, size))/size));
+		b.size = (long long)(min(x+n, size)-x) * (min(y+n, size)-y) * (min(z+n, size)-z);
+		bricks.push_back(b);
+	}
+	return bricks;
+}
+
+static void AddLevels(BrickLOD &lod, const int *sizes, const int *bricks, int num)
+{
+	lod.clear();
+	for (int i = 0; i < num; i++)
+		lod.add_level(sizes[i], sizes[i], sizes[i], MakeLevel(i, sizes[i], bricks[i]));
+}
+
+static void SetCamera(BrickLOD &lod, glm::vec3 eye, glm::vec3 center)
+{
+	glm::mat4 mv = glm::lookAt(eye, center, glm::vec3(0.0f, 1.0f, 0.0f));
+	glm::mat4 proj = glm::perspective(glm::radians(30.0f),
+		float(WIDTH)/float(HEIGHT), 0.01f, 100.0f);
+	lod.set_view(mv, proj, WIDTH, HEIGHT);
+}
+
+//sample points off the brick faces of all test pyramids
+static bool CoversOnce(const vector<LODBrick> &cut)
+{
+	for (int z = 0; z < 20; z++)
+	for (int y = 0; y < 20; y++)
+	for (int x = 0; x < 20; x++)
+	{
+		Point p((x+0.37)/20.0, (y+0.37)/20.0, (z+0.37)/20.0);
+		int count = 0;
+		for (size_t i = 0; i < cut.size(); i++)
+		{
+			const BBox &b = cut[i].bbox;
+			if (p.x() > b.min().x() && p.x() < b.max().x() &&
+				p.y() > b.min().y() && p.y() < b.max().y() &&
+				p.z() > b.min().z() && p.z() < b.max().z())
+				count++;
+		}
+		if (count != 1)
+			return false;
+	}
+	return true;
+}
+
+static int LevelAt(const vector<LODBrick> &cut, const Point &p)
+{
+	for (size_t i = 0; i < cut.size(); i++)
+		if (cut[i].bbox.inside(p))
+			return cut[i].level;
+	return -1;
+}
+
+static long long CutSize(const vector<LODBrick> &cut)
+{
+	long long size = 0;
+	for (size_t i = 0; i < cut.size(); i++)
+		size += cut[i].size;
+	return size;
+}
+
+int main(int argc, char* argv[])
+{
+	BrickLOD lod;
+	vector<LODBrick> cut;
+	glm::vec3 center(0.5f);
+
+	//a pyramid that nests: 1024 voxels in bricks of 128 down to one brick
+	int sizes[4] = {1024, 512, 256, 128};
+	int bricks[4] = {128, 128, 128, 128};
+	AddLevels(lod, sizes, bricks, 4);
+	CHECK(lod.level_num() == 4);
+
+	//dolly toward the volume, the cut only gets finer
+	int prev = 4;
+	for (int i = 0; i <= 20; i++)
+	{
+		float d = 6.0f - i * 0.25f;
+		SetCamera(lod, glm::vec3(0.5f, 0.5f, 0.5f + d), center);
+		int finest = lod.select(cut);
+		CHECK(CoversOnce(cut));
+		CHECK(finest <= prev);
+		prev = finest;
+	}
+	CHECK(prev == 0);
+	//far away the volume is one brick
+	SetCamera(lod, glm::vec3(0.5f, 0.5f, 200.0f), center);
+	lod.select(cut);
+	CHECK(cut.size() == 1 && cut[0].level == 3);
+
+	//orbit, the side facing the eye is at least as fine as the far side
+	for (int i = 0; i < 16; i++)
+	{
+		double a = i * 2.0 * M_PI / 16;
+		glm::vec3 eye(0.5f + 1.2f*float(cos(a)), 0.6f, 0.5f + 1.2f*float(sin(a)));
+		SetCamera(lod, eye, center);
+		lod.set_budget(0);
+		lod.select(cut);
+		CHECK(CoversOnce(cut));
+		Point near_p(0.5 + 0.45*cos(a), 0.5, 0.5 + 0.45*sin(a));
+		Point far_p(0.5 - 0.45*cos(a), 0.5, 0.5 - 0.45*sin(a));
+		CHECK(LevelAt(cut, near_p) <= LevelAt(cut, far_p));
+
+		//the budget holds and the volume stays covered
+		long long budget = 20LL * 128 * 128 * 128;
+		lod.set_budget(budget);
+		lod.select(cut);
+		CHECK(CoversOnce(cut));
+		CHECK(CutSize(cut) <= budget);
+	}
+	lod.set_budget(0);
+
+	//fly through the volume, bricks behind the eye are not refined
+	size_t finest_num = MakeLevel(0, 1024, 128).size();
+	for (int i = 0; i < 8; i++)
+	{
+		float z = 0.9f - i * 0.1f;
+		SetCamera(lod, glm::vec3(0.5f, 0.5f, z), glm::vec3(0.5f, 0.5f, z - 1.0f));
+		int finest = lod.select(cut);
+		CHECK(CoversOnce(cut));
+		CHECK(finest == 0);
+		CHECK(cut.size() < finest_num);
+		//a brick of level 1 behind the eye is out of view
+		for (size_t j = 0; j < cut.size(); j++)
+			if (cut[j].level == 0)
+				CHECK(cut[j].bbox.min().z() < z + 0.125 + 1e-6);
+	}
+
+	//levels whose bricks do not nest: thirds over fifths
+	int sizes2[3] = {500, 300, 100};
+	int bricks2[3] = {100, 100, 100};
+	AddLevels(lod, sizes2, bricks2, 3);
+	for (int i = 0; i <= 20; i++)
+	{
+		float d = 5.0f - i * 0.22f;
+		SetCamera(lod, glm::vec3(0.1f, 0.2f, 0.5f + d), glm::vec3(0.1f, 0.2f, 0.5f));
+		lod.select(cut);
+		CHECK(CoversOnce(cut));
+	}
+	CHECK(LevelAt(cut, Point(0.1, 0.2, 0.95)) == 0);
+
+	//levels of odd sizes end within a voxel of each other, they still
+	//refine brick by brick
+	int sizes3[3] = {1001, 501, 251};
+	int bricks3[3] = {256, 128, 64};
+	AddLevels(lod, sizes3, bricks3, 3);
+	SetCamera(lod, glm::vec3(0.05f, 0.05f, 1.05f), glm::vec3(0.05f, 0.05f, 0.0f));
+	lod.select(cut);
+	CHECK(CoversOnce(cut));
+	CHECK(LevelAt(cut, Point(0.05, 0.05, 0.95)) == 0);
+	CHECK(LevelAt(cut, Point(0.9, 0.9, 0.05)) > 0);
+
+	//a voxel covers the larger of the two pixel sizes
+	vector<LODBrick> one = MakeLevel(0, 100, 100);
+	lod.clear();
+	lod.add_level(100, 100, 100, one);
+	glm::mat4 ortho = glm::ortho(-1.0f, 1.0f, -1.0f, 1.0f, -10.0f, 10.0f);
+	lod.set_view(glm::mat4(1.0f), ortho, 2000, 500);
+	CHECK(fabs(lod.screen_error(0, one[0].bbox) - 10.0) < 1e-3);
+	lod.set_view(glm::mat4(1.0f), ortho, 500, 2000);
+	CHECK(fabs(lod.screen_error(0, one[0].bbox) - 10.0) < 1e-3);
+
+	if (failed)
+		fprintf(stderr, "%d checks failed\n", failed);
+	return failed ? 1 : 0;
+}
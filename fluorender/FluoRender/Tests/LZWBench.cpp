@@ -0,0 +1,495 @@
+/*
+For more information, please see: http://software.sci.utah.edu
+
+The MIT License
+
+Copyright (c) 2014 Scientific Computing and Imaging Institute,
+University of Utah.
+
+
+Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the "Software"),
+to deal in the Software without restriction, including without limitation
+the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.
+*/
+
+
+//micro-benchmark of the LZW decoder and the horizontal predictor undo
+//synthetic strips are encoded here, then decoded by BaseReader and compared
+//against the original samples, the decode speed is reported in MB/s
+//the previous libtiff style decoder is kept below as a reference, it decodes
+//the same strips, its output has to match and its speed is reported as before
+
+#include "compatibility.h"
+#include "Formats/tif_reader.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <random>
+#include <string>
+#include <vector>
+
+//gives access to the decoders of BaseReader
+class DecodeReader : public TIFReader
+{
+public:
+	bool Decode(const unsigned char* in, size_t in_size, unsigned char* out, size_t out_size)
+	{
+		return LZWDecode((tidata_t)in, (tidata_t)out, (tsize_t)out_size, (tsize_t)in_size) != 0;
+	}
+	void UndoPredictor(unsigned char* row, size_t row_size, int bytes, bool swap)
+	{
+		if (bytes == 1)
+			DecodeAcc8((tidata_t)row, (tsize_t)row_size, 1);
+		else
+			DecodeAcc16((tidata_t)row, (tsize_t)row_size, 1, swap);
+	}
+
+	//the previous decoders
+	bool RefDecode(const unsigned char* in, unsigned char* out, size_t out_size)
+	{
+		return RefLZWDecode((tidata_t)in, (tidata_t)out, (tsize_t)out_size) != 0;
+	}
+	void RefUndoPredictor(unsigned char* row, size_t row_size, int bytes, bool swap)
+	{
+		if (bytes == 1)
+			RefDecodeAcc8((tidata_t)row, (tsize_t)row_size, 1);
+		else
+		{
+			//the samples were swapped in a separate pass
+			if (swap)
+				for (size_t i = 0; i + 1 < row_size; i += 2)
+					std::swap(row[i], row[i+1]);
+			RefDecodeAcc16((tidata_t)row, (tsize_t)row_size, 1);
+		}
+	}
+
+private:
+	typedef struct code_ent
+	{
+		struct code_ent *next;
+		unsigned short	length;		/* string len, including this token */
+		unsigned char	value;		/* data value */
+		unsigned char	firstchar;	/* first token of string */
+	} code_t;
+	#define	RefGetNextCode(bp, code) {				\
+		nextdata = (nextdata<<8) | *(bp)++;			\
+		nextbits += 8;						\
+		if (nextbits < nbits) {					\
+			nextdata = (nextdata<<8) | *(bp)++;		\
+			nextbits += 8;					\
+		}							\
+		code = (hcode_t)((nextdata >> (nextbits-nbits)) & nbitsmask);	\
+		nextbits -= nbits;					\
+	}
+
+	//BaseReader::LZWDecode before the offset table, the input is not bounded
+	int RefLZWDecode(tidata_t tif, tidata_t op0, tsize_t occ0)
+	{
+		code_t* codetab = new code_t[CSIZE];
+		int icode = 255;
+		do
+		{
+			codetab[icode].value = icode;
+			codetab[icode].firstchar = icode;
+			codetab[icode].length = 1;
+			codetab[icode].next = NULL;
+		} while (icode--);
+		memset(codetab + CODE_FIRST, 0, (CSIZE-CODE_FIRST)*sizeof(code_t));
+
+		char *op = (char*) op0;
+		long occ = (long) occ0;
+		char *tp;
+		unsigned char *bp = (unsigned char *)tif;
+		hcode_t code;
+		int len;
+		long nbits = BITS_MIN;
+		long nextbits = 0;
+		unsigned long nextdata = 0;
+		long nbitsmask = MAXCODE(BITS_MIN);
+		code_t *codep;
+		code_t *free_entp = codetab + CODE_FIRST;
+		code_t *maxcodep = &codetab[nbitsmask-1];
+		code_t *oldcodep = &codetab[-1];
+		int result = 1;
+
+		while (occ > 0)
+		{
+			RefGetNextCode(bp, code);
+			if (code == CODE_EOI)
+				break;
+			if (code == CODE_CLEAR)
+			{
+				free_entp = codetab + CODE_FIRST;
+				nbits = BITS_MIN;
+				nbitsmask = MAXCODE(BITS_MIN);
+				maxcodep = codetab + nbitsmask-1;
+				RefGetNextCode(bp, code);
+				if (code == CODE_EOI)
+					break;
+				*op++ = (char)code, occ--;
+				oldcodep = codetab + code;
+				continue;
+			}
+			codep = codetab + code;
+
+			if (free_entp < &codetab[0] ||
+				free_entp >= &codetab[CSIZE])
+			{
+				result = 0;
+				break;
+			}
+			free_entp->next = oldcodep;
+			if (free_entp->next < &codetab[0] ||
+				free_entp->next >= &codetab[CSIZE])
+			{
+				result = 0;
+				break;
+			}
+			free_entp->firstchar = free_entp->next->firstchar;
+			free_entp->length = free_entp->next->length+1;
+			free_entp->value = (codep < free_entp) ?
+				codep->firstchar : free_entp->firstchar;
+			if (++free_entp > maxcodep)
+			{
+				if (++nbits > BITS_MAX)
+					nbits = BITS_MAX;
+				nbitsmask = MAXCODE(nbits);
+				maxcodep = codetab + nbitsmask-1;
+			}
+			oldcodep = codep;
+			if (code >= 256)
+			{
+				//copy the string to the output, written in reverse
+				if (codep->length == 0 || codep->length > occ)
+				{
+					result = 0;
+					break;
+				}
+				len = codep->length;
+				tp = op + len;
+				do
+				{
+					int t;
+					--tp;
+					t = codep->value;
+					codep = codep->next;
+					*tp = t;
+				} while (codep && tp > op);
+				if (codep)
+					break;
+				op += len, occ -= len;
+			} else
+				*op++ = (char)code, occ--;
+		}
+
+		delete []codetab;
+		return result && occ <= 0;
+	}
+	#undef RefGetNextCode
+
+	void RefDecodeAcc8(tidata_t cp0, tsize_t cc, tsize_t stride)
+	{
+		char* cp = (char*) cp0;
+		if ((cc%stride) != 0) return;
+		if (cc > stride)
+		{
+			cc -= stride;
+			do
+			{
+				REPEAT4(stride, cp[stride] =
+					(char) (cp[stride] + *cp); cp++)
+				cc -= stride;
+			} while (cc > 0);
+		}
+	}
+
+	void RefDecodeAcc16(tidata_t cp0, tsize_t cc, tsize_t stride)
+	{
+		uint16* wp = (uint16*) cp0;
+		tsize_t wc = cc / 2;
+		if ((cc%(2*stride)) != 0) return;
+		if (wc > stride)
+		{
+			wc -= stride;
+			do
+			{
+				REPEAT4(stride, wp[stride] += wp[0]; wp++)
+				wc -= stride;
+			} while (wc > 0);
+		}
+	}
+};
+
+//tiff lzw with msb-first codes and the early code width change
+static void LZWEncode(const unsigned char* data, size_t size, vector<unsigned char> &out)
+{
+	out.clear();
+	unsigned long long acc = 0;
+	int bits = 0;
+	int nbits = 9;
+	auto emit = [&](int code) {
+		acc = (acc << nbits) | (unsigned long long)code;
+		bits += nbits;
+		while (bits >= 8)
+		{
+			out.push_back((unsigned char)(acc >> (bits - 8)));
+			bits -= 8;
+		}
+	};
+	//strings are keyed by the code of their prefix and the last byte
+	map<pair<int, unsigned char>, int> table;
+	int next = 258;
+	emit(256);
+	if (size == 0)
+	{
+		emit(257);
+		if (bits > 0) out.push_back((unsigned char)(acc << (8 - bits)));
+		return;
+	}
+	int w = data[0];
+	for (size_t i = 1; i < size; i++)
+	{
+		auto it = table.find(make_pair(w, data[i]));
+		if (it != table.end())
+		{
+			w = it->second;
+			continue;
+		}
+		emit(w);
+		table[make_pair(w, data[i])] = next++;
+		if (next + 1 > (1 << nbits))
+			nbits++;
+		if (next >= 4093)
+		{
+			emit(256);
+			table.clear();
+			next = 258;
+			nbits = 9;
+		}
+		w = data[i];
+	}
+	emit(w);
+	emit(257);
+	if (bits > 0)
+		out.push_back((unsigned char)(acc << (8 - bits)));
+}
+
+struct StripSet
+{
+	string name;
+	int bytes;			//bytes per sample
+	bool predictor;
+	bool swap;			//16-bit samples stored big-endian
+	size_t row_size;	//bytes
+	size_t rows;
+	vector<vector<unsigned char> > raw;		//expected output
+	vector<vector<unsigned char> > coded;	//lzw strips
+};
+
+//a smooth image with noise, like a fluorescence slice
+static void MakeStrips(StripSet &set, int width, int height, int rows, int count)
+{
+	mt19937 rng(1);
+	normal_distribution<double> noise(0.0, set.bytes == 1 ? 3.0 : 40.0);
+	set.row_size = (size_t)width * set.bytes;
+	set.rows = rows;
+	for (int s = 0; s < count; s++)
+	{
+		vector<unsigned char> raw(set.row_size * rows);
+		for (int y = 0; y < rows; y++)
+		for (int x = 0; x < width; x++)
+		{
+			int yy = (s * rows + y) % height;
+			double v = 0.5 + 0.4 * sin(x * 0.01) * cos(yy * 0.013);
+			v = v * (set.bytes == 1 ? 255.0 : 4095.0) + noise(rng);
+			int iv = (int)v;
+			if (set.bytes == 1)
+				raw[y * set.row_size + x] = (unsigned char)max(0, min(255, iv));
+			else
+			{
+				unsigned short sv = (unsigned short)max(0, min(4095, iv));
+				memcpy(&raw[y * set.row_size + x * 2], &sv, 2);
+			}
+		}
+
+		//the stored bytes are differenced and byte swapped as in the file
+		vector<unsigned char> stored = raw;
+		for (int y = 0; y < rows; y++)
+		{
+			unsigned char* row = &stored[y * set.row_size];
+			if (set.predictor)
+			{
+				if (set.bytes == 1)
+				{
+					for (int x = width - 1; x > 0; x--)
+						row[x] = (unsigned char)(row[x] - row[x-1]);
+				}
+				else
+				{
+					unsigned short* wr = (unsigned short*)row;
+					for (int x = width - 1; x > 0; x--)
+						wr[x] = (unsigned short)(wr[x] - wr[x-1]);
+				}
+			}
+			if (set.swap)
+				for (int x = 0; x < width; x++)
+					swap(row[x*2], row[x*2+1]);
+		}
+		vector<unsigned char> coded;
+		LZWEncode(&stored[0], stored.size(), coded);
+		set.raw.push_back(raw);
+		set.coded.push_back(coded);
+	}
+}
+
+//ref: decode with the previous decoders
+static bool DecodeStrip(DecodeReader &reader, const StripSet &set, size_t s,
+	vector<unsigned char> &out, bool ref = false)
+{
+	out.resize(set.raw[s].size());
+	bool ok = ref ?
+		reader.RefDecode(&set.coded[s][0], &out[0], out.size()) :
+		reader.Decode(&set.coded[s][0], set.coded[s].size(), &out[0], out.size());
+	if (!ok)
+		return false;
+	if (set.predictor)
+	{
+		for (size_t y = 0; y < set.rows; y++)
+		{
+			if (ref)
+				reader.RefUndoPredictor(&out[y * set.row_size], set.row_size, set.bytes, set.swap);
+			else
+				reader.UndoPredictor(&out[y * set.row_size], set.row_size, set.bytes, set.swap);
+		}
+	}
+	else if (set.swap)
+	{
+		for (size_t i = 0; i + 1 < out.size(); i += 2)
+			swap(out[i], out[i+1]);
+	}
+	return true;
+}
+
+int main(int argc, char* argv[])
+{
+	int iter = 20;
+	int width = 1024;
+	for (int i = 1; i < argc; i++)
+	{
+		if (!strcmp(argv[i], "-iter") && i + 1 < argc)
+			iter = max(1, atoi(argv[++i]));
+		else if (!strcmp(argv[i], "-width") && i + 1 < argc)
+			width = max(16, atoi(argv[++i]));
+		else
+		{
+			fprintf(stderr, "Usage: %s [-iter <num>] [-width <pixels>]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	const int rows = 16;
+	const int count = 64;
+	StripSet sets[4];
+	sets[0].name = "8-bit";
+	sets[0].bytes = 1; sets[0].predictor = false; sets[0].swap = false;
+	sets[1].name = "8-bit predictor";
+	sets[1].bytes = 1; sets[1].predictor = true; sets[1].swap = false;
+	sets[2].name = "16-bit predictor";
+	sets[2].bytes = 2; sets[2].predictor = true; sets[2].swap = false;
+	sets[3].name = "16-bit predictor swapped";
+	sets[3].bytes = 2; sets[3].predictor = true; sets[3].swap = true;
+
+	DecodeReader reader;
+	vector<unsigned char> out, ref_out;
+	int failed = 0;
+	for (int k = 0; k < 4; k++)
+	{
+		StripSet &set = sets[k];
+		MakeStrips(set, width, 1024, rows, count);
+		size_t raw_bytes = 0, coded_bytes = 0;
+		for (size_t s = 0; s < set.raw.size(); s++)
+		{
+			raw_bytes += set.raw[s].size();
+			coded_bytes += set.coded[s].size();
+			if (!DecodeStrip(reader, set, s, out) || out != set.raw[s])
+			{
+				fprintf(stderr, "%s: strip %d decoded wrong\n", set.name.c_str(), (int)s);
+				failed++;
+				break;
+			}
+			if (!DecodeStrip(reader, set, s, ref_out, true) || ref_out != out)
+			{
+				fprintf(stderr, "%s: strip %d differs from the previous decoder\n",
+					set.name.c_str(), (int)s);
+				failed++;
+				break;
+			}
+		}
+
+		//the whole strip, lzw and predictor undo
+		double sec[2];
+		for (int r = 0; r < 2; r++)
+		{
+			auto t0 = chrono::steady_clock::now();
+			for (int i = 0; i < iter; i++)
+				for (size_t s = 0; s < set.raw.size(); s++)
+					DecodeStrip(reader, set, s, out, r == 0);
+			sec[r] = chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+		}
+		double mb = double(raw_bytes) * iter / (1024.0 * 1024.0);
+		printf("%-26s ratio %.2f  before %8.1f MB/s  now %8.1f MB/s\n", set.name.c_str(),
+			double(raw_bytes) / coded_bytes, mb / sec[0], mb / sec[1]);
+
+		//the predictor undo alone, it runs in place over and over on the same rows
+		if (!set.predictor)
+			continue;
+		vector<vector<unsigned char> > rows = set.raw;
+		for (int r = 0; r < 2; r++)
+		{
+			auto t0 = chrono::steady_clock::now();
+			for (int i = 0; i < iter; i++)
+				for (size_t s = 0; s < rows.size(); s++)
+				{
+					vector<unsigned char> &stored = rows[s];
+					for (size_t y = 0; y < set.rows; y++)
+					{
+						if (r == 0)
+							reader.RefUndoPredictor(&stored[y * set.row_size], set.row_size, set.bytes, set.swap);
+						else
+							reader.UndoPredictor(&stored[y * set.row_size], set.row_size, set.bytes, set.swap);
+					}
+				}
+			sec[r] = chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+		}
+		printf("%-26s            before %8.1f MB/s  now %8.1f MB/s\n", "  predictor undo",
+			mb / sec[0], mb / sec[1]);
+	}
+
+	//a truncated strip has to fail without reading past its end
+	const StripSet &set = sets[2];
+	vector<unsigned char> cut(set.coded[0].begin(), set.coded[0].begin() + set.coded[0].size() / 2);
+	out.resize(set.raw[0].size());
+	if (reader.Decode(&cut[0], cut.size(), &out[0], out.size()))
+	{
+		fprintf(stderr, "truncated strip decoded as complete\n");
+		failed++;
+	}
+
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,220 @@
+/*
+For more information, please see: http://software.sci.utah.edu
+
+The MIT License
+
+Copyright (c) 2014 Scientific Computing and Imaging Institute,
+University of Utah.
+
+
+Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the "Software"),
+to deal in the Software without restriction, including without limitation
+the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.
+*/
+
+
+
+//stress benchmark of the brick load queue with synthetic bricks
+//the queue is filled in view order, reprioritized as if the camera moved and
+//drained in order, then drained by loader threads while bricks are pushed
+//and moved by the render thread. every brick has to come out once
+//the vector the loader used before, popped with erase(begin()), is timed too
+
+#include "BrickLoadQueue.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <thread>
+#include <vector>
+
+#define BRICK_BYTES (64*64*64)
+
+//the queue only compares the brick pointers, they are not dereferenced
+static vector<char> brick_ids;
+static TextureBrick* Brick(int i) { return (TextureBrick*)(&brick_ids[0] + i); }
+static int BrickIndex(TextureBrick *b) { return int((char*)b - &brick_ids[0]); }
+static long long BrickSize(TextureBrick *b) { return BRICK_BYTES; }
+
+static VolumeLoaderData MakeData(int i)
+{
+	VolumeLoaderData d;
+	d.finfo = NULL;
+	d.brick = Brick(i);
+	d.vd = NULL;
+	d.datasize = 0;
+	d.mode = 0;
+	d.priority = 0.0;
+	return d;
+}
+
+static double Seconds(chrono::steady_clock::time_point t0)
+{
+	return chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+}
+
+int main(int argc, char* argv[])
+{
+	int num = 50000;
+	int iter = 5;
+	int threads = 4;
+	for (int i = 1; i < argc; i++)
+	{
+		if (!strcmp(argv[i], "-n") && i + 1 < argc)
+			num = max(16, atoi(argv[++i]));
+		else if (!strcmp(argv[i], "-iter") && i + 1 < argc)
+			iter = max(1, atoi(argv[++i]));
+		else if (!strcmp(argv[i], "-threads") && i + 1 < argc)
+			threads = max(1, atoi(argv[++i]));
+		else
+		{
+			fprintf(stderr, "Usage: %s [-n <bricks>] [-iter <num>] [-threads <num>]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	brick_ids.resize(num);
+	vector<VolumeLoaderData> vld(num);
+	for (int i = 0; i < num; i++)
+		vld[i] = MakeData(i);
+
+	mt19937 rng(1);
+	BrickLoadQueue queue(BrickSize);
+	int failed = 0;
+	double t_assign = 0.0, t_move = 0.0, t_pop = 0.0;
+	long long moves = 0;
+	for (int it = 0; it < iter; it++)
+	{
+		auto t0 = chrono::steady_clock::now();
+		queue.Assign(vld);
+		t_assign += Seconds(t0);
+		if (queue.GetBytes() != (long long)num * BRICK_BYTES)
+		{
+			fprintf(stderr, "queued bytes are wrong after assign\n");
+			failed++;
+		}
+
+		//the camera moved, a quarter of the bricks change places
+		vector<double> prio(num);
+		for (int i = 0; i < num; i++)
+			prio[i] = i;
+		t0 = chrono::steady_clock::now();
+		for (int k = 0; k < num / 4; k++)
+		{
+			int i = rng() % num;
+			prio[i] = rng() % num;
+			queue.SetPriority(Brick(i), 0, prio[i]);
+		}
+		t_move += Seconds(t0);
+		moves += num / 4;
+
+		t0 = chrono::steady_clock::now();
+		VolumeLoaderData d;
+		double last = -1.0;
+		int count = 0;
+		bool order = true;
+		while (queue.Pop(d))
+		{
+			if (d.priority < last || d.priority != prio[BrickIndex(d.brick)])
+				order = false;
+			last = d.priority;
+			count++;
+		}
+		t_pop += Seconds(t0);
+		if (!order || count != num || queue.GetBytes() != 0)
+		{
+			fprintf(stderr, "bricks popped out of order or lost\n");
+			failed++;
+		}
+	}
+	printf("%-26s %12.0f bricks/s\n", "assign", double(num) * iter / t_assign);
+	printf("%-26s %12.0f bricks/s\n", "reprioritize", double(moves) / t_move);
+	printf("%-26s %12.0f bricks/s\n", "pop", double(num) * iter / t_pop);
+
+	//popping from the front of a vector moves the whole queue each time
+	{
+		int vnum = min(num, 20000);
+		auto t0 = chrono::steady_clock::now();
+		for (int it = 0; it < iter; it++)
+		{
+			vector<VolumeLoaderData> queues(vld.begin(), vld.begin() + vnum);
+			while (!queues.empty())
+				queues.erase(queues.begin());
+		}
+		printf("%-26s %12.0f bricks/s (%d bricks)\n", "vector erase(begin)",
+			double(vnum) * iter / Seconds(t0), vnum);
+	}
+
+	//loader threads drain the queue while the render thread pushes the
+	//second half of the bricks and moves queued ones
+	{
+		vector<atomic<int> > popped(num);
+		for (int i = 0; i < num; i++)
+			popped[i] = 0;
+		vector<VolumeLoaderData> first(vld.begin(), vld.begin() + num / 2);
+		queue.Assign(first);
+		atomic<bool> pushing(true);
+		atomic<long long> pops(0);
+		auto t0 = chrono::steady_clock::now();
+		vector<thread> loaders;
+		for (int t = 0; t < threads; t++)
+		{
+			loaders.push_back(thread([&]() {
+				VolumeLoaderData d;
+				while (true)
+				{
+					bool more = pushing;
+					if (queue.Pop(d))
+					{
+						popped[BrickIndex(d.brick)]++;
+						pops++;
+					}
+					else if (!more)
+						break;
+				}
+			}));
+		}
+		mt19937 prng(2);
+		for (int i = num / 2; i < num; i++)
+		{
+			queue.Push(vld[i]);
+			int j = prng() % (i + 1);
+			queue.SetPriority(Brick(j), 0, double(prng() % num));
+		}
+		pushing = false;
+		for (size_t t = 0; t < loaders.size(); t++)
+			loaders[t].join();
+		double sec = Seconds(t0);
+		int lost = 0;
+		for (int i = 0; i < num; i++)
+			if (popped[i] != 1)
+				lost++;
+		if (lost || !queue.Empty())
+		{
+			fprintf(stderr, "%d bricks lost or popped twice by the loader threads\n", lost);
+			failed++;
+		}
+		char name[64];
+		snprintf(name, sizeof(name), "%d loaders, 1 pusher", threads);
+		printf("%-26s %12.0f bricks/s\n", name, double(pops) / sec);
+	}
+
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,415 @@
+/*
+For more information, please see: http://software.sci.utah.edu
+
+The MIT License
+
+Copyright (c) 2014 Scientific Computing and Imaging Institute,
+University of Utah.
+
+
+Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the "Software"),
+to deal in the Software without restriction, including without limitation
+the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.
+*/
+
+
+
+//benchmark of the slice polygons of TextureBrick::compute_polygons
+//the bricks are laid out as Texture::build_bricks does. the slices of every
+//brick are compared bit for bit with the code compute_polygons had before
+//the slice cache, for a fresh computation, a cache hit and after
+//prepare_polygons has filled the caches on its threads
+
+#include "FLIVR/TextureBrick.h"
+#include "FLIVR/TextureRenderer.h"
+#include "FLIVR/Utils.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <vector>
+
+using namespace std;
+using namespace FLIVR;
+
+//TextureRenderer.cpp needs a GL context and is not linked
+int TextureRenderer::update_order_ = 0;
+
+//keeps the results from being optimized away
+static volatile size_t sink;
+
+//bricks of a volume cut as Texture::build_bricks does without power of
+//two sizes, neighbors share a voxel
+static void BuildBricks(vector<TextureBrick*> &bricks,
+	int sx, int sy, int sz, int size)
+{
+	int nb[1] = {1};
+	for (int k = 0; k < sz; k += size)
+	{
+		if (k) k--;
+		for (int j = 0; j < sy; j += size)
+		{
+			if (j) j--;
+			for (int i = 0; i < sx; i += size)
+			{
+				if (i) i--;
+				int mx = min(size, sx - i);
+				int my = min(size, sy - j);
+				int mz = min(size, sz - k);
+				BBox tbox(Point(i ? 0.5 / mx : 0.0, j ? 0.5 / my : 0.0, k ? 0.5 / mz : 0.0),
+					Point(mx < size || sx - i == size ? 1.0 : 1.0 - 0.5 / mx,
+					my < size || sy - j == size ? 1.0 : 1.0 - 0.5 / my,
+					mz < size || sz - k == size ? 1.0 : 1.0 - 0.5 / mz));
+				BBox bbox(Point(i ? (i + 0.5) / sx : 0.0, j ? (j + 0.5) / sy : 0.0,
+					k ? (k + 0.5) / sz : 0.0),
+					Point(sx - i == size ? 1.0 : min((i + size - 0.5) / sx, 1.0),
+					sy - j == size ? 1.0 : min((j + size - 0.5) / sy, 1.0),
+					sz - k == size ? 1.0 : min((k + size - 0.5) / sz, 1.0)));
+				BBox dbox(Point(double(i) / sx, double(j) / sy, double(k) / sz),
+					Point(double(i + mx) / sx, double(j + my) / sy, double(k + mz) / sz));
+				bricks.push_back(new TextureBrick(0, 0, mx, my, mz, 1, nb,
+					i, j, k, mx, my, mz, bbox, tbox, dbox));
+			}
+		}
+	}
+}
+
+//the 12 edges in the order of TextureBrick::compute_edge_rays
+static void RefEdges(const BBox &bbox, Ray edge[12])
+{
+	Point corner[8];
+	corner[0] = bbox.min();
+	corner[1] = Point(bbox.min().x(), bbox.min().y(), bbox.max().z());
+	corner[2] = Point(bbox.min().x(), bbox.max().y(), bbox.min().z());
+	corner[3] = Point(bbox.min().x(), bbox.max().y(), bbox.max().z());
+	corner[4] = Point(bbox.max().x(), bbox.min().y(), bbox.min().z());
+	corner[5] = Point(bbox.max().x(), bbox.min().y(), bbox.max().z());
+	corner[6] = Point(bbox.max().x(), bbox.max().y(), bbox.min().z());
+	corner[7] = bbox.max();
+
+	edge[0] = Ray(corner[0], corner[2] - corner[0]);
+	edge[1] = Ray(corner[4], corner[6] - corner[4]);
+	edge[2] = Ray(corner[5], corner[7] - corner[5]);
+	edge[3] = Ray(corner[1], corner[3] - corner[1]);
+	edge[4] = Ray(corner[2], corner[6] - corner[2]);
+	edge[5] = Ray(corner[0], corner[4] - corner[0]);
+	edge[6] = Ray(corner[3], corner[7] - corner[3]);
+	edge[7] = Ray(corner[1], corner[5] - corner[1]);
+	edge[8] = Ray(corner[0], corner[1] - corner[0]);
+	edge[9] = Ray(corner[2], corner[3] - corner[2]);
+	edge[10] = Ray(corner[6], corner[7] - corner[6]);
+	edge[11] = Ray(corner[4], corner[5] - corner[4]);
+}
+
+//compute_polygons before the slice cache, one plane intersection per edge
+//and slice
+static void RefPolygons(TextureBrick* b, Ray& view, double dt,
+	vector<float>& vertex, vector<uint32_t>& index, vector<uint32_t>& size)
+{
+	Ray edge[12], tex_edge[12];
+	RefEdges(b->bbox(), edge);
+	RefEdges(b->tbox(), tex_edge);
+	BBox &bbox = b->bbox();
+
+	Point corner[8];
+	corner[0] = bbox.min();
+	corner[1] = Point(bbox.min().x(), bbox.min().y(), bbox.max().z());
+	corner[2] = Point(bbox.min().x(), bbox.max().y(), bbox.min().z());
+	corner[3] = Point(bbox.min().x(), bbox.max().y(), bbox.max().z());
+	corner[4] = Point(bbox.max().x(), bbox.min().y(), bbox.min().z());
+	corner[5] = Point(bbox.max().x(), bbox.min().y(), bbox.max().z());
+	corner[6] = Point(bbox.max().x(), bbox.max().y(), bbox.min().z());
+	corner[7] = bbox.max();
+
+	double tmin = Dot(corner[0] - view.origin(), view.direction());
+	double tmax = tmin;
+	int maxi = 0;
+	int mini = 0;
+	for (int i=1; i<8; i++)
+	{
+		double t = Dot(corner[i] - view.origin(), view.direction());
+		if (t < tmin) { mini = i; tmin = t; }
+		if (t > tmax) { maxi = i; tmax = t; }
+	}
+
+	bool order = TextureRenderer::get_update_order();
+	double tanchor = Dot(corner[order?mini:maxi], view.direction());
+	double tanchor0 = (floor(tanchor/dt)+1)*dt;
+	double tanchordiff = tanchor - tanchor0;
+	if (order) tmin -= tanchordiff;
+	else tmax -= tanchordiff;
+
+	Vector vv[12], tt[12];
+	uint32_t degree = 0;
+	Vector vdir = view.direction();
+	Vector up;
+	switch(MinIndex(fabs(vdir.x()), fabs(vdir.y()), fabs(vdir.z())))
+	{
+	case 0:
+		up.x(0.0); up.y(-vdir.z()); up.z(vdir.y());
+		break;
+	case 1:
+		up.x(-vdir.z()); up.y(0.0); up.z(vdir.x());
+		break;
+	case 2:
+		up.x(-vdir.y()); up.y(vdir.x()); up.z(0.0);
+		break;
+	}
+	up.normalize();
+	Vector right = Cross(vdir, up);
+	size_t vert_count = 0;
+	for (double t = order?tmin:tmax;
+		order?(t <= tmax):(t >= tmin);
+		t += order?dt:-dt)
+	{
+		degree = 0;
+		Vector vec = -view.direction();
+		Point pnt = view.parameter(t);
+		for (size_t j=0; j<=11; j++)
+		{
+			double u;
+			bool intersects = edge[j].planeIntersectParameter(vec, pnt, u);
+			//the first 4 edges keep the corners, the others skip them
+			bool inside = j<=3 ? (u >= 0.0 && u <= 1.0) : (u > 0.0 && u < 1.0);
+			if (intersects && inside)
+			{
+				vv[degree] = (Vector)edge[j].parameter(u);
+				tt[degree] = (Vector)tex_edge[j].parameter(u);
+				degree++;
+			}
+		}
+
+		if (degree < 3 || degree >6) continue;
+		bool sorted = degree > 3;
+		uint32_t idx[6];
+		if (sorted)
+		{
+			Vector vc(0.0, 0.0, 0.0), tc(0.0, 0.0, 0.0);
+			for (uint32_t j=0; j<degree; j++)
+			{
+				vc += vv[j]; tc += tt[j];
+			}
+			vc /= (double)degree; tc /= (double)degree;
+
+			double pa[6];
+			for (uint32_t i=0; i<degree; i++)
+			{
+				double vx = Dot(vv[i] - vc, right);
+				double vy = Dot(vv[i] - vc, up);
+				pa[i] = vy / (fabs(vx) + fabs(vy));
+				if (vx < 0.0) pa[i] = 2.0 - pa[i];
+				else if (vy < 0.0) pa[i] = 4.0 + pa[i];
+				idx[i] = i;
+			}
+			Sort(pa, idx, degree);
+		}
+		for (uint32_t j = 1; j < degree - 1; j++)
+		{
+			index.push_back(vert_count);
+			index.push_back(vert_count+j);
+			index.push_back(vert_count+j+1);
+		}
+		for (uint32_t j=0; j<degree; j++)
+		{
+			vertex.push_back((sorted?vv[idx[j]]:vv[j]).x());
+			vertex.push_back((sorted?vv[idx[j]]:vv[j]).y());
+			vertex.push_back((sorted?vv[idx[j]]:vv[j]).z());
+			vertex.push_back((sorted?tt[idx[j]]:tt[j]).x());
+			vertex.push_back((sorted?tt[idx[j]]:tt[j]).y());
+			vertex.push_back((sorted?tt[idx[j]]:tt[j]).z());
+			vert_count++;
+		}
+		size.push_back(degree);
+	}
+}
+
+struct Slices
+{
+	vector<float> vertex;
+	vector<uint32_t> index;
+	vector<uint32_t> size;
+
+	void clear() { vertex.clear(); index.clear(); size.clear(); }
+	//the vertices are compared by their bits
+	bool operator==(const Slices &s) const
+	{
+		return vertex.size() == s.vertex.size() &&
+			(vertex.empty() || !memcmp(&vertex[0], &s.vertex[0],
+			vertex.size() * sizeof(float))) &&
+			index == s.index && size == s.size;
+	}
+};
+
+static double Seconds(chrono::steady_clock::time_point t0)
+{
+	return chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+}
+
+static Ray RandomView(mt19937 &rng, int i)
+{
+	uniform_real_distribution<double> u(-1.0, 1.0);
+	Vector d(u(rng), u(rng), u(rng));
+	//views along the axes and diagonals put slices through brick corners
+	if (i % 10 == 0) d = Vector(0, 0, -1);
+	else if (i % 10 == 1) d = Vector(1, 1, 0);
+	else if (i % 10 == 2) d = Vector(-1, 1, 1);
+	d.normalize();
+	return Ray(Point(0.5, 0.5, 0.5) - d * 3.0, d);
+}
+
+//returns the number of bricks whose slices differ from the reference
+static int Check(vector<TextureBrick*> &bricks, int views, double dt, mt19937 &rng)
+{
+	int wrong = 0;
+	Slices ref, out;
+	for (int v = 0; v < views; v++)
+	{
+		Ray view = RandomView(rng, v);
+		TextureRenderer::set_update_order(v % 2);
+		//fresh, then the kept slices
+		for (int pass = 0; pass < 2; pass++)
+			for (size_t i = 0; i < bricks.size(); i++)
+			{
+				ref.clear();
+				out.clear();
+				RefPolygons(bricks[i], view, dt, ref.vertex, ref.index, ref.size);
+				bricks[i]->compute_polygons(view, dt, out.vertex, out.index, out.size);
+				if (!(ref == out))
+					wrong++;
+			}
+		//filled on the threads of prepare_polygons
+		view = RandomView(rng, v);
+		TextureBrick::prepare_polygons(bricks, view, dt);
+		for (size_t i = 0; i < bricks.size(); i++)
+		{
+			ref.clear();
+			out.clear();
+			RefPolygons(bricks[i], view, dt, ref.vertex, ref.index, ref.size);
+			bricks[i]->compute_polygons(view, dt, out.vertex, out.index, out.size);
+			if (!(ref == out))
+				wrong++;
+		}
+	}
+	return wrong;
+}
+
+static void Time(const char* name, vector<TextureBrick*> &bricks, double dt,
+	int iter, mt19937 &rng)
+{
+	TextureRenderer::set_update_order(0);
+	vector<Ray> views;
+	for (int i = 0; i < iter; i++)
+		views.push_back(RandomView(rng, i + 3));
+	Slices out;
+	size_t sum = 0;
+	size_t calls = bricks.size() * iter;
+
+	auto t0 = chrono::steady_clock::now();
+	for (int v = 0; v < iter; v++)
+		for (size_t i = 0; i < bricks.size(); i++)
+		{
+			out.clear();
+			RefPolygons(bricks[i], views[v], dt, out.vertex, out.index, out.size);
+			sum += out.vertex.size();
+		}
+	double t_ref = Seconds(t0);
+
+	t0 = chrono::steady_clock::now();
+	for (int v = 0; v < iter; v++)
+		for (size_t i = 0; i < bricks.size(); i++)
+		{
+			out.clear();
+			bricks[i]->compute_polygons(views[v], dt, out.vertex, out.index, out.size);
+			sum += out.vertex.size();
+		}
+	double t_new = Seconds(t0);
+
+	//the last view is kept by every brick
+	t0 = chrono::steady_clock::now();
+	for (int v = 0; v < iter; v++)
+		for (size_t i = 0; i < bricks.size(); i++)
+		{
+			out.clear();
+			bricks[i]->compute_polygons(views[iter-1], dt, out.vertex, out.index, out.size);
+			sum += out.vertex.size();
+		}
+	double t_hit = Seconds(t0);
+
+	//a new view every draw, the slices are filled on the threads and
+	//then drawn
+	t0 = chrono::steady_clock::now();
+	for (int v = 0; v < iter; v++)
+	{
+		TextureBrick::prepare_polygons(bricks, views[(v + 1) % iter], dt);
+		for (size_t i = 0; i < bricks.size(); i++)
+		{
+			out.clear();
+			bricks[i]->compute_polygons(views[(v + 1) % iter], dt, out.vertex, out.index, out.size);
+			sum += out.vertex.size();
+		}
+	}
+	double t_par = Seconds(t0);
+
+	sink = sum;
+	printf("%-26s %5d bricks  before %8.2f us  now %8.2f us  kept %6.2f us  threads %8.2f us\n",
+		name, (int)bricks.size(), t_ref * 1e6 / calls, t_new * 1e6 / calls,
+		t_hit * 1e6 / calls, t_par * 1e6 / calls);
+}
+
+int main(int argc, char* argv[])
+{
+	int views = 60;
+	int iter = 20;
+	for (int i = 1; i < argc; i++)
+	{
+		if (!strcmp(argv[i], "-views") && i + 1 < argc)
+			views = max(1, atoi(argv[++i]));
+		else if (!strcmp(argv[i], "-iter") && i + 1 < argc)
+			iter = max(1, atoi(argv[++i]));
+		else
+		{
+			fprintf(stderr, "Usage: %s [-views <views>] [-iter <iterations>]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	mt19937 rng(7);
+	int failed = 0;
+	struct Case { const char* name; int sx, sy, sz, size; double dt; };
+	Case cases[3] = {
+		{"8x8x8 bricks", 1016, 1016, 1016, 128, 1.0 / 1024},
+		{"odd sizes", 1001, 517, 263, 128, 1.0 / 700},
+		{"one brick, 500 slices", 256, 256, 256, 256, 1.0 / 288}};
+	for (int c = 0; c < 3; c++)
+	{
+		vector<TextureBrick*> bricks;
+		BuildBricks(bricks, cases[c].sx, cases[c].sy, cases[c].sz, cases[c].size);
+		int wrong = Check(bricks, views, cases[c].dt, rng);
+		if (wrong)
+			fprintf(stderr, "%s: %d bricks differ from the previous slices\n",
+				cases[c].name, wrong);
+		failed += wrong;
+		Time(cases[c].name, bricks, cases[c].dt, iter, rng);
+		for (size_t i = 0; i < bricks.size(); i++)
+			delete bricks[i];
+	}
+
+	return failed ? 1 : 0;
+}
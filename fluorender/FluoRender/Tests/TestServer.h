@@ -0,0 +1,261 @@
+/*
+For more information, please see: http://software.sci.utah.edu
+
+The MIT License
+
+Copyright (c) 2014 Scientific Computing and Imaging Institute,
+University of Utah.
+
+
+Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the "Software"),
+to deal in the Software without restriction, including without limitation
+the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.
+*/
+
+
+
+//http server on the loopback interface for the headless tests
+//it runs in a thread of the test and serves files from memory
+
+#ifndef _TEST_SERVER_H_
+#define _TEST_SERVER_H_
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+typedef SOCKET sock_t;
+#define close_socket closesocket
+#else
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+typedef int sock_t;
+#define close_socket ::close
+#define INVALID_SOCKET (-1)
+#endif
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+
+using namespace std;
+
+//http/1.1, one request per connection
+//ranges are answered with 206 unless they are turned off, and requests
+//with the etag of the file in If-None-Match with 304
+class TestServer
+{
+public:
+	TestServer() : listen_(INVALID_SOCKET), port_(0), stop_(false),
+		ranges_(true), requests_(0), not_modified_(0) {}
+	~TestServer() { stop(); }
+
+	bool start()
+	{
+#ifdef _WIN32
+		WSADATA wsa;
+		if (WSAStartup(MAKEWORD(2, 2), &wsa) != 0)
+			return false;
+#endif
+		listen_ = socket(AF_INET, SOCK_STREAM, 0);
+		if (listen_ == INVALID_SOCKET)
+			return false;
+		sockaddr_in addr;
+		memset(&addr, 0, sizeof(addr));
+		addr.sin_family = AF_INET;
+		addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		addr.sin_port = 0;
+		socklen_t len = sizeof(addr);
+		if (::bind(listen_, (sockaddr*)&addr, sizeof(addr)) != 0 ||
+			listen(listen_, 16) != 0 ||
+			getsockname(listen_, (sockaddr*)&addr, &len) != 0)
+			return false;
+		port_ = ntohs(addr.sin_port);
+		thread_ = thread(&TestServer::run, this);
+		return true;
+	}
+
+	void stop()
+	{
+		if (thread_.joinable())
+		{
+			//wake up accept
+			stop_ = true;
+			sock_t s = socket(AF_INET, SOCK_STREAM, 0);
+			sockaddr_in addr;
+			memset(&addr, 0, sizeof(addr));
+			addr.sin_family = AF_INET;
+			addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+			addr.sin_port = htons((unsigned short)port_);
+			connect(s, (sockaddr*)&addr, sizeof(addr));
+			thread_.join();
+			close_socket(s);
+		}
+		if (listen_ != INVALID_SOCKET)
+		{
+			close_socket(listen_);
+			listen_ = INVALID_SOCKET;
+#ifdef _WIN32
+			WSACleanup();
+#endif
+		}
+	}
+
+	string url(const string &path) { return "http://127.0.0.1:" + to_string(port_) + path; }
+
+	void set_file(const string &path, const string &data, const string &etag)
+	{
+		lock_guard<mutex> lock(lock_);
+		File &f = files_[path];
+		f.data = data;
+		f.etag = etag;
+	}
+	void set_ranges(bool val) { lock_guard<mutex> lock(lock_); ranges_ = val; }
+	int requests() { lock_guard<mutex> lock(lock_); return requests_; }
+	int not_modified() { lock_guard<mutex> lock(lock_); return not_modified_; }
+	string last_range() { lock_guard<mutex> lock(lock_); return last_range_; }
+
+private:
+	struct File {
+		string data;
+		string etag;
+	};
+
+	void run()
+	{
+		while (true)
+		{
+			sock_t s = accept(listen_, NULL, NULL);
+			if (stop_)
+			{
+				if (s != INVALID_SOCKET)
+					close_socket(s);
+				break;
+			}
+			if (s == INVALID_SOCKET)
+				continue;
+			serve(s);
+			close_socket(s);
+		}
+	}
+
+	static void send_all(sock_t s, const string &str)
+	{
+		size_t done = 0;
+		while (done < str.size())
+		{
+			int num = send(s, str.data() + done, (int)min(str.size() - done, (size_t)65536), 0);
+			if (num <= 0)
+				return;
+			done += num;
+		}
+	}
+
+	void serve(sock_t s)
+	{
+		string req;
+		char buf[4096];
+		while (req.find("\r\n\r\n") == string::npos && req.size() < 65536)
+		{
+			int num = recv(s, buf, sizeof(buf), 0);
+			if (num <= 0)
+				return;
+			req.append(buf, num);
+		}
+
+		//GET <path> HTTP/1.1, then the headers
+		size_t st = req.find(' ');
+		size_t ed = st == string::npos ? st : req.find(' ', st + 1);
+		if (ed == string::npos)
+			return;
+		string path = req.substr(st + 1, ed - st - 1);
+		string range, etag;
+		size_t pos = req.find("\r\n");
+		while (pos != string::npos && pos + 2 < req.size())
+		{
+			size_t next = req.find("\r\n", pos + 2);
+			string line = req.substr(pos + 2, next == string::npos ? string::npos : next - pos - 2);
+			size_t colon = line.find(':');
+			if (colon != string::npos)
+			{
+				string name = line.substr(0, colon);
+				for (size_t i = 0; i < name.size(); i++)
+					name[i] = tolower(name[i]);
+				size_t vst = line.find_first_not_of(' ', colon + 1);
+				string value = vst == string::npos ? "" : line.substr(vst);
+				if (name == "range")
+					range = value;
+				else if (name == "if-none-match")
+					etag = value;
+			}
+			pos = next;
+		}
+
+		string head, body;
+		{
+			lock_guard<mutex> lock(lock_);
+			requests_++;
+			last_range_ = range;
+			auto itr = files_.find(path);
+			long long a = 0, b = -1;
+			//files without an etag are sent without a validator
+			string validator;
+			if (itr != files_.end() && !itr->second.etag.empty())
+				validator = "ETag: " + itr->second.etag + "\r\n";
+			if (itr == files_.end())
+				head = "HTTP/1.1 404 Not Found\r\n";
+			else if (!etag.empty() && etag == itr->second.etag)
+			{
+				head = "HTTP/1.1 304 Not Modified\r\n" + validator;
+				not_modified_++;
+			}
+			else if (ranges_ && sscanf(range.c_str(), "bytes=%lld-%lld", &a, &b) == 2 &&
+				a >= 0 && a <= b && b < (long long)itr->second.data.size())
+			{
+				head = "HTTP/1.1 206 Partial Content\r\n" + validator +
+					"Content-Range: bytes " + to_string(a) + "-" + to_string(b) + "/" +
+					to_string(itr->second.data.size()) + "\r\n";
+				body = itr->second.data.substr((size_t)a, (size_t)(b - a + 1));
+			}
+			else
+			{
+				head = "HTTP/1.1 200 OK\r\n" + validator;
+				body = itr->second.data;
+			}
+		}
+		head += "Content-Length: " + to_string(body.size()) + "\r\nConnection: close\r\n\r\n";
+		send_all(s, head);
+		send_all(s, body);
+	}
+
+	sock_t listen_;
+	int port_;
+	atomic<bool> stop_;
+	thread thread_;
+	mutex lock_;
+	map<string, File> files_;
+	bool ranges_;
+	int requests_;
+	int not_modified_;
+	string last_range_;
+};
+
+#endif//_TEST_SERVER_H_
@@ -1381,6 +1381,8 @@ void TraceDlg::CompDelete()
 		else
 			data_mask[index] = 0;
 	}
+	//the mask was written in memory, save it with the next undo
+	vd->GetTexture()->mask_changed();
 	//invalidate label mask in gpu
 	vd->GetVR()->clear_tex_pool();
 	//update view
@@ -1505,6 +1507,8 @@ void TraceDlg::OnCompAppend(wxCommandEvent &event)
 					data_mask[index] = 255;
 			}
 		}
+		//the mask was written in memory, save it with the next undo
+		vd->GetTexture()->mask_changed();
 		//invalidate label mask in gpu
 		vd->GetVR()->clear_tex_pool();
 	}
@@ -1558,6 +1562,8 @@ void TraceDlg::OnCompExclusive(wxCommandEvent &event)
 			else
 				data_mask[index] = 0;
 		}
+		//the mask was written in memory, save it with the next undo
+		vd->GetTexture()->mask_changed();
 		//invalidate label mask in gpu
 		vd->GetVR()->clear_tex_pool();
 	}
@@ -1662,6 +1668,8 @@ void TraceDlg::CellFull()
 						data_mask[index] = 0;
 				}
 			}
+	//the mask was written in memory, save it with the next undo
+	vd->GetTexture()->mask_changed();
 	//invalidate label mask in gpu
 	vd->GetVR()->clear_tex_pool();
 	//update view
@@ -1860,6 +1868,8 @@ void TraceDlg::CellNewID(bool append)
 	if (new_id)
 		trace_group->AddCell(cell, m_cur_time);
 
+	//the mask was written in memory, save it with the next undo
+	vd->GetTexture()->mask_changed();
 	//invalidate label mask in gpu
 	vd->GetVR()->clear_tex_pool();
 	//save label mask to disk
@@ -3155,7 +3165,10 @@ void TraceDlg::GenMap()
 	{
 		if (i == 0)
 		{
-			nrrd_data1 = reader->Convert(i, chan, true);
+			{
+				lock_guard<recursive_mutex> lock(reader->GetLock());
+				nrrd_data1 = reader->Convert(i, chan, true);
+			}
 			if (!nrrd_data1)
 			{
 				file_err = true;
@@ -3176,7 +3189,10 @@ void TraceDlg::GenMap()
 		}
 		else
 		{
-			nrrd_data2 = reader->Convert(i, chan, true);
+			{
+				lock_guard<recursive_mutex> lock(reader->GetLock());
+				nrrd_data2 = reader->Convert(i, chan, true);
+			}
 			if (!nrrd_data2)
 			{
 				file_err = true;
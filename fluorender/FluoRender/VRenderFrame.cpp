@@ -658,7 +658,7 @@ VRenderFrame::~VRenderFrame()
 	curl_multi_cleanup(_g_curlm);
 	curl_global_cleanup();//add by takashi
 
-	TextureBrick::delete_all_cache_files();
+	TextureBrick::close_cache_files();
 }
 
 void VRenderFrame::OnExit(wxCommandEvent& WXUNUSED(event))
@@ -2822,6 +2822,7 @@ void VRenderFrame::SaveProject(wxString& filename)
 			fconfig.Write("aov", vrv->GetAov());
 			fconfig.Write("min_dpi", vrv->GetMinPPI());
 			fconfig.Write("res_mode", vrv->GetResMode());
+			fconfig.Write("mixed_lod", vrv->GetMixedLOD());
 			fconfig.Write("nearclip", vrv->GetNearClip());
 			fconfig.Write("farclip", vrv->GetFarClip());
 			Color bkcolor;
@@ -3580,6 +3581,9 @@ void VRenderFrame::OpenProject(wxString& filename)
 	int iVal;
 	int i, j, k;
 	//clear
+	//the frame prefetch of the views converts with the readers deleted here
+	for (i=0; i<(int)m_vrv_list.size(); i++)
+		if (m_vrv_list[i]) m_vrv_list[i]->ClearPrefetch();
 	m_data_mgr.ClearAll();
 	DataGroup::ResetID();
 	MeshGroup::ResetID();
@@ -3934,6 +3938,9 @@ void VRenderFrame::OpenProject(wxString& filename)
 				int res_mode;
 				if (fconfig.Read("res_mode", &res_mode))
 					vrv->SetResMode(res_mode);
+				bool mixed_lod;
+				if (fconfig.Read("mixed_lod", &mixed_lod))
+					vrv->SetMixedLOD(mixed_lod);
 				double nearclip;
 				if (fconfig.Read("nearclip", &nearclip))
 					vrv->SetNearClip(nearclip);
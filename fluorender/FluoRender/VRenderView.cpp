@@ -398,64 +398,324 @@ void LMSeacher::OnMouse(wxMouseEvent& event)
 
 /////////////////////////////////////////////////////////////////////////
 
-VolumeDecompressorThread::VolumeDecompressorThread(VolumeLoader *vl)
-	: wxThread(wxTHREAD_DETACHED), m_vl(vl)
+LoadedBrickList::LoadedBrickList()
 {
+	m_cost_aware = true;
+	m_loads = 0;
+	m_evictions = 0;
+	m_reloads = 0;
+}
 
+LoadedBrickList::~LoadedBrickList()
+{
 }
 
-VolumeDecompressorThread::~VolumeDecompressorThread()
+int LoadedBrickList::Classify(const VolumeLoaderData &d)
 {
-	wxCriticalSectionLocker enter(m_vl->m_pThreadCS);
-	// the thread is being destroyed; make sure not to leave dangling pointers around
-	m_vl->m_running_decomp_th--;
+	if (!d.vd->GetDisp())
+		return EVICT_VD_HIDDEN;
+	if (!d.brick->get_disp())
+		return EVICT_BRICK_HIDDEN;
+	if (d.brick->drawn(d.mode))
+		return EVICT_DRAWN;
+	return EVICT_SPECULATIVE;
 }
 
-wxThread::ExitCode VolumeDecompressorThread::Entry()
+int LoadedBrickList::ReloadCost(const VolumeLoaderData &d)
 {
-	unsigned int st_time = GET_TICK_COUNT();
+	int cost = 1;
+	if (d.finfo->type != BRICK_FILE_TYPE_RAW)
+		cost += 1;
+	if (d.finfo->isurl && !BrickCache::has(d.finfo))
+		cost += 2;
+	return cost;
+}
 
-	m_vl->m_pThreadCS.Enter();
-	m_vl->m_running_decomp_th++;
-	m_vl->m_pThreadCS.Leave();
+void LoadedBrickList::Touch(const VolumeLoaderData &d)
+{
+	int cls = Classify(d);
+	auto ite = m_items.find(d.brick);
+	if (ite == m_items.end())
+	{
+		Item item;
+		item.d = d;
+		item.cls = cls;
+		item.pos = m_lists[cls].insert(m_lists[cls].end(), d.brick);
+		m_items[d.brick] = item;
 
-	while(1)
+		m_loads++;
+		auto eite = m_evicted.find(d.brick);
+		if (eite != m_evicted.end())
+		{
+			m_reloads++;
+			m_evicted.erase(eite);
+		}
+	}
+	else
 	{
-		m_vl->m_pThreadCS.Enter();
+		Item &item = ite->second;
+		item.d = d;
+		m_lists[cls].splice(m_lists[cls].end(), m_lists[item.cls], item.pos);
+		item.cls = cls;
+	}
+}
+
+void LoadedBrickList::Erase(TextureBrick *b)
+{
+	auto ite = m_items.find(b);
+	if (ite == m_items.end())
+		return;
+	m_lists[ite->second.cls].erase(ite->second.pos);
+	m_items.erase(ite);
+}
+
+void LoadedBrickList::Clear()
+{
+	m_items.clear();
+	for (int i = 0; i < EVICT_CLASS_NUM; i++)
+		m_lists[i].clear();
+	m_evicted.clear();
+}
+
+void LoadedBrickList::GetAll(vector<VolumeLoaderData> &items)
+{
+	items.reserve(items.size() + m_items.size());
+	for (auto ite = m_items.begin(); ite != m_items.end(); ++ite)
+		items.push_back(ite->second.d);
+}
+
+bool LoadedBrickList::Evict(int cls, BrickLoadQueue &queue, VolumeLoaderData &d)
+{
+	//candidates compared by cost
+	const int window = 4;
+	bool spec = cls == EVICT_SPECULATIVE;
+	list<TextureBrick*> &lst = m_lists[cls];
 
-		if (m_vl->m_decomp_queues.size() == 0)
+	Item *best = NULL;
+	int best_cost = 0;
+	int found = 0;
+	auto ite = spec ? lst.end() : lst.begin();
+	size_t num = lst.size();
+	for (size_t i = 0; i < num; i++)
+	{
+		if (spec)
+			--ite;
+		auto cur = ite;
+		if (!spec)
+			++ite;
+
+		Item &item = m_items[*cur];
+		int c = Classify(item.d);
+		if (c > cls)
 		{
-			m_vl->m_pThreadCS.Leave();
-			break;
+			//it is freed later now, and keeps its age in the new class
+			m_lists[c].splice(m_lists[c].begin(), lst, cur);
+			item.cls = c;
+			continue;
 		}
-		VolumeDecompressorData q = m_vl->m_decomp_queues[0];
-		m_vl->m_decomp_queues.erase(m_vl->m_decomp_queues.begin());
+		if (!item.d.brick->isLoaded() ||
+			(c == EVICT_SPECULATIVE && !queue.Contains(item.d.brick, item.d.mode)))
+			continue;
 
-		m_vl->m_pThreadCS.Leave();
+		int cost = m_cost_aware ? ReloadCost(item.d) : 0;
+		if (!best || cost < best_cost)
+		{
+			best = &item;
+			best_cost = cost;
+		}
+		if (!m_cost_aware || ++found >= window)
+			break;
+	}
+	if (!best)
+		return false;
+
+	d = best->d;
+	m_evicted[d.brick] = d.vd;
+	m_evictions++;
+	Erase(d.brick);
+	return true;
+}
+
+void LoadedBrickList::GetCounters(long long &loads, long long &evictions, long long &reloads)
+{
+	loads = m_loads;
+	evictions = m_evictions;
+	reloads = m_reloads;
+}
+
+void LoadedBrickList::ResetCounters()
+{
+	m_loads = 0;
+	m_evictions = 0;
+	m_reloads = 0;
+}
 
+void LoadedBrickList::ForgetVD(VolumeData *vd)
+{
+	auto ite = m_evicted.begin();
+	while (ite != m_evicted.end())
+	{
+		if (ite->second == vd)
+			ite = m_evicted.erase(ite);
+		else
+			++ite;
+	}
+}
+
+/////////////////////////////////////////////////////////////////////////
+
+BrickPayloadCache::BrickPayloadCache()
+{
+	m_size = 0;
+	m_max_size = 256LL*1024LL*1024LL;
+	m_hits = 0;
+	m_misses = 0;
+}
+
+BrickPayloadCache::~BrickPayloadCache()
+{
+	Clear();
+}
+
+bool BrickPayloadCache::Put(TextureBrick *b, VolumeData *vd, char *data, size_t size, int type)
+{
+	wxCriticalSectionLocker enter(m_cs);
+	if (!data || (long long)size > m_max_size)
+		return false;
+
+	auto ite = m_entries.find(b);
+	if (ite != m_entries.end())
+		Remove(ite);
+	Evict(m_max_size - (long long)size);
+
+	Entry e;
+	e.vd = vd;
+	e.data = data;
+	e.size = size;
+	e.type = type;
+	e.pos = m_lru.insert(m_lru.end(), b);
+	m_entries[b] = e;
+	m_size += size;
+	return true;
+}
+
+bool BrickPayloadCache::Take(TextureBrick *b, char* &data, size_t &size, int &type)
+{
+	wxCriticalSectionLocker enter(m_cs);
+	auto ite = m_entries.find(b);
+	if (ite == m_entries.end())
+	{
+		m_misses++;
+		return false;
+	}
+	m_hits++;
+	data = ite->second.data;
+	size = ite->second.size;
+	type = ite->second.type;
+	m_size -= size;
+	m_lru.erase(ite->second.pos);
+	m_entries.erase(ite);
+	return true;
+}
+
+bool BrickPayloadCache::Has(TextureBrick *b)
+{
+	wxCriticalSectionLocker enter(m_cs);
+	return m_entries.find(b) != m_entries.end();
+}
+
+void BrickPayloadCache::RemoveVD(VolumeData *vd)
+{
+	wxCriticalSectionLocker enter(m_cs);
+	auto ite = m_entries.begin();
+	while (ite != m_entries.end())
+	{
+		auto cur = ite++;
+		if (cur->second.vd == vd)
+			Remove(cur);
+	}
+}
+
+void BrickPayloadCache::Clear()
+{
+	wxCriticalSectionLocker enter(m_cs);
+	Evict(0);
+}
+
+void BrickPayloadCache::SetMaxSize(long long size)
+{
+	wxCriticalSectionLocker enter(m_cs);
+	m_max_size = size > 0 ? size : 0;
+	Evict(m_max_size);
+}
+
+void BrickPayloadCache::GetStats(long long &size, long long &hits, long long &misses)
+{
+	wxCriticalSectionLocker enter(m_cs);
+	size = m_size;
+	hits = m_hits;
+	misses = m_misses;
+}
+
+void BrickPayloadCache::Remove(unordered_map<TextureBrick*, Entry>::iterator ite)
+{
+	BrickBufferPool::release(ite->second.data);
+	m_size -= ite->second.size;
+	m_lru.erase(ite->second.pos);
+	m_entries.erase(ite);
+}
+
+void BrickPayloadCache::Evict(long long max_size)
+{
+	while (m_size > max_size && !m_lru.empty())
+		Remove(m_entries.find(m_lru.front()));
+}
+
+/////////////////////////////////////////////////////////////////////////
+
+VolumeDecompressorThread::VolumeDecompressorThread(VolumeLoader *vl)
+	: wxThread(wxTHREAD_JOINABLE), m_vl(vl)
+{
+
+}
+
+VolumeDecompressorThread::~VolumeDecompressorThread()
+{
+}
+
+wxThread::ExitCode VolumeDecompressorThread::Entry()
+{
+	while(1)
+	{
+		VolumeDecompressorData q;
+		if (!m_vl->PopDecompQueue(q))
+			break;
 
 		size_t bsize = (size_t)(q.b->nx())*(size_t)(q.b->ny())*(size_t)(q.b->nz())*(size_t)(q.b->nb(0));
-		char *result = new char[bsize];
-		if (TextureBrick::decompress_brick(result, q.in_data, bsize, q.in_size, q.finfo->type))
+		char *result = BrickBufferPool::alloc(bsize);
+		if (result && TextureBrick::decompress_brick(result, q.in_data, bsize, q.in_size, q.type))
 		{
 			m_vl->m_pThreadCS.Enter();
 
-			delete [] q.in_data;
+			m_vl->KeepPayload(q.b, q.vd, q.in_data, q.in_size, q.type);
 			q.b->set_brkdata(result);
 			q.b->set_loading_state(false);
 			m_vl->m_pThreadCS.Leave();
 		}
 		else
 		{
-			delete [] result;
+			BrickBufferPool::release(result);
 
 			m_vl->m_pThreadCS.Enter();
-			delete [] q.in_data;
+			BrickBufferPool::release(q.in_data);
+			//charged and listed as loaded when it was queued
 			m_vl->m_used_memory -= bsize;
+			m_vl->m_loaded.Erase(q.b);
 			q.b->set_drawn(q.mode, true);
 			q.b->set_loading_state(false);
 			m_vl->m_pThreadCS.Leave();
 		}
+		m_vl->FinishDecomp();
 	}
 
 	return (wxThread::ExitCode)0;
@@ -466,256 +726,905 @@ wxDEFINE_EVENT(wxEVT_VLTHREAD_COMPLETED, wxCommandEvent);
 wxDEFINE_EVENT(wxEVT_VLTHREAD_PAUSED, wxCommandEvent);
 */
 VolumeLoaderThread::VolumeLoaderThread(VolumeLoader *vl)
-	: wxThread(wxTHREAD_JOINABLE), m_vl(vl)
+	: wxThread(wxTHREAD_JOINABLE), m_vl(vl), m_gen(0)
+{
+
+}
+
+VolumeLoaderThread::~VolumeLoaderThread()
+{
+}
+
+bool VolumeLoaderThread::TestDestroy()
+{
+	return m_vl->IsCanceled(m_gen) || wxThread::TestDestroy();
+}
+
+wxThread::ExitCode VolumeLoaderThread::Entry()
+{
+	while(m_vl->WaitRequest(m_gen))
+	{
+		Load();
+		m_vl->FinishRequest();
+	}
+
+	return (wxThread::ExitCode)0;
+}
+
+void VolumeLoaderThread::Load()
+{
+	unsigned int st_time = GET_TICK_COUNT();
+
+	//stop the downloads the new queue does not need
+	vector<VolumeLoaderData> items;
+	m_vl->m_queues.GetAll(items);
+	vector<TextureBrick*> queued;
+	for (size_t i = 0; i < items.size(); i++)
+		queued.push_back(items[i].brick);
+	m_vl->m_downloader.cancel_except(queued);
+	auto fite = m_vl->m_fetching.begin();
+	while(fite != m_vl->m_fetching.end())
+	{
+		if (find(queued.begin(), queued.end(), fite->first) == queued.end())
+			fite = m_vl->m_fetching.erase(fite);
+		else
+			fite++;
+	}
+
+	bool aborted = false;
+	while(1)
+	{
+		if (TestDestroy())
+		{
+			aborted = true;
+			break;
+		}
+
+		VolumeLoaderData b;
+		if (!m_vl->m_queues.Pop(b))
+			break;
+		m_vl->m_pThreadCS.Enter();
+		b.brick->set_loading_state(false);
+		m_vl->m_pThreadCS.Leave();
+
+		if (!b.brick->isLoaded() && !b.brick->isLoading())
+		{
+			if (m_vl->m_used_memory >= m_vl->m_memory_limit)
+			{
+				m_vl->m_pThreadCS.Enter();
+				while(1)
+				{
+					m_vl->CleanupLoadedBrick();
+					if (m_vl->m_used_memory < m_vl->m_memory_limit)
+						break;
+					m_vl->m_pThreadCS.Leave();
+					//bricks are released when they are drawn, a new request wakes it up
+					bool canceled = m_vl->WaitCancel(m_gen, 10);
+					m_vl->m_pThreadCS.Enter();
+					if (canceled)
+						break;
+				}
+				m_vl->m_pThreadCS.Leave();
+			}
+			else
+				m_vl->TrimBufferPool();
+
+			//bricks evicted before are decompressed again without reading them
+			char *payload = NULL;
+			size_t payload_size = 0;
+			int payload_type = 0;
+			if (m_vl->m_payloads.Take(b.brick, payload, payload_size, payload_type))
+			{
+				StoreBrick(b, payload, payload_size, payload_type);
+				StoreFetchedBricks(0);
+				continue;
+			}
+
+			//read the bricks packed next to this one with the same call
+			//or the same range request if they are remote
+			bool fetch = b.finfo->isurl && !BrickCache::has(b.finfo);
+			vector<VolumeLoaderData> group;
+			group.push_back(b);
+			if (m_vl->m_max_merge_size > 0 && b.finfo->datasize > 0 && (fetch || !b.finfo->isurl))
+			{
+				m_vl->m_pThreadCS.Enter();
+				m_vl->GatherAdjacentBricks(group);
+				m_vl->m_pThreadCS.Leave();
+			}
+
+			//remote bricks that are not cached are stored when their transfers finish
+			if (fetch && FetchBricks(group))
+				continue;
+
+			vector<char*> ptrs(group.size(), (char*)NULL);
+			vector<size_t> sizes(group.size(), 0);
+			if (group.size() > 1 && !b.finfo->isurl)
+			{
+				long long st = group[0].finfo->offset;
+				long long ed = group.back().finfo->offset + group.back().finfo->datasize;
+				char *span = BrickBufferPool::alloc((size_t)(ed - st));
+				if (span && BrickFileHandles::read(b.finfo->filename, st, (size_t)(ed - st), span))
+				{
+					for (size_t i = 0; i < group.size(); i++)
+					{
+						size_t size = group[i].finfo->datasize;
+						ptrs[i] = BrickBufferPool::alloc(size);
+						if (!ptrs[i]) continue;
+						memcpy(ptrs[i], span + (group[i].finfo->offset - st), size);
+						sizes[i] = size;
+					}
+				}
+				BrickBufferPool::release(span);
+			}
+			for (size_t i = 0; i < group.size(); i++)
+			{
+				if (!ptrs[i])
+					TextureBrick::read_brick_without_decomp(ptrs[i], sizes[i], group[i].finfo, this);
+				if (ptrs[i])
+					StoreBrick(group[i], ptrs[i], sizes[i]);
+			}
+
+		}
+		else
+		{
+			size_t bsize = (size_t)(b.brick->nx())*(size_t)(b.brick->ny())*(size_t)(b.brick->nz())*(size_t)(b.brick->nb(0));
+			b.datasize = bsize;
+
+			m_vl->m_pThreadCS.Enter();
+			if (m_vl->m_loaded.Has(b.brick))
+				m_vl->m_loaded.Touch(b);
+			m_vl->m_pThreadCS.Leave();
+		}
+
+		StoreFetchedBricks(0);
+	}
+
+	//transfers still running are picked up by the next run when aborted
+	while (!aborted && m_vl->m_downloader.size() > 0)
+	{
+		if (TestDestroy())
+			break;
+		StoreFetchedBricks(100);
+	}
+
+	/*
+	wxCommandEvent evt(wxEVT_VLTHREAD_COMPLETED, GetId());
+	VolumeLoaderData *data = new VolumeLoaderData;
+	data->m_cur_cat = 0;
+	data->m_cur_item = 0;
+	data->m_progress = 0;
+	evt.SetClientData(data);
+	wxPostEvent(m_pParent, evt);
+	*/
+}
+
+bool VolumeLoaderThread::FetchBricks(const vector<VolumeLoaderData> &group)
+{
+	while (m_vl->m_downloader.full())
+	{
+		if (TestDestroy())
+			return true;
+		StoreFetchedBricks(100);
+	}
+
+	vector<const FileLocInfo*> finfos;
+	vector<TextureBrick*> bricks;
+	for (size_t i = 0; i < group.size(); i++)
+	{
+		m_vl->m_fetching[group[i].brick] = group[i];
+		finfos.push_back(group[i].finfo);
+		bricks.push_back(group[i].brick);
+	}
+	if (!m_vl->m_downloader.add(finfos, bricks))
+	{
+		for (size_t i = 0; i < group.size(); i++)
+			m_vl->m_fetching.erase(group[i].brick);
+		return false;
+	}
+	return true;
+}
+
+void VolumeLoaderThread::StoreFetchedBricks(int timeout)
+{
+	vector<BrickDownloader::Result> done;
+	m_vl->m_downloader.perform(done, timeout);
+
+	for (size_t i = 0; i < done.size(); i++)
+	{
+		for (size_t j = 0; j < done[i].bricks.size(); j++)
+		{
+			auto ite = m_vl->m_fetching.find(done[i].bricks[j]);
+			if (ite == m_vl->m_fetching.end())
+				continue;
+			VolumeLoaderData b = ite->second;
+			m_vl->m_fetching.erase(ite);
+			if (done[i].filename.empty() || b.brick->isLoaded() || b.brick->isLoading())
+				continue;
+
+			size_t size = b.finfo->datasize;
+			if (size <= 0)
+			{
+				long long fsize = BrickFileHandles::file_size(done[i].filename);
+				size = fsize > 0 ? (size_t)fsize : 0;
+			}
+			//a cached range holds only this brick
+			long long offset = b.finfo->is_range() ? 0 : b.finfo->offset;
+			char *ptr = size > 0 ? BrickBufferPool::alloc(size) : NULL;
+			if (ptr && BrickFileHandles::read(done[i].filename, offset, size, ptr))
+				StoreBrick(b, ptr, size);
+			else
+				BrickBufferPool::release(ptr);
+		}
+		if (!done[i].filename.empty())
+			BrickCache::release(done[i].filename);
+	}
+}
+
+void VolumeLoaderThread::StoreBrick(VolumeLoaderData b, char *ptr, size_t readsize, int type)
+{
+	if (type < 0)
+		type = b.finfo->type;
+
+	if (type == BRICK_FILE_TYPE_RAW)
+	{
+		//a compressed copy is restored faster than a raw brick is read again
+		char *zdata = NULL;
+		size_t zsize = 0;
+		if (m_vl->m_recompress_raw &&
+			TextureBrick::zlib_compressor(zdata, zsize, ptr, readsize))
+			m_vl->KeepPayload(b.brick, b.vd, zdata, zsize, BRICK_FILE_TYPE_ZLIB);
+
+		m_vl->m_pThreadCS.Enter();
+		b.brick->set_brkdata(ptr);
+		b.datasize = readsize;
+		m_vl->AddLoadedBrick(b);
+		m_vl->m_pThreadCS.Leave();
+	}
+	else
+	{
+		bool decomp_in_this_thread = false;
+		VolumeDecompressorData dq;
+		dq.b = b.brick;
+		dq.finfo = b.finfo;
+		dq.vd = b.vd;
+		dq.mode = b.mode;
+		dq.type = type;
+		dq.priority = b.priority;
+		dq.in_data = ptr;
+		dq.in_size = readsize;
+
+		size_t bsize = (size_t)(b.brick->nx())*(size_t)(b.brick->ny())*(size_t)(b.brick->nz())*(size_t)(b.brick->nb(0));
+		b.datasize = bsize;
+		dq.datasize = bsize;
+
+		if (m_vl->m_max_decomp_th == 0 || !m_vl->StartDecompThread())
+			decomp_in_this_thread = true;
+		else
+		{
+			m_vl->m_pThreadCS.Enter();
+			m_vl->PushDecompQueue(dq);
+			m_vl->m_used_memory += bsize;
+			b.brick->set_loading_state(true);
+			m_vl->m_loaded.Touch(b);
+			m_vl->m_pThreadCS.Leave();
+		}
+
+		if (decomp_in_this_thread)
+		{
+			char *result = BrickBufferPool::alloc(bsize);
+			if (result && TextureBrick::decompress_brick(result, dq.in_data, bsize, dq.in_size, dq.type))
+			{
+				m_vl->m_pThreadCS.Enter();
+				m_vl->KeepPayload(dq.b, dq.vd, dq.in_data, dq.in_size, dq.type);
+				b.brick->set_brkdata(result);
+				b.datasize = bsize;
+				m_vl->m_used_memory += bsize;
+				m_vl->m_loaded.Touch(b);
+				m_vl->m_pThreadCS.Leave();
+			}
+			else
+			{
+				BrickBufferPool::release(result);
+
+				m_vl->m_pThreadCS.Enter();
+				BrickBufferPool::release(dq.in_data);
+				dq.b->set_drawn(dq.mode, true);
+				m_vl->m_pThreadCS.Leave();
+			}
+		}
+	}
+}
+
+VolumeLoader::VolumeLoader() :
+	m_runCond(m_runMutex),
+	m_idleCond(m_runMutex),
+	m_decompCond(m_decompMutex),
+	m_decompIdleCond(m_decompMutex)
+{
+	m_thread = NULL;
+	m_gen = 0;
+	m_pending = false;
+	m_busy = false;
+	m_exit = false;
+	m_idle_decomp_th = 0;
+	m_decomp_exit = false;
+	m_running_decomp_th = 0;
+	m_max_decomp_th = wxThread::GetCPUCount()-1;
+	if (m_max_decomp_th < 0)
+		m_max_decomp_th = -1;
+	m_memory_limit = 10000000LL;
+	m_used_memory = 0LL;
+	m_max_merge_size = 32LL*1024LL*1024LL;
+	m_decomp_seq = 0;
+	m_recompress_raw = false;
+}
+
+VolumeLoader::~VolumeLoader()
+{
+	Abort();
+	if (m_thread)
+	{
+		m_runMutex.Lock();
+		m_exit = true;
+		m_runCond.Broadcast();
+		m_runMutex.Unlock();
+		m_thread->Wait();
+		delete m_thread;
+		m_thread = NULL;
+	}
+
+	m_decompMutex.Lock();
+	m_decomp_exit = true;
+	m_decompCond.Broadcast();
+	m_decompMutex.Unlock();
+	for (size_t i = 0; i < m_decomp_threads.size(); i++)
+	{
+		m_decomp_threads[i]->Wait();
+		delete m_decomp_threads[i];
+	}
+	m_decomp_threads.clear();
+
+	RemoveAllLoadedBrick();
+}
+
+void VolumeLoader::Queue(VolumeLoaderData brick)
+{
+	m_queues.Push(brick);
+}
+
+void VolumeLoader::ClearQueues()
+{
+	if (!m_queues.Empty())
+	{
+		Abort();
+		m_queues.Clear();
+	}
+}
+
+//vld is in loading order, the bricks are reprioritized by their positions in it
+void VolumeLoader::Set(vector<VolumeLoaderData> vld)
+{
+	Abort();
+	//StopAll();
+	m_queues.Assign(vld);
+}
+
+//cancel the current request and wait until the loader thread lets it go
+//bricks read but not decompressed yet are dropped
+void VolumeLoader::Abort()
+{
+	m_runMutex.Lock();
+	m_gen++;
+	m_pending = false;
+	m_runCond.Broadcast();
+	while (m_busy)
+		m_idleCond.Wait();
+	m_runMutex.Unlock();
+
+	wxCriticalSectionLocker enter(m_pThreadCS);
+	DropDecompQueue();
+}
+
+void VolumeLoader::StopAll()
+{
+	Abort();
+	m_downloader.cancel_all();
+	m_fetching.clear();
+
+	WaitDecompIdle();
+}
+
+bool VolumeLoader::Run()
+{
+	Abort();
+	//StopAll();
+
+	if (!m_thread)
+	{
+		m_thread = new VolumeLoaderThread(this);
+		if (m_thread->Create() != wxTHREAD_NO_ERROR ||
+			m_thread->Run() != wxTHREAD_NO_ERROR)
+		{
+			delete m_thread;
+			m_thread = NULL;
+			return false;
+		}
+	}
+
+	wxMutexLocker lock(m_runMutex);
+	m_pending = true;
+	m_runCond.Broadcast();
+
+	return true;
+}
+
+bool VolumeLoader::WaitRequest(unsigned int &gen)
+{
+	wxMutexLocker lock(m_runMutex);
+	while (!m_exit && !m_pending)
+		m_runCond.Wait();
+	if (m_exit)
+		return false;
+	m_pending = false;
+	m_busy = true;
+	gen = m_gen;
+	return true;
+}
+
+void VolumeLoader::FinishRequest()
+{
+	wxMutexLocker lock(m_runMutex);
+	m_busy = false;
+	m_idleCond.Broadcast();
+}
+
+bool VolumeLoader::IsCanceled(unsigned int gen)
+{
+	wxMutexLocker lock(m_runMutex);
+	return m_exit || gen != m_gen;
+}
+
+bool VolumeLoader::WaitCancel(unsigned int gen, int ms)
+{
+	wxMutexLocker lock(m_runMutex);
+	if (!m_exit && gen == m_gen)
+		m_runCond.WaitTimeout(ms);
+	return m_exit || gen != m_gen;
+}
+
+//take the queued bricks stored next to the first one of the group from the same file
+//only a window at the top of the heap is searched so the load order is mostly kept
+//called with m_pThreadCS held
+void VolumeLoader::GatherAdjacentBricks(vector<VolumeLoaderData> &group)
+{
+	const int window = 64;
+	//read through small gaps rather than seeking
+	const long long max_gap = 64LL*1024LL;
+
+	FileLocInfo *first = group[0].finfo;
+	vector<VolumeLoaderData> front;
+	m_queues.GetFront(window, front);
+	vector<pair<long long, int> > cands;
+	for (int i = 0; i < (int)front.size(); i++)
+	{
+		FileLocInfo *finfo = front[i].finfo;
+		if (!finfo || finfo->isurl != first->isurl || finfo->datasize <= 0 ||
+			finfo->filename != first->filename ||
+			(finfo->isurl && BrickCache::has(finfo)) ||
+			front[i].brick == group[0].brick ||
+			m_payloads.Has(front[i].brick) ||
+			front[i].brick->isLoaded() || front[i].brick->isLoading())
+			continue;
+		cands.push_back(pair<long long, int>(finfo->offset, i));
+	}
+	if (cands.empty())
+		return;
+	sort(cands.begin(), cands.end());
+
+	//grow the range around the first brick in both directions
+	long long st = first->offset;
+	long long ed = first->offset + first->datasize;
+	size_t pos = lower_bound(cands.begin(), cands.end(), pair<long long, int>(st, -1)) - cands.begin();
+	vector<int> picked;
+	for (size_t i = pos; i < cands.size(); i++)
+	{
+		FileLocInfo *finfo = front[cands[i].second].finfo;
+		long long end = finfo->offset + finfo->datasize;
+		if (finfo->offset < ed)
+			continue;
+		if (finfo->offset > ed + max_gap || end - st > m_max_merge_size)
+			break;
+		ed = end;
+		picked.push_back(cands[i].second);
+	}
+	for (size_t i = pos; i-- > 0; )
+	{
+		FileLocInfo *finfo = front[cands[i].second].finfo;
+		long long end = finfo->offset + finfo->datasize;
+		if (end > st)
+			continue;
+		if (end + max_gap < st || ed - finfo->offset > m_max_merge_size)
+			break;
+		st = finfo->offset;
+		picked.push_back(cands[i].second);
+	}
+	if (picked.empty())
+		return;
+
+	for (size_t i = 0; i < picked.size(); i++)
+	{
+		VolumeLoaderData &q = front[picked[i]];
+		if (!m_queues.Remove(q.brick, q.mode))
+			continue;
+		q.brick->set_loading_state(false);
+		group.push_back(q);
+	}
+	sort(group.begin(), group.end(), sort_data_offset);
+}
+
+//free loaded bricks class by class until the queued ones fit
+void VolumeLoader::CleanupLoadedBrick()
+{
+	long long required = m_queues.GetBytes();
+
+	for (int c = 0; c < LoadedBrickList::EVICT_CLASS_NUM; c++)
+	{
+		//bricks that are not drawn yet are only freed to stay within the limit
+		bool spec = c == LoadedBrickList::EVICT_SPECULATIVE;
+		VolumeLoaderData d;
+		while ((!spec && required > 0) || m_used_memory >= m_memory_limit)
+		{
+			if (!m_loaded.Evict(c, m_queues, d))
+				break;
+			d.brick->freeBrkData();
+			required -= d.datasize;
+			m_used_memory -= d.datasize;
+		}
+	}
+	TrimBufferPool();
+}
+
+//freed buffers are kept for the next bricks, they count against the limit too
+void VolumeLoader::TrimBufferPool()
+{
+	size_t in_use, pooled;
+	BrickBufferPool::get_stats(in_use, pooled);
+	long long room = m_memory_limit - m_used_memory;
+	if ((long long)pooled > room)
+		BrickBufferPool::trim(room > 0 ? (size_t)room : 0);
+}
+
+void VolumeLoader::RemoveAllLoadedBrick()
+{
+	StopAll();
+	m_downloader.close();
+	vector<VolumeLoaderData> loaded;
+	m_loaded.GetAll(loaded);
+	for (size_t i = 0; i < loaded.size(); i++)
+	{
+		if (loaded[i].brick->isLoaded())
+		{
+			loaded[i].brick->freeBrkData();
+			m_used_memory -= loaded[i].datasize;
+		}
+	}
+	m_loaded.Clear();
+	m_payloads.Clear();
+}
+
+void VolumeLoader::RemoveBrickVD(VolumeData *vd)
+{
+	StopAll();
+	vector<VolumeLoaderData> loaded;
+	m_loaded.GetAll(loaded);
+	for (size_t i = 0; i < loaded.size(); i++)
+	{
+		if (loaded[i].vd == vd && loaded[i].brick->isLoaded())
+		{
+			loaded[i].brick->freeBrkData();
+			m_used_memory -= loaded[i].datasize;
+			m_loaded.Erase(loaded[i].brick);
+		}
+	}
+	m_loaded.ForgetVD(vd);
+	m_payloads.RemoveVD(vd);
+}
+
+void VolumeLoader::GetPalams(long long &used_mem, int &running_decomp_th, int &queue_num, int &decomp_queue_num)
+{
+	long long us = 0;
+	int ll = 0;
+/*	vector<VolumeLoaderData> loaded;
+	m_loaded.GetAll(loaded);
+	for(auto e : loaded)
+	{
+		if (e.brick->isLoaded())
+			us += e.datasize;
+		if (!e.brick->get_disp())
+			ll++;
+	}
+*/	m_pThreadCS.Enter();
+	used_mem = m_used_memory;
+	m_pThreadCS.Leave();
+	queue_num = m_queues.Size();
+	wxMutexLocker lock(m_decompMutex);
+	running_decomp_th = m_running_decomp_th;
+	decomp_queue_num = m_decomp_queues.size();
+}
+
+void VolumeLoader::GetCounters(long long &loads, long long &evictions, long long &reloads)
+{
+	wxCriticalSectionLocker enter(m_pThreadCS);
+	m_loaded.GetCounters(loads, evictions, reloads);
+}
+
+void VolumeLoader::ResetCounters()
+{
+	wxCriticalSectionLocker enter(m_pThreadCS);
+	m_loaded.ResetCounters();
+}
+
+void VolumeLoader::SetCostAwareEviction(bool val)
+{
+	wxCriticalSectionLocker enter(m_pThreadCS);
+	m_loaded.SetCostAware(val);
+}
+
+//the pool grows up to m_max_decomp_th workers, no limit if it is negative
+bool VolumeLoader::StartDecompThread()
+{
+	{
+		wxMutexLocker lock(m_decompMutex);
+		if (m_idle_decomp_th > (int)m_decomp_queues.size() ||
+			(m_max_decomp_th > 0 && (int)m_decomp_threads.size() >= m_max_decomp_th))
+			return true;
+	}
+
+	VolumeDecompressorThread *dthread = new VolumeDecompressorThread(this);
+	if (dthread->Create() != wxTHREAD_NO_ERROR ||
+		dthread->Run() != wxTHREAD_NO_ERROR)
+	{
+		delete dthread;
+		return !m_decomp_threads.empty();
+	}
+	m_decomp_threads.push_back(dthread);
+	return true;
+}
+
+void VolumeLoader::PushDecompQueue(VolumeDecompressorData &dq)
+{
+	wxMutexLocker lock(m_decompMutex);
+	dq.seq = m_decomp_seq++;
+	m_decomp_queues.push_back(dq);
+	push_heap(m_decomp_queues.begin(), m_decomp_queues.end(), sort_decomp);
+	m_decompCond.Signal();
+}
+
+//the bricks are decompressed in the order of their priorities, not the order their reads finished
+bool VolumeLoader::PopDecompQueue(VolumeDecompressorData &dq)
+{
+	wxMutexLocker lock(m_decompMutex);
+	while (!m_decomp_exit && m_decomp_queues.empty())
+	{
+		m_idle_decomp_th++;
+		m_decompCond.Wait();
+		m_idle_decomp_th--;
+	}
+	if (m_decomp_exit)
+		return false;
+	pop_heap(m_decomp_queues.begin(), m_decomp_queues.end(), sort_decomp);
+	dq = m_decomp_queues.back();
+	m_decomp_queues.pop_back();
+	m_running_decomp_th++;
+	return true;
+}
+
+void VolumeLoader::FinishDecomp()
 {
+	wxMutexLocker lock(m_decompMutex);
+	m_running_decomp_th--;
+	if (m_running_decomp_th == 0 && m_decomp_queues.empty())
+		m_decompIdleCond.Broadcast();
+}
 
+void VolumeLoader::KeepPayload(TextureBrick *b, VolumeData *vd, char *data, size_t size, int type)
+{
+	if (!m_payloads.Put(b, vd, data, size, type))
+		BrickBufferPool::release(data);
 }
 
-VolumeLoaderThread::~VolumeLoaderThread()
+void VolumeLoader::DropDecompQueue()
 {
-	wxCriticalSectionLocker enter(m_vl->m_pThreadCS);
-	if (!m_vl->m_decomp_queues.empty())
+	wxMutexLocker lock(m_decompMutex);
+	for (size_t i = 0; i < m_decomp_queues.size(); i++)
 	{
-		for (int i = 0; i < m_vl->m_decomp_queues.size(); i++)
-		{
-			if (m_vl->m_decomp_queues[i].in_data != NULL)
-				delete [] m_vl->m_decomp_queues[i].in_data;
-			m_vl->m_used_memory -= m_vl->m_decomp_queues[i].datasize;
-		}
-		m_vl->m_decomp_queues.clear();
+		VolumeDecompressorData &q = m_decomp_queues[i];
+		KeepPayload(q.b, q.vd, q.in_data, q.in_size, q.type);
+		m_used_memory -= q.datasize;
+		q.b->set_loading_state(false);
+		m_loaded.Erase(q.b);
 	}
-	// the thread is being destroyed; make sure not to leave dangling pointers around
+	m_decomp_queues.clear();
+	if (m_running_decomp_th == 0)
+		m_decompIdleCond.Broadcast();
 }
 
-wxThread::ExitCode VolumeLoaderThread::Entry()
+void VolumeLoader::WaitDecompIdle()
 {
-	unsigned int st_time = GET_TICK_COUNT();
+	wxMutexLocker lock(m_decompMutex);
+	while (m_running_decomp_th > 0 || !m_decomp_queues.empty())
+		m_decompIdleCond.Wait();
+}
 
-	while(m_vl->m_running_decomp_th > 0)
-	{
-		if (TestDestroy())
-			return (wxThread::ExitCode)0;
-		Sleep(10);
-	}
+/////////////////////////////////////////////////////////////////////////
 
-	m_vl->m_pThreadCS.Enter();
-	auto ite = m_vl->m_loaded.begin();
-	while(ite != m_vl->m_loaded.end())
-	{
-		if (!ite->second.brick->isLoaded() && ite->second.brick->isLoading())
-		{
-			ite->second.brick->set_loading_state(false);
-			ite = m_vl->m_loaded.erase(ite);
-		}
-		else
-			ite++;
-	}
-	m_vl->m_pThreadCS.Leave();
+VolumePrefetchThread::VolumePrefetchThread(VolumePrefetcher *vp)
+	: wxThread(wxTHREAD_JOINABLE), m_vp(vp)
+{
+
+}
+
+VolumePrefetchThread::~VolumePrefetchThread()
+{
+
+}
 
+wxThread::ExitCode VolumePrefetchThread::Entry()
+{
 	while(1)
 	{
-		if (TestDestroy())
-			break;
-
-		m_vl->m_pThreadCS.Enter();
-		if (m_vl->m_queues.size() == 0)
+		m_vp->m_pThreadCS.Enter();
+		if (TestDestroy() ||
+			m_vp->m_queues.size() == 0 ||
+			!m_vp->HasRoom(max(m_vp->m_frame_size, 1LL)))
 		{
-			m_vl->m_pThreadCS.Leave();
+			m_vp->m_running = false;
+			m_vp->m_pThreadCS.Leave();
 			break;
 		}
-		VolumeLoaderData b = m_vl->m_queues[0];
-		b.brick->set_loading_state(false);
-		m_vl->m_queues.erase(m_vl->m_queues.begin());
-		m_vl->m_queued.push_back(b);
-		m_vl->m_pThreadCS.Leave();
-
-		if (!b.brick->isLoaded() && !b.brick->isLoading())
-		{
-			if (m_vl->m_used_memory >= m_vl->m_memory_limit)
-			{
-				m_vl->m_pThreadCS.Enter();
-				while(1)
-				{
-					m_vl->CleanupLoadedBrick();
-					if (m_vl->m_used_memory < m_vl->m_memory_limit || TestDestroy())
-						break;
-					m_vl->m_pThreadCS.Leave();
-					Sleep(10);
-					m_vl->m_pThreadCS.Enter();
-				}
-				m_vl->m_pThreadCS.Leave();
-			}
-
-			char *ptr = NULL;
-			size_t readsize;
-			TextureBrick::read_brick_without_decomp(ptr, readsize, b.finfo, this);
-			if (!ptr) continue;
-
-			if (b.finfo->type == BRICK_FILE_TYPE_RAW)
-			{
-				m_vl->m_pThreadCS.Enter();
-				b.brick->set_brkdata(ptr);
-				b.datasize = readsize;
-				m_vl->AddLoadedBrick(b);
-				m_vl->m_pThreadCS.Leave();
-			}
-			else
-			{
-				bool decomp_in_this_thread = false;
-				VolumeDecompressorData dq;
-				dq.b = b.brick;
-				dq.finfo = b.finfo;
-				dq.vd = b.vd;
-				dq.mode = b.mode;
-				dq.in_data = ptr;
-				dq.in_size = readsize;
-
-				size_t bsize = (size_t)(b.brick->nx())*(size_t)(b.brick->ny())*(size_t)(b.brick->nz())*(size_t)(b.brick->nb(0));
-				b.datasize = bsize;
-				dq.datasize = bsize;
-
-				if (m_vl->m_max_decomp_th == 0)
-					decomp_in_this_thread = true;
-				else if (m_vl->m_max_decomp_th < 0 || 
-					m_vl->m_running_decomp_th < m_vl->m_max_decomp_th)
-				{
-					VolumeDecompressorThread *dthread = new VolumeDecompressorThread(m_vl);
-					if (dthread->Create() == wxTHREAD_NO_ERROR)
-					{
-						m_vl->m_pThreadCS.Enter();
-						m_vl->m_decomp_queues.push_back(dq);
-						m_vl->m_used_memory += bsize;
-						b.brick->set_loading_state(true);
-						m_vl->m_loaded[b.brick] = b;
-						m_vl->m_pThreadCS.Leave();
-
-						dthread->Run();
-					}
-					else
-					{
-						if (m_vl->m_running_decomp_th <= 0)
-							decomp_in_this_thread = true;
-						else
-						{
-							m_vl->m_pThreadCS.Enter();
-							m_vl->m_decomp_queues.push_back(dq);
-							m_vl->m_used_memory += bsize;
-							b.brick->set_loading_state(true);
-							m_vl->m_loaded[b.brick] = b;
-							m_vl->m_pThreadCS.Leave();
-						}
-					}
-				}
-				else
-				{
-					m_vl->m_pThreadCS.Enter();
-					m_vl->m_decomp_queues.push_back(dq);
-					m_vl->m_used_memory += bsize;
-					b.brick->set_loading_state(true);
-					m_vl->m_loaded[b.brick] = b;
-					m_vl->m_pThreadCS.Leave();
-				}
-
-				if (decomp_in_this_thread)
-				{
-					char *result = new char[bsize];
-					if (TextureBrick::decompress_brick(result, dq.in_data, bsize, dq.in_size, dq.finfo->type))
-					{
-						m_vl->m_pThreadCS.Enter();
-						delete [] dq.in_data;
-						b.brick->set_brkdata(result);
-						b.datasize = bsize;
-						m_vl->m_used_memory += bsize;
-						m_vl->m_loaded[b.brick] = b;
-						m_vl->m_pThreadCS.Leave();
-					}
-					else
-					{
-						delete [] result;
+		VolumePrefetchData q = m_vp->m_queues[0];
+		m_vp->m_queues.erase(m_vp->m_queues.begin());
+		bool ready = m_vp->IsReady(q);
+		m_vp->m_pThreadCS.Leave();
 
-						m_vl->m_pThreadCS.Enter();
-						delete [] dq.in_data;
-						m_vl->m_used_memory -= bsize;
-						dq.b->set_drawn(dq.mode, true);
-						m_vl->m_pThreadCS.Leave();
-					}
-				}
-			}
+		if (ready)
+			continue;
 
-		}
-		else
 		{
-			size_t bsize = (size_t)(b.brick->nx())*(size_t)(b.brick->ny())*(size_t)(b.brick->nz())*(size_t)(b.brick->nb(0));
-			b.datasize = bsize;
+			lock_guard<recursive_mutex> lock(q.reader->GetLock());
+			//the views still read the time of the frame they are on
+			int cur_time = q.reader->GetCurTime();
+			q.data = q.reader->Convert(q.frame, q.chan, false);
+			q.reader->SetCurTime(cur_time);
+		}
+		if (!q.data)
+			continue;
+		q.datasize = (unsigned long long)nrrdElementNumber(q.data)*
+			(unsigned long long)nrrdElementSize(q.data);
 
-			m_vl->m_pThreadCS.Enter();
-			if (m_vl->m_loaded.find(b.brick) != m_vl->m_loaded.end())
-				m_vl->m_loaded[b.brick] = b;
-			m_vl->m_pThreadCS.Leave();
+		m_vp->m_pThreadCS.Enter();
+		m_vp->m_frame_size = max(m_vp->m_frame_size, (long long)q.datasize);
+		//the current frame may have moved on while converting
+		//a frame larger than the ones before may not fit
+		if (m_vp->FrameDist(q.frame) <= m_vp->m_frame_num && !m_vp->IsReady(q) &&
+			m_vp->HasRoom(q.datasize))
+		{
+			m_vp->m_ready.push_back(q);
+			m_vp->m_used_memory += q.datasize;
+			q.data = NULL;
 		}
+		m_vp->m_pThreadCS.Leave();
+		if (q.data)
+			nrrdNuke(q.data);
 	}
 
-	/*
-	wxCommandEvent evt(wxEVT_VLTHREAD_COMPLETED, GetId());
-	VolumeLoaderData *data = new VolumeLoaderData;
-	data->m_cur_cat = 0;
-	data->m_cur_item = 0;
-	data->m_progress = 0;
-	evt.SetClientData(data);
-	wxPostEvent(m_pParent, evt);
-	*/
 	return (wxThread::ExitCode)0;
 }
 
-VolumeLoader::VolumeLoader()
+VolumePrefetcher::VolumePrefetcher()
 {
 	m_thread = NULL;
-	m_running_decomp_th = 0;
-	m_max_decomp_th = wxThread::GetCPUCount()-1;
-	if (m_max_decomp_th < 0)
-		m_max_decomp_th = -1;
-	m_memory_limit = 10000000LL;
+	m_running = false;
+	m_frame_num = 2;
+	m_cur_frame = 0;
+	m_start_frame = 0;
+	m_end_frame = 0;
+	m_memory_limit = 1024LL*1024LL*1024LL;
 	m_used_memory = 0LL;
+	m_frame_size = 0LL;
+	m_hits = 0LL;
+	m_misses = 0LL;
 }
 
-VolumeLoader::~VolumeLoader()
+VolumePrefetcher::~VolumePrefetcher()
 {
-	if (m_thread)
-	{
-		if (m_thread->IsAlive())
-		{
-			m_thread->Delete();
-			if (m_thread->IsAlive()) m_thread->Wait();
-		}
-		delete m_thread;
-	}
-	RemoveAllLoadedBrick();
+	Clear();
 }
 
-void VolumeLoader::Queue(VolumeLoaderData brick)
+Nrrd* VolumePrefetcher::Get(BaseReader *reader, int frame, int chan)
 {
+	Nrrd* data = Take(reader, frame, chan);
+	if (data)
+	{
+		wxCriticalSectionLocker enter(m_pThreadCS);
+		m_hits++;
+		return data;
+	}
+
+	//the frame may be converting right now
+	lock_guard<recursive_mutex> lock(reader->GetLock());
+	data = Take(reader, frame, chan);
+	if (!data)
+		data = reader->Convert(frame, chan, false);
+
 	wxCriticalSectionLocker enter(m_pThreadCS);
-	m_queues.push_back(brick);
+	m_misses++;
+	return data;
 }
 
-void VolumeLoader::ClearQueues()
+void VolumePrefetcher::Prefetch(vector<VolumePrefetchData> chans, int frame, int dir,
+	int start_frame, int end_frame)
 {
-	if (!m_queues.empty())
+	bool run = false;
 	{
-		Abort();
+		wxCriticalSectionLocker enter(m_pThreadCS);
+		m_cur_frame = frame;
+		m_start_frame = start_frame;
+		m_end_frame = end_frame;
+		ReleaseFarFrames(chans);
+
 		m_queues.clear();
+		int num = end_frame - start_frame + 1;
+		if (num <= 1 || m_frame_num <= 0)
+			return;
+		//frames in the playback direction come first
+		for (int side = 0; side < 2; side++)
+		{
+			int step = side==0?dir:-dir;
+			for (int k = 1; k <= m_frame_num && k < num; k++)
+			{
+				int f = frame - start_frame + step*k;
+				f = start_frame + (f%num + num)%num;
+				for (int i = 0; i < (int)chans.size(); i++)
+				{
+					VolumePrefetchData q = chans[i];
+					q.frame = f;
+					q.data = NULL;
+					q.datasize = 0;
+					m_queues.push_back(q);
+				}
+			}
+		}
+
+		if (!m_running && !m_queues.empty() && HasRoom(max(m_frame_size, 1LL)))
+		{
+			m_running = true;
+			run = true;
+		}
 	}
+
+	if (run)
+		Run();
 }
 
-void VolumeLoader::Set(vector<VolumeLoaderData> vld)
+void VolumePrefetcher::Clear()
 {
-	Abort();
-	//StopAll();
-	m_queues = vld;
+	StopAll();
+
+	wxCriticalSectionLocker enter(m_pThreadCS);
+	for (int i = 0; i < (int)m_ready.size(); i++)
+		nrrdNuke(m_ready[i].data);
+	m_ready.clear();
+	m_used_memory = 0LL;
+	m_frame_size = 0LL;
 }
 
-void VolumeLoader::Abort()
+void VolumePrefetcher::StopAll()
 {
+	m_pThreadCS.Enter();
+	m_queues.clear();
+	m_pThreadCS.Leave();
+
 	if (m_thread)
 	{
 		if (m_thread->IsAlive())
@@ -726,177 +1635,104 @@ void VolumeLoader::Abort()
 		delete m_thread;
 		m_thread = NULL;
 	}
+	m_running = false;
 }
 
-void VolumeLoader::StopAll()
+void VolumePrefetcher::GetCounters(long long &hits, long long &misses, long long &used_mem)
 {
-	Abort();
-
-	while(m_running_decomp_th > 0)
-	{
-		wxMilliSleep(10);
-	}
+	wxCriticalSectionLocker enter(m_pThreadCS);
+	hits = m_hits;
+	misses = m_misses;
+	used_mem = m_used_memory;
 }
 
-bool VolumeLoader::Run()
+void VolumePrefetcher::ResetCounters()
 {
-	Abort();
-	//StopAll();
-	if (!m_queued.empty())
-		m_queued.clear();
-
-	m_thread = new VolumeLoaderThread(this);
-	if (m_thread->Create() != wxTHREAD_NO_ERROR)
-	{
-		delete m_thread;
-		m_thread = NULL;
-		return false;
-	}
-	m_thread->Run();
-
-	return true;
+	wxCriticalSectionLocker enter(m_pThreadCS);
+	m_hits = 0LL;
+	m_misses = 0LL;
 }
 
-void VolumeLoader::CleanupLoadedBrick()
+int VolumePrefetcher::FrameDist(int frame)
 {
-	long long required = 0;
-
-	for(int i = 0; i < m_queues.size(); i++)
-	{
-		TextureBrick *b = m_queues[i].brick;
-		if (!m_queues[i].brick->isLoaded())
-			required += (size_t)b->nx()*(size_t)b->ny()*(size_t)b->nz()*(size_t)b->nb(0);
-	}
+	int num = m_end_frame - m_start_frame + 1;
+	int d = abs(frame - m_cur_frame);
+	return num>0?min(d, num-d):d;
+}
 
-	vector<VolumeLoaderData> vd_undisp;
-	vector<VolumeLoaderData> b_undisp;
-	vector<VolumeLoaderData> b_drawn;
-	for(auto elem : m_loaded)
-	{
-		if (!elem.second.vd->GetDisp())
-			vd_undisp.push_back(elem.second);
-		else if(!elem.second.brick->get_disp())
-			b_undisp.push_back(elem.second);
-		else if (elem.second.brick->drawn(elem.second.mode))
-			b_drawn.push_back(elem.second);
-	}
-	if (required > 0 || m_used_memory >= m_memory_limit)
-	{
-		for (int i = 0; i < vd_undisp.size(); i++)
-		{
-			if (!vd_undisp[i].brick->isLoaded())
-				continue;
-			vd_undisp[i].brick->freeBrkData();
-			required -= vd_undisp[i].datasize;
-			m_used_memory -= vd_undisp[i].datasize;
-			m_loaded.erase(vd_undisp[i].brick);
-			if (required <= 0 && m_used_memory < m_memory_limit)
-				break;
-		}
-	}
-	if (required > 0 || m_used_memory >= m_memory_limit)
-	{
-		for (int i = 0; i < b_undisp.size(); i++)
-		{
-			if (!b_undisp[i].brick->isLoaded())
-				continue;
-			b_undisp[i].brick->freeBrkData();
-			required -= b_undisp[i].datasize;
-			m_used_memory -= b_undisp[i].datasize;
-			m_loaded.erase(b_undisp[i].brick);
-			if (required <= 0 && m_used_memory < m_memory_limit)
-				break;
-		}
-	}
-	if (required > 0 || m_used_memory >= m_memory_limit)
-	{
-		for (int i = 0; i < b_drawn.size(); i++)
-		{
-			if (!b_drawn[i].brick->isLoaded())
-				continue;
-			b_drawn[i].brick->freeBrkData();
-			required -= b_drawn[i].datasize;
-			m_used_memory -= b_drawn[i].datasize;
-			m_loaded.erase(b_drawn[i].brick);
-			if (required <= 0 && m_used_memory < m_memory_limit)
-				break;
-		}
-	}
-	if (m_used_memory >= m_memory_limit)
+bool VolumePrefetcher::IsReady(VolumePrefetchData &d)
+{
+	for (int i = 0; i < (int)m_ready.size(); i++)
 	{
-		for(int i = m_queues.size()-1; i >= 0; i--)
-		{
-			TextureBrick *b = m_queues[i].brick;
-			if (b->isLoaded() && m_loaded.find(b) != m_loaded.end())
-			{
-				bool skip = false;
-				for (int j = m_queued.size()-1; j >= 0; j--)
-				{
-					if (m_queued[j].brick == b && !b->drawn(m_queued[j].mode))
-						skip = true;
-				}
-				if (!skip)
-				{
-					b->freeBrkData();
-					long long datasize = (size_t)(b->nx())*(size_t)(b->ny())*(size_t)(b->nz())*(size_t)(b->nb(0));
-					required -= datasize;
-					m_used_memory -= datasize;
-					m_loaded.erase(b);
-					if (m_used_memory < m_memory_limit)
-						break;
-				}
-			}
-		}
+		if (m_ready[i].reader == d.reader &&
+			m_ready[i].chan == d.chan &&
+			m_ready[i].frame == d.frame)
+			return true;
 	}
-
+	return false;
 }
 
-void VolumeLoader::RemoveAllLoadedBrick()
+Nrrd* VolumePrefetcher::Take(BaseReader *reader, int frame, int chan)
 {
-	StopAll();
-	for(auto e : m_loaded)
+	wxCriticalSectionLocker enter(m_pThreadCS);
+	for (int i = 0; i < (int)m_ready.size(); i++)
 	{
-		if (e.second.brick->isLoaded())
+		if (m_ready[i].reader == reader &&
+			m_ready[i].chan == chan &&
+			m_ready[i].frame == frame)
 		{
-			e.second.brick->freeBrkData();
-			m_used_memory -= e.second.datasize;
+			Nrrd* data = m_ready[i].data;
+			m_used_memory -= m_ready[i].datasize;
+			m_ready.erase(m_ready.begin()+i);
+			return data;
 		}
 	}
-	m_loaded.clear();
+	return NULL;
 }
 
-void VolumeLoader::RemoveBrickVD(VolumeData *vd)
+void VolumePrefetcher::ReleaseFarFrames(vector<VolumePrefetchData> &chans)
 {
-	StopAll();
-	auto ite = m_loaded.begin();
-	while(ite != m_loaded.end())
+	auto ite = m_ready.begin();
+	while (ite != m_ready.end())
 	{
-		if (ite->second.vd == vd && ite->second.brick->isLoaded())
+		bool keep = FrameDist(ite->frame) <= m_frame_num;
+		if (keep)
 		{
-			ite->second.brick->freeBrkData();
-			m_used_memory -= ite->second.datasize;
-			ite = m_loaded.erase(ite);
+			keep = false;
+			for (int i = 0; i < (int)chans.size(); i++)
+				if (chans[i].reader == ite->reader && chans[i].chan == ite->chan)
+					keep = true;
 		}
-		else
+		if (keep)
 			ite++;
+		else
+		{
+			nrrdNuke(ite->data);
+			m_used_memory -= ite->datasize;
+			ite = m_ready.erase(ite);
+		}
 	}
 }
 
-void VolumeLoader::GetPalams(long long &used_mem, int &running_decomp_th, int &queue_num, int &decomp_queue_num)
+void VolumePrefetcher::Run()
 {
-	long long us = 0;
-	int ll = 0;
-/*	for(auto e : m_loaded)
+	if (m_thread)
 	{
-		if (e.second.brick->isLoaded())
-			us += e.second.datasize;
-		if (!e.second.brick->get_disp())
-			ll++;
+		//the last thread has left its loop
+		m_thread->Wait();
+		delete m_thread;
 	}
-*/	used_mem = m_used_memory;
-	running_decomp_th = m_running_decomp_th;
-	queue_num = m_queues.size();
-	decomp_queue_num = m_decomp_queues.size();
+
+	m_thread = new VolumePrefetchThread(this);
+	if (m_thread->Create() != wxTHREAD_NO_ERROR)
+	{
+		delete m_thread;
+		m_thread = NULL;
+		wxCriticalSectionLocker enter(m_pThreadCS);
+		m_running = false;
+		return;
+	}
+	m_thread->Run();
 }
 
 //////////////////////////////////////////////////////////////////////////
@@ -1170,6 +2006,7 @@ wxGLCanvas(parent, id, attriblist, pos, size, style),
 	m_manip_time(300),
 	m_min_ppi(20),
 	m_res_mode(0),
+	m_mixed_lod(false),
 	m_draw_landmarks(false),
 	m_draw_overlays_only(false),
 	m_enhance_sel(false),
@@ -1262,6 +2099,7 @@ VRenderGLView::~VRenderGLView()
 #endif
 
 	m_loader.StopAll();
+	m_prefetcher.Clear();
 
 	int i;
 	//delete groups
@@ -1409,6 +2247,7 @@ void VRenderGLView::Init()
 void VRenderGLView::Clear()
 {
 	m_loader.RemoveAllLoadedBrick();
+	m_prefetcher.Clear();
 	TextureRenderer::clear_tex_pool();
 
 	//delete groups
@@ -2717,6 +3556,7 @@ void VRenderGLView::RandomizeColor()
 void VRenderGLView::ClearVolList()
 {
 	m_loader.RemoveAllLoadedBrick();
+	m_prefetcher.Clear();
 	TextureRenderer::clear_tex_pool();
 	m_vd_pop_list.clear();
 }
@@ -4299,6 +5139,32 @@ void VRenderGLView::switchLevel(VolumeData *vd)
 			default:
 				res_scale = 1.0;
 			}
+
+			//mixed levels: each region uses the coarsest level whose voxels
+			//cover at most res_scale pixels, within the memory of the loader
+			if (m_mixed_lod && vtex->nmask() == -1 && vtex->nlabel() == -1)
+			{
+				Transform *tform = vtex->transform();
+				double mvmat[16];
+				tform->get_trans(mvmat);
+				glm::mat4 mv_mat = m_mv_mat * glm::mat4(
+					mvmat[0], mvmat[4], mvmat[8], mvmat[12],
+					mvmat[1], mvmat[5], mvmat[9], mvmat[13],
+					mvmat[2], mvmat[6], mvmat[10], mvmat[14],
+					mvmat[3], mvmat[7], mvmat[11], mvmat[15]);
+				double pixel_err = res_scale;
+				if (m_manip)
+					pixel_err = 1e10;
+				else if (m_int_res)
+					pixel_err *= 16.0;
+				long long budget = (long long)(TextureRenderer::get_mainmem_buf_size()*1024.0*1024.0);
+				if (vtex->selectLOD(mv_mat, m_proj_mat, nx, ny, pixel_err, budget))
+				{
+					vd->SetLevel(vtex->GetCurLevel());
+					vtex->set_sort_bricks();
+				}
+				return;
+			}
 			vector<double> sfs;
 			vector<double> spx, spy, spz;
 			int lvnum = vtex->GetLevelNum();
@@ -4339,6 +5205,11 @@ void VRenderGLView::switchLevel(VolumeData *vd)
 			new_lv = lv;
 			//vd->GetVR()->set_scalar_scale();
 		}
+		if (vtex->isLOD())
+		{
+			vtex->clearLOD();
+			prev_lv = -1;
+		}
 		if (prev_lv != new_lv)
 		{
 			vector<TextureBrick*> *bricks = vtex->get_bricks();
@@ -6566,7 +7437,8 @@ void VRenderGLView::Get4DSeqFrames(int &start_frame, int &end_frame, int &cur_fr
 
 			int vd_start_frame = 0;
 			int vd_end_frame = reader->GetTimeNum()-1;
-			int vd_cur_frame = reader->GetCurTime();
+			//the reader's time may belong to a prefetched frame
+			int vd_cur_frame = vd->GetCurTime();
 
 			if (i==0)
 			{
@@ -6602,6 +7474,7 @@ void VRenderGLView::Set4DSeqFrame(int frame, bool run_script)
 		m_script_file = vframe->GetSettingDlg()->GetScriptFile();
 	}
 
+	vector<VolumePrefetchData> prefetch;
 	for (int i=0; i<(int)m_vd_pop_list.size(); i++)
 	{
 		VolumeData* vd = m_vd_pop_list[i];
@@ -6610,6 +7483,18 @@ void VRenderGLView::Set4DSeqFrame(int frame, bool run_script)
 			BaseReader* reader = vd->GetReader();
 			bool clear_pool = false;
 
+			Texture *vtex = vd->GetTexture();
+			if (!(vtex && vtex->isBrxml()))
+			{
+				VolumePrefetchData pd;
+				pd.reader = reader;
+				pd.chan = vd->GetCurChannel();
+				pd.frame = frame;
+				pd.data = NULL;
+				pd.datasize = 0;
+				prefetch.push_back(pd);
+			}
+
 			if (cur_frame != frame)
 			{
 				Texture *tex = vd->GetTexture();
@@ -6635,11 +7520,11 @@ void VRenderGLView::Set4DSeqFrame(int frame, bool run_script)
 					double spcx, spcy, spcz;
 					vd->GetSpacings(spcx, spcy, spcz);
 
-					Nrrd* data = reader->Convert(frame, vd->GetCurChannel(), false);
+					Nrrd* data = m_prefetcher.Get(reader, frame, vd->GetCurChannel());
 					if (!vd->Replace(data, false))
 						continue;
 
-					vd->SetCurTime(reader->GetCurTime());
+					vd->SetCurTime(frame);
 					vd->SetSpacings(spcx, spcy, spcz);
 
 					//update rulers
@@ -6658,6 +7543,11 @@ void VRenderGLView::Set4DSeqFrame(int frame, bool run_script)
 				vd->GetVR()->clear_tex_pool();
 		}
 	}
+
+	//decode the next frames while this one is shown
+	m_prefetcher.Prefetch(prefetch, frame,
+		frame>=m_tseq_prv_num?1:-1, start_frame, end_frame);
+
 	RefreshGL();
 }
 
@@ -6709,6 +7599,9 @@ void VRenderGLView::Set3DBatFrame(int offset)
 	vector<BaseReader*> reader_list;
 	m_bat_folder = "";
 
+	//readers are about to load other files
+	m_prefetcher.Clear();
+
 	m_tseq_prv_num = m_tseq_cur_num;
 	m_tseq_cur_num = offset;
 	for (i=0; i<(int)m_vd_pop_list.size(); i++)
@@ -6763,6 +7656,7 @@ void VRenderGLView::Set3DBatFrame(int offset)
 				}
 				if (!found)
 				{
+					lock_guard<recursive_mutex> lock(reader->GetLock());
 					reader->LoadOffset(offset);
 					reader_list.push_back(reader);
 				}
@@ -6770,7 +7664,11 @@ void VRenderGLView::Set3DBatFrame(int offset)
 				double spcx, spcy, spcz;
 				vd->GetSpacings(spcx, spcy, spcz);
 
-				Nrrd* data = reader->Convert(0, vd->GetCurChannel(), true);
+				Nrrd* data = NULL;
+				{
+					lock_guard<recursive_mutex> lock(reader->GetLock());
+					data = reader->Convert(0, vd->GetCurChannel(), true);
+				}
 				if (vd->Replace(data, true))
 					vd->SetDisp(true);
 				else
@@ -7139,6 +8037,7 @@ void VRenderGLView::RunSelectionTracking(wxFileConfig &fconfig)
 								mask_data[index] = 255;
 						}
 					}
+					m_cur_vol->GetTexture()->mask_changed();
 
 					//add traces to trace dialog
 					VRenderFrame* vr_frame = (VRenderFrame*)m_frame;
@@ -10350,6 +11249,22 @@ void VRenderGLView::DrawInfo(int nx, int ny)
 		int dtnum, qnum, dqnum;
 		m_loader.GetPalams(used_mem, dtnum, qnum, dqnum);
 		str += wxString::Format(" Mem: %lld Th: %d Q: %d DQ: %d,", used_mem, dtnum, qnum, dqnum);
+		long long loads, evictions, reloads;
+		m_loader.GetCounters(loads, evictions, reloads);
+		str += wxString::Format(" Evict: %lld Reload: %lld/%lld,", evictions, reloads, loads);
+		size_t in_use, pooled;
+		BrickBufferPool::get_stats(in_use, pooled);
+		str += wxString::Format(" Pool: %lld/%lld,", (long long)in_use, (long long)pooled);
+		long long zsize, zhits, zmisses;
+		m_loader.GetPayloadStats(zsize, zhits, zmisses);
+		str += wxString::Format(" ZCache: %lld Hit: %lld/%lld,", zsize, zhits, zhits+zmisses);
+	}
+	else if (m_cur_vol && m_cur_vol->GetReader() &&
+		m_cur_vol->GetReader()->GetTimeNum() > 1)
+	{
+		long long hits, misses, used_mem;
+		m_prefetcher.GetCounters(hits, misses, used_mem);
+		str += wxString::Format(" Prefetch Hit: %lld Miss: %lld Mem: %lld,", hits, misses, used_mem);
 	}
 
 	wstring wstr_temp = str.ToStdWstring();
@@ -10875,20 +11790,30 @@ void VRenderGLView::StartLoopUpdate()
 
 					Ray view_ray = vd->GetVR()->compute_view();
 
-					vector<TextureBrick*> *bricks = tex->get_sorted_bricks(view_ray, !m_persp);
+					//cull first so that only the bricks shown are sorted
+					vector<TextureBrick*> *bricks = tex->get_bricks();
 					if (!bricks || bricks->size()==0)
 						continue;
+					//bricks without voxels in the visible range are neither loaded nor drawn
+					double vis_lo, vis_hi;
+					bool skip_empty = vd->GetVR()->get_visible_range(vis_lo, vis_hi);
+					bool culling_changed = false;
 					for (j=0; j<bricks->size(); j++)
 					{
 						(*bricks)[j]->set_drawn(false);
+						bool disp = (*bricks)[j]->get_disp();
+						FileLocInfo *finfo = skip_empty ? tex->GetFileName((*bricks)[j]) : NULL;
 						if ((*bricks)[j]->get_priority()>0 ||
+							(finfo && !finfo->has_values(vis_lo, vis_hi)) ||
 							!vd->GetVR()->test_against_view_clip((*bricks)[j]->bbox(), (*bricks)[j]->tbox(), (*bricks)[j]->dbox(), m_persp))//changed by takashi
 						{
 							(*bricks)[j]->set_disp(false);
+							culling_changed |= disp;
 							continue;
 						}
 						else
 							(*bricks)[j]->set_disp(true);
+						culling_changed |= !disp;
 						total_num++;
 						num_chan++;
 						if (vd->GetMode()==1 && vd->GetShading())
@@ -10912,6 +11837,9 @@ void VRenderGLView::StartLoopUpdate()
 							num_chan++;
 						}
 					}
+					if (culling_changed)
+						tex->set_sort_bricks();
+					tex->get_sorted_bricks(view_ray, !m_persp, true);
 				}
 				vd->SetBrickNum(num_chan);
 				if (vd->GetVR())
@@ -10955,7 +11883,7 @@ void VRenderGLView::StartLoopUpdate()
 					if (b->get_disp())
 					{
 						d.brick = b;
-						d.finfo = tex->GetFileName(b->getID());
+						d.finfo = tex->GetFileName(b);
 						d.vd = vd;
 						if (!b->drawn(mode))
 						{
@@ -11041,7 +11969,7 @@ void VRenderGLView::StartLoopUpdate()
 								if (b->get_disp())
 								{
 									d.brick = b;
-									d.finfo = tex->GetFileName(b->getID());
+									d.finfo = tex->GetFileName(b);
 									d.vd = vd;
 									if (!b->drawn(mode))
 									{
@@ -11123,7 +12051,7 @@ void VRenderGLView::StartLoopUpdate()
 									if (b->get_disp())
 									{
 										d.brick = b;
-										d.finfo = tex->GetFileName(b->getID());
+										d.finfo = tex->GetFileName(b);
 										d.vd = vd;
 										if (!b->drawn(mode))
 										{
@@ -11198,7 +12126,7 @@ void VRenderGLView::StartLoopUpdate()
 									if (b->get_disp())
 									{
 										d.brick = b;
-										d.finfo = tex->GetFileName(b->getID());
+										d.finfo = tex->GetFileName(b);
 										d.vd = vd;
 										if (!b->drawn(mode))
 										{
@@ -14094,6 +15022,7 @@ BEGIN_EVENT_TABLE(VRenderView, wxPanel)
 	EVT_COMMAND_SCROLL(ID_PPISldr, VRenderView::OnPPIChange)
 	EVT_TEXT(ID_PPIText, VRenderView::OnPPIEdit)
 	EVT_COMBOBOX(ID_ResCombo, VRenderView::OnResModesCombo)
+	EVT_CHECKBOX(ID_MixedLODChk, VRenderView::OnMixedLODCheck)
 	//bar left
 	EVT_CHECKBOX(ID_DepthAttenChk, VRenderView::OnDepthAttenCheck)
 	EVT_COMMAND_SCROLL(ID_DepthAttenFactorSldr, VRenderView::OnDepthAttenFactorChange)
@@ -14356,6 +15285,10 @@ void VRenderView::CreateBar()
 	for (size_t i=0; i<mode_list.size(); ++i)
 		m_res_mode_combo->Append(mode_list[i]);
 	m_res_mode_combo->SetSelection(m_res_mode);
+	//bricks of several levels by their size on screen
+	m_mixed_lod_chk = new wxCheckBox(this, ID_MixedLODChk, "Mixed",
+		wxDefaultPosition, wxSize(-1, 20));
+	m_mixed_lod_chk->SetValue(false);
 
 	//
 	sizer_h_1->Add(10, 5, 0);
@@ -14380,6 +15313,8 @@ void VRenderView::CreateBar()
 	//	sizer_h_1->Add(5, 5, 0);
 	sizer_h_1->Add(st3, 0, wxALIGN_CENTER, 0);
 	sizer_h_1->Add(m_res_mode_combo, 0, wxALIGN_CENTER);
+	sizer_h_1->Add(5, 5, 0);
+	sizer_h_1->Add(m_mixed_lod_chk, 0, wxALIGN_CENTER);
 	sizer_h_1->Add(10, 5, 0);
 	sizer_h_1->Add(st2, 0, wxALIGN_CENTER, 0);
 	sizer_h_1->Add(m_aov_sldr, 0, wxALIGN_CENTER);
@@ -15430,6 +16365,13 @@ void VRenderView::OnResModesCombo(wxCommandEvent &event)
 	RefreshGL();
 }
 
+void VRenderView::OnMixedLODCheck(wxCommandEvent& event)
+{
+	SetMixedLOD(m_mixed_lod_chk->GetValue());
+
+	RefreshGL();
+}
+
 //bar left
 void VRenderView::OnDepthAttenCheck(wxCommandEvent& event)
 {
@@ -15954,6 +16896,7 @@ void VRenderView::SaveDefault(unsigned int mask)
 	//min dpi
 	fconfig.Write("min_dpi", m_glview->m_min_ppi);
 	fconfig.Write("res_mode", m_glview->m_res_mode);
+	fconfig.Write("mixed_lod", m_glview->m_mixed_lod);
 	//rotations
 	str = m_x_rot_text->GetValue();
 	fconfig.Write("x_rot", str);
@@ -16107,6 +17050,8 @@ void VRenderView::LoadSettings()
 	}
 	else
 		SetResMode(0);
+	if (fconfig.Read("mixed_lod", &bVal))
+		SetMixedLOD(bVal);
 	if (fconfig.Read("free_rd", &bVal))
 	{
 		m_free_chk->SetValue(bVal);
@@ -32,6 +32,7 @@ DEALINGS IN THE SOFTWARE.
 #include "Animator/Interpolator.h"
 #include "TextRenderer.h"
 #include "KernelExecutor.h"
+#include "BrickLoadQueue.h"
 
 #include "FLIVR/Color.h"
 #include "FLIVR/ShaderProgram.h"
@@ -53,6 +54,7 @@ DEALINGS IN THE SOFTWARE.
 #include <vector>
 #include <stdarg.h>
 #include <unordered_map>
+#include <list>
 #include "nv/timer.h"
 
 #include <glm/glm.hpp>
@@ -202,15 +204,6 @@ private:
 	DECLARE_EVENT_TABLE()
 };
 
-struct VolumeLoaderData
-{
-	FileLocInfo *finfo;
-	TextureBrick *brick;
-	VolumeData *vd;
-	unsigned long long datasize;
-	int mode;
-};
-
 struct VolumeDecompressorData
 {
 	char *in_data;
@@ -220,10 +213,114 @@ struct VolumeDecompressorData
 	VolumeData *vd;
 	unsigned long long datasize;
 	int mode;
+	//BRICK_FILE_TYPE_JPEG or BRICK_FILE_TYPE_ZLIB
+	int type;
+	double priority;
+	unsigned long long seq;
+};
+
+//bricks held in memory by the loader, guarded by the loader's m_pThreadCS
+//each eviction class lists its bricks from the least recently used one
+//a brick changes class when it is touched or when eviction finds it in the wrong list
+class LoadedBrickList
+{
+	public:
+		enum
+		{
+			EVICT_VD_HIDDEN = 0,	//its volume is not displayed
+			EVICT_BRICK_HIDDEN,		//outside of the view
+			EVICT_DRAWN,			//drawn in its mode
+			EVICT_SPECULATIVE,		//not drawn yet, the most recently loaded goes first
+			EVICT_CLASS_NUM
+		};
+
+		LoadedBrickList();
+		~LoadedBrickList();
+		//add a brick or make it the most recently used one of its class
+		void Touch(const VolumeLoaderData &d);
+		bool Has(TextureBrick *b) {return m_items.find(b) != m_items.end();}
+		void Erase(TextureBrick *b);
+		void Clear();
+		size_t Size() {return m_items.size();}
+		void GetAll(vector<VolumeLoaderData> &items);
+		//take the next brick to free from a class, false if there is none
+		//speculative bricks are only taken if the queue loads them again
+		bool Evict(int cls, BrickLoadQueue &queue, VolumeLoaderData &d);
+		//choose the brick that is cheapest to read again among the oldest ones
+		void SetCostAware(bool val) {m_cost_aware = val;}
+		//reloads are evicted bricks that were loaded again
+		void GetCounters(long long &loads, long long &evictions, long long &reloads);
+		void ResetCounters();
+		//forget the evicted bricks of a volume that is being removed
+		void ForgetVD(VolumeData *vd);
+
+	private:
+		struct Item
+		{
+			VolumeLoaderData d;
+			int cls;
+			list<TextureBrick*>::iterator pos;
+		};
+
+		unordered_map<TextureBrick*, Item> m_items;
+		list<TextureBrick*> m_lists[EVICT_CLASS_NUM];
+		unordered_map<TextureBrick*, VolumeData*> m_evicted;
+		bool m_cost_aware;
+		long long m_loads;
+		long long m_evictions;
+		long long m_reloads;
+
+		static int Classify(const VolumeLoaderData &d);
+		//raw local bricks are the cheapest to read again, uncached remote ones the most expensive
+		static int ReloadCost(const VolumeLoaderData &d);
+};
+
+//compressed data of bricks that have been decompressed, kept in memory
+//so that evicted bricks are restored by decompressing them again
+//the least recently stored entries are dropped beyond the size limit
+//all methods lock the cache
+class BrickPayloadCache
+{
+	public:
+		BrickPayloadCache();
+		~BrickPayloadCache();
+		//take a buffer from BrickBufferPool, false if it is not kept
+		bool Put(TextureBrick *b, VolumeData *vd, char *data, size_t size, int type);
+		//remove an entry and hand its buffer to the caller
+		bool Take(TextureBrick *b, char* &data, size_t &size, int &type);
+		bool Has(TextureBrick *b);
+		void RemoveVD(VolumeData *vd);
+		void Clear();
+		//0 disables the cache
+		void SetMaxSize(long long size);
+		void GetStats(long long &size, long long &hits, long long &misses);
+
+	private:
+		struct Entry
+		{
+			VolumeData *vd;
+			char *data;
+			size_t size;
+			int type;
+			list<TextureBrick*>::iterator pos;
+		};
+
+		unordered_map<TextureBrick*, Entry> m_entries;
+		list<TextureBrick*> m_lru;
+		long long m_size;
+		long long m_max_size;
+		long long m_hits;
+		long long m_misses;
+		wxCriticalSection m_cs;
+
+		//called with m_cs held
+		void Remove(unordered_map<TextureBrick*, Entry>::iterator ite);
+		void Evict(long long max_size);
 };
 
 class VolumeLoader;
 
+//a worker of the decompressor pool, it sleeps while the queue is empty
 class VolumeDecompressorThread : public wxThread
 {
     public:
@@ -234,14 +331,29 @@ class VolumeDecompressorThread : public wxThread
         VolumeLoader* m_vl;
 };
 
+//reads the queued bricks of each request passed by VolumeLoader::Run()
+//it sleeps between requests and lives as long as the loader
 class VolumeLoaderThread : public wxThread
 {
     public:
 		VolumeLoaderThread(VolumeLoader *vl);
 		~VolumeLoaderThread();
+		//true when the request being loaded has been replaced or aborted
+		virtual bool TestDestroy();
     protected:
 		virtual ExitCode Entry();
+		//load the bricks of one request
+		void Load();
+		//hand a read brick to the brick or to the decompressors
+		//type is the format of the data, the file type of the brick if it is negative
+		void StoreBrick(VolumeLoaderData b, char *ptr, size_t readsize, int type=-1);
+		//start downloading remote bricks of one file, false if they have to be read in this thread
+		bool FetchBricks(const vector<VolumeLoaderData> &group);
+		//store the remote bricks whose transfers finished, waiting up to timeout ms
+		void StoreFetchedBricks(int timeout);
         VolumeLoader* m_vl;
+		//generation of the request being loaded
+		unsigned int m_gen;
 };
 
 class VolumeLoader
@@ -255,36 +367,101 @@ class VolumeLoader
 		void Abort();
 		void StopAll();
 		bool Run();
+		//size of the decompressor pool, 0 decompresses in the loader thread
 		void SetMaxThreadNum(int num) {m_max_decomp_th = num;}
 		void SetMemoryLimitByte(long long limit) {m_memory_limit = limit;}
+		//bricks packed next to each other are read together up to this size, 0 disables
+		void SetMaxMergeSize(long long size) {m_max_merge_size = size;}
+		//remote bricks downloaded at the same time
+		void SetMaxTransferNum(int num) {m_downloader.set_max_transfers(num);}
+		//weigh evictions by the cost of reading the bricks again
+		void SetCostAwareEviction(bool val);
+		//memory for the compressed data of evicted bricks, 0 disables it
+		void SetPayloadCacheSize(long long size) {m_payloads.SetMaxSize(size);}
+		//keep a fast zlib copy of raw bricks in the compressed cache
+		void SetRecompressRaw(bool val) {m_recompress_raw = val;}
+		void GetPayloadStats(long long &size, long long &hits, long long &misses)
+		{m_payloads.GetStats(size, hits, misses);}
 		void CleanupLoadedBrick();
+		void TrimBufferPool();
 		void RemoveAllLoadedBrick();
 		void RemoveBrickVD(VolumeData *vd);
 		void GetPalams(long long &used_mem, int &running_decomp_th, int &queue_num, int &decomp_queue_num);
+		void GetCounters(long long &loads, long long &evictions, long long &reloads);
+		void ResetCounters();
 
 		static bool sort_data_dsc(const VolumeLoaderData b1, const VolumeLoaderData b2)
 		{ return b2.brick->get_d() > b1.brick->get_d(); }
 		static bool sort_data_asc(const VolumeLoaderData b1, const VolumeLoaderData b2)
 		{ return b2.brick->get_d() < b1.brick->get_d(); }
+		static bool sort_data_offset(const VolumeLoaderData b1, const VolumeLoaderData b2)
+		{ return b1.finfo->offset < b2.finfo->offset; }
 
 	protected:
 		VolumeLoaderThread *m_thread;
 		wxCriticalSection m_pThreadCS;
-		vector<VolumeLoaderData> m_queues;
-		vector<VolumeLoaderData> m_queued;
+		BrickLoadQueue m_queues;
+		LoadedBrickList m_loaded;
+		BrickPayloadCache m_payloads;
+		bool m_recompress_raw;
+		bool m_valid;
+
+		//requests to the loader thread, each one gets a new generation
+		//and the loader stops when the generation it loads is not current
+		wxMutex m_runMutex;
+		wxCondition m_runCond;	//a request is pending, or the current one is canceled
+		wxCondition m_idleCond;	//the loader thread finished a request
+		unsigned int m_gen;
+		bool m_pending;
+		bool m_busy;
+		bool m_exit;
+
+		//binary heap ordered by brick priority, guarded by m_decompMutex
 		vector<VolumeDecompressorData> m_decomp_queues;
 		vector<VolumeDecompressorThread *> m_decomp_threads;
-		unordered_map<TextureBrick*, VolumeLoaderData> m_loaded;
+		wxMutex m_decompMutex;
+		wxCondition m_decompCond;	//bricks to decompress
+		wxCondition m_decompIdleCond;	//no brick is being decompressed
+		unsigned long long m_decomp_seq;
+		int m_idle_decomp_th;
 		int m_running_decomp_th;
 		int m_max_decomp_th;
-		bool m_valid;
+		bool m_decomp_exit;
 
 		long long m_memory_limit;
 		long long m_used_memory;
+		long long m_max_merge_size;
+
+		//transfers are kept when the view changes if their bricks are still queued
+		//only used by the loader thread, or when it is stopped
+		BrickDownloader m_downloader;
+		unordered_map<TextureBrick*, VolumeLoaderData> m_fetching;
+
+		void GatherAdjacentBricks(vector<VolumeLoaderData> &group);
+		//used by the loader thread
+		bool WaitRequest(unsigned int &gen);
+		void FinishRequest();
+		bool IsCanceled(unsigned int gen);
+		//sleep up to ms or until the request is canceled, true if it is
+		bool WaitCancel(unsigned int gen, int ms);
+		//the decompression queue has its own lock, taken after m_pThreadCS
+		//make sure a worker will take one more brick, false if none can run
+		bool StartDecompThread();
+		void PushDecompQueue(VolumeDecompressorData &dq);
+		//blocks until there is a brick, false when the pool is closed
+		bool PopDecompQueue(VolumeDecompressorData &dq);
+		void FinishDecomp();
+		//keep the compressed data of a decompressed brick, or release it
+		void KeepPayload(TextureBrick *b, VolumeData *vd, char *data, size_t size, int type);
+		//drop the bricks waiting for decompression, called with m_pThreadCS held
+		void DropDecompQueue();
+		void WaitDecompIdle();
+		static bool sort_decomp(const VolumeDecompressorData &d1, const VolumeDecompressorData &d2)
+		{ return d1.priority > d2.priority || (d1.priority == d2.priority && d1.seq > d2.seq); }
 
 		inline void AddLoadedBrick(VolumeLoaderData lbd)
 		{
-			m_loaded[lbd.brick] = lbd;
+			m_loaded.Touch(lbd);
 			m_used_memory += lbd.datasize;
 		}
 
@@ -292,6 +469,80 @@ class VolumeLoader
 		friend class VolumeDecompressorThread;
 };
 
+//a channel of a time sequence to prefetch
+struct VolumePrefetchData
+{
+	BaseReader *reader;
+	int chan;
+	int frame;
+	Nrrd *data;
+	unsigned long long datasize;
+};
+
+class VolumePrefetcher;
+
+class VolumePrefetchThread : public wxThread
+{
+    public:
+		VolumePrefetchThread(VolumePrefetcher *vp);
+		~VolumePrefetchThread();
+    protected:
+		virtual ExitCode Entry();
+        VolumePrefetcher* m_vp;
+};
+
+//decodes the frames around the current one of 4d sequences in the background
+class VolumePrefetcher
+{
+	public:
+		VolumePrefetcher();
+		~VolumePrefetcher();
+		//take a decoded frame, it is converted here if it is not ready
+		Nrrd* Get(BaseReader *reader, int frame, int chan);
+		//queue the frames around the current one, the ones ahead first
+		//dir: 1-forward; -1-backward
+		void Prefetch(vector<VolumePrefetchData> chans, int frame, int dir,
+			int start_frame, int end_frame);
+		void Clear();
+		void StopAll();
+		//frames ahead and behind the current one kept for each channel
+		void SetFrameNum(int num) {m_frame_num = num;}
+		int GetFrameNum() {return m_frame_num;}
+		void SetMemoryLimitByte(long long limit) {m_memory_limit = limit;}
+		void GetCounters(long long &hits, long long &misses, long long &used_mem);
+		void ResetCounters();
+
+	protected:
+		VolumePrefetchThread *m_thread;
+		wxCriticalSection m_pThreadCS;	//queues and ready frames
+		vector<VolumePrefetchData> m_queues;
+		vector<VolumePrefetchData> m_ready;
+		bool m_running;
+		int m_frame_num;
+		//current window
+		int m_cur_frame;
+		int m_start_frame;
+		int m_end_frame;
+
+		long long m_memory_limit;
+		long long m_used_memory;
+		//largest frame converted, a frame is only started if this fits
+		long long m_frame_size;
+		long long m_hits;
+		long long m_misses;
+
+		//distance of a frame from the current one, wrapping around the sequence
+		int FrameDist(int frame);
+		bool IsReady(VolumePrefetchData &d);
+		bool HasRoom(long long size) {return m_used_memory + size <= m_memory_limit;}
+		//remove a ready frame and return its data
+		Nrrd* Take(BaseReader *reader, int frame, int chan);
+		void ReleaseFarFrames(vector<VolumePrefetchData> &chans);
+		void Run();
+
+		friend class VolumePrefetchThread;
+};
+
 class VRenderGLView: public wxGLCanvas
 {
 	enum
@@ -536,6 +787,12 @@ public:
 	//4d movie frame calculation
 	void Get4DSeqFrames(int &start_frame, int &end_frame, int &cur_frame);
 	void Set4DSeqFrame(int frame, bool run_script);
+	//4d frame prefetching
+	void SetPrefetchFrameNum(int num) {m_prefetcher.SetFrameNum(num);}
+	void SetPrefetchMemoryLimitByte(long long limit) {m_prefetcher.SetMemoryLimitByte(limit);}
+	void GetPrefetchCounters(long long &hits, long long &misses, long long &used_mem)
+	{ m_prefetcher.GetCounters(hits, misses, used_mem); }
+	void ClearPrefetch() {m_prefetcher.Clear();}
 	//3d batch file calculation
 	void Get3DBatFrames(int &start_frame, int &end_frame, int &cur_frame);
 	void Set3DBatFrame(int offset);
@@ -1098,6 +1355,8 @@ private:
 
 	int m_min_ppi;
 	int m_res_mode;
+	//bricks of mixed pyramid levels by their error on the screen
+	bool m_mixed_lod;
 
 	LMSeacher *m_searcher;
 	vector<VolumeData *> m_lm_vdlist;
@@ -1121,6 +1380,7 @@ private:
 
 	VolumeLoader m_loader;
 	bool m_load_in_main_thread;
+	VolumePrefetcher m_prefetcher;
 
 private:
 #ifdef _WIN32
@@ -1292,6 +1552,7 @@ public:
 		ID_AovText,
 		ID_FreeChk,
 		ID_ResCombo,
+		ID_MixedLODChk,
 		ID_PPISldr,
 		ID_PPIText,
 		ID_Searcher,
@@ -1583,6 +1844,9 @@ public:
 	{if (m_glview) m_glview->ClearVolList();}
 	void ClearMeshList()
 	{if (m_glview) m_glview->ClearMeshList();}
+	//stop decoding frames in the background, before their readers are deleted
+	void ClearPrefetch()
+	{if (m_glview) m_glview->ClearPrefetch();}
 
 	//inteactive mode selection
 	int GetIntMode()
@@ -1855,6 +2119,12 @@ public:
 		m_res_mode_combo->SetSelection(mode);
 	}
 	int GetResMode() {if (m_glview) return m_glview->m_res_mode; else return 0;}
+	void SetMixedLOD(bool val)
+	{
+		if (m_glview) m_glview->m_mixed_lod = val;
+		m_mixed_lod_chk->SetValue(val);
+	}
+	bool GetMixedLOD() {if (m_glview) return m_glview->m_mixed_lod; else return false;}
 
 public:
 	wxWindow* m_frame;
@@ -1885,6 +2155,7 @@ public:
 	wxTextCtrl* m_ppi_text;
 	int m_res_mode;
 	wxComboBox *m_res_mode_combo;
+	wxCheckBox *m_mixed_lod_chk;
 
 	//bottom bar///////////////////////////////////////////////////
 	wxPanel* m_panel_2;
@@ -1956,6 +2227,7 @@ private:
 	void OnPPIChange(wxScrollEvent& event);
 	void OnPPIEdit(wxCommandEvent &event);
 	void OnResModesCombo(wxCommandEvent &event);
+	void OnMixedLODCheck(wxCommandEvent& event);
 	//bar left
 	void OnDepthAttenCheck(wxCommandEvent& event);
 	void OnDepthAttenFactorChange(wxScrollEvent& event);
@@ -0,0 +1,224 @@
+/*
+For more information, please see: http://software.sci.utah.edu
+
+The MIT License
+
+Copyright (c) 2014 Scientific Computing and Imaging Institute,
+University of Utah.
+
+
+Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the "Software"),
+to deal in the Software without restriction, including without limitation
+the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.
+*/
+
+//command line converter from the volume formats FluoRender reads to bricked vvd
+//the volume is streamed through BRKXMLWriter slab by slab, no gui or gl is needed
+
+#include "compatibility.h"
+#include "Formats/tif_reader.h"
+#include "Formats/nrrd_reader.h"
+#include "Formats/oib_reader.h"
+#include "Formats/oif_reader.h"
+#include "Formats/lsm_reader.h"
+#include "Formats/pvxml_reader.h"
+#include "Formats/brkxml_writer.h"
+#include <wx/init.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+static void PrintUsage(const char* name)
+{
+	fprintf(stderr,
+		"Usage: %s [options] <input> <output.vvd>\n"
+		"Input: .tif .tiff .nrrd .oib .oif .lsm .xml (PrairieView)\n"
+		"Options:\n"
+		"  -type <raw|zlib|jpeg>  brick file type (default: zlib)\n"
+		"  -quality <1-100>       jpeg quality (default: 90)\n"
+		"  -brick <size|wxhxd>    brick size including overlap (default: 256)\n"
+		"  -levels <num>          maximum number of levels (default: until one brick)\n"
+		"  -threads <num>         compression threads (default: all cores)\n"
+		"  -spacing <x> <y> <z>   override the voxel spacings\n"
+		"  -sliceseq              the input is a sequence of 2d slices\n"
+		"  -timeseq               the input is a sequence of time points\n"
+		"  -timeid <id>           time sequence identifier (default: _T)\n",
+		name);
+}
+
+static BaseReader* CreateReader(const wstring &filename)
+{
+	size_t pos = filename.find_last_of(L'.');
+	if (pos == wstring::npos)
+		return 0;
+	wstring suffix = filename.substr(pos);
+	transform(suffix.begin(), suffix.end(), suffix.begin(), ::towlower);
+
+	if (suffix == L".nrrd")
+		return new NRRDReader();
+	else if (suffix == L".tif" || suffix == L".tiff")
+		return new TIFReader();
+	else if (suffix == L".oib")
+		return new OIBReader();
+	else if (suffix == L".oif")
+		return new OIFReader();
+	else if (suffix == L".lsm")
+		return new LSMReader();
+	else if (suffix == L".xml")
+		return new PVXMLReader();
+	return 0;
+}
+
+int main(int argc, char* argv[])
+{
+	//wxBase only, for the xml parser of the PrairieView reader
+	wxInitializer initializer;
+	if (!initializer.IsOk())
+	{
+		fprintf(stderr, "Failed to initialize wxWidgets.\n");
+		return 1;
+	}
+
+	int file_type = BRICK_FILE_TYPE_ZLIB;
+	int quality = 90;
+	int bw = 256, bh = 256, bd = 256;
+	int levels = 0;
+	int threads = 0;
+	bool use_spc = false;
+	double spcx = 1.0, spcy = 1.0, spcz = 1.0;
+	bool slice_seq = false;
+	bool time_seq = false;
+	wstring time_id = L"_T";
+	vector<wstring> files;
+
+	for (int i = 1; i < argc; i++)
+	{
+		string arg = argv[i];
+		bool has_value = i+1 < argc;
+		if (arg == "-type" && has_value)
+		{
+			string type = argv[++i];
+			if (type == "raw")
+				file_type = BRICK_FILE_TYPE_RAW;
+			else if (type == "zlib")
+				file_type = BRICK_FILE_TYPE_ZLIB;
+			else if (type == "jpeg" || type == "jpg")
+				file_type = BRICK_FILE_TYPE_JPEG;
+			else
+			{
+				fprintf(stderr, "Unknown brick file type: %s\n", type.c_str());
+				return 1;
+			}
+		}
+		else if (arg == "-quality" && has_value)
+			quality = atoi(argv[++i]);
+		else if (arg == "-brick" && has_value)
+		{
+			//either one size or wxhxd
+			if (sscanf(argv[++i], "%dx%dx%d", &bw, &bh, &bd) != 3)
+				bh = bd = bw;
+		}
+		else if (arg == "-levels" && has_value)
+			levels = atoi(argv[++i]);
+		else if (arg == "-threads" && has_value)
+			threads = atoi(argv[++i]);
+		else if (arg == "-spacing" && i+3 < argc)
+		{
+			spcx = atof(argv[++i]);
+			spcy = atof(argv[++i]);
+			spcz = atof(argv[++i]);
+			use_spc = true;
+		}
+		else if (arg == "-sliceseq")
+			slice_seq = true;
+		else if (arg == "-timeseq")
+			time_seq = true;
+		else if (arg == "-timeid" && has_value)
+			time_id = s2ws(argv[++i]);
+		else if (arg == "-h" || arg == "-help" || arg == "--help")
+		{
+			PrintUsage(argv[0]);
+			return 0;
+		}
+		else if (!arg.empty() && arg[0] == '-')
+		{
+			fprintf(stderr, "Unknown option: %s\n", arg.c_str());
+			PrintUsage(argv[0]);
+			return 1;
+		}
+		else
+			files.push_back(s2ws(arg));
+	}
+
+	if (files.size() != 2)
+	{
+		PrintUsage(argv[0]);
+		return 1;
+	}
+	if (bw < 2 || bh < 2 || bd < 2)
+	{
+		fprintf(stderr, "Brick size must be at least 2.\n");
+		return 1;
+	}
+
+	BaseReader* reader = CreateReader(files[0]);
+	if (!reader)
+	{
+		fprintf(stderr, "Unsupported input file: %s\n", ws2s(files[0]).c_str());
+		return 1;
+	}
+	reader->SetFile(files[0]);
+	reader->SetSliceSeq(slice_seq);
+	reader->SetTimeSeq(time_seq);
+	reader->SetTimeId(time_id);
+	reader->Preprocess();
+
+	int frames = reader->GetTimeNum();
+	int chans = reader->GetChanNum();
+	//some readers only know the volume size after reading, the writer checks it
+	if (frames <= 0 || chans <= 0)
+	{
+		fprintf(stderr, "Failed to read %s\n", ws2s(files[0]).c_str());
+		delete reader;
+		return 1;
+	}
+	printf("%s: %d frame(s), %d channel(s)\n",
+		ws2s(files[0]).c_str(), frames, chans);
+
+	BRKXMLWriter writer;
+	writer.SetReader(reader);
+	writer.SetFileType(file_type);
+	writer.SetJpegQuality(quality);
+	writer.SetBrickSize(bw, bh, bd);
+	writer.SetMaxLevelNum(levels);
+	if (threads > 0)
+		writer.SetThreadNum(threads);
+	if (use_spc)
+		writer.SetSpacings(spcx, spcy, spcz);
+	writer.Save(files[1], 0);
+
+	delete reader;
+
+	if (writer.GetError())
+	{
+		fprintf(stderr, "Failed to write %s\n", ws2s(files[1]).c_str());
+		return 1;
+	}
+	printf("Saved %s\n", ws2s(files[1]).c_str());
+	return 0;
+}
@@ -461,6 +461,7 @@ int VolumeSelector::CompIslandCount(double min_voxels, double max_voxels)
 				m_prog_diag->Update(95*(m_progress+1)/m_total_pr);
 			}
 	}
+	m_vd->GetTexture()->mask_changed();
 	TextureRenderer::clear_tex_pool();
 
 	//count
@@ -880,6 +881,7 @@ int VolumeSelector::ProcessSel(double thresh)
 			//clear data_mvd_mask
 			size_t set_num = res_x*res_y*res_z;
 			memset(data_mvd_mask, 0, set_num);
+			tex_mvd->mask_changed();
 
 			if (nw > 0.0)
 			{
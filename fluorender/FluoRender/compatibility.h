@@ -58,6 +58,7 @@ DEALINGS IN THE SOFTWARE.
 #define GETCURRENTDIR _getcwd
 
 #define FSEEK64     _fseeki64
+#define FTELL64     _ftelli64
 #define SSCANF    sscanf
 
 inline wchar_t GETSLASH() { return L'\\'; }
@@ -124,8 +125,64 @@ inline time_t TIME(time_t* n) { return _time32((__time32_t*)n); }
 
 inline int CREATE_DIR(const wchar_t *f) { return CreateDirectory(f,NULL); }
 
+//last modification time of a file or directory, 0 if it cannot be read
+inline int64_t GET_MTIME(std::wstring name) {
+   if (!name.empty() && (name.back() == L'\\' || name.back() == L'/'))
+      name.pop_back();
+   WIN32_FILE_ATTRIBUTE_DATA attr;
+   if (!GetFileAttributesExW(name.c_str(), GetFileExInfoStandard, &attr))
+      return 0;
+   return (int64_t(attr.ftLastWriteTime.dwHighDateTime) << 32) |
+      int64_t(attr.ftLastWriteTime.dwLowDateTime);
+}
+
 inline uint32_t GET_TICK_COUNT() { return GetTickCount(); }
 
+typedef struct _MAPPED_FILE {
+   HANDLE file;
+   HANDLE mapping;
+   const char* data;
+   uint64_t size;
+} MAPPED_FILE;
+
+//map a whole file read-only, returns false if it cannot be mapped
+inline bool OPEN_MAPPED_FILE(std::wstring name, MAPPED_FILE &mf) {
+   mf.mapping = NULL;
+   mf.data = NULL;
+   mf.size = 0;
+   mf.file = CreateFileW(name.c_str(), GENERIC_READ, FILE_SHARE_READ,
+         NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+   if (mf.file == INVALID_HANDLE_VALUE)
+      return false;
+   LARGE_INTEGER fsize;
+   if (GetFileSizeEx(mf.file, &fsize) && fsize.QuadPart > 0) {
+      mf.mapping = CreateFileMappingW(mf.file, NULL, PAGE_READONLY, 0, 0, NULL);
+      if (mf.mapping)
+         mf.data = (const char*)MapViewOfFile(mf.mapping, FILE_MAP_READ, 0, 0, 0);
+   }
+   if (!mf.data) {
+      if (mf.mapping) CloseHandle(mf.mapping);
+      CloseHandle(mf.file);
+      mf.mapping = NULL;
+      mf.file = INVALID_HANDLE_VALUE;
+      return false;
+   }
+   mf.size = (uint64_t)fsize.QuadPart;
+   return true;
+}
+
+//only a successfully opened mapping has data set
+inline void CLOSE_MAPPED_FILE(MAPPED_FILE &mf) {
+   if (!mf.data) return;
+   UnmapViewOfFile(mf.data);
+   CloseHandle(mf.mapping);
+   CloseHandle(mf.file);
+   mf.file = INVALID_HANDLE_VALUE;
+   mf.mapping = NULL;
+   mf.data = NULL;
+   mf.size = 0;
+}
+
 inline void FIND_FILES(std::wstring m_path_name,
       std::wstring search_ext,
       std::vector<std::wstring> &m_batch_list,
@@ -166,6 +223,9 @@ inline void FIND_FILES(std::wstring m_path_name,
 #include <dirent.h>
 #include <sys/time.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <stdint.h>
 #include <vector>
 #include <iostream>
 #include "tiffio.h"
@@ -174,6 +234,7 @@ inline void FIND_FILES(std::wstring m_path_name,
 #define GETCURRENTDIR getcwd
 
 #define FSEEK64     fseek
+#define FTELL64     ftell
 
 inline wchar_t GETSLASH() { return L'/'; }
 
@@ -243,6 +304,58 @@ inline time_t TIME(time_t* n) { return time(n); }
 
 inline int CREATE_DIR(const char *f) { return mkdir(f, S_IRWXU | S_IRGRP | S_IXGRP); }
 
+//last modification time of a file or directory, 0 if it cannot be read
+inline int64_t GET_MTIME(std::wstring name) {
+   struct stat st;
+   if (stat(ws2s(name).c_str(), &st) != 0)
+      return 0;
+#ifdef _DARWIN
+   return int64_t(st.st_mtimespec.tv_sec) * 1000000000LL + st.st_mtimespec.tv_nsec;
+#else
+   return int64_t(st.st_mtim.tv_sec) * 1000000000LL + st.st_mtim.tv_nsec;
+#endif
+}
+
+typedef struct _MAPPED_FILE {
+   int file;
+   const char* data;
+   uint64_t size;
+} MAPPED_FILE;
+
+//map a whole file read-only, returns false if it cannot be mapped
+inline bool OPEN_MAPPED_FILE(std::wstring name, MAPPED_FILE &mf) {
+   mf.data = NULL;
+   mf.size = 0;
+   mf.file = open(ws2s(name).c_str(), O_RDONLY);
+   if (mf.file < 0)
+      return false;
+   struct stat st;
+   if (fstat(mf.file, &st) == 0 && st.st_size > 0) {
+      void* addr = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, mf.file, 0);
+      if (addr != MAP_FAILED) {
+         madvise(addr, (size_t)st.st_size, MADV_SEQUENTIAL);
+         mf.data = (const char*)addr;
+         mf.size = (uint64_t)st.st_size;
+      }
+   }
+   if (!mf.data) {
+      close(mf.file);
+      mf.file = -1;
+      return false;
+   }
+   return true;
+}
+
+//only a successfully opened mapping has data set
+inline void CLOSE_MAPPED_FILE(MAPPED_FILE &mf) {
+   if (!mf.data) return;
+   munmap((void*)mf.data, (size_t)mf.size);
+   close(mf.file);
+   mf.file = -1;
+   mf.data = NULL;
+   mf.size = 0;
+}
+
 typedef union _LARGE_INTEGER {
    struct {
       unsigned int LowPart;